@@ -0,0 +1,21 @@
+# 协议热点路径的基准测试：make check 运行，或直接运行 bench_framescanner
+QT       += core testlib
+QT       -= gui
+
+lessThan(QT_MAJOR_VERSION, 6): error("需要 Qt 6 或更高版本")
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+TARGET = bench_framescanner
+
+# 只用到分隔符扫描，不引入 Common.pri 中的网络和压缩依赖
+INCLUDEPATH += ../Common
+DEPENDPATH += ../Common
+
+SOURCES += \
+    bench_framescanner.cpp \
+    ../Common/framescanner.cpp
+
+HEADERS += \
+    ../Common/framescanner.h
@@ -0,0 +1,179 @@
+#include <QtTest>
+#include "framescanner.h"
+
+namespace {
+
+// 每组测试数据的大小，远大于L2缓存，测的是持续吞吐
+constexpr int PayloadSize = 4 * 1024 * 1024;
+
+// 仿照服务器发出的聊天记录行：MESSAGE|消息ID|发送者|接收者|类型|内容|文件名|文件大小|时间
+QByteArray makePayload(const QString& content)
+{
+    QByteArray payload;
+    payload.reserve(PayloadSize + 256);
+    for (int id = 1; payload.size() < PayloadSize; ++id) {
+        payload += QString("MESSAGE|%1|%2|%3|1|%4||0|2026-10-19 12:00:00\n")
+                       .arg(id)
+                       .arg(1000 + id % 7)
+                       .arg(2000 + id % 5)
+                       .arg(content)
+                       .toUtf8();
+    }
+    return payload;
+}
+
+// 在合法数据的不同位置插入非法UTF-8，覆盖向量块内部、跨块边界和缓冲区末尾
+QList<QByteArray> makeInvalidPayloads(const QByteArray& valid)
+{
+    static const char* const sequences[] = {
+        "\x80",                // 孤立的后续字节
+        "\xC0\xAF",            // 过长编码
+        "\xE4\xB8",            // 被截断的三字节序列
+        "\xED\xA0\x80",        // 代理区码点
+        "\xF4\x90\x80\x80",    // 超出U+10FFFF
+        "\xFF",
+    };
+    const qsizetype offsets[] = { 0, 15, 31, 32, 63, 1000, valid.size() - 1 };
+
+    QList<QByteArray> payloads;
+    for (const char* sequence : sequences) {
+        for (qsizetype offset : offsets) {
+            QByteArray payload = valid;
+            payload.insert(offset, sequence);
+            payloads.append(payload);
+        }
+    }
+    return payloads;
+}
+
+} // namespace
+
+// 分隔符扫描的基准测试：逐一比较本机可用的扫描实现（avx2 / sse2 / scalar），
+// 以及完整的 LineReader 切分与原来先转 QString 再 split 的做法
+class FrameScannerBench : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void scanKernel_data();
+    void scanKernel();
+    void lineReader_data();
+    void lineReader();
+    void splitBaseline_data();
+    void splitBaseline();
+
+private:
+    void addPayloadRows();
+
+    QByteArray m_ascii;
+    QByteArray m_cjk;
+};
+
+void FrameScannerBench::initTestCase()
+{
+    m_ascii = makePayload(QStringLiteral("See you at the station at eight, bring the tickets please"));
+    m_cjk = makePayload(QStringLiteral("明天早上八点在车站见，记得带上车票和身份证"));
+    qInfo() << "scan() 使用的实现：" << FrameScanner::implementationName();
+
+    // 各实现的结果必须和标量实现一致，否则比较速度没有意义
+    QList<QByteArray> payloads{ m_ascii, m_cjk };
+    payloads += makeInvalidPayloads(m_cjk.left(4096));
+    for (const QByteArray& payload : payloads) {
+        QList<qsizetype> expected;
+        FrameScanner::ScanResult expectedResult;
+        QVERIFY(FrameScanner::scanWith("scalar", payload.constData(), 0, payload.size(), expected, expectedResult));
+        for (const char* name : FrameScanner::availableImplementations()) {
+            QList<qsizetype> delimiters;
+            FrameScanner::ScanResult result;
+            QVERIFY(FrameScanner::scanWith(name, payload.constData(), 0, payload.size(), delimiters, result));
+            QCOMPARE(delimiters, expected);
+            QCOMPARE(result.utf8Valid, expectedResult.utf8Valid);
+            QCOMPARE(result.resumePos, expectedResult.resumePos);
+        }
+    }
+}
+
+void FrameScannerBench::addPayloadRows()
+{
+    QTest::addColumn<QByteArray>("payload");
+    QTest::newRow("ascii") << m_ascii;
+    QTest::newRow("cjk") << m_cjk;
+}
+
+void FrameScannerBench::scanKernel_data()
+{
+    QTest::addColumn<QByteArray>("implementation");
+    QTest::addColumn<QByteArray>("payload");
+    for (const char* name : FrameScanner::availableImplementations()) {
+        QTest::addRow("%s/ascii", name) << QByteArray(name) << m_ascii;
+        QTest::addRow("%s/cjk", name) << QByteArray(name) << m_cjk;
+    }
+}
+
+void FrameScannerBench::scanKernel()
+{
+    QFETCH(QByteArray, implementation);
+    QFETCH(QByteArray, payload);
+
+    QList<qsizetype> delimiters;
+    FrameScanner::ScanResult result;
+    QBENCHMARK {
+        delimiters.clear();
+        FrameScanner::scanWith(implementation.constData(), payload.constData(), 0, payload.size(),
+                               delimiters, result);
+    }
+    QVERIFY(result.utf8Valid);
+    QCOMPARE(result.resumePos, payload.size());
+}
+
+void FrameScannerBench::lineReader_data()
+{
+    addPayloadRows();
+}
+
+void FrameScannerBench::lineReader()
+{
+    QFETCH(QByteArray, payload);
+
+    const qsizetype expectedLines = payload.count('\n');
+    qsizetype lines = 0;
+    QBENCHMARK {
+        LineReader reader;
+        reader.append(payload);
+        QStringList fields;
+        bool utf8Valid = true;
+        lines = 0;
+        while (reader.readLine(fields, &utf8Valid)) {
+            ++lines;
+        }
+    }
+    QCOMPARE(lines, expectedLines);
+}
+
+void FrameScannerBench::splitBaseline_data()
+{
+    addPayloadRows();
+}
+
+void FrameScannerBench::splitBaseline()
+{
+    QFETCH(QByteArray, payload);
+
+    // 原来的做法：整体解码成 QString，按行再按'|'切分
+    const qsizetype expectedLines = payload.count('\n');
+    qsizetype lines = 0;
+    QBENCHMARK {
+        const QStringList lineList = QString::fromUtf8(payload).split('\n', Qt::SkipEmptyParts);
+        lines = 0;
+        for (const QString& line : lineList) {
+            const QStringList fields = line.split('|');
+            lines += fields.isEmpty() ? 0 : 1;
+        }
+    }
+    QCOMPARE(lines, expectedLines);
+}
+
+QTEST_APPLESS_MAIN(FrameScannerBench)
+
+#include "bench_framescanner.moc"
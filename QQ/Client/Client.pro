@@ -1,20 +1,33 @@
-QT       += core gui network sql
+QT       += core gui network sql concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++17
 
+include(../Common/Common.pri)
+
 SOURCES += \
     Login.cpp \
+    avatarcache.cpp \
     chat.cpp \
+    chatservice.cpp \
     main.cpp \
-    register.cpp
+    messagecache.cpp \
+    messageview.cpp \
+    register.cpp \
+    reliableudp.cpp \
+    serverconnection.cpp
 
 HEADERS += \
     Login.h \
+    avatarcache.h \
     chat.h \
+    chatservice.h \
+    messagecache.h \
+    messageview.h \
     register.h \
-    userinfo.h
+    reliableudp.h \
+    serverconnection.h
 
 FORMS += \
     Login.ui \
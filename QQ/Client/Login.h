@@ -3,10 +3,9 @@
 
 #include <QMainWindow>
 #include <QMessageBox>
-#include <QTcpSocket>
-#include <QHostAddress>
 #include <QTimer>
 #include "userinfo.h"  // 包含统一的UserInfo定义
+#include "chatservice.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui {
@@ -25,17 +24,17 @@ public:
 private slots:
     void onLoginButtonClicked();
     void onRegisterButtonClicked();
-    void onSocketConnected();
-    void onSocketReadyRead();
-    void onSocketError(QAbstractSocket::SocketError error);
 
 private:
     Ui::MainWindow *ui;
-    QTcpSocket *m_tcpSocket;
-    bool m_serverConnected;
-
-    void connectToServer();
-    void disconnectFromServer();
+    // 登录、注册和聊天窗口共用的服务器连接，程序启动时就开始连接
+    ServerConnection *m_connection;
+    ChatService *m_service;
+    bool m_loginPending = false;
+
+    bool handleLoginReply(const ServerReply& reply);
+    void handleLoginFailure(ServerReply::Status status);
+    void openChatWindow(const UserInfo& userInfo, const QString& resumeToken);
 };
 
 #endif // LOGIN_H
@@ -0,0 +1,251 @@
+#include "avatarcache.h"
+
+#include <QGuiApplication>
+#include <QImageReader>
+#include <QPainter>
+#include <QPainterPath>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QDebug>
+#include "protocol.h"
+
+namespace {
+
+// 缓存上限：约 8MB 像素数据，足够容纳上千个 40px 头像
+constexpr int MaxCostBytes = 8 * 1024 * 1024;
+// 解码线程数：头像解码以磁盘和JPEG解码为主，少量线程即可
+constexpr int MaxDecodeThreads = 2;
+
+qreal screenRatio()
+{
+    return qGuiApp ? qGuiApp->devicePixelRatio() : 1.0;
+}
+
+int costOf(const QPixmap& pixmap)
+{
+    return int(qint64(pixmap.width()) * pixmap.height() * 4);
+}
+
+} // namespace
+
+AvatarCache& AvatarCache::instance()
+{
+    static AvatarCache instance;
+    return instance;
+}
+
+AvatarCache::AvatarCache(QObject *parent)
+    : QObject(parent)
+    , m_pixmaps(MaxCostBytes)
+{
+    m_pool.setMaxThreadCount(MaxDecodeThreads);
+
+    // QPixmap 必须在 QGuiApplication 析构前释放
+    if (qGuiApp) {
+        connect(qGuiApp, &QCoreApplication::aboutToQuit, this, [this]() {
+            m_pool.clear();
+            m_pool.waitForDone();
+            clear();
+        });
+    }
+}
+
+QString AvatarCache::cacheKey(const QString& path, int size)
+{
+    return QString::number(size) + QLatin1Char('|') + path;
+}
+
+QString AvatarCache::diskCachePath(const QString& hash)
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+           + QStringLiteral("/avatars/") + hash + QStringLiteral(".png");
+}
+
+QPixmap AvatarCache::avatar(const QString& path, int size)
+{
+    if (path.isEmpty() || size <= 0 || m_missing.contains(path)) {
+        return QPixmap();
+    }
+
+    const QString key = cacheKey(path, size);
+    if (QPixmap *cached = m_pixmaps.object(key)) {
+        return *cached;
+    }
+
+    if (!m_pending.contains(key)) {
+        // 头像库引用：磁盘缓存命中就读本地文件，否则先请求下载，下载完成后再加载
+        QString file = path;
+        QString hash;
+        if (Protocol::parseContentReference(path, hash)) {
+            file = diskCachePath(hash);
+            if (!QFileInfo::exists(file)) {
+                auto it = m_downloading.find(path);
+                if (it == m_downloading.end()) {
+                    m_downloading.insert(path, QSet<int>{size});
+                    emit downloadRequested(path);
+                } else {
+                    it->insert(size);
+                }
+                return QPixmap();
+            }
+        }
+
+        m_pending.insert(key);
+
+        const int pixelSize = qRound(size * screenRatio());
+        QFutureWatcher<QImage> *watcher = new QFutureWatcher<QImage>(this);
+        connect(watcher, &QFutureWatcher<QImage>::finished, this, [this, watcher, path, size]() {
+            onAvatarLoaded(path, size, watcher->result());
+            watcher->deleteLater();
+        });
+        watcher->setFuture(QtConcurrent::run(&m_pool, &AvatarCache::loadCircular, file, pixelSize));
+    }
+
+    return QPixmap();
+}
+
+QImage AvatarCache::loadCircular(const QString& path, int pixelSize)
+{
+    QImageReader reader(path);
+    reader.setAutoTransform(true);
+
+    // 只解码居中的正方形区域，并直接解码到目标尺寸（JPEG可在解码阶段缩小，不必先展开整张大图）
+    const QSize fullSize = reader.size();
+    if (fullSize.isValid()) {
+        const int side = qMin(fullSize.width(), fullSize.height());
+        reader.setClipRect(QRect((fullSize.width() - side) / 2, (fullSize.height() - side) / 2, side, side));
+        reader.setScaledSize(QSize(pixelSize, pixelSize));
+    }
+
+    QImage source = reader.read();
+    if (source.isNull()) {
+        return QImage();
+    }
+    if (source.size() != QSize(pixelSize, pixelSize)) {
+        const int side = qMin(source.width(), source.height());
+        source = source.copy((source.width() - side) / 2, (source.height() - side) / 2, side, side)
+                     .scaled(pixelSize, pixelSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    // QImage 上的绘制可以在工作线程进行
+    QImage image(pixelSize, pixelSize, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing);
+    QPainterPath clipPath;
+    clipPath.addEllipse(0, 0, pixelSize, pixelSize);
+    painter.setClipPath(clipPath);
+    painter.drawImage(0, 0, source);
+    painter.end();
+    return image;
+}
+
+void AvatarCache::onAvatarLoaded(const QString& path, int size, const QImage& image)
+{
+    const QString key = cacheKey(path, size);
+    if (!m_pending.remove(key)) {
+        // 加载期间被 invalidate/clear，结果作废
+        return;
+    }
+
+    if (image.isNull()) {
+        m_missing.insert(path);
+        return;
+    }
+
+    QPixmap *pixmap = new QPixmap(QPixmap::fromImage(image));
+    pixmap->setDevicePixelRatio(qreal(image.width()) / size);
+    m_pixmaps.insert(key, pixmap, costOf(*pixmap));
+
+    emit avatarReady(path, size);
+}
+
+QPixmap AvatarCache::placeholder(const QString& text, int size, const QColor& background)
+{
+    const QString key = QString("placeholder|%1|%2|%3").arg(size).arg(background.name(), text);
+    if (QPixmap *cached = m_pixmaps.object(key)) {
+        return *cached;
+    }
+
+    const qreal ratio = screenRatio();
+    QPixmap *pixmap = new QPixmap(qRound(size * ratio), qRound(size * ratio));
+    pixmap->setDevicePixelRatio(ratio);
+    pixmap->fill(Qt::transparent);
+
+    QPainter painter(pixmap);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(background);
+    painter.drawEllipse(0, 0, size, size);
+    painter.setPen(Qt::white);
+    QFont font = painter.font();
+    font.setPixelSize(size * 4 / 9);
+    painter.setFont(font);
+    painter.drawText(QRect(0, 0, size, size), Qt::AlignCenter, text);
+    painter.end();
+
+    const QPixmap result = *pixmap;
+    m_pixmaps.insert(key, pixmap, costOf(result));
+    return result;
+}
+
+void AvatarCache::invalidate(const QString& path)
+{
+    m_missing.remove(path);
+    const QString suffix = QLatin1Char('|') + path;
+    const QList<QString> keys = m_pixmaps.keys();
+    for (const QString& key : keys) {
+        if (key.endsWith(suffix)) {
+            m_pixmaps.remove(key);
+        }
+    }
+    const QList<QString> pending = m_pending.values();
+    for (const QString& key : pending) {
+        if (key.endsWith(suffix)) {
+            m_pending.remove(key);
+        }
+    }
+}
+
+void AvatarCache::clear()
+{
+    m_pixmaps.clear();
+    m_missing.clear();
+    m_pending.clear();
+    m_downloading.clear();
+}
+
+void AvatarCache::storeDownloaded(const QString& reference, const QByteArray& imageData)
+{
+    QString hash;
+    if (!Protocol::parseContentReference(reference, hash)) {
+        return;
+    }
+
+    const QString file = diskCachePath(hash);
+    QDir().mkpath(QFileInfo(file).absolutePath());
+    QSaveFile output(file);
+    if (!output.open(QIODevice::WriteOnly) || output.write(imageData) != imageData.size() || !output.commit()) {
+        qDebug() << "头像缓存写入失败：" << file;
+        markUnavailable(reference);
+        return;
+    }
+
+    // 按等待中的尺寸重新加载，完成后照常发出 avatarReady
+    const QSet<int> sizes = m_downloading.take(reference);
+    m_missing.remove(reference);
+    for (int size : sizes) {
+        avatar(reference, size);
+    }
+}
+
+void AvatarCache::markUnavailable(const QString& reference)
+{
+    m_downloading.remove(reference);
+    m_missing.insert(reference);
+}
@@ -0,0 +1,67 @@
+#ifndef AVATARCACHE_H
+#define AVATARCACHE_H
+
+#include <QObject>
+#include <QCache>
+#include <QHash>
+#include <QColor>
+#include <QImage>
+#include <QPixmap>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+// 客户端共用的头像缓存
+// 按 路径+尺寸 保存已缩放、裁成圆形的头像，按占用内存做LRU淘汰；
+// 加载失败的路径也记下来，重绘时不再访问磁盘
+// 未命中时在后台线程用 QImageReader 按目标尺寸解码，完成后发出 avatarReady
+// 路径是服务器头像库引用（"sha256:<哈希>"）时从本地磁盘缓存读取，缓存中没有才向服务器请求，
+// 同一哈希的头像只下载一次，之后每次登录都直接读磁盘
+class AvatarCache : public QObject
+{
+    Q_OBJECT
+public:
+    static AvatarCache& instance();
+
+    // 返回 size×size 的圆形头像；尚未加载完成、路径为空或无法加载时返回空QPixmap
+    QPixmap avatar(const QString& path, int size);
+
+    // 首字母占位头像，用于图片还没加载好或没有头像的用户
+    QPixmap placeholder(const QString& text, int size, const QColor& background);
+
+    // 头像文件被替换后调用，丢弃该路径的所有尺寸
+    void invalidate(const QString& path);
+    void clear();
+
+    // 服务器返回的头像写入磁盘缓存，随后加载等待中的各个尺寸
+    void storeDownloaded(const QString& reference, const QByteArray& imageData);
+    // 服务器没有该头像或无法请求，之后按加载失败处理
+    void markUnavailable(const QString& reference);
+
+    // 向服务器请求头像时使用的尺寸，客户端各处的尺寸都从它缩小得到
+    static constexpr int DownloadSize = 40;
+
+signals:
+    // 后台加载成功后发出，界面据此重绘
+    void avatarReady(const QString& path, int size);
+    // 头像库引用在磁盘缓存中不存在，需要向服务器请求；每个引用只发出一次
+    void downloadRequested(const QString& reference);
+
+private:
+    explicit AvatarCache(QObject *parent = nullptr);
+
+    static QString cacheKey(const QString& path, int size);
+    static QString diskCachePath(const QString& hash);
+    // 在工作线程中执行：按需解码并裁成圆形
+    static QImage loadCircular(const QString& path, int pixelSize);
+
+    void onAvatarLoaded(const QString& path, int size, const QImage& image);
+
+    QCache<QString, QPixmap> m_pixmaps;   // cost为像素字节数
+    QSet<QString> m_missing;              // 不存在或无法解码的路径
+    QSet<QString> m_pending;              // 正在后台加载的缓存键
+    QHash<QString, QSet<int>> m_downloading;  // 正在向服务器请求的引用 -> 等待的尺寸
+    QThreadPool m_pool;
+};
+
+#endif // AVATARCACHE_H
@@ -15,9 +15,52 @@
 #include <QPainterPath>
 #include <QTimer>
 #include <QTextDocument>
+#include <QTextCursor>
+#include <QUrl>
+#include <QStringBuilder>
 #include <QDir>
 #include <QSettings>
 #include <QMouseEvent>
+#include <algorithm>
+#include "binarycodec.h"
+#include "messageview.h"
+#include "avatarcache.h"
+#include "filetransfer.h"
+#include "reliableudp.h"
+#include <QStatusBar>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+
+namespace {
+
+// 分块聊天记录立即显示的条数，大约一屏
+constexpr int HistoryFirstScreenCount = 20;
+// 之后每次空闲时插入的条数
+constexpr int HistorySliceCount = 50;
+// 服务器不支持端点登记时，消息仍按旧版方式发往这个固定端口
+constexpr quint16 LegacyUdpPort = 12346;
+// 搜索框停止输入这么久后自动搜索
+constexpr int SearchDebounceMs = 300;
+// 续连时最多带上的投递标识个数，与服务器最多补发的消息条数一致
+constexpr int MaxDeliveredKeys = 500;
+// UDP重传失败后改走服务器转发的时长，之后重新尝试UDP（网络可能已经恢复）
+constexpr qint64 UdpRetryDelayMs = 60 * 1000;
+// 收到未知端点的好友报文时查询对方端点的最短间隔，报文在查到之前一律丢弃
+constexpr qint64 PeerLookupIntervalMs = 5 * 1000;
+
+// 使用CSS类来设置系统消息样式
+QString systemMessageHtml(const QString& text)
+{
+    return QStringLiteral("<div class='system-message'>") % text.toHtmlEscaped() % QStringLiteral("</div>");
+}
+
+// 可靠通道上一条消息的投递标识：发送方通道ID.序号，发送方随消息保存到服务器
+QString deliveryKey(quint32 channelId, quint64 sequence)
+{
+    return QString("%1.%2").arg(channelId).arg(sequence);
+}
+
+} // namespace
 
 // FriendItemDelegate 实现
 FriendItemDelegate::FriendItemDelegate(QObject *parent)
@@ -53,33 +96,21 @@ void FriendItemDelegate::paint(QPainter *painter, const QStyleOptionViewItem &op
     avatarRect.moveTop(option.rect.top() + (option.rect.height() - avatarRect.height()) / 2);
     avatarRect.moveLeft(option.rect.left() + 10);
 
-    // 绘制头像（圆形）
-    QPainterPath clipPath;
-    clipPath.addEllipse(avatarRect);
-    painter->setClipPath(clipPath);
-
-    if (!avatarPath.isEmpty() && QFile::exists(avatarPath)) {
-        // 加载头像图片
-        QPixmap avatar(avatarPath);
-        if (!avatar.isNull()) {
-            painter->drawPixmap(avatarRect, avatar.scaled(36, 36, Qt::KeepAspectRatio, Qt::SmoothTransformation));
-        } else {
-            // 加载失败，使用默认头像
-            painter->fillRect(avatarRect, QColor(100, 149, 237));
-            painter->setPen(Qt::white);
-            painter->setFont(QFont("Arial", 14, QFont::Bold));
-            painter->drawText(avatarRect, Qt::AlignCenter, nickname.left(1).toUpper());
-        }
+    // 绘制头像（圆形，缓存中已裁好，重绘时不访问磁盘）
+    QPixmap avatar = AvatarCache::instance().avatar(avatarPath, 36);
+    if (!avatar.isNull()) {
+        painter->drawPixmap(avatarRect, avatar);
     } else {
         // 使用默认头像
-        painter->fillRect(avatarRect, QColor(100, 149, 237));
+        painter->setRenderHint(QPainter::Antialiasing);
+        painter->setBrush(QColor(100, 149, 237));
+        painter->setPen(Qt::NoPen);
+        painter->drawEllipse(avatarRect);
         painter->setPen(Qt::white);
         painter->setFont(QFont("Arial", 14, QFont::Bold));
         painter->drawText(avatarRect, Qt::AlignCenter, nickname.left(1).toUpper());
     }
 
-    painter->setClipping(false);
-
     // 绘制在线状态指示器
     QColor statusColor = (status == 1) ? QColor(0, 200, 0) : QColor(150, 150, 150);
     painter->setBrush(statusColor);
@@ -169,7 +200,6 @@ bool FriendItemDelegate::editorEvent(QEvent *event, QAbstractItemModel *model,
 Chat::Chat(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::Chat)
-    , m_tcpSocket(nullptr)
 {
     ui->setupUi(this);
 
@@ -180,6 +210,17 @@ Chat::Chat(QWidget *parent)
     currentUser.userId = -1;
     currentUser.status = 0;
 
+    // 较早的聊天记录在事件循环空闲时分批显示，避免一次插入大量消息卡住界面
+    m_historyRenderTimer = new QTimer(this);
+    m_historyRenderTimer->setSingleShot(true);
+    m_historyRenderTimer->setInterval(0);
+    connect(m_historyRenderTimer, &QTimer::timeout, this, &Chat::onHistoryRenderTimeout);
+
+    m_searchDebounceTimer = new QTimer(this);
+    m_searchDebounceTimer->setSingleShot(true);
+    m_searchDebounceTimer->setInterval(SearchDebounceMs);
+    connect(m_searchDebounceTimer, &QTimer::timeout, this, &Chat::onSearchDebounceTimeout);
+
     // 初始化Model/View
     friendListModel = new QStandardItemModel(this);
     friendItemDelegate = new FriendItemDelegate(this);
@@ -215,11 +256,39 @@ Chat::Chat(QWidget *parent)
     connect(ui->searchEdit, &QLineEdit::textChanged, this, &Chat::onSearchTextChanged);
     connect(ui->searchButton, &QPushButton::clicked, this, &Chat::onSearchButtonClicked);  // 新增：连接搜索按钮
 
+    // 列表方式的聊天记录视图：只绘制可见的行，适合很长的会话
+    m_messageModel = new MessageListModel(this);
+    m_messageListView = new QListView(this);
+    m_messageListView->setModel(m_messageModel);
+    m_messageListView->setItemDelegate(new MessageItemDelegate(this));
+    m_messageListView->setUniformItemSizes(false);
+    m_messageListView->setLayoutMode(QListView::Batched);
+    m_messageListView->setBatchSize(200);
+    m_messageListView->setResizeMode(QListView::Adjust);
+    m_messageListView->setVerticalScrollMode(QAbstractItemView::ScrollPerPixel);
+    m_messageListView->setSelectionMode(QAbstractItemView::NoSelection);
+    m_messageListView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    m_messageListView->setFrameShape(QFrame::NoFrame);
+    m_messageListView->setStyleSheet("QListView { background-color: #f5f5f5; border: none; }");
+    ui->verticalLayout_2->insertWidget(ui->verticalLayout_2->indexOf(ui->messageBrowser) + 1, m_messageListView);
+
+    // 头像在后台线程解码，完成后刷新用到它的地方
+    connect(&AvatarCache::instance(), &AvatarCache::avatarReady, this, &Chat::onAvatarReady);
+    // 磁盘缓存中没有的头像库头像才向服务器请求
+    connect(&AvatarCache::instance(), &AvatarCache::downloadRequested, this, &Chat::onAvatarDownloadRequested);
+
     // 连接菜单项
     QAction *logoutAction = new QAction("退出登录", this);
     ui->menu->addAction(logoutAction);
     connect(logoutAction, &QAction::triggered, this, &Chat::onMenuTriggered);
 
+    QAction *listViewAction = new QAction("列表方式显示聊天记录", this);
+    listViewAction->setCheckable(true);
+    listViewAction->setChecked(QSettings("QQ", "Client").value("chat/messageListView", false).toBool());
+    ui->menu->addAction(listViewAction);
+    connect(listViewAction, &QAction::toggled, this, &Chat::onMessageViewToggled);
+    setMessageListViewEnabled(listViewAction->isChecked());
+
     // 新增：连接添加好友信号
     connect(friendItemDelegate, &FriendItemDelegate::addFriendClicked,
             this, &Chat::onAddFriendClicked);
@@ -235,10 +304,6 @@ Chat::~Chat()
 {
     delete ui;
     if (udpSocket) udpSocket->deleteLater();
-    if (m_tcpSocket) {
-        m_tcpSocket->disconnectFromHost();
-        m_tcpSocket->deleteLater();
-    }
     if (tcpServer) tcpServer->deleteLater();
 }
 
@@ -260,93 +325,221 @@ void Chat::loadCSSStyles()
         );
 }
 
-void Chat::displayMessage(const MessageInfo& message)
+QString Chat::avatarHtml(int userId)
+{
+    auto it = m_avatarHtml.constFind(userId);
+    if (it != m_avatarHtml.constEnd()) {
+        return it.value();
+    }
+
+    const UserInfo user = (userId == currentUser.userId) ? currentUser : m_friendMap.value(userId);
+
+    // 每个用户的头像只作为文档资源注册一次，消息中按URL引用，不再逐条编码图片
+    // 图片还在后台加载时先注册首字母占位图，加载完成后替换同一个资源
+    QPixmap avatar = AvatarCache::instance().avatar(user.avatarPath, 36);
+    if (avatar.isNull()) {
+        avatar = AvatarCache::instance().placeholder(user.nickname.left(1), 36, QColor(0xcc, 0xcc, 0xcc));
+        m_avatarPlaceholders.insert(userId);
+    }
+
+    QUrl url(QString("avatar://%1").arg(userId));
+    ui->messageBrowser->document()->addResource(QTextDocument::ImageResource, url, avatar.toImage());
+    QString html = QString("<div class='avatar'>"
+                           "<img class='avatar-img' src='%1' width='36' height='36'>"
+                           "</div>").arg(url.toString());
+
+    m_avatarHtml.insert(userId, html);
+    return html;
+}
+
+void Chat::onAvatarReady(const QString& path, int size)
+{
+    // 委托绘制的列表直接重绘可见区域即可
+    ui->friendListView->viewport()->update();
+    m_messageListView->viewport()->update();
+
+    if (size == 30 && path == currentUser.avatarPath) {
+        ui->usernamelabel->setPixmap(AvatarCache::instance().avatar(path, 30));
+    }
+
+    if (size == 40) {
+        QPixmap icon = AvatarCache::instance().avatar(path, 40);
+        for (int row = 0; row < friendListModel->rowCount(); ++row) {
+            QStandardItem *item = friendListModel->item(row);
+            if (item && item->data(Qt::UserRole + 1).toString() == path) {
+                item->setIcon(QIcon(icon));
+            }
+        }
+    }
+
+    // 聊天记录中的占位图替换为真实头像
+    if (size == 36) {
+        bool replaced = false;
+        for (auto it = m_avatarPlaceholders.begin(); it != m_avatarPlaceholders.end();) {
+            const int userId = *it;
+            const QString userAvatar = (userId == currentUser.userId)
+                                           ? currentUser.avatarPath
+                                           : m_friendMap.value(userId).avatarPath;
+            if (userAvatar == path) {
+                ui->messageBrowser->document()->addResource(QTextDocument::ImageResource,
+                                                            QUrl(QString("avatar://%1").arg(userId)),
+                                                            AvatarCache::instance().avatar(path, 36).toImage());
+                it = m_avatarPlaceholders.erase(it);
+                replaced = true;
+            } else {
+                ++it;
+            }
+        }
+        if (replaced) {
+            ui->messageBrowser->viewport()->update();
+        }
+    }
+}
+
+QString Chat::buildMessageHtml(const MessageInfo& message)
 {
     bool isMy = (message.senderId == currentUser.userId);
 
     /* ===== 头像 ===== */
-    QString avatarPath;
+    const QString avatarHtml = this->avatarHtml(message.senderId);
+
+    /* ===== 消息内容 ===== */
+    // 模板片段是编译期常量，每条消息只做一次拼接，不再逐层解析 %1 占位符
+    const QString content = message.content.toHtmlEscaped().replace("\n", "<br>");
+
+    /* ===== 表格结构（核心） ===== */
     if (isMy) {
-        avatarPath = currentUser.avatarPath;
-    } else if (m_friendMap.contains(message.senderId)) {
-        avatarPath = m_friendMap[message.senderId].avatarPath;
-    }
-
-    QString avatarHtml;
-    if (!avatarPath.isEmpty() && QFile::exists(avatarPath)) {
-        QImage img(avatarPath);
-        img = img.scaled(36, 36, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-        QByteArray bytes;
-        QBuffer buffer(&bytes);
-        buffer.open(QIODevice::WriteOnly);
-        img.save(&buffer, "PNG");
-
-        avatarHtml = QString(
-                         "<div class='avatar'>"
-                         "<img class='avatar-img' src='data:image/png;base64,%1'>"
-                         "</div>"
-                         ).arg(QString::fromLatin1(bytes.toBase64()));
-    } else {
-        QString initial = isMy
-                              ? currentUser.nickname.left(1)
-                              : m_friendMap.value(message.senderId).nickname.left(1);
+        return QStringLiteral("<div class='message-row my-row'><table class='message-table'><tr>"
+                              "<td class='spacer'></td>"
+                              "<td class='cell'><div class='bubble my-bubble'>")
+               % content
+               % QStringLiteral("</div></td><td class='avatar-cell'>")
+               % avatarHtml
+               % QStringLiteral("</td></tr></table></div>");
+    }
+
+    return QStringLiteral("<div class='message-row other-row'><table class='message-table'><tr>"
+                          "<td class='avatar-cell'>")
+           % avatarHtml
+           % QStringLiteral("</td><td class='cell'><div class='bubble other-bubble'>")
+           % content
+           % QStringLiteral("</div></td><td class='spacer'></td></tr></table></div>");
+}
 
-        avatarHtml = QString("<div class='avatar'>%1</div>").arg(initial);
+void Chat::appendHtml(const QString& html)
+{
+    // 直接在文档末尾插入片段，已有内容不重新解析和排版
+    QTextDocument *document = ui->messageBrowser->document();
+    QTextCursor cursor(document);
+    cursor.movePosition(QTextCursor::End);
+    if (!document->isEmpty()) {
+        cursor.insertBlock(QTextBlockFormat(), QTextCharFormat());
     }
+    cursor.insertHtml(html);
+}
 
-    /* ===== 消息内容 ===== */
-    QString bubbleClass = isMy ? "bubble my-bubble" : "bubble other-bubble";
+void Chat::scrollToBottomLater()
+{
+    // 连续添加多条消息时只滚动一次
+    if (m_scrollToBottomPending) {
+        return;
+    }
+    m_scrollToBottomPending = true;
 
-    QString bubbleHtml = QString(
-                             "<div class='%1'>%2</div>"
-                             ).arg(
-                                 bubbleClass,
-                                 message.content.toHtmlEscaped().replace("\n", "<br>")
-                                 );
+    QTimer::singleShot(0, this, [this]() {
+        m_scrollToBottomPending = false;
+        auto *bar = messageScrollBar();
+        bar->setValue(bar->maximum());
+    });
+}
 
-    /* ===== 表格结构（核心） ===== */
-    QString tableHtml;
+QScrollBar* Chat::messageScrollBar() const
+{
+    return m_useMessageListView ? m_messageListView->verticalScrollBar()
+                                : ui->messageBrowser->verticalScrollBar();
+}
 
-    if (isMy) {
-        tableHtml = QString(
-                        "<table class='message-table'><tr>"
-                        "<td class='spacer'></td>"
-                        "<td class='cell'>%1</td>"
-                        "<td class='avatar-cell'>%2</td>"
-                        "</tr></table>"
-                        ).arg(bubbleHtml, avatarHtml);
-    } else {
-        tableHtml = QString(
-                        "<table class='message-table'><tr>"
-                        "<td class='avatar-cell'>%1</td>"
-                        "<td class='cell'>%2</td>"
-                        "<td class='spacer'></td>"
-                        "</tr></table>"
-                        ).arg(avatarHtml, bubbleHtml);
-    }
+void Chat::clearMessageView()
+{
+    // 清空文档会同时清掉已注册的头像资源
+    ui->messageBrowser->clear();
+    m_avatarHtml.clear();
+    m_avatarPlaceholders.clear();
+    m_messageModel->clear();
+}
 
-    QString rowClass = isMy
-                           ? "message-row my-row"
-                           : "message-row other-row";
+void Chat::setMessageListViewEnabled(bool enabled)
+{
+    m_useMessageListView = enabled;
+    ui->messageBrowser->setVisible(!enabled);
+    m_messageListView->setVisible(enabled);
+    // 隐藏时不接模型，文本视图下追加消息不触发列表视图的排版
+    m_messageListView->setModel(enabled ? m_messageModel : nullptr);
+}
 
-    QString messageHtml =
-        QString("<div class='%1'>%2</div>").arg(rowClass, tableHtml);
+void Chat::onMessageViewToggled(bool checked)
+{
+    QSettings("QQ", "Client").setValue("chat/messageListView", checked);
+    setMessageListViewEnabled(checked);
+
+    // 模型里始终是完整的显示记录（包括系统消息），列表视图直接使用，文本视图按它重新生成
+    if (!m_useMessageListView) {
+        ui->messageBrowser->clear();
+        m_avatarHtml.clear();
+        m_avatarPlaceholders.clear();
+        QString html;
+        for (int row = 0; row < m_messageModel->rowCount(); ++row) {
+            html += m_messageModel->isSystemMessage(row) ? systemMessageHtml(m_messageModel->message(row).content)
+                                                         : buildMessageHtml(m_messageModel->message(row));
+        }
+        appendHtml(html);
+    }
+    scrollToBottomLater();
+}
 
+void Chat::displayMessage(const MessageInfo& message)
+{
     /* ===== 插入 ===== */
-    QString html = ui->messageBrowser->toHtml();
-    if (!html.contains("<body")) {
-        html = "<html><body></body></html>";
+    m_messageModel->appendMessage(message);
+    if (!m_useMessageListView) {
+        appendHtml(buildMessageHtml(message));
     }
+    scrollToBottomLater();
+}
 
-    int pos = html.lastIndexOf("</body>");
-    html.insert(pos, messageHtml);
+void Chat::prependMessages(const QList<MessageInfo>& messageList)
+{
+    if (messageList.isEmpty()) {
+        return;
+    }
 
-    ui->messageBrowser->setHtml(html);
+    // 在顶部插入时保持用户正在看的位置不动
+    auto *bar = messageScrollBar();
+    int distanceFromBottom = bar->maximum() - bar->value();
 
-    QTimer::singleShot(0, this, [this]() {
-        auto *bar = ui->messageBrowser->verticalScrollBar();
-        bar->setValue(bar->maximum());
+    m_messageModel->prependMessages(messageList);
+    if (!m_useMessageListView) {
+        QString batchHtml;
+        for (const MessageInfo& message : messageList) {
+            batchHtml += buildMessageHtml(message);
+        }
+
+        QTextDocument *document = ui->messageBrowser->document();
+        QTextCursor cursor(document);
+        cursor.movePosition(QTextCursor::Start);
+        bool wasEmpty = document->isEmpty();
+        cursor.insertHtml(batchHtml);
+        if (!wasEmpty) {
+            cursor.insertBlock(QTextBlockFormat(), QTextCharFormat());
+        }
+    }
+
+    QTimer::singleShot(0, this, [this, distanceFromBottom]() {
+        auto *bar = messageScrollBar();
+        bar->setValue(bar->maximum() - distanceFromBottom);
     });
+
+    chatHistory = messageList + chatHistory;
 }
 
 void Chat::setCurrentUser(const UserInfo& userInfo)
@@ -356,71 +549,234 @@ void Chat::setCurrentUser(const UserInfo& userInfo)
     ui->usernamelabel->setText(userInfo.nickname);
 
     // 设置用户头像（如果存在）
-    if (!userInfo.avatarPath.isEmpty() && QFile::exists(userInfo.avatarPath)) {
-        QPixmap avatar(userInfo.avatarPath);
-        if (!avatar.isNull()) {
-            QPixmap scaledAvatar = avatar.scaled(30, 30, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-            ui->usernamelabel->setPixmap(scaledAvatar);
-        }
+    QPixmap avatar = AvatarCache::instance().avatar(userInfo.avatarPath, 30);
+    if (!avatar.isNull()) {
+        ui->usernamelabel->setPixmap(avatar);
     }
 
+    m_messageModel->setUsers(currentUser, m_friendMap);
+    m_avatarHtml.clear();
+    m_avatarPlaceholders.clear();
+    m_messageCache.open(userInfo.userId);
     qDebug() << "设置当前用户：" << userInfo.nickname << "ID:" << userInfo.userId;
 }
 
-void Chat::setTcpSocket(QTcpSocket* socket)
+void Chat::setService(ChatService* service)
 {
-    if (m_tcpSocket) {
-        m_tcpSocket->disconnect(this);
-        m_tcpSocket->deleteLater();
+    // 连接属于登录窗口，聊天窗口关闭后留给下次登录使用
+    if (m_connection) {
+        m_connection->disconnect(this);
     }
 
-    m_tcpSocket = socket;
-    if (m_tcpSocket) {
-        connect(m_tcpSocket, &QTcpSocket::readyRead, this, &Chat::onSocketReadyRead);
-        connect(m_tcpSocket, &QTcpSocket::connected, this, [this]() {
-            qDebug() << "Chat TCP连接已建立";
-        });
-        connect(m_tcpSocket, &QTcpSocket::disconnected, this, [this]() {
+    m_service = service;
+    m_connection = service ? service->connection() : nullptr;
+    m_historyFuture.cancel();
+    m_searchFuture.cancel();
+    m_historyPeerId = -1;
+    m_historyRenderTimer->stop();
+    m_pendingHistory.clear();
+    if (m_connection) {
+        connect(m_connection, &ServerConnection::replyReceived, this, &Chat::onServerReply);
+        connect(m_connection, &ServerConnection::ready, this, &Chat::onConnectionReady);
+        connect(m_connection, &ServerConnection::disconnected, this, [this]() {
             qDebug() << "Chat TCP连接已断开";
+            if (!m_connectionLost) {
+                m_connectionLost = true;
+                addSystemMessage("与服务器的连接已断开，正在重新连接...");
+            }
         });
-
-#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
-        connect(m_tcpSocket, &QAbstractSocket::errorOccurred, this, [this](QAbstractSocket::SocketError error) {
-            qDebug() << "Chat TCP错误：" << m_tcpSocket->errorString();
+        connect(m_connection, &ServerConnection::reconnecting, this, [this](int attempt, int delayMs) {
+            statusBar()->showMessage(QString("连接已断开，%1秒后第%2次重连...")
+                                         .arg(qMax(1, (delayMs + 999) / 1000))
+                                         .arg(attempt));
         });
-#else
-        connect(m_tcpSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
-                this, [this](QAbstractSocket::SocketError error) {
-                    qDebug() << "Chat TCP错误：" << m_tcpSocket->errorString();
-                });
-#endif
+        // 聊天窗口打开期间断线自动重连，关闭时停止
+        m_connection->setAutoReconnect(true);
+        // 登录时握手已经完成，直接登记端点
+        if (m_connection->isReady()) {
+            onConnectionReady();
+        }
     }
 }
 
+void Chat::watchReply(const QFuture<ServerReply>& future, const QString& failureMessage)
+{
+    // 聊天窗口释放或 future 被取消后，之后的回复直接丢弃
+    ChatService::onReply(future, this, [this, failureMessage](const ServerReply& reply) {
+        if (reply.ok()) {
+            onServerReply(reply);
+            return;
+        }
+        // 旧服务器的回复不带请求ID，经 replyReceived 到达 onServerReply
+        if (reply.status == ServerReply::Status::Unmatched) {
+            return;
+        }
+        qDebug() << "请求没有完成：" << (reply.status == ServerReply::Status::TimedOut ? "超时" : "连接断开");
+        if (!failureMessage.isEmpty()) {
+            addSystemMessage(failureMessage);
+        }
+    });
+}
+
+void Chat::onConnectionReady()
+{
+    m_protocol = m_connection->protocol();
+    if (!m_connectionLost) {
+        registerEndpoint();
+        flushUnsavedMessages();
+        flushAvatarRequests();
+        return;
+    }
+    m_connectionLost = false;
+    statusBar()->clearMessage();
+    // 断线期间发出的消息排在续连请求之后，服务器恢复登录状态后再保存
+    resumeSession();
+    flushUnsavedMessages();
+    flushAvatarRequests();
+}
+
+void Chat::resumeSession()
+{
+    if (!m_protocol.sessionResume() || m_resumeToken.isEmpty()) {
+        // 服务器不支持续连：重新登记端点，刷新好友列表和当前会话
+        registerEndpoint();
+        requestFriendList();
+        if (currentFriendId > 0) {
+            requestChatHistory(currentFriendId);
+        }
+        addSystemMessage("已重新连接到服务器");
+        return;
+    }
+
+    const quint16 udpPort = udpSocket ? udpSocket->localPort() : 0;
+    const quint16 filePort = tcpServer && tcpServer->isListening() ? tcpServer->serverPort() : 0;
+    ChatService::onReply(m_service->resume(m_resumeToken, udpPort, filePort, m_deliveredKeys), this,
+                         [this](const ServerReply& reply) {
+        if (!reply.ok()) {
+            // 又断线时下次 ready 会再次恢复
+            if (reply.status == ServerReply::Status::TimedOut) {
+                addSystemMessage("恢复会话超时，部分消息可能需要重新打开会话查看");
+            }
+            return;
+        }
+        if (reply.command == "RESUME_OK" && reply.parts.size() >= 3) {
+            // 令牌每次续连后更换
+            m_resumeToken = reply.parts[2];
+            addSystemMessage("已重新连接到服务器");
+        } else if (reply.command == "RESUME_FAIL") {
+            m_resumeToken.clear();
+            QMessageBox::warning(this, "会话已过期", reply.parts.value(1, "请重新登录"));
+            close();
+        } else {
+            onServerReply(reply);
+        }
+    });
+}
+
+void Chat::handleMissedMessages(const QList<MessageInfo>& messageList)
+{
+    QMap<int, int> unreadCounts;
+    for (const MessageInfo& message : messageList) {
+        const int peerId = message.senderId == currentUser.userId ? message.receiverId : message.senderId;
+        if (peerId != currentFriendId) {
+            if (message.senderId != currentUser.userId) {
+                ++unreadCounts[peerId];
+            }
+            continue;
+        }
+        // 经UDP已经收到的消息服务器按投递标识排除了，这里按消息ID去掉已显示的；
+        // 自己发出的消息本地显示时还没有ID，按内容认领
+        if (message.senderId == currentUser.userId && claimLocalMessage(message)) {
+            continue;
+        }
+        addMessageToUI(message);
+    }
+
+    for (auto it = unreadCounts.cbegin(); it != unreadCounts.cend(); ++it) {
+        const QString nickname = m_friendMap.contains(it.key()) ? m_friendMap.value(it.key()).nickname
+                                                                : QString("用户ID: %1").arg(it.key());
+        addSystemMessage(QString("断线期间 %1 发来 %2 条消息").arg(nickname).arg(it.value()));
+    }
+}
+
+bool Chat::claimLocalMessage(const MessageInfo& message)
+{
+    for (MessageInfo& local : chatHistory) {
+        if (message.messageId > 0 && local.messageId == message.messageId) {
+            return true;
+        }
+        if (local.messageId == 0 && local.senderId == message.senderId && local.receiverId == message.receiverId
+            && local.contentType == message.contentType
+            && (message.contentType == 2 ? local.fileName == message.fileName : local.content == message.content)) {
+            // 同样内容的消息可能发了多条，每条本地消息只认领一次
+            local.messageId = message.messageId;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Chat::onAvatarDownloadRequested(const QString& reference)
+{
+    if (m_avatarRequestQueue.isEmpty()) {
+        QTimer::singleShot(0, this, &Chat::flushAvatarRequests);
+    }
+    m_avatarRequestQueue.append(reference);
+}
+
+void Chat::flushAvatarRequests()
+{
+    if (m_avatarRequestQueue.isEmpty()) {
+        return;
+    }
+    if (!m_connection || !m_connection->isReady()) {
+        // 断线时留在队列里，重新连接后再请求
+        qDebug() << "TCP连接不可用，头像等待重连后请求：" << m_avatarRequestQueue.size() << "个";
+        return;
+    }
+    const QStringList references = m_avatarRequestQueue;
+    m_avatarRequestQueue.clear();
+
+    // 多个请求连续发出，不等待各自的回复；没有结果的头像先显示默认图
+    for (const QString& reference : references) {
+        ChatService::onReply(m_service->fetchAvatar(reference, AvatarCache::DownloadSize), this,
+                             [this, reference](const ServerReply& reply) {
+                                 if (reply.ok()) {
+                                     onServerReply(reply);
+                                 } else if (reply.status != ServerReply::Status::Unmatched) {
+                                     AvatarCache::instance().markUnavailable(reference);
+                                 }
+                             });
+    }
+    qDebug() << "已请求头像：" << references.size() << "个";
+}
+
 void Chat::requestFriendList()
 {
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        QString request = QString("GET_FRIENDS|%1\n").arg(currentUser.userId);
-        m_tcpSocket->write(request.toUtf8());
-        m_tcpSocket->flush();
-        qDebug() << "已发送好友列表请求：" << request.trimmed();
+    // 第一次先显示缓存的好友列表，服务器的回复到达后再更新
+    if (friendListModel->rowCount() == 0 && !m_isSearchMode) {
+        const QList<UserInfo> cachedFriends = m_messageCache.friendList();
+        if (!cachedFriends.isEmpty()) {
+            loadFriendsList(cachedFriends);
+        }
+    }
+
+    if (m_connection && m_connection->isConnected()) {
+        watchReply(m_service->friendList(currentUser.userId), "好友列表加载超时，请稍后重试");
+        qDebug() << "已发送好友列表请求：" << currentUser.userId;
     } else {
         qDebug() << "TCP连接不可用，无法请求好友列表";
-        if (m_tcpSocket) {
-            qDebug() << "Socket状态：" << m_tcpSocket->state();
-            qDebug() << "错误信息：" << m_tcpSocket->errorString();
-        }
     }
 }
 
 void Chat::closeEvent(QCloseEvent *event)
 {
-    // 发送登出请求
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        QString logoutRequest = QString("LOGOUT|%1\n").arg(currentUser.userId);
-        m_tcpSocket->write(logoutRequest.toUtf8());
-        m_tcpSocket->flush();
-        m_tcpSocket->waitForBytesWritten(1000);
+    // 发送登出请求；连接留给下次登录，不再自动重连
+    if (m_connection) {
+        m_connection->setAutoReconnect(false);
+    }
+    if (m_connection && m_connection->isConnected()) {
+        watchReply(m_service->logout(currentUser.userId));
     }
 
     emit windowClosed();
@@ -429,18 +785,147 @@ void Chat::closeEvent(QCloseEvent *event)
 
 void Chat::setupNetwork()
 {
-    // 设置UDP Socket（用于消息传输）
+    // 设置UDP Socket（用于消息传输）；端口由系统分配，同一台机器上可以运行多个客户端
+    // 服务器把聊天连接的对端地址告诉好友，必须监听所有地址，其他主机上的好友才能连到；
+    // 因此只接受来自好友登记端点的报文，文件连接只接受经服务器告知并由用户同意的传输
     udpSocket = new QUdpSocket(this);
-    udpSocket->bind(QHostAddress::LocalHost, 12345);
-    connect(udpSocket, &QUdpSocket::readyRead, this, &Chat::onReadyRead);
+    if (!udpSocket->bind(QHostAddress::Any, 0)) {
+        qDebug() << "UDP端口绑定失败：" << udpSocket->errorString();
+    }
+    // 收到的报文由可靠通道解析，旧版客户端直接发来的报文原样交出
+    m_udpChannel = new ReliableUdpChannel(udpSocket, this);
+    m_udpChannel->setSenderCheck([this](const QByteArray& payload, const QHostAddress& address, quint16 port) {
+        return isFromPeerEndpoint(payload, address, port);
+    });
+    connect(m_udpChannel, &ReliableUdpChannel::messageReceived, this, &Chat::onPeerMessage);
+    connect(m_udpChannel, &ReliableUdpChannel::datagramReceived, this, [this](const QByteArray& datagram) {
+        onPeerMessage(datagram, 0, 0);
+    });
+    connect(m_udpChannel, &ReliableUdpChannel::deliveryFailed, this, &Chat::onUdpDeliveryFailed);
 
     // 设置TCP Server用于接收文件
     tcpServer = new QTcpServer(this);
-    if (!tcpServer->listen(QHostAddress::LocalHost, 54321)) {
+    if (!tcpServer->listen(QHostAddress::Any, 0)) {
         qDebug() << "TCP Server启动失败：" << tcpServer->errorString();
     } else {
         connect(tcpServer, &QTcpServer::newConnection, this, &Chat::onNewConnection);
     }
+    qDebug() << "本地端点：UDP" << udpSocket->localPort() << "文件" << tcpServer->serverPort();
+}
+
+void Chat::registerEndpoint()
+{
+    // 实际端口登记到服务器，好友通过 PEER_LOOKUP 找到这里
+    if (!m_protocol.peerDiscovery() || !m_connection || !m_connection->isConnected()) {
+        return;
+    }
+    m_connection->send(QString("REGISTER_ENDPOINT|%1|%2|%3")
+                           .arg(currentUser.userId)
+                           .arg(udpSocket ? udpSocket->localPort() : 0)
+                           .arg(tcpServer && tcpServer->isListening() ? tcpServer->serverPort() : 0));
+}
+
+void Chat::lookupPeer(int peerId)
+{
+    if (!m_protocol.peerDiscovery() || !m_connection || !m_connection->isConnected()) {
+        return;
+    }
+    watchReply(m_service->lookupPeer(peerId));
+}
+
+bool Chat::isFromPeerEndpoint(const QByteArray& payload, const QHostAddress& address, quint16 port)
+{
+    // 负载的第一个字段是发送者ID
+    const int senderId = payload.left(payload.indexOf('|')).toInt();
+    if (!m_friendMap.contains(senderId)) {
+        qDebug() << "丢弃非好友的UDP报文，来源" << address.toString() << port;
+        return false;
+    }
+    const auto it = m_peerEndpoints.constFind(senderId);
+    if (it == m_peerEndpoints.constEnd()) {
+        // 还不知道对方的端点：先查询，查到之后对方的重传就能通过；旧版客户端不重传，消息从聊天记录中看到
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if (now - m_peerLookupTimes.value(senderId) >= PeerLookupIntervalMs) {
+            m_peerLookupTimes.insert(senderId, now);
+            lookupPeer(senderId);
+        }
+        return false;
+    }
+    if (it->udpPort != port || !it->address.isEqual(address, QHostAddress::TolerantConversion)) {
+        qDebug() << "UDP报文的来源与好友" << senderId << "的端点不符，已丢弃：" << address.toString() << port;
+        return false;
+    }
+    return true;
+}
+
+void Chat::handlePeerEndpoint(int peerId, const QHostAddress& address, quint16 udpPort, quint16 filePort,
+                              int version)
+{
+    const QList<QByteArray> pending = m_pendingDatagrams.take(peerId);
+    if (udpPort == 0) {
+        // 对方不在线，消息已经由服务器保存，对方登录后从聊天记录中看到
+        m_peerEndpoints.remove(peerId);
+        if (!pending.isEmpty()) {
+            qDebug() << "好友" << peerId << "不在线，" << pending.size() << "条消息只保存到服务器";
+        }
+        return;
+    }
+
+    PeerEndpoint endpoint;
+    endpoint.address = address;
+    endpoint.udpPort = udpPort;
+    endpoint.filePort = filePort;
+    endpoint.version = version;
+    m_peerEndpoints.insert(peerId, endpoint);
+    qDebug() << "好友" << peerId << "的端点：" << address.toString() << "UDP" << udpPort << "文件" << filePort
+             << "版本" << version;
+    for (const QByteArray& payload : pending) {
+        deliverPeerMessage(peerId, payload);
+    }
+}
+
+QString Chat::deliverPeerMessage(int peerId, const QByteArray& payload)
+{
+    const PeerEndpoint endpoint = m_peerEndpoints.value(peerId);
+    if (endpoint.version < Protocol::MessageRelayVersion) {
+        // 对方不认识可靠通道的报文格式，仍然只发一次
+        udpSocket->writeDatagram(payload, endpoint.address, endpoint.udpPort);
+        return QString();
+    }
+    if (m_udpBlockedPeers.value(peerId) > QDateTime::currentMSecsSinceEpoch()) {
+        relayMessage(peerId, 0, payload);
+        return QString();
+    }
+    m_udpBlockedPeers.remove(peerId);
+    const quint64 sequence = m_udpChannel->send(endpoint.address, endpoint.udpPort, payload);
+    if (sequence == 0) {
+        // 单个报文放不下，直接经服务器转发
+        relayMessage(peerId, 0, payload);
+        return QString();
+    }
+    return deliveryKey(m_udpChannel->channelId(), sequence);
+}
+
+void Chat::relayMessage(int peerId, quint64 sequence, const QByteArray& payload)
+{
+    if (!m_protocol.messageRelay() || !m_connection || !m_connection->isConnected()) {
+        qDebug() << "无法经服务器转发消息，好友" << peerId << "只能从聊天记录中看到";
+        return;
+    }
+    m_connection->send(QString("RELAY_MESSAGE|%1|%2|%3|%4")
+                           .arg(peerId)
+                           .arg(m_udpChannel->channelId())
+                           .arg(sequence)
+                           .arg(QString::fromUtf8(payload)));
+}
+
+void Chat::onUdpDeliveryFailed(const QHostAddress& address, quint16 port, quint64 sequence, const QByteArray& payload)
+{
+    // 负载是 发送者|接收者|消息
+    const int peerId = QString::fromUtf8(payload).section('|', 1, 1).toInt();
+    qDebug() << "UDP消息多次重传未确认，改由服务器转发：" << address.toString() << port << "序号" << sequence;
+    m_udpBlockedPeers.insert(peerId, QDateTime::currentMSecsSinceEpoch() + UdpRetryDelayMs);
+    relayMessage(peerId, sequence, payload);
 }
 
 void Chat::loadFriendsList(const QList<UserInfo>& friendList)
@@ -494,15 +979,9 @@ void Chat::loadFriendsList(const QList<UserInfo>& friendList)
             }
 
             // 设置图标（简化版）
-            QPixmap iconPixmap(40, 40);
-            if (!friendInfo.avatarPath.isEmpty() && QFile::exists(friendInfo.avatarPath)) {
-                QPixmap avatar(friendInfo.avatarPath);
-                if (!avatar.isNull()) {
-                    iconPixmap = avatar.scaled(40, 40, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-                } else {
-                    iconPixmap.fill(QColor(100, 149, 237));
-                }
-            } else {
+            QPixmap iconPixmap = AvatarCache::instance().avatar(friendInfo.avatarPath, 40);
+            if (iconPixmap.isNull()) {
+                iconPixmap = QPixmap(40, 40);
                 iconPixmap.fill(QColor(100, 149, 237));
             }
 
@@ -513,6 +992,12 @@ void Chat::loadFriendsList(const QList<UserInfo>& friendList)
         }
     }
 
+    if (!m_isSearchMode) {
+        m_messageModel->setUsers(currentUser, m_friendMap);
+        m_avatarHtml.clear();
+        m_avatarPlaceholders.clear();
+    }
+
     // 更新视图
     ui->friendListView->update();
     qDebug() << (m_isSearchMode ? "搜索结果" : "好友列表") << "加载完成";
@@ -550,6 +1035,10 @@ void Chat::onFriendItemClicked(const QModelIndex &index)
 
     currentFriendId = friendId;
     currentFriendName = friendName;
+    // 对方可能重新登录换了端口，每次打开会话都重新查询
+    m_peerEndpoints.remove(friendId);
+    m_udpBlockedPeers.remove(friendId);
+    lookupPeer(friendId);
 
     ui->friendNameLabel->setText(currentFriendName);
     qDebug() << "选中好友：" << currentFriendName << " ID:" << currentFriendId;
@@ -563,27 +1052,64 @@ void Chat::onFriendItemClicked(const QModelIndex &index)
 
 void Chat::requestChatHistory(int friendId)
 {
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        QString request = QString("GET_MESSAGES|%1|%2\n")
-        .arg(currentUser.userId)
-            .arg(friendId);
-        m_tcpSocket->write(request.toUtf8());
-        m_tcpSocket->flush();
-        qDebug() << "已发送聊天记录请求：" << request.trimmed();
+    // 丢弃上一个好友尚未显示完的聊天记录
+    m_historyRenderTimer->stop();
+    m_pendingHistory.clear();
+    // 服务器收到新请求后不再发送旧请求的分块，旧请求不会再有结束标记
+    m_historyFuture.cancel();
+
+    // 先显示本地缓存，不等网络
+    const int syncedId = showCachedHistory(friendId);
+
+    if (m_connection && m_connection->isConnected()) {
+        if (syncedId > 0 && m_protocol.historySync()) {
+            // 只取缓存之后的新消息
+            m_historyFuture = m_service->syncHistory(currentUser.userId, friendId, syncedId);
+            watchReply(m_historyFuture, "新消息同步超时，显示的是本地缓存的聊天记录");
+            qDebug() << "已发送聊天记录同步请求：" << friendId << "起始消息ID" << syncedId;
+            return;
+        }
+
+        m_historyFuture = m_service->chatHistory(currentUser.userId, friendId);
+        watchReply(m_historyFuture, "聊天记录加载超时，请重新打开会话");
+        qDebug() << "已发送聊天记录请求：" << friendId;
 
         // 先显示系统消息
-        addSystemMessage("正在加载聊天记录...");
+        if (syncedId == 0) {
+            addSystemMessage("正在加载聊天记录...");
+        }
     } else {
         qDebug() << "TCP连接不可用，无法请求聊天记录";
-        addSystemMessage("网络连接异常，无法加载聊天记录");
+        addSystemMessage(syncedId > 0 ? "网络连接异常，显示的是本地缓存的聊天记录"
+                                      : "网络连接异常，无法加载聊天记录");
+    }
+}
+
+int Chat::showCachedHistory(int friendId)
+{
+    const int syncedId = m_messageCache.syncedMessageId(friendId);
+    if (syncedId <= 0) {
+        return 0;
+    }
+
+    // 与分块聊天记录走同一条显示路径：先显示最近一屏，其余空闲时插入顶部
+    chatHistory.clear();
+    clearMessageView();
+    m_pendingHistory = m_messageCache.messages(currentUser.userId, friendId);
+    m_historyRenderedCount = 0;
+    qDebug() << "显示本地缓存的聊天记录：" << m_pendingHistory.size() << "条";
+    renderPendingHistory(HistoryFirstScreenCount);
+    if (!m_pendingHistory.isEmpty()) {
+        m_historyRenderTimer->start();
     }
+    return syncedId;
 }
 
 void Chat::addMessageToUI(const MessageInfo& message)
 {
-    // 检查是否已经在聊天记录中
+    // 检查是否已经在聊天记录中；没有服务器ID的消息无从比较，直接添加
     for (const auto& msg : chatHistory) {
-        if (msg.messageId == message.messageId) {
+        if (message.messageId > 0 && msg.messageId == message.messageId) {
             return; // 消息已存在，不重复添加
         }
     }
@@ -597,16 +1123,15 @@ void Chat::addMessageToUI(const MessageInfo& message)
 
 void Chat::addSystemMessage(const QString& content)
 {
-    QString timeStr = QDateTime::currentDateTime().toString("HH:mm");
-
-    // 使用CSS类来设置系统消息样式
-    QString messageHtml = QString("<div class='system-message'>"
-                                  "%1 系统消息: %2"
-                                  "</div>")
-                              .arg(timeStr, content);
+    const QString text = QDateTime::currentDateTime().toString("HH:mm") % QStringLiteral(" 系统消息: ") % content;
 
-    QString currentHtml = ui->messageBrowser->toHtml();
-    ui->messageBrowser->setHtml(currentHtml + messageHtml);
+    // 系统消息也记在模型里，切换视图后仍然显示
+    m_messageModel->appendSystemMessage(text);
+    if (m_useMessageListView) {
+        scrollToBottomLater();
+        return;
+    }
+    appendHtml(systemMessageHtml(text));
 }
 
 void Chat::onSendButtonClicked()
@@ -644,7 +1169,7 @@ void Chat::onSendButtonClicked()
 void Chat::sendMessage(const QString& message)
 {
     // 通过UDP发送消息
-    if (!udpSocket) return;
+    if (!udpSocket || !m_udpChannel) return;
 
     QByteArray datagram;
     QDataStream out(&datagram, QIODevice::WriteOnly);
@@ -656,20 +1181,41 @@ void Chat::sendMessage(const QString& message)
                           .arg(currentFriendId)
                           .arg(message);
 
-    out << msgData;
-
-    // 发送到服务器（假设服务器在localhost:12346）
-    udpSocket->writeDatagram(datagram, QHostAddress::LocalHost, 12346);
+    QString key;   // 经可靠通道发出时的投递标识，随消息保存到服务器
+    if (!m_protocol.peerDiscovery()) {
+        out << msgData;
+        // 发送到服务器（假设服务器在localhost:12346）
+        udpSocket->writeDatagram(datagram, QHostAddress::LocalHost, LegacyUdpPort);
+    } else {
+        // 直接发给好友登记的端点，负载按UTF-8编码；端点未知时先向服务器查询
+        datagram = msgData.toUtf8();
+        if (m_peerEndpoints.contains(currentFriendId)) {
+            key = deliverPeerMessage(currentFriendId, datagram);
+        } else {
+            // 等待查询端点的消息保存时还没有投递标识
+            if (!m_pendingDatagrams.contains(currentFriendId)) {
+                lookupPeer(currentFriendId);
+            }
+            m_pendingDatagrams[currentFriendId].append(datagram);
+        }
+    }
     qDebug() << "发送消息：" << msgData;
 
-    // 同时通过TCP发送到服务器保存到数据库
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        QString saveRequest = QString("SAVE_MESSAGE|%1|%2|1|%3\n")
-        .arg(currentUser.userId)
-            .arg(currentFriendId)
-            .arg(message);
-        m_tcpSocket->write(saveRequest.toUtf8());
-        m_tcpSocket->flush();
+    // 同时通过TCP发送到服务器保存到数据库；自动重连期间先留着，恢复会话后再保存
+    m_unsavedMessages.append({currentFriendId, message, key});
+    if (m_connection && m_connection->isReady()) {
+        flushUnsavedMessages();
+    }
+}
+
+void Chat::flushUnsavedMessages()
+{
+    const QList<UnsavedMessage> messages = m_unsavedMessages;
+    m_unsavedMessages.clear();
+    for (const UnsavedMessage& message : messages) {
+        watchReply(m_service->saveTextMessage(currentUser.userId, message.receiverId, message.content,
+                                              message.deliveryKey),
+                   "消息没有保存到服务器，对方离线时可能收不到");
     }
 }
 
@@ -696,230 +1242,659 @@ void Chat::onSendFileButtonClicked()
     // 添加到聊天记录并显示
     addMessageToUI(fileMessage);
 
+    const int receiverId = currentFriendId;
+    const bool connected = m_connection && m_connection->isConnected();
+    if (connected && m_protocol.peerFileOffers() && m_peerEndpoints.value(receiverId).filePort != 0) {
+        // 对方在线时直连发送，对方拒绝前不占用服务器的空间
+        offerPeerFile(filePath, receiverId);
+        return;
+    }
+    if (connected && m_protocol.fileRelay()) {
+        sendFileViaRelay(filePath, receiverId);
+        return;
+    }
+
     // 通过TCP发送文件消息到服务器保存
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        QString saveRequest = QString("SAVE_MESSAGE|%1|%2|2|%3|%4|%5\n")
-        .arg(currentUser.userId)
-            .arg(currentFriendId)
-            .arg(fileName)
-            .arg(fileSize)
-            .arg(filePath);
-        m_tcpSocket->write(saveRequest.toUtf8());
-        m_tcpSocket->flush();
-    }
-
-    QMessageBox::information(this, "提示", QString("已选择文件：%1").arg(filePath));
-}
-
-void Chat::onReadyRead()
-{
-    while (udpSocket->hasPendingDatagrams()) {
-        QByteArray datagram;
-        datagram.resize(udpSocket->pendingDatagramSize());
-        udpSocket->readDatagram(datagram.data(), datagram.size());
-
-        // 解析UDP消息格式：senderId|receiverId|message
-        QString msgData = QString::fromUtf8(datagram);
-        QStringList parts = msgData.split("|");
-
-        if (parts.size() >= 3) {
-            int senderId = parts[0].toInt();
-            int receiverId = parts[1].toInt();
-            QString message = parts[2];
-
-            // 如果当前显示的是发送者的聊天窗口，则显示消息
-            if (currentFriendId == senderId || (currentFriendId == receiverId && receiverId == currentUser.userId)) {
-                // 创建消息对象
-                MessageInfo newMessage;
-                newMessage.senderId = senderId;
-                newMessage.receiverId = receiverId;
-                newMessage.content = message;
-                newMessage.contentType = 1; // 文本消息
-                newMessage.sendTime = QDateTime::currentDateTime().toString("yyyy-MM-dd HH:mm:ss");
-
-                // 添加到聊天记录并显示
-                addMessageToUI(newMessage);
-            }
+    if (m_connection && m_connection->isConnected()) {
+        watchReply(m_service->saveFileMessage(currentUser.userId, receiverId, fileName, fileSize, filePath));
+    }
+
+    // 分块读取发送，断线后自动续传；直接发给对方登记的文件端口，不知道时按旧版的固定端口
+    QHostAddress peerAddress = QHostAddress::LocalHost;
+    quint16 peerPort = FileTransfer::DefaultPort;
+    const PeerEndpoint endpoint = m_peerEndpoints.value(receiverId);
+    if (endpoint.filePort != 0) {
+        peerAddress = endpoint.address;
+        peerPort = endpoint.filePort;
+    }
+    watchFileSender(new FileSender(filePath, currentUser.userId, peerAddress, peerPort, this));
+}
+
+void Chat::sendFileViaRelay(const QString& filePath, int receiverId)
+{
+    statusBar()->showMessage(QString("正在计算 %1 的校验值...").arg(QFileInfo(filePath).fileName()));
+    QFutureWatcher<QByteArray> *watcher = new QFutureWatcher<QByteArray>(this);
+    connect(watcher, &QFutureWatcher<QByteArray>::finished, this, [this, watcher, filePath, receiverId]() {
+        watcher->deleteLater();
+        const QByteArray digest = watcher->result();
+        if (digest.isEmpty()) {
+            addSystemMessage(QString("无法读取文件 %1").arg(QFileInfo(filePath).fileName()));
+            return;
         }
+        startRelayFileSend(filePath, receiverId, Protocol::contentReferenceFromDigest(digest));
+    });
+    watcher->setFuture(QtConcurrent::run(&FileTransfer::sha256, filePath));
+}
+
+void Chat::startRelayFileSend(const QString& filePath, int receiverId, const QString& contentHash)
+{
+    if (!m_connection || !m_connection->isConnected()) {
+        addSystemMessage("网络连接异常，文件未发送");
+        return;
     }
+
+    // 消息记录只引用服务器文件库中的内容
+    const QFileInfo fileInfo(filePath);
+    watchReply(m_service->saveFileMessage(currentUser.userId, receiverId, fileInfo.fileName(), fileInfo.size(),
+                                          contentHash));
+
+    FileSender *fileSender = new FileSender(filePath, currentUser.userId,
+                                            m_connection->peerAddress(), m_connection->peerPort(), this);
+    fileSender->setRelayReceiver(receiverId, contentHash);
+    if (!m_protocol.uploadTokens()) {
+        watchFileSender(fileSender);
+        return;
+    }
+
+    // 上传连接不登录，先在聊天连接上领取这次上传的令牌
+    ChatService::onReply(m_service->relayUpload(fileSender->transferId(), receiverId, fileInfo.size()), this,
+                         [this, fileSender](const ServerReply& reply) {
+        if (reply.ok() && reply.command == "RELAY_UPLOAD_OK" && reply.parts.size() == 3) {
+            fileSender->setTransferToken(reply.parts[2]);
+            watchFileSender(fileSender);
+            return;
+        }
+        const QString reason = reply.command == "RELAY_UPLOAD_FAIL" ? reply.parts.value(2) : QString("无法取得上传令牌");
+        addSystemMessage(QString("文件 %1 发送失败：%2").arg(fileSender->fileName(), reason));
+        fileSender->deleteLater();
+    });
+}
+
+void Chat::offerPeerFile(const QString& filePath, int receiverId)
+{
+    const QFileInfo fileInfo(filePath);
+    const QString transferId = FileTransfer::transferId(fileInfo, currentUser.userId);
+    OutgoingPeerFile outgoing;
+    outgoing.filePath = filePath;
+    outgoing.receiverId = receiverId;
+    outgoing.endpoint = m_peerEndpoints.value(receiverId);
+    m_outgoingPeerFiles.insert(transferId, outgoing);
+
+    ChatService::onReply(m_service->offerPeerFile(receiverId, transferId, fileInfo.fileName(), fileInfo.size()), this,
+                         [this, transferId, fileName = fileInfo.fileName()](const ServerReply& reply) {
+        if (reply.ok() && reply.command == "PEER_FILE_SENT") {
+            statusBar()->showMessage(QString("等待对方接收文件 %1").arg(fileName));
+            return;
+        }
+        // 对方不在线或不支持直连时改由服务器中转
+        const OutgoingPeerFile outgoing = m_outgoingPeerFiles.take(transferId);
+        if (outgoing.filePath.isEmpty()) {
+            return;
+        }
+        if (m_protocol.fileRelay() && m_connection && m_connection->isConnected()) {
+            sendFileViaRelay(outgoing.filePath, outgoing.receiverId);
+            return;
+        }
+        const QString reason = reply.command == "PEER_FILE_FAIL" ? reply.parts.value(2) : QString("服务器没有回应");
+        addSystemMessage(QString("文件 %1 发送失败：%2").arg(fileName, reason));
+    });
 }
 
-void Chat::onSocketReadyRead()
+void Chat::handlePeerFileAnswer(int peerId, const QString& transferId, const QString& token)
 {
-    if (!m_tcpSocket) {
-        qDebug() << "TCP Socket为空";
+    const auto it = m_outgoingPeerFiles.constFind(transferId);
+    if (it == m_outgoingPeerFiles.constEnd() || it->receiverId != peerId) {
+        return;
+    }
+    const OutgoingPeerFile outgoing = m_outgoingPeerFiles.take(transferId);
+    const QFileInfo fileInfo(outgoing.filePath);
+    if (token.isEmpty()) {
+        addSystemMessage(QString("对方拒绝接收文件 %1").arg(fileInfo.fileName()));
         return;
     }
 
-    while (m_tcpSocket->canReadLine()) {
-        QByteArray data = m_tcpSocket->readLine();
-        QString response = QString::fromUtf8(data).trimmed();
-        qDebug() << "Chat收到服务器响应：" << response;
-
-        // 解析服务器响应
-        QStringList parts = response.split("|");
-        if (parts.size() > 0) {
-            QString command = parts[0];
-
-            if (command == "FRIEND_LIST") {
-                // 处理好友列表响应（只在非搜索模式下处理）
-                if (!m_isSearchMode) {
-                    int friendCount = parts[1].toInt();
-                    qDebug() << "好友数量：" << friendCount;
-
-                    QList<UserInfo> friendList;
-
-                    int index = 2;
-                    for (int i = 0; i < friendCount; i++) {
-                        if (index + 4 < parts.size()) {  // 确保有足够的数据
-                            UserInfo friendInfo;
-                            friendInfo.userId = parts[index++].toInt();
-                            friendInfo.username = parts[index++];
-                            friendInfo.nickname = parts[index++];
-                            friendInfo.avatarPath = parts[index++];
-                            friendInfo.status = parts[index++].toInt();
-
-                            friendList.append(friendInfo);
-                            qDebug() << "解析好友信息：" << friendInfo.nickname
-                                     << " ID:" << friendInfo.userId
-                                     << " 头像:" << friendInfo.avatarPath
-                                     << " 状态:" << friendInfo.status;
-                        } else {
-                            qDebug() << "数据不完整，跳过剩余好友";
-                            break;
-                        }
-                    }
-
-                    // 加载好友列表到界面
-                    loadFriendsList(friendList);
-                }
-            } else if (command == "LOGOUT_SUCCESS") {
-                qDebug() << "登出成功";
-            } else if (command == "MESSAGES_LIST") {
-                // 处理聊天记录响应
-                int messageCount = parts[1].toInt();
-                qDebug() << "收到聊天记录，数量：" << messageCount;
-
-                // 清空当前显示
-                ui->messageBrowser->clear();
-
-                if (messageCount == 0) {
-                    addSystemMessage("暂无聊天记录");
-                    return;
-                }
+    if (m_connection && m_connection->isConnected()) {
+        watchReply(m_service->saveFileMessage(currentUser.userId, peerId, fileInfo.fileName(), fileInfo.size(),
+                                              outgoing.filePath));
+    }
+    FileSender *fileSender = new FileSender(outgoing.filePath, currentUser.userId, outgoing.endpoint.address,
+                                            outgoing.endpoint.filePort, this);
+    fileSender->setTransferToken(token);
+    watchFileSender(fileSender);
+}
 
-                int index = 2;
-                for (int i = 0; i < messageCount; i++) {
-                    if (index + 6 < parts.size()) {  // 确保有足够的数据
-                        MessageInfo message;
-                        message.messageId = parts[index++].toInt();
-                        message.senderId = parts[index++].toInt();
-                        message.receiverId = parts[index++].toInt();
-                        message.contentType = parts[index++].toInt();
-                        message.content = parts[index++];
-                        message.fileName = parts[index++];
-                        message.fileSize = parts[index++].toLongLong();
-                        message.sendTime = parts[index++];
-
-                        // 添加到聊天记录并显示
-                        addMessageToUI(message);
-                        qDebug() << "解析消息：" << message.content;
-                    } else {
-                        qDebug() << "数据不完整，跳过剩余消息";
-                        break;
-                    }
-                }
+void Chat::handlePeerFileOffer(int senderId, const QString& transferId, const QString& fileName, qint64 fileSize)
+{
+    // 只问好友的、大小在上限之内的文件，其余直接拒绝
+    QString token;
+    const QString name = QFileInfo(fileName).fileName();
+    if (m_friendMap.contains(senderId) && FileTransfer::isValidTransferId(transferId) && !name.isEmpty()
+        && fileSize >= 0 && fileSize <= FileTransfer::MaxFileSize) {
+        const QString question = QString("%1 要发送文件 %2（%3 KB），是否接收？")
+                                     .arg(m_friendMap.value(senderId).nickname, name)
+                                     .arg((fileSize + 1023) / 1024);
+        if (QMessageBox::question(this, "接收文件", question) == QMessageBox::Yes) {
+            AcceptedPeerFile accepted;
+            accepted.senderId = senderId;
+            accepted.fileName = name;
+            accepted.fileSize = fileSize;
+            accepted.token = Protocol::randomToken();
+            m_acceptedPeerFiles.insert(transferId, accepted);
+            token = accepted.token;
+        }
+    }
+    if (m_connection && m_connection->isConnected()) {
+        m_connection->send(QString("PEER_FILE_ANSWER|%1|%2|%3").arg(senderId).arg(transferId, token));
+    }
+}
 
-                addSystemMessage("聊天记录加载完成");
-            } else if (command == "MESSAGE_SAVED") {
-                qDebug() << "消息保存成功";
-            } else if (command == "SEARCH_RESULTS") {
-                // 新增：处理搜索结果响应
-                int userCount = parts[1].toInt();
-                qDebug() << "搜索结果数量：" << userCount;
-
-                m_searchResults.clear();
-                m_searchResultFriendStatus.clear();
-
-                if (userCount == 0) {
-                    // 没有搜索结果
-                    loadFriendsList(QList<UserInfo>());
-                    addSystemMessage("没有找到匹配的用户");
-                    return;
-                }
+bool Chat::isAcceptedPeerTransfer(const QStringList& parts) const
+{
+    // FILE_OFFER|传输ID|发送者|文件名|大小|接收者|哈希|令牌，FILE_JOIN|传输ID|起点|终点|令牌
+    const auto it = m_acceptedPeerFiles.constFind(parts.value(1));
+    if (it == m_acceptedPeerFiles.constEnd()) {
+        return false;
+    }
+    if (parts.value(0) == "FILE_JOIN") {
+        return Protocol::tokenEquals(it->token, parts.value(4));
+    }
+    return Protocol::tokenEquals(it->token, parts.value(7)) && parts.value(2).toInt() == it->senderId
+           && QFileInfo(parts.value(3)).fileName() == it->fileName && parts.value(4).toLongLong() == it->fileSize;
+}
+
+void Chat::watchFileSender(FileSender *fileSender)
+{
+    const QString fileName = fileSender->fileName();
+    // 大文件分段并行发送，连接数可在设置中调整
+    fileSender->setMaxStreams(QSettings("QQ", "Client")
+                                  .value("transfer/parallelStreams", FileTransfer::DefaultParallelStreams)
+                                  .toInt());
+    connect(fileSender, &FileSender::progress, this, [this, fileName](qint64 confirmed, qint64 total) {
+        showTransferProgress(QString("正在发送 %1").arg(fileName), confirmed, total);
+    });
+    connect(fileSender, &FileSender::finished, this, [this, fileSender, fileName]() {
+        statusBar()->showMessage(QString("文件 %1 发送完成").arg(fileName), 5000);
+        fileSender->deleteLater();
+    });
+    connect(fileSender, &FileSender::failed, this, [this, fileSender, fileName](const QString& reason) {
+        addSystemMessage(QString("文件 %1 发送失败：%2").arg(fileName, reason));
+        fileSender->deleteLater();
+    });
+    fileSender->start();
+}
 
-                int index = 2;
-                for (int i = 0; i < userCount; i++) {
-                    if (index + 4 < parts.size()) {  // 确保有足够的数据
-                        UserInfo userInfo;
-                        userInfo.userId = parts[index++].toInt();
-                        userInfo.username = parts[index++];
-                        userInfo.nickname = parts[index++];
-                        userInfo.avatarPath = parts[index++];
-                        userInfo.status = parts[index++].toInt();
-
-                        m_searchResults.append(userInfo);
-                        qDebug() << "搜索结果用户：" << userInfo.nickname
-                                 << " ID:" << userInfo.userId
-                                 << " 状态:" << userInfo.status;
-                    } else {
-                        qDebug() << "数据不完整，跳过剩余用户";
-                        break;
-                    }
+void Chat::showTransferProgress(const QString& title, qint64 done, qint64 total)
+{
+    const int percent = total > 0 ? int(done * 100 / total) : 100;
+    statusBar()->showMessage(QString("%1：%2%（%3 / %4 KB）")
+                                 .arg(title)
+                                 .arg(percent)
+                                 .arg(done / 1024)
+                                 .arg(total / 1024));
+}
+
+void Chat::onPeerMessage(const QByteArray& payload, quint32 channelId, quint64 sequence)
+{
+    // 解析消息格式：senderId|receiverId|message，消息中可以含有'|'
+    QString msgData = QString::fromUtf8(payload);
+    QStringList parts = msgData.split("|");
+
+    if (parts.size() >= 3) {
+        int senderId = parts[0].toInt();
+        int receiverId = parts[1].toInt();
+        QString message = parts.mid(2).join('|');
+
+        // 如果当前显示的是发送者的聊天窗口，则显示消息
+        if (currentFriendId == senderId || (currentFriendId == receiverId && receiverId == currentUser.userId)) {
+            // 创建消息对象
+            MessageInfo newMessage;
+            newMessage.senderId = senderId;
+            newMessage.receiverId = receiverId;
+            newMessage.content = message;
+            newMessage.contentType = 1; // 文本消息
+            newMessage.sendTime = QDateTime::currentDateTime().toString("yyyy-MM-dd HH:mm:ss");
+
+            // 添加到聊天记录并显示
+            addMessageToUI(newMessage);
+
+            // 记下已经显示的消息，断线续连时服务器不再补发；没显示的留给补发计入未读
+            if (sequence > 0) {
+                m_deliveredKeys.append(deliveryKey(channelId, sequence));
+                if (m_deliveredKeys.size() > MaxDeliveredKeys) {
+                    m_deliveredKeys.removeFirst();
                 }
+            }
+        }
+    }
+}
 
-                // 加载搜索结果到界面
-                loadFriendsList(m_searchResults);
-                addSystemMessage(QString("找到 %1 个匹配的用户").arg(userCount));
-            } else if (command == "ADD_FRIEND_RESULT") {
-                // 新增：处理添加好友结果
-                if (parts.size() >= 4) {
-                    int userId = parts[1].toInt();
-                    int friendId = parts[2].toInt();
-                    QString result = parts[3];
-                    QString message = parts.size() > 4 ? parts[4] : "";
-
-                    if (result == "SUCCESS") {
-                        QMessageBox::information(this, "添加好友",
-                                                 QString("成功添加好友！\n用户ID: %1").arg(friendId));
-
-                        // 更新好友状态
-                        m_searchResultFriendStatus[friendId] = true;
-
-                        // 如果是当前搜索模式，刷新显示
-                        if (m_isSearchMode) {
-                            updateFriendList();
-                        }
-
-                        // 重新请求好友列表，更新m_friendMap
-                        requestFriendList();
-
-                    } else {
-                        QMessageBox::warning(this, "添加好友失败",
-                                             QString("添加好友失败: %1").arg(message));
-                    }
+void Chat::onServerReply(const ServerReply& reply)
+{
+    if (reply.binary) {
+        handleBinaryResponse(reply.command, reply.payload);
+        return;
+    }
+
+    const QStringList& parts = reply.parts;
+    qDebug() << "Chat收到服务器响应：" << parts[0] << "字段数：" << parts.size();
+
+    // 解析服务器响应
+    QString command = parts[0];
+
+    if (command == "FRIEND_LIST") {
+        // 处理好友列表响应（只在非搜索模式下处理）
+        int friendCount = parts[1].toInt();
+        qDebug() << "好友数量：" << friendCount;
+        handleFriendList(parseUserList(parts, friendCount));
+    } else if (command == "PEER_ENDPOINT" && (parts.size() == 5 || parts.size() == 6)) {
+        // 第六个字段是对方的协议版本
+        handlePeerEndpoint(parts[1].toInt(), QHostAddress(parts[2]),
+                           quint16(parts[3].toUInt()), quint16(parts[4].toUInt()), parts.value(5).toInt());
+    } else if (command == "MESSAGE_RELAYED" && parts.size() >= 4) {
+        // UDP不通时好友经服务器转发来的消息，与UDP收到的一起去重排序
+        m_udpChannel->receiveRelayed(parts[1].toUInt(), parts[2].toULongLong(),
+                                     parts.mid(3).join('|').toUtf8());
+    } else if (command == "PEER_OFFLINE" && parts.size() == 2) {
+        handlePeerEndpoint(parts[1].toInt(), QHostAddress(), 0, 0);
+    } else if (command == "PEER_FILE_OFFER" && parts.size() == 5) {
+        handlePeerFileOffer(parts[1].toInt(), parts[2], parts[3], parts[4].toLongLong());
+    } else if (command == "PEER_FILE_ANSWER" && parts.size() == 4) {
+        handlePeerFileAnswer(parts[1].toInt(), parts[2], parts[3]);
+    } else if (command == "FILE_AVAILABLE" && (parts.size() == 5 || parts.size() == 6)) {
+        // 有好友经服务器发来的文件，最后一个字段是下载令牌（旧服务器不带）
+        handleFileAvailable(parts[1], parts[3], parts.value(5));
+    } else if (command == "AVATAR_FAIL" && parts.size() >= 2) {
+        qDebug() << "头像获取失败：" << parts[1] << parts.value(2);
+        AvatarCache::instance().markUnavailable(parts[1]);
+    } else if (command == "LOGOUT_SUCCESS") {
+        qDebug() << "登出成功";
+    } else if (command == "MESSAGES_LIST") {
+        // 处理聊天记录响应
+        int messageCount = parts[1].toInt();
+        qDebug() << "收到聊天记录，数量：" << messageCount;
+        handleMessageList(parseMessageList(parts, messageCount));
+    } else if (command == "MISSED_MESSAGES" && parts.size() >= 2) {
+        // 续连时补发的断线期间的消息
+        handleMissedMessages(parseMessageList(parts, parts[1].toInt()));
+    } else if (command == "MESSAGES_BEGIN" && parts.size() >= 2) {
+        handleMessagesBegin(parts[1].toInt());
+    } else if (command == "MESSAGES_CHUNK" && parts.size() >= 3) {
+        int messageCount = parts[2].toInt();
+        handleMessageChunk(parts[1].toInt(), parseMessageList(parts, messageCount, 3));
+    } else if (command == "MESSAGES_END" && parts.size() >= 3) {
+        handleMessagesEnd(parts[1].toInt(), parts[2].toInt());
+    } else if (command == "MESSAGES_SINCE" && parts.size() >= 3) {
+        int messageCount = parts[2].toInt();
+        handleMessagesSince(parts[1].toInt(), parseMessageList(parts, messageCount, 3));
+    } else if (command == "MESSAGE_SAVED") {
+        qDebug() << "消息保存成功";
+    } else if (command == "SEARCH_RESULTS") {
+        // 新增：处理搜索结果响应
+        int userCount = parts[1].toInt();
+        qDebug() << "搜索结果数量：" << userCount;
+        handleSearchResults(parseUserList(parts, userCount));
+    } else if (command == "ADD_FRIEND_RESULT") {
+        // 新增：处理添加好友结果
+        if (parts.size() >= 4) {
+            int userId = parts[1].toInt();
+            int friendId = parts[2].toInt();
+            QString result = parts[3];
+            QString message = parts.size() > 4 ? parts[4] : "";
+
+            if (result == "SUCCESS") {
+                QMessageBox::information(this, "添加好友",
+                                         QString("成功添加好友！\n用户ID: %1").arg(friendId));
+
+                // 更新好友状态
+                m_searchResultFriendStatus[friendId] = true;
+
+                // 如果是当前搜索模式，刷新显示
+                if (m_isSearchMode) {
+                    updateFriendList();
                 }
+
+                // 重新请求好友列表，更新m_friendMap
+                requestFriendList();
+
             } else {
-                qDebug() << "未知命令：" << command;
+                QMessageBox::warning(this, "添加好友失败",
+                                     QString("添加好友失败: %1").arg(message));
             }
         }
+    } else {
+        qDebug() << "未知命令：" << command;
     }
 }
 
+void Chat::handleBinaryResponse(const QString& command, const QByteArray& payload)
+{
+    qDebug() << "Chat收到二进制响应：" << command << payload.size() << "字节";
+
+    if (command == "FRIEND_LIST" || command == "SEARCH_RESULTS") {
+        QList<UserInfo> userList;
+        if (!BinaryCodec::decodeUserList(payload, userList)) {
+            qDebug() << "二进制用户列表解析失败";
+            return;
+        }
+        if (command == "FRIEND_LIST") {
+            handleFriendList(userList);
+        } else {
+            handleSearchResults(userList);
+        }
+    } else if (command == "MESSAGES_LIST") {
+        QList<MessageInfo> messageList;
+        if (!BinaryCodec::decodeMessageList(payload, messageList)) {
+            qDebug() << "二进制聊天记录解析失败";
+            return;
+        }
+        handleMessageList(messageList);
+    } else if (command == "MISSED_MESSAGES") {
+        QList<MessageInfo> messageList;
+        if (!BinaryCodec::decodeMessageList(payload, messageList)) {
+            qDebug() << "二进制补发消息解析失败";
+            return;
+        }
+        handleMissedMessages(messageList);
+    } else if (command == "MESSAGES_CHUNK") {
+        int peerId = -1;
+        QList<MessageInfo> messageList;
+        if (!BinaryCodec::decodeMessageChunk(payload, peerId, messageList)) {
+            qDebug() << "二进制聊天记录分块解析失败";
+            return;
+        }
+        handleMessageChunk(peerId, messageList);
+    } else if (command == "MESSAGES_SINCE") {
+        int peerId = -1;
+        QList<MessageInfo> messageList;
+        if (!BinaryCodec::decodeMessageChunk(payload, peerId, messageList)) {
+            qDebug() << "二进制增量消息解析失败";
+            return;
+        }
+        handleMessagesSince(peerId, messageList);
+    } else if (command == "AVATAR") {
+        // 负载：头像引用、尺寸、PNG数据
+        BinaryReader reader(payload);
+        QString reference;
+        quint64 size;
+        QByteArray image;
+        if (!reader.readString(reference) || !reader.readVarUInt(size) || !reader.readBytes(image)) {
+            qDebug() << "头像数据解析失败";
+            return;
+        }
+        AvatarCache::instance().storeDownloaded(reference, image);
+    } else {
+        qDebug() << "未知二进制命令：" << command;
+    }
+}
+
+QList<UserInfo> Chat::parseUserList(const QStringList& parts, int userCount)
+{
+    QList<UserInfo> userList;
+    userList.reserve(userCount);
+
+    int index = 2;
+    for (int i = 0; i < userCount; i++) {
+        if (index + 4 < parts.size()) {  // 确保有足够的数据
+            UserInfo userInfo;
+            userInfo.userId = parts[index++].toInt();
+            userInfo.username = parts[index++];
+            userInfo.nickname = parts[index++];
+            userInfo.avatarPath = parts[index++];
+            userInfo.status = parts[index++].toInt();
+            userList.append(userInfo);
+        } else {
+            qDebug() << "数据不完整，跳过剩余用户";
+            break;
+        }
+    }
+
+    return userList;
+}
+
+QList<MessageInfo> Chat::parseMessageList(const QStringList& parts, int messageCount, int firstIndex)
+{
+    QList<MessageInfo> messageList;
+    messageList.reserve(messageCount);
+
+    int index = firstIndex;
+    for (int i = 0; i < messageCount; i++) {
+        if (index + 7 < parts.size()) {  // 确保有足够的数据
+            MessageInfo message;
+            message.messageId = parts[index++].toInt();
+            message.senderId = parts[index++].toInt();
+            message.receiverId = parts[index++].toInt();
+            message.contentType = parts[index++].toInt();
+            message.content = parts[index++];
+            message.fileName = parts[index++];
+            message.fileSize = parts[index++].toLongLong();
+            message.sendTime = parts[index++];
+            messageList.append(message);
+        } else {
+            qDebug() << "数据不完整，跳过剩余消息";
+            break;
+        }
+    }
+
+    return messageList;
+}
+
+void Chat::handleFriendList(const QList<UserInfo>& friendList)
+{
+    m_messageCache.storeFriendList(friendList);
+
+    // 只在非搜索模式下处理
+    if (m_isSearchMode) {
+        return;
+    }
+
+    for (const UserInfo& friendInfo : friendList) {
+        qDebug() << "解析好友信息：" << friendInfo.nickname
+                 << " ID:" << friendInfo.userId
+                 << " 头像:" << friendInfo.avatarPath
+                 << " 状态:" << friendInfo.status;
+    }
+
+    // 加载好友列表到界面
+    loadFriendsList(friendList);
+}
+
+void Chat::handleMessageList(const QList<MessageInfo>& messageList)
+{
+    // 清空当前显示
+    clearMessageView();
+
+    if (messageList.isEmpty()) {
+        addSystemMessage("暂无聊天记录");
+        return;
+    }
+
+    for (const MessageInfo& message : messageList) {
+        // 添加到聊天记录并显示
+        addMessageToUI(message);
+    }
+
+    addSystemMessage("聊天记录加载完成");
+}
+
+void Chat::handleMessagesBegin(int peerId)
+{
+    m_historyRenderTimer->stop();
+    m_pendingHistory.clear();
+    m_historyRenderedCount = 0;
+
+    // 已切换到其他好友的旧请求直接忽略
+    if (peerId != currentFriendId) {
+        m_historyPeerId = -1;
+        return;
+    }
+
+    m_historyPeerId = peerId;
+    m_historyMaxId = 0;
+    chatHistory.clear();
+    clearMessageView();
+}
+
+void Chat::handleMessageChunk(int peerId, const QList<MessageInfo>& messageList)
+{
+    if (peerId != m_historyPeerId || peerId != currentFriendId) {
+        return;
+    }
+
+    // 分块按从新到旧的顺序到达：凑满第一屏立即显示，其余排队到空闲时再插入顶部
+    qDebug() << "收到聊天记录分块，数量：" << messageList.size();
+    m_messageCache.storeMessages(messageList);
+    for (const MessageInfo& message : messageList) {
+        m_historyMaxId = qMax(m_historyMaxId, message.messageId);
+    }
+    m_pendingHistory.append(messageList);
+    if (m_historyRenderedCount < HistoryFirstScreenCount) {
+        renderPendingHistory(HistoryFirstScreenCount - m_historyRenderedCount);
+    }
+    if (!m_pendingHistory.isEmpty() && !m_historyRenderTimer->isActive()) {
+        m_historyRenderTimer->start();
+    }
+}
+
+void Chat::handleMessagesEnd(int peerId, int totalCount)
+{
+    if (peerId != m_historyPeerId || peerId != currentFriendId) {
+        return;
+    }
+
+    m_historyPeerId = -1;
+    // 完整收完才推进同步位置，中途切换会话时缓存的部分不会被当作完整的
+    m_messageCache.markSynced(peerId, m_historyMaxId);
+    qDebug() << "聊天记录接收完成，共" << totalCount << "条";
+    addSystemMessage(totalCount > 0 ? "聊天记录加载完成" : "暂无聊天记录");
+}
+
+void Chat::handleMessagesSince(int peerId, const QList<MessageInfo>& messageList)
+{
+    // 增量是从上次同步位置开始的全部新消息，写入后同步位置推进到最后一条
+    m_messageCache.storeMessages(messageList);
+    if (!messageList.isEmpty()) {
+        m_messageCache.markSynced(peerId, messageList.last().messageId);
+    }
+    qDebug() << "同步到新消息：" << messageList.size() << "条";
+
+    if (peerId != currentFriendId) {
+        return;
+    }
+    for (const MessageInfo& message : messageList) {
+        addMessageToUI(message);
+    }
+}
+
+void Chat::onHistoryRenderTimeout()
+{
+    renderPendingHistory(HistorySliceCount);
+    if (!m_pendingHistory.isEmpty()) {
+        m_historyRenderTimer->start();
+    }
+}
+
+void Chat::renderPendingHistory(int maxCount)
+{
+    int count = qMin<qsizetype>(maxCount, m_pendingHistory.size());
+    if (count <= 0) {
+        return;
+    }
+
+    // 取出最新的 count 条，按时间正序插入到已显示内容的上方
+    QList<MessageInfo> slice(m_pendingHistory.cbegin(), m_pendingHistory.cbegin() + count);
+    m_pendingHistory.remove(0, count);
+    std::reverse(slice.begin(), slice.end());
+
+    prependMessages(slice);
+    m_historyRenderedCount += count;
+}
+
+void Chat::handleSearchResults(const QList<UserInfo>& userList)
+{
+    m_searchResults = userList;
+    m_searchResultFriendStatus.clear();
+
+    if (userList.isEmpty()) {
+        // 没有搜索结果
+        loadFriendsList(QList<UserInfo>());
+        addSystemMessage("没有找到匹配的用户");
+        return;
+    }
+
+    for (const UserInfo& userInfo : userList) {
+        qDebug() << "搜索结果用户：" << userInfo.nickname
+                 << " ID:" << userInfo.userId
+                 << " 状态:" << userInfo.status;
+    }
+
+    // 加载搜索结果到界面
+    loadFriendsList(m_searchResults);
+    addSystemMessage(QString("找到 %1 个匹配的用户").arg(userList.size()));
+}
+
 void Chat::onNewConnection()
 {
-    // TODO: 处理文件接收
-    QTcpSocket *clientSocket = tcpServer->nextPendingConnection();
-    if (clientSocket) {
+    while (QTcpSocket *clientSocket = tcpServer->nextPendingConnection()) {
         qDebug() << "新的文件传输连接";
-        connect(clientSocket, &QTcpSocket::readyRead, this, [clientSocket]() {
-            // 处理文件接收
-            QByteArray data = clientSocket->readAll();
-            qDebug() << "收到文件数据：" << data.size() << "字节";
+        // 接收对象随连接断开自行释放，未收完的部分留在下载目录等待续传
+        FileReceiver *receiver = new FileReceiver(clientSocket, FileTransfer::downloadDirectory(), this);
+        receiver->setOfferCheck([this](const QStringList& parts) { return isAcceptedPeerTransfer(parts); });
+        connect(receiver, &FileReceiver::finished, this, [this, receiver]() {
+            m_acceptedPeerFiles.remove(receiver->transferId());
         });
+        watchFileReceiver(receiver);
     }
 }
 
+void Chat::handleFileAvailable(const QString& transferId, const QString& fileName, const QString& fetchToken)
+{
+    if (!m_connection || !m_connection->isConnected()) {
+        return;
+    }
+
+    // 另开一条连接从服务器取中转文件，下载目录中有同一传输的 .part 时从断点继续
+    qDebug() << "开始下载中转文件：" << fileName;
+    QTcpSocket *socket = new QTcpSocket(this);
+    FileReceiver *receiver = new FileReceiver(socket, FileTransfer::downloadDirectory(), this);
+    watchFileReceiver(receiver);
+    connect(socket, &QAbstractSocket::errorOccurred, receiver, [this, receiver, socket, fileName]() {
+        if (socket->state() == QAbstractSocket::UnconnectedState) {
+            addSystemMessage(QString("文件 %1 下载失败：%2").arg(fileName, socket->errorString()));
+            receiver->deleteLater();
+        }
+    });
+    socket->connectToHost(m_connection->peerAddress(), m_connection->peerPort());
+    QString request = QString("FILE_FETCH|%1").arg(transferId);
+    if (!fetchToken.isEmpty()) {
+        request += QString("|%1").arg(fetchToken);
+    }
+    socket->write((request + "\n").toUtf8());
+}
+
+void Chat::watchFileReceiver(FileReceiver *receiver)
+{
+    connect(receiver, &FileReceiver::progress, this, [this](const QString& fileName, qint64 received, qint64 total) {
+        showTransferProgress(QString("正在接收 %1").arg(fileName), received, total);
+    });
+    connect(receiver, &FileReceiver::finished, this, [this](const QString& fileName, const QString& savedPath) {
+        statusBar()->showMessage(QString("文件 %1 接收完成").arg(fileName), 5000);
+        addSystemMessage(QString("已收到文件 %1，保存在 %2").arg(fileName, QDir::toNativeSeparators(savedPath)));
+    });
+    connect(receiver, &FileReceiver::failed, this, [this](const QString& fileName, const QString& reason) {
+        addSystemMessage(QString("文件 %1 接收失败：%2").arg(fileName, reason));
+    });
+}
+
 void Chat::onMenuTriggered()
 {
     this->close();
@@ -927,6 +1902,14 @@ void Chat::onMenuTriggered()
 
 void Chat::onSearchTextChanged(const QString &text)
 {
+    // 边输入边搜索：停顿一会儿再发请求，之前发出的搜索在新请求发出时取消
+    if (!text.trimmed().isEmpty()) {
+        m_searchDebounceTimer->start();
+        return;
+    }
+    m_searchDebounceTimer->stop();
+    m_searchFuture.cancel();
+
     // 当搜索框内容改变时，自动清空搜索结果并退出搜索模式
     if (text.isEmpty() && m_isSearchMode) {
         m_isSearchMode = false;
@@ -952,26 +1935,37 @@ void Chat::onSearchButtonClicked()
     }
 
     // 发送搜索请求
+    m_searchDebounceTimer->stop();
     sendSearchRequest(keyword);
 }
 
+void Chat::onSearchDebounceTimeout()
+{
+    const QString keyword = ui->searchEdit->text().trimmed();
+    if (!keyword.isEmpty()) {
+        sendSearchRequest(keyword);
+    }
+}
+
 void Chat::sendSearchRequest(const QString& keyword)
 {
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        QString request = QString("SEARCH_USERS|%1|%2\n")
-        .arg(currentUser.userId)
-            .arg(keyword);
-        m_tcpSocket->write(request.toUtf8());
-        m_tcpSocket->flush();
-        qDebug() << "已发送搜索请求：" << request.trimmed();
+    if (m_connection && m_connection->isConnected()) {
+        // 之前的搜索已经过期，它的结果不再显示
+        m_searchFuture.cancel();
+        m_searchFuture = m_service->searchUsers(currentUser.userId, keyword);
+        watchReply(m_searchFuture, "搜索超时，请稍后重试");
+        qDebug() << "已发送搜索请求：" << keyword;
 
         // 设置搜索模式
+        const bool wasSearchMode = m_isSearchMode;
         m_isSearchMode = true;
         m_searchResults.clear();
         m_searchResultFriendStatus.clear();
 
-        // 显示系统消息
-        addSystemMessage(QString("正在搜索昵称包含 '%1' 的用户...").arg(keyword));
+        // 显示系统消息；边输入边搜索时只在第一次提示
+        if (!wasSearchMode) {
+            addSystemMessage(QString("正在搜索昵称包含 '%1' 的用户...").arg(keyword));
+        }
     } else {
         qDebug() << "TCP连接不可用，无法发送搜索请求";
         addSystemMessage("网络连接异常，无法搜索用户");
@@ -1012,13 +2006,9 @@ void Chat::onAddFriendClicked(int friendId)
 // 新增：发送添加好友请求
 void Chat::sendAddFriendRequest(int friendId)
 {
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        QString request = QString("ADD_FRIEND|%1|%2\n")
-        .arg(currentUser.userId)
-            .arg(friendId);
-        m_tcpSocket->write(request.toUtf8());
-        m_tcpSocket->flush();
-        qDebug() << "已发送添加好友请求：" << request.trimmed();
+    if (m_connection && m_connection->isConnected()) {
+        watchReply(m_service->addFriend(currentUser.userId, friendId), "添加好友请求没有得到服务器响应");
+        qDebug() << "已发送添加好友请求：" << friendId;
 
         addSystemMessage(QString("正在发送好友请求给用户ID: %1...").arg(friendId));
     } else {
@@ -4,7 +4,6 @@
 #include <QMainWindow>
 #include <QListWidgetItem>
 #include <QUdpSocket>
-#include <QTcpSocket>
 #include <QTcpServer>
 #include <QStandardItemModel>
 #include <QStyledItemDelegate>
@@ -12,13 +11,27 @@
 #include <QFile>
 #include <QTextStream>
 #include <QMap>
+#include <QHash>
+#include <QSet>
 #include <QBuffer>
+#include <QTimer>
+#include <QFuture>
 #include "userinfo.h"
+#include "protocol.h"
+#include "chatservice.h"
+#include "messagecache.h"
 
 namespace Ui {
 class Chat;
 }
 
+class QListView;
+class QScrollBar;
+class MessageListModel;
+class FileSender;
+class ReliableUdpChannel;
+class FileReceiver;
+
 class FriendItemDelegate : public QStyledItemDelegate
 {
     Q_OBJECT
@@ -47,7 +60,10 @@ public:
     ~Chat();
 
     void setCurrentUser(const UserInfo& userInfo);
-    void setTcpSocket(QTcpSocket* socket);
+    // 使用登录窗口已经握手并登录的连接
+    void setService(ChatService* service);
+    // 登录时服务器签发的续连令牌；为空时断线重连后重新请求好友列表和聊天记录
+    void setResumeToken(const QString& token) { m_resumeToken = token; }
     void requestFriendList();
 
 signals:
@@ -60,20 +76,70 @@ private slots:
     void onFriendItemClicked(const QModelIndex &index);
     void onSendButtonClicked();
     void onSendFileButtonClicked();
-    void onReadyRead();
+    // channelId/sequence 为0表示不是经可靠通道收到的消息
+    void onPeerMessage(const QByteArray& payload, quint32 channelId, quint64 sequence);
+    void onUdpDeliveryFailed(const QHostAddress& address, quint16 port, quint64 sequence, const QByteArray& payload);
     void onNewConnection();
     void onMenuTriggered();
-    void onSocketReadyRead();
+    void onServerReply(const ServerReply& reply);
+    void onConnectionReady();
     void onSearchTextChanged(const QString &text);
     void onSearchButtonClicked();
+    void onSearchDebounceTimeout();
     void onAddFriendClicked(int friendId);  // 新增：处理添加好友点击
+    void onHistoryRenderTimeout();
+    void onMessageViewToggled(bool checked);
+    void onAvatarReady(const QString& path, int size);
+    void onAvatarDownloadRequested(const QString& reference);
 
 private:
     void setupNetwork();
+    // 回复交给 onServerReply；超时或断线时显示 failureMessage（为空则只记录日志）
+    void watchReply(const QFuture<ServerReply>& future, const QString& failureMessage = QString());
     void loadFriendsList(const QList<UserInfo>& friendList);
     void sendMessage(const QString& message);
+    void flushUnsavedMessages();   // 恢复连接后保存断线期间发出的消息
     void requestChatHistory(int friendId);
+    // 立即显示本地缓存的聊天记录，返回缓存已完整同步到的消息ID，没有缓存时为0
+    int showCachedHistory(int friendId);
+    QString avatarHtml(int userId);  // 头像片段，首次使用时把头像注册为文档资源
+    QString buildMessageHtml(const MessageInfo& message);
     void displayMessage(const MessageInfo& message);
+    void appendHtml(const QString& html);     // 通过QTextCursor追加到文档末尾
+    void scrollToBottomLater();
+    void flushAvatarRequests();  // 同一轮事件中缺少的头像合并成一次写入
+    void showTransferProgress(const QString& title, qint64 done, qint64 total);
+    // 经服务器中转：先在后台算出内容哈希，服务器已有相同文件时不必上传
+    void sendFileViaRelay(const QString& filePath, int receiverId);
+    void startRelayFileSend(const QString& filePath, int receiverId, const QString& contentHash);
+    // 直连发送：经服务器征得对方同意并取得令牌后再连接对方的文件端口
+    void offerPeerFile(const QString& filePath, int receiverId);
+    void handlePeerFileAnswer(int peerId, const QString& transferId, const QString& token);
+    // 好友要直连发来文件，询问用户后答复；同意时生成令牌，只接受带这个令牌的连接
+    void handlePeerFileOffer(int senderId, const QString& transferId, const QString& fileName, qint64 fileSize);
+    bool isAcceptedPeerTransfer(const QStringList& parts) const;
+    void watchFileSender(FileSender *fileSender);
+    void handleFileAvailable(const QString& transferId, const QString& fileName, const QString& fetchToken);
+    void watchFileReceiver(FileReceiver *receiver);
+    void registerEndpoint();
+    // 重连后恢复会话：一次请求取回登录状态、好友列表和断线期间的消息
+    void resumeSession();
+    void handleMissedMessages(const QList<MessageInfo>& messageList);
+    // 补发的自己的消息已经在本地显示过（没有服务器ID）时记下服务器ID并返回true
+    bool claimLocalMessage(const MessageInfo& message);
+    void lookupPeer(int peerId);
+    // UDP报文声称的发送者必须是好友，且来自服务器告知的该好友的UDP端点
+    bool isFromPeerEndpoint(const QByteArray& payload, const QHostAddress& address, quint16 port);
+    void handlePeerEndpoint(int peerId, const QHostAddress& address, quint16 udpPort, quint16 filePort,
+                            int version = 0);
+    // 对方支持时走可靠UDP通道，否则发单个报文；UDP不通时经服务器转发
+    // 返回这条消息的投递标识，没有经可靠通道发出时为空
+    QString deliverPeerMessage(int peerId, const QByteArray& payload);
+    void relayMessage(int peerId, quint64 sequence, const QByteArray& payload);
+    void clearMessageView();
+    void setMessageListViewEnabled(bool enabled);
+    QScrollBar* messageScrollBar() const;
+    void prependMessages(const QList<MessageInfo>& messageList);  // 按时间正序插入到最上方
     void addMessageToUI(const MessageInfo& message);
     void addSystemMessage(const QString& content);
     void loadCSSStyles();
@@ -81,6 +147,21 @@ private:
     void sendAddFriendRequest(int friendId);  // 新增：发送添加好友请求
     void updateFriendList();  // 新增：更新好友列表显示
 
+    // 服务器响应处理：文本和二进制两种编码解析后走同一套逻辑
+    void handleBinaryResponse(const QString& command, const QByteArray& payload);
+    void handleFriendList(const QList<UserInfo>& friendList);
+    void handleMessageList(const QList<MessageInfo>& messageList);
+    // 分块聊天记录：MESSAGES_BEGIN、若干 MESSAGES_CHUNK、MESSAGES_END
+    void handleMessagesBegin(int peerId);
+    void handleMessageChunk(int peerId, const QList<MessageInfo>& messageList);
+    void handleMessagesEnd(int peerId, int totalCount);
+    // 增量同步得到的新消息，按ID升序
+    void handleMessagesSince(int peerId, const QList<MessageInfo>& messageList);
+    void renderPendingHistory(int maxCount);
+    void handleSearchResults(const QList<UserInfo>& userList);
+    static QList<UserInfo> parseUserList(const QStringList& parts, int userCount);
+    static QList<MessageInfo> parseMessageList(const QStringList& parts, int messageCount, int firstIndex = 2);
+
 private:
     Ui::Chat *ui;
     UserInfo currentUser;
@@ -90,11 +171,73 @@ private:
     QStandardItemModel *friendListModel;
     FriendItemDelegate *friendItemDelegate;
 
-    QTcpSocket *m_tcpSocket = nullptr;
+    ChatService *m_service = nullptr;
+    ServerConnection *m_connection = nullptr;
+    QString m_resumeToken;
+    bool m_connectionLost = false;    // 断线后尚未恢复会话
+    QStringList m_deliveredKeys;      // 最近经UDP收到并显示的消息的投递标识，续连时告诉服务器不必补发
+    struct UnsavedMessage
+    {
+        int receiverId = 0;
+        QString content;
+        QString deliveryKey;
+    };
+    QList<UnsavedMessage> m_unsavedMessages;   // 自动重连期间发出、等待保存到服务器的消息
+    // 同类请求只显示最新一次的回复，发出新请求前取消上一次
+    QFuture<ServerReply> m_historyFuture;
+    QFuture<ServerReply> m_searchFuture;
+    QTimer *m_searchDebounceTimer = nullptr;   // 输入停顿后再搜索
     QUdpSocket *udpSocket = nullptr;
+    ReliableUdpChannel *m_udpChannel = nullptr;
     QTcpServer *tcpServer = nullptr;
+    // 好友的UDP和文件端点，由服务器的 PEER_ENDPOINT 告知
+    struct PeerEndpoint
+    {
+        QHostAddress address;
+        quint16 udpPort = 0;
+        quint16 filePort = 0;
+        int version = 0;   // 对方的协议版本，旧服务器不告知时为0
+    };
+    QHash<int, PeerEndpoint> m_peerEndpoints;
+    QHash<int, QList<QByteArray>> m_pendingDatagrams;   // 等待对方端点的消息
+    // UDP重传失败的好友 -> 恢复尝试UDP的时间（自纪元起的毫秒数），在此之前消息都经服务器转发
+    QHash<int, qint64> m_udpBlockedPeers;
+    QHash<int, qint64> m_peerLookupTimes;   // 因收到未知端点的报文而查询的好友 -> 查询时间，避免反复查询
+    // 等待对方答复的直连发送
+    struct OutgoingPeerFile
+    {
+        QString filePath;
+        int receiverId = 0;
+        PeerEndpoint endpoint;
+    };
+    QHash<QString, OutgoingPeerFile> m_outgoingPeerFiles;   // 传输ID -> 发送信息
+    // 用户同意接收的直连文件，对方的 FILE_OFFER、FILE_JOIN 必须与之相符
+    struct AcceptedPeerFile
+    {
+        int senderId = 0;
+        QString fileName;
+        qint64 fileSize = 0;
+        QString token;
+    };
+    QHash<QString, AcceptedPeerFile> m_acceptedPeerFiles;   // 传输ID -> 接收信息
+    Protocol::Settings m_protocol;       // 与服务器协商的协议选项
+    bool m_scrollToBottomPending = false;
+
+    // 聊天记录的两种视图：默认的 messageBrowser，或按需开启的虚拟化列表
+    bool m_useMessageListView = false;
+    QListView *m_messageListView = nullptr;
+    MessageListModel *m_messageModel = nullptr;
+    int m_historyPeerId = -1;            // 正在接收分块聊天记录的好友ID，-1表示没有
+    QList<MessageInfo> m_pendingHistory; // 已收到、尚未显示的较早消息（从新到旧）
+    int m_historyRenderedCount = 0;      // 本次已显示的历史消息条数
+    int m_historyMaxId = 0;              // 正在接收的分块聊天记录中最大的消息ID
+    MessageCache m_messageCache;         // 本地缓存，打开会话时先显示
+    QTimer *m_historyRenderTimer = nullptr;  // 空闲时分批显示较早的消息
 
     QList<MessageInfo> chatHistory;
+    QHash<int, QString> m_avatarHtml;   // 用户ID -> 头像HTML片段（引用 avatar://用户ID 资源）
+    QSet<int> m_avatarPlaceholders;     // 文档中仍是占位图、等待头像加载的用户ID
+    QStringList m_avatarRequestQueue;   // 本地磁盘缓存中没有、尚未发出请求的头像引用
     QMap<int, UserInfo> m_friendMap;
 
     bool m_isSearchMode = false;
@@ -0,0 +1,179 @@
+#include "chatservice.h"
+
+#include <QFutureWatcher>
+#include <QPointer>
+#include <QPromise>
+#include <memory>
+
+ChatService::ChatService(ServerConnection *connection, QObject *parent)
+    : QObject(parent)
+    , m_connection(connection)
+{
+}
+
+QFuture<ServerReply> ChatService::login(const QString& username, const QString& password)
+{
+    return call(QString("LOGIN|%1|%2").arg(username, password), {"LOGIN_SUCCESS", "LOGIN_FAIL"});
+}
+
+QFuture<ServerReply> ChatService::registerUser(const QString& username, const QString& password,
+                                               const QString& nickname, const QString& avatarPath)
+{
+    return call(QString("REGISTER|%1|%2|%3|%4").arg(username, password, nickname, avatarPath),
+                {"REGISTER_SUCCESS", "REGISTER_FAIL"});
+}
+
+QFuture<ServerReply> ChatService::uploadAvatar(const QByteArray& imageData)
+{
+    return callBinary("AVATAR_UPLOAD", imageData, {"AVATAR_UPLOADED", "AVATAR_UPLOAD_FAIL"});
+}
+
+QFuture<ServerReply> ChatService::logout(int userId)
+{
+    return call(QString("LOGOUT|%1").arg(userId), {"LOGOUT_SUCCESS"});
+}
+
+QFuture<ServerReply> ChatService::resume(const QString& token, quint16 udpPort, quint16 filePort,
+                                         const QStringList& deliveredKeys)
+{
+    return call(QString("RESUME|%1|%2|%3|%4").arg(token).arg(udpPort).arg(filePort).arg(deliveredKeys.join(',')),
+                {"MISSED_MESSAGES", "RESUME_FAIL"});
+}
+
+QFuture<ServerReply> ChatService::friendList(int userId)
+{
+    return call(QString("GET_FRIENDS|%1").arg(userId), {"FRIEND_LIST"});
+}
+
+QFuture<ServerReply> ChatService::chatHistory(int userId, int friendId)
+{
+    const QString request = m_connection->protocol().streamedHistory()
+                                ? QString("GET_MESSAGES|%1|%2|desc").arg(userId).arg(friendId)
+                                : QString("GET_MESSAGES|%1|%2").arg(userId).arg(friendId);
+    return call(request, {"MESSAGES_END", "MESSAGES_LIST"});
+}
+
+QFuture<ServerReply> ChatService::syncHistory(int userId, int friendId, int afterMessageId)
+{
+    return call(QString("SYNC_MESSAGES|%1|%2|%3").arg(userId).arg(friendId).arg(afterMessageId),
+                {"MESSAGES_SINCE", "MESSAGES_END"});
+}
+
+QFuture<ServerReply> ChatService::searchUsers(int userId, const QString& keyword)
+{
+    return call(QString("SEARCH_USERS|%1|%2").arg(userId).arg(keyword), {"SEARCH_RESULTS"});
+}
+
+QFuture<ServerReply> ChatService::addFriend(int userId, int friendId)
+{
+    return call(QString("ADD_FRIEND|%1|%2").arg(userId).arg(friendId), {"ADD_FRIEND_RESULT"});
+}
+
+QFuture<ServerReply> ChatService::saveTextMessage(int senderId, int receiverId, const QString& content,
+                                                  const QString& deliveryKey)
+{
+    if (m_connection->protocol().sessionResume()) {
+        // 支持续连的服务器在内容前多一个投递标识字段
+        return call(QString("SAVE_MESSAGE|%1|%2|1|%3|%4").arg(senderId).arg(receiverId).arg(deliveryKey, content),
+                    {"MESSAGE_SAVED"});
+    }
+    return call(QString("SAVE_MESSAGE|%1|%2|1|%3").arg(senderId).arg(receiverId).arg(content),
+                {"MESSAGE_SAVED"});
+}
+
+QFuture<ServerReply> ChatService::saveFileMessage(int senderId, int receiverId, const QString& fileName,
+                                                  qint64 fileSize, const QString& location)
+{
+    return call(QString("SAVE_MESSAGE|%1|%2|2|%3|%4|%5")
+                    .arg(senderId)
+                    .arg(receiverId)
+                    .arg(fileName)
+                    .arg(fileSize)
+                    .arg(location),
+                {"MESSAGE_SAVED"});
+}
+
+QFuture<ServerReply> ChatService::relayUpload(const QString& transferId, int receiverId, qint64 fileSize)
+{
+    return call(QString("RELAY_UPLOAD|%1|%2|%3").arg(transferId).arg(receiverId).arg(fileSize),
+                {"RELAY_UPLOAD_OK", "RELAY_UPLOAD_FAIL"});
+}
+
+QFuture<ServerReply> ChatService::offerPeerFile(int receiverId, const QString& transferId, const QString& fileName,
+                                                qint64 fileSize)
+{
+    return call(QString("PEER_FILE|%1|%2|%3|%4").arg(receiverId).arg(transferId, fileName).arg(fileSize),
+                {"PEER_FILE_SENT", "PEER_FILE_FAIL"});
+}
+
+QFuture<ServerReply> ChatService::lookupPeer(int peerId)
+{
+    return call(QString("PEER_LOOKUP|%1").arg(peerId), {"PEER_ENDPOINT", "PEER_OFFLINE"});
+}
+
+QFuture<ServerReply> ChatService::fetchAvatar(const QString& reference, int size)
+{
+    return call(QString("GET_AVATAR|%1|%2").arg(reference).arg(size), {"AVATAR", "AVATAR_FAIL"});
+}
+
+QFuture<ServerReply> ChatService::call(const QString& request, const QStringList& finalCommands, int timeoutMs)
+{
+    return track(finalCommands, [this, request, timeoutMs](const ServerConnection::ReplyHandler& handler) {
+        return m_connection->send(request, handler, timeoutMs);
+    });
+}
+
+QFuture<ServerReply> ChatService::callBinary(const QString& command, const QByteArray& payload,
+                                             const QStringList& finalCommands, int timeoutMs)
+{
+    return track(finalCommands, [this, command, payload, timeoutMs](const ServerConnection::ReplyHandler& handler) {
+        return m_connection->sendBinary(command, payload, handler, timeoutMs);
+    });
+}
+
+template <typename Send>
+QFuture<ServerReply> ChatService::track(const QStringList& finalCommands, Send send)
+{
+    // QPromise 不能复制，由处理函数共享；请求结束后处理函数释放，promise 随之析构
+    auto promise = std::make_shared<QPromise<ServerReply>>();
+    auto requestId = std::make_shared<quint32>(0);
+    promise->start();
+    QFuture<ServerReply> future = promise->future();
+
+    QPointer<ServerConnection> connection(m_connection);
+    *requestId = send([promise, requestId, connection, finalCommands](const ServerReply& reply) {
+        if (promise->isCanceled()) {
+            // 取消时已经在回调中的回复
+            promise->finish();
+            return true;
+        }
+        promise->addResult(reply);
+        const bool finished = !reply.ok() || finalCommands.contains(reply.command);
+        if (finished) {
+            promise->finish();
+        }
+        return finished;
+    });
+
+    // 调用方取消后立即撤下处理函数，之后的回复在连接中直接丢弃；处理函数释放时 promise 随之结束
+    future.onCanceled(this, [connection, requestId]() {
+        if (connection) {
+            connection->cancel(*requestId);
+        }
+    });
+    return future;
+}
+
+void ChatService::onReply(const QFuture<ServerReply>& future, QObject *context,
+                          const std::function<void(const ServerReply&)>& handler)
+{
+    auto *watcher = new QFutureWatcher<ServerReply>(context);
+    QObject::connect(watcher, &QFutureWatcherBase::resultsReadyAt, context,
+                     [watcher, handler](int begin, int end) {
+                         for (int i = begin; i < end && !watcher->isCanceled(); ++i) {
+                             handler(watcher->resultAt(i));
+                         }
+                     });
+    QObject::connect(watcher, &QFutureWatcherBase::finished, watcher, &QObject::deleteLater);
+    watcher->setFuture(future);
+}
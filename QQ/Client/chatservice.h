@@ -0,0 +1,70 @@
+#ifndef CHATSERVICE_H
+#define CHATSERVICE_H
+
+#include <QObject>
+#include <QFuture>
+#include <functional>
+#include "serverconnection.h"
+
+// 客户端请求的异步接口：每个服务器命令对应一个方法，返回该请求的全部回复
+// 回复按到达顺序作为 future 的结果逐条加入，收到结束回复后 future 完成；
+// 超时、断线等情况下最后一条结果的 status 说明原因。
+// 调用方对 future 调用 cancel() 后不再收到这个请求的回复，用于丢弃过期的搜索和聊天记录请求。
+class ChatService : public QObject
+{
+    Q_OBJECT
+public:
+    // 普通请求没有任何回复时的超时时间；聊天记录分块发送，每收到一块重新计时
+    static constexpr int DefaultTimeoutMs = 10 * 1000;
+
+    explicit ChatService(ServerConnection *connection, QObject *parent = nullptr);
+
+    ServerConnection* connection() const { return m_connection; }
+
+    QFuture<ServerReply> login(const QString& username, const QString& password);
+    QFuture<ServerReply> registerUser(const QString& username, const QString& password,
+                                      const QString& nickname, const QString& avatarPath);
+    QFuture<ServerReply> uploadAvatar(const QByteArray& imageData);
+    QFuture<ServerReply> logout(int userId);
+    // 重连后凭续连令牌恢复会话并登记端点：RESUME_OK、好友列表、MISSED_MESSAGES，或 RESUME_FAIL
+    // deliveredKeys 是已经经UDP直接收到并显示的消息的投递标识，服务器补发时跳过它们
+    QFuture<ServerReply> resume(const QString& token, quint16 udpPort, quint16 filePort,
+                                const QStringList& deliveredKeys);
+    QFuture<ServerReply> friendList(int userId);
+    // 支持分块的服务器从最新一条往前发送
+    QFuture<ServerReply> chatHistory(int userId, int friendId);
+    // 只取 afterMessageId 之后的消息：MESSAGES_SINCE，落后太多时服务器改发完整的分块聊天记录
+    QFuture<ServerReply> syncHistory(int userId, int friendId, int afterMessageId);
+    QFuture<ServerReply> searchUsers(int userId, const QString& keyword);
+    QFuture<ServerReply> addFriend(int userId, int friendId);
+    // deliveryKey 是这条消息经UDP发出时的投递标识，没有走UDP时为空
+    QFuture<ServerReply> saveTextMessage(int senderId, int receiverId, const QString& content,
+                                         const QString& deliveryKey = QString());
+    // location 为发送方的本地路径，或服务器文件库中的内容引用
+    QFuture<ServerReply> saveFileMessage(int senderId, int receiverId, const QString& fileName, qint64 fileSize,
+                                         const QString& location);
+    // 中转上传前领取上传令牌：RELAY_UPLOAD_OK|传输ID|令牌 或 RELAY_UPLOAD_FAIL|传输ID|原因
+    QFuture<ServerReply> relayUpload(const QString& transferId, int receiverId, qint64 fileSize);
+    // 直连发文件前经服务器告诉对方：PEER_FILE_SENT|传输ID 或 PEER_FILE_FAIL|传输ID|原因，对方的答复另行推送
+    QFuture<ServerReply> offerPeerFile(int receiverId, const QString& transferId, const QString& fileName,
+                                       qint64 fileSize);
+    QFuture<ServerReply> lookupPeer(int peerId);
+    QFuture<ServerReply> fetchAvatar(const QString& reference, int size);
+
+    // 在 context 所在线程逐条处理 future 的回复；future 被取消或 context 释放后不再调用
+    static void onReply(const QFuture<ServerReply>& future, QObject *context,
+                        const std::function<void(const ServerReply&)>& handler);
+
+private:
+    // finalCommands 为结束该请求的回复命令
+    QFuture<ServerReply> call(const QString& request, const QStringList& finalCommands,
+                              int timeoutMs = DefaultTimeoutMs);
+    QFuture<ServerReply> callBinary(const QString& command, const QByteArray& payload,
+                                    const QStringList& finalCommands, int timeoutMs = DefaultTimeoutMs);
+    template <typename Send>
+    QFuture<ServerReply> track(const QStringList& finalCommands, Send send);
+
+    ServerConnection *m_connection;
+};
+
+#endif // CHATSERVICE_H
@@ -0,0 +1,243 @@
+#include "messagecache.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStandardPaths>
+#include <QVariant>
+#include <QDebug>
+
+MessageCache::~MessageCache()
+{
+    close();
+}
+
+bool MessageCache::open(int userId)
+{
+    close();
+    if (userId <= 0) {
+        return false;
+    }
+
+    const QString path = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+                         + QStringLiteral("/cache/user_%1.db").arg(userId);
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    // 重新登录时旧的聊天窗口可能还没释放，连接名按对象区分
+    m_connectionName = QStringLiteral("message_cache_%1").arg(quintptr(this), 0, 16);
+    m_database = QSqlDatabase::addDatabase("QSQLITE", m_connectionName);
+    m_database.setDatabaseName(path);
+    if (!m_database.open()) {
+        qDebug() << "本地缓存打开失败：" << m_database.lastError().text();
+        close();
+        return false;
+    }
+
+    ensureSchema();
+    qDebug() << "本地缓存：" << path;
+    return true;
+}
+
+void MessageCache::close()
+{
+    if (m_connectionName.isEmpty()) {
+        return;
+    }
+    m_database.close();
+    m_database = QSqlDatabase();
+    QSqlDatabase::removeDatabase(m_connectionName);
+    m_connectionName.clear();
+}
+
+void MessageCache::ensureSchema()
+{
+    QSqlQuery query(m_database);
+    // 缓存随时可以删掉重建，写入不必等到落盘
+    query.exec("PRAGMA journal_mode = WAL");
+    query.exec("PRAGMA synchronous = NORMAL");
+
+    if (!query.exec("CREATE TABLE IF NOT EXISTS friends ("
+                    "user_id INTEGER PRIMARY KEY, "
+                    "username TEXT, "
+                    "nickname TEXT, "
+                    "avatar_path TEXT, "
+                    "status INTEGER, "
+                    "position INTEGER)")) {
+        qDebug() << "Create friends failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE TABLE IF NOT EXISTS messages ("
+                    "message_id INTEGER PRIMARY KEY, "
+                    "sender_id INTEGER NOT NULL, "
+                    "receiver_id INTEGER NOT NULL, "
+                    "content_type INTEGER, "
+                    "content TEXT, "
+                    "file_name TEXT, "
+                    "file_size INTEGER, "
+                    "send_time TEXT)")) {
+        qDebug() << "Create messages failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE INDEX IF NOT EXISTS idx_messages_pair ON messages (sender_id, receiver_id, message_id)")) {
+        qDebug() << "Create idx_messages_pair failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE TABLE IF NOT EXISTS conversations ("
+                    "peer_id INTEGER PRIMARY KEY, "
+                    "synced_id INTEGER NOT NULL DEFAULT 0)")) {
+        qDebug() << "Create conversations failed:" << query.lastError().text();
+    }
+}
+
+QList<UserInfo> MessageCache::friendList()
+{
+    QList<UserInfo> friendList;
+    if (!isOpen()) {
+        return friendList;
+    }
+
+    QSqlQuery query(m_database);
+    query.setForwardOnly(true);
+    if (!query.exec("SELECT user_id, username, nickname, avatar_path, status FROM friends ORDER BY position")) {
+        qDebug() << "读取缓存的好友列表失败：" << query.lastError().text();
+        return friendList;
+    }
+    while (query.next()) {
+        UserInfo friendInfo;
+        friendInfo.userId = query.value(0).toInt();
+        friendInfo.username = query.value(1).toString();
+        friendInfo.nickname = query.value(2).toString();
+        friendInfo.avatarPath = query.value(3).toString();
+        friendInfo.status = query.value(4).toInt();
+        friendList.append(friendInfo);
+    }
+    return friendList;
+}
+
+void MessageCache::storeFriendList(const QList<UserInfo>& friendList)
+{
+    if (!isOpen()) {
+        return;
+    }
+
+    // 整体替换，保留服务器给出的顺序
+    m_database.transaction();
+    QSqlQuery query(m_database);
+    query.exec("DELETE FROM friends");
+    query.prepare("INSERT INTO friends (user_id, username, nickname, avatar_path, status, position) "
+                  "VALUES (?, ?, ?, ?, ?, ?)");
+    for (int i = 0; i < friendList.size(); ++i) {
+        const UserInfo& friendInfo = friendList[i];
+        query.addBindValue(friendInfo.userId);
+        query.addBindValue(friendInfo.username);
+        query.addBindValue(friendInfo.nickname);
+        query.addBindValue(friendInfo.avatarPath);
+        query.addBindValue(friendInfo.status);
+        query.addBindValue(i);
+        if (!query.exec()) {
+            qDebug() << "缓存好友列表失败：" << query.lastError().text();
+            m_database.rollback();
+            return;
+        }
+    }
+    m_database.commit();
+}
+
+QList<MessageInfo> MessageCache::messages(int userId, int peerId)
+{
+    QList<MessageInfo> messageList;
+    const int syncedId = syncedMessageId(peerId);
+    if (syncedId <= 0) {
+        return messageList;
+    }
+
+    // 只取已同步范围内的消息，之后的部分可能不完整，由增量同步补上
+    QSqlQuery query(m_database);
+    query.setForwardOnly(true);
+    query.prepare("SELECT message_id, sender_id, receiver_id, content_type, content, file_name, file_size, send_time "
+                  "FROM messages "
+                  "WHERE message_id <= :syncedId "
+                  "AND ((sender_id = :userId AND receiver_id = :peerId) OR (sender_id = :peerId AND receiver_id = :userId)) "
+                  "ORDER BY message_id DESC");
+    query.bindValue(":syncedId", syncedId);
+    query.bindValue(":userId", userId);
+    query.bindValue(":peerId", peerId);
+    if (!query.exec()) {
+        qDebug() << "读取缓存的聊天记录失败：" << query.lastError().text();
+        return messageList;
+    }
+    while (query.next()) {
+        MessageInfo message;
+        message.messageId = query.value(0).toInt();
+        message.senderId = query.value(1).toInt();
+        message.receiverId = query.value(2).toInt();
+        message.contentType = query.value(3).toInt();
+        message.content = query.value(4).toString();
+        message.fileName = query.value(5).toString();
+        message.fileSize = query.value(6).toLongLong();
+        message.sendTime = query.value(7).toString();
+        messageList.append(message);
+    }
+    return messageList;
+}
+
+int MessageCache::syncedMessageId(int peerId)
+{
+    if (!isOpen()) {
+        return 0;
+    }
+
+    QSqlQuery query(m_database);
+    query.prepare("SELECT synced_id FROM conversations WHERE peer_id = :peerId");
+    query.bindValue(":peerId", peerId);
+    if (!query.exec() || !query.next()) {
+        return 0;
+    }
+    return query.value(0).toInt();
+}
+
+void MessageCache::storeMessages(const QList<MessageInfo>& messageList)
+{
+    if (!isOpen() || messageList.isEmpty()) {
+        return;
+    }
+
+    m_database.transaction();
+    QSqlQuery query(m_database);
+    query.prepare("INSERT OR REPLACE INTO messages "
+                  "(message_id, sender_id, receiver_id, content_type, content, file_name, file_size, send_time) "
+                  "VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
+    for (const MessageInfo& message : messageList) {
+        if (message.messageId <= 0) {
+            continue;
+        }
+        query.addBindValue(message.messageId);
+        query.addBindValue(message.senderId);
+        query.addBindValue(message.receiverId);
+        query.addBindValue(message.contentType);
+        query.addBindValue(message.content);
+        query.addBindValue(message.fileName);
+        query.addBindValue(message.fileSize);
+        query.addBindValue(message.sendTime);
+        if (!query.exec()) {
+            qDebug() << "缓存聊天记录失败：" << query.lastError().text();
+            m_database.rollback();
+            return;
+        }
+    }
+    m_database.commit();
+}
+
+void MessageCache::markSynced(int peerId, int messageId)
+{
+    if (!isOpen() || messageId <= 0) {
+        return;
+    }
+
+    QSqlQuery query(m_database);
+    query.prepare("INSERT INTO conversations (peer_id, synced_id) VALUES (:peerId, :messageId) "
+                  "ON CONFLICT(peer_id) DO UPDATE SET synced_id = MAX(synced_id, excluded.synced_id)");
+    query.bindValue(":peerId", peerId);
+    query.bindValue(":messageId", messageId);
+    if (!query.exec()) {
+        qDebug() << "更新同步位置失败：" << query.lastError().text();
+    }
+}
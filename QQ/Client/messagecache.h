@@ -0,0 +1,46 @@
+#ifndef MESSAGECACHE_H
+#define MESSAGECACHE_H
+
+#include <QList>
+#include <QSqlDatabase>
+#include <QString>
+#include "userinfo.h"
+
+// 客户端本地的好友列表和聊天记录缓存，每个用户一个 SQLite 文件
+// 打开会话时先显示缓存，再向服务器只取缓存之后的新消息
+// 每个会话记录 synced_id：这个ID及之前的消息在缓存中是完整的，增量同步从这里开始；
+// 没有收完的聊天记录也会写入缓存，但不推进 synced_id
+class MessageCache
+{
+public:
+    MessageCache() = default;
+    ~MessageCache();
+
+    MessageCache(const MessageCache&) = delete;
+    MessageCache& operator=(const MessageCache&) = delete;
+
+    // 打开该用户的缓存，已打开其他用户的缓存时先关闭
+    bool open(int userId);
+    void close();
+    bool isOpen() const { return m_database.isOpen(); }
+
+    QList<UserInfo> friendList();
+    void storeFriendList(const QList<UserInfo>& friendList);
+
+    // 与该好友的已同步消息，从新到旧
+    QList<MessageInfo> messages(int userId, int peerId);
+    // 缓存中完整的最后一条消息ID，0表示还没有完整同步过
+    int syncedMessageId(int peerId);
+    // 写入服务器确认过的消息（带消息ID）；已有的消息覆盖
+    void storeMessages(const QList<MessageInfo>& messageList);
+    // 该会话的消息已经完整到 messageId，只会往后推进
+    void markSynced(int peerId, int messageId);
+
+private:
+    void ensureSchema();
+
+    QSqlDatabase m_database;
+    QString m_connectionName;
+};
+
+#endif // MESSAGECACHE_H
@@ -0,0 +1,285 @@
+#include "messageview.h"
+
+#include <QAbstractItemView>
+#include <QPainter>
+#include "avatarcache.h"
+
+namespace {
+
+// 与 chat.css 中的尺寸保持一致
+constexpr int RowMargin = 6;
+constexpr int AvatarSize = 36;
+constexpr int AvatarCellWidth = 48;
+constexpr int BubblePaddingH = 12;
+constexpr int BubblePaddingV = 8;
+constexpr int BubbleRadius = 8;
+constexpr int BubbleFontPixelSize = 14;
+constexpr int SystemFontPixelSize = 12;
+
+// 气泡最大宽度占视图宽度的比例
+constexpr qreal BubbleMaxWidthRatio = 0.6;
+
+int maxTextWidth(int width)
+{
+    return qMax(40, int((width - 2 * AvatarCellWidth) * BubbleMaxWidthRatio) - 2 * BubblePaddingH);
+}
+
+} // namespace
+
+// MessageListModel 实现
+MessageListModel::MessageListModel(QObject *parent)
+    : QAbstractListModel(parent)
+{
+}
+
+int MessageListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : int(m_rows.size());
+}
+
+QVariant MessageListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_rows.size()) {
+        return QVariant();
+    }
+
+    const Row& row = m_rows[index.row()];
+    switch (role) {
+    case Qt::DisplayRole:
+        return row.message.content;
+    case SenderIdRole:
+        return row.message.senderId;
+    case IsMineRole:
+        return !row.isSystem && row.message.senderId == m_currentUserId;
+    case IsSystemRole:
+        return row.isSystem;
+    case SendTimeRole:
+        return row.message.sendTime;
+    case AvatarPathRole:
+        return m_users.value(row.message.senderId).avatarPath;
+    case NicknameRole:
+        return m_users.value(row.message.senderId).nickname;
+    default:
+        return QVariant();
+    }
+}
+
+void MessageListModel::setUsers(const UserInfo& currentUser, const QMap<int, UserInfo>& friends)
+{
+    m_currentUserId = currentUser.userId;
+    m_users.clear();
+    for (auto it = friends.cbegin(); it != friends.cend(); ++it) {
+        m_users.insert(it.key(), it.value());
+    }
+    m_users.insert(currentUser.userId, currentUser);
+
+    if (!m_rows.isEmpty()) {
+        emit dataChanged(index(0), index(int(m_rows.size()) - 1));
+    }
+}
+
+void MessageListModel::appendMessage(const MessageInfo& message)
+{
+    const int row = int(m_rows.size());
+    beginInsertRows(QModelIndex(), row, row);
+    Row entry;
+    entry.message = message;
+    m_rows.append(entry);
+    endInsertRows();
+}
+
+void MessageListModel::appendSystemMessage(const QString& text)
+{
+    MessageInfo message{};
+    message.content = text;
+
+    const int row = int(m_rows.size());
+    beginInsertRows(QModelIndex(), row, row);
+    Row entry;
+    entry.message = message;
+    entry.isSystem = true;
+    m_rows.append(entry);
+    endInsertRows();
+}
+
+void MessageListModel::prependMessages(const QList<MessageInfo>& messageList)
+{
+    if (messageList.isEmpty()) {
+        return;
+    }
+
+    QList<Row> rows;
+    rows.reserve(messageList.size() + m_rows.size());
+    for (const MessageInfo& message : messageList) {
+        Row entry;
+        entry.message = message;
+        rows.append(entry);
+    }
+
+    beginInsertRows(QModelIndex(), 0, int(messageList.size()) - 1);
+    rows.append(m_rows);
+    m_rows.swap(rows);
+    endInsertRows();
+}
+
+void MessageListModel::clear()
+{
+    beginResetModel();
+    m_rows.clear();
+    endResetModel();
+}
+
+int MessageListModel::cachedHeight(int row, int width) const
+{
+    if (row < 0 || row >= m_rows.size() || m_rows[row].heightWidth != width) {
+        return -1;
+    }
+    return m_rows[row].height;
+}
+
+QSize MessageListModel::cachedTextSize(int row, int width) const
+{
+    if (row < 0 || row >= m_rows.size() || m_rows[row].heightWidth != width) {
+        return QSize();
+    }
+    return m_rows[row].textSize;
+}
+
+void MessageListModel::setCachedLayout(int row, int width, int height, const QSize& textSize) const
+{
+    if (row >= 0 && row < m_rows.size()) {
+        m_rows[row].height = height;
+        m_rows[row].textSize = textSize;
+        m_rows[row].heightWidth = width;
+    }
+}
+
+// MessageItemDelegate 实现
+MessageItemDelegate::MessageItemDelegate(QObject *parent)
+    : QStyledItemDelegate(parent)
+{
+}
+
+int MessageItemDelegate::viewWidth(const QStyleOptionViewItem &option)
+{
+    // QListView 计算行高时传入的 option.rect 不一定是行的实际宽度，以视口宽度为准
+    const QAbstractItemView *view = qobject_cast<const QAbstractItemView*>(option.widget);
+    return view ? view->viewport()->width() : option.rect.width();
+}
+
+QFont MessageItemDelegate::bubbleFont(const QStyleOptionViewItem &option)
+{
+    QFont font = option.font;
+    font.setPixelSize(BubbleFontPixelSize);
+    return font;
+}
+
+QRect MessageItemDelegate::textBounds(const QString& text, const QFont& font, int width)
+{
+    QFontMetrics metrics(font);
+    return metrics.boundingRect(QRect(0, 0, maxTextWidth(width), 1 << 20),
+                                Qt::TextWordWrap, text);
+}
+
+QSize MessageItemDelegate::sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    const int width = viewWidth(option);
+    const MessageListModel *model = qobject_cast<const MessageListModel*>(index.model());
+    if (model) {
+        int height = model->cachedHeight(index.row(), width);
+        if (height > 0) {
+            return QSize(width, height);
+        }
+    }
+
+    int height;
+    QSize textSize;
+    if (index.data(MessageListModel::IsSystemRole).toBool()) {
+        QFont font = option.font;
+        font.setPixelSize(SystemFontPixelSize);
+        height = QFontMetrics(font).height() + 2 * RowMargin;
+    } else {
+        textSize = textBounds(index.data(Qt::DisplayRole).toString(), bubbleFont(option), width).size();
+        height = qMax(AvatarSize, textSize.height() + 2 * BubblePaddingV) + 2 * RowMargin;
+    }
+
+    // 绘制时直接使用缓存的文字范围，不必每次重绘都重新排版
+    if (model) {
+        model->setCachedLayout(index.row(), width, height, textSize);
+    }
+    return QSize(width, height);
+}
+
+void MessageItemDelegate::paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    painter->save();
+    painter->setRenderHint(QPainter::Antialiasing);
+
+    // 系统消息：居中的灰色文字
+    if (index.data(MessageListModel::IsSystemRole).toBool()) {
+        QFont font = option.font;
+        font.setPixelSize(SystemFontPixelSize);
+        painter->setFont(font);
+        painter->setPen(QColor(150, 150, 150));
+        painter->drawText(option.rect, Qt::AlignCenter, index.data(Qt::DisplayRole).toString());
+        painter->restore();
+        return;
+    }
+
+    const bool isMine = index.data(MessageListModel::IsMineRole).toBool();
+    const QString content = index.data(Qt::DisplayRole).toString();
+    const QString avatarPath = index.data(MessageListModel::AvatarPathRole).toString();
+    const QString nickname = index.data(MessageListModel::NicknameRole).toString();
+
+    /* ===== 头像 ===== */
+    QRect avatarRect(0, 0, AvatarSize, AvatarSize);
+    avatarRect.moveBottom(option.rect.bottom() - RowMargin);
+    if (isMine) {
+        avatarRect.moveRight(option.rect.right() - (AvatarCellWidth - AvatarSize) / 2);
+    } else {
+        avatarRect.moveLeft(option.rect.left() + (AvatarCellWidth - AvatarSize) / 2);
+    }
+
+    QPixmap avatar = AvatarCache::instance().avatar(avatarPath, AvatarSize);
+    if (!avatar.isNull()) {
+        painter->drawPixmap(avatarRect, avatar);
+    } else {
+        painter->setPen(Qt::NoPen);
+        painter->setBrush(QColor(0xcc, 0xcc, 0xcc));
+        painter->drawEllipse(avatarRect);
+        painter->setPen(Qt::white);
+        QFont font = option.font;
+        font.setPixelSize(16);
+        painter->setFont(font);
+        painter->drawText(avatarRect, Qt::AlignCenter, nickname.left(1));
+    }
+
+    /* ===== 气泡 ===== */
+    const QFont font = bubbleFont(option);
+    const int width = viewWidth(option);
+    const MessageListModel *model = qobject_cast<const MessageListModel*>(index.model());
+    QSize text = model ? model->cachedTextSize(index.row(), width) : QSize();
+    if (!text.isValid()) {
+        text = textBounds(content, font, width).size();
+    }
+
+    QRect bubbleRect(0, 0, text.width() + 2 * BubblePaddingH, text.height() + 2 * BubblePaddingV);
+    bubbleRect.moveBottom(option.rect.bottom() - RowMargin);
+    if (isMine) {
+        bubbleRect.moveRight(option.rect.right() - AvatarCellWidth - 4);
+        painter->setPen(Qt::NoPen);
+        painter->setBrush(QColor(0x95, 0xec, 0x69));
+    } else {
+        bubbleRect.moveLeft(option.rect.left() + AvatarCellWidth + 4);
+        painter->setPen(QColor(0xdd, 0xdd, 0xdd));
+        painter->setBrush(Qt::white);
+    }
+    painter->drawRoundedRect(bubbleRect, BubbleRadius, BubbleRadius);
+
+    painter->setFont(font);
+    painter->setPen(Qt::black);
+    painter->drawText(bubbleRect.adjusted(BubblePaddingH, BubblePaddingV, -BubblePaddingH, -BubblePaddingV),
+                      Qt::TextWordWrap | Qt::AlignLeft | Qt::AlignTop, content);
+
+    painter->restore();
+}
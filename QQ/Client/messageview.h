@@ -0,0 +1,78 @@
+#ifndef MESSAGEVIEW_H
+#define MESSAGEVIEW_H
+
+#include <QAbstractListModel>
+#include <QStyledItemDelegate>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include "userinfo.h"
+
+// 聊天记录列表模型：每行一条消息或一条系统提示，两种视图都以它为完整的显示记录
+// 行高和文字范围按视图宽度缓存在模型里，视图只为可见区域绘制
+class MessageListModel : public QAbstractListModel
+{
+    Q_OBJECT
+public:
+    enum Roles {
+        SenderIdRole = Qt::UserRole + 1,
+        IsMineRole,
+        IsSystemRole,
+        SendTimeRole,
+        AvatarPathRole,
+        NicknameRole
+    };
+
+    explicit MessageListModel(QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+    // 头像和昵称从这里查找，好友列表更新后重新设置
+    void setUsers(const UserInfo& currentUser, const QMap<int, UserInfo>& friends);
+
+    void appendMessage(const MessageInfo& message);
+    void appendSystemMessage(const QString& text);   // text 为带时间的完整提示
+    void prependMessages(const QList<MessageInfo>& messageList);  // 按时间正序插入到最前面
+    void clear();
+
+    // 切换视图时按行重新生成文本视图
+    const MessageInfo& message(int row) const { return m_rows[row].message; }
+    bool isSystemMessage(int row) const { return m_rows[row].isSystem; }
+
+    // 行高和气泡文字范围的缓存，宽度与缓存时不同则视为未缓存
+    int cachedHeight(int row, int width) const;
+    QSize cachedTextSize(int row, int width) const;
+    void setCachedLayout(int row, int width, int height, const QSize& textSize) const;
+
+private:
+    struct Row
+    {
+        MessageInfo message;
+        bool isSystem = false;
+        mutable int height = -1;
+        mutable QSize textSize;
+        mutable int heightWidth = -1;
+    };
+
+    QList<Row> m_rows;
+    int m_currentUserId = -1;
+    QHash<int, UserInfo> m_users;
+};
+
+// 聊天气泡委托，外观与 chat.css 中的 HTML 气泡一致
+class MessageItemDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+public:
+    explicit MessageItemDelegate(QObject *parent = nullptr);
+    void paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+    QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+
+private:
+    static int viewWidth(const QStyleOptionViewItem &option);
+    static QFont bubbleFont(const QStyleOptionViewItem &option);
+    static QRect textBounds(const QString& text, const QFont& font, int width);
+};
+
+#endif // MESSAGEVIEW_H
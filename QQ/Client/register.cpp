@@ -3,14 +3,16 @@
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QDir>
-#include <QHostAddress>
+#include <QFile>
+#include <QDebug>
+#include "protocol.h"
 
 
-Register::Register(QWidget *parent)
+Register::Register(ChatService *service, QWidget *parent)
     : QDialog(parent)
     , ui(new Ui::Register)
+    , m_service(service)
     , m_fileDialogOpen(false)
-    , m_serverConnected(false)
 {
     ui->setupUi(this);
 
@@ -20,54 +22,14 @@ Register::Register(QWidget *parent)
     // 设置密码输入框为密码模式
     ui->ResPasswordEdit->setEchoMode(QLineEdit::Password);
 
-    // 初始化TCP Socket
-    m_tcpSocket = new QTcpSocket(this);
-    connect(m_tcpSocket, &QTcpSocket::connected, this, &Register::onSocketConnected);
-    connect(m_tcpSocket, &QTcpSocket::readyRead, this, &Register::onSocketReadyRead);
-#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
-    connect(m_tcpSocket, &QAbstractSocket::errorOccurred, this, &Register::onSocketError);
-#else
-    connect(m_tcpSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
-            this, &Register::onSocketError);
-#endif
+    // 旧服务器的回复不带请求ID，按命令名处理
+    connect(m_service->connection(), &ServerConnection::replyReceived, this, &Register::handleReply);
+    m_service->connection()->connectToServer();
 }
 
 Register::~Register()
 {
     delete ui;
-    disconnectFromServer();
-}
-
-void Register::setTcpSocket(QTcpSocket* socket)
-{
-    if (m_tcpSocket) {
-        m_tcpSocket->deleteLater();
-    }
-    m_tcpSocket = socket;
-
-    connect(m_tcpSocket, &QTcpSocket::connected, this, &Register::onSocketConnected);
-    connect(m_tcpSocket, &QTcpSocket::readyRead, this, &Register::onSocketReadyRead);
-#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
-    connect(m_tcpSocket, &QAbstractSocket::errorOccurred, this, &Register::onSocketError);
-#else
-    connect(m_tcpSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error),
-            this, &Register::onSocketError);
-#endif
-}
-
-void Register::connectToServer()
-{
-    if (m_tcpSocket->state() != QAbstractSocket::ConnectedState) {
-        m_tcpSocket->connectToHost(QHostAddress::LocalHost, 1967);
-        m_tcpSocket->waitForConnected(1000);
-    }
-}
-
-void Register::disconnectFromServer()
-{
-    if (m_tcpSocket && m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        m_tcpSocket->disconnectFromHost();
-    }
 }
 
 void Register::on_PathpushButton_clicked()
@@ -139,26 +101,46 @@ void Register::on_RegisterpushButton_clicked()
         avatarPath = "default_avatar.png";
     }
 
-    // 尝试连接服务器
-    if (m_tcpSocket->state() != QAbstractSocket::ConnectedState) {
-        disconnectFromServer();
-        connectToServer();
+    // 选择了本地图片时先上传到服务器头像库，注册信息中只保存内容哈希
+    QByteArray avatarData;
+    QFile avatarFile(avatarPath);
+    if (avatarFile.exists()) {
+        if (avatarFile.size() > Protocol::MaxAvatarUploadSize) {
+            QMessageBox::warning(this, "输入错误", "头像图片不能超过8MB！");
+            return;
+        }
+        if (!avatarFile.open(QIODevice::ReadOnly)) {
+            QMessageBox::warning(this, "输入错误", "无法读取头像图片！");
+            return;
+        }
+        avatarData = avatarFile.readAll();
+        // 服务器按同样的算法计算哈希，上传和注册按顺序处理，注册时头像已经入库
+        avatarPath = Protocol::contentReference(avatarData);
     }
 
-    // 发送注册请求到服务器
-    QString registerRequest = QString("REGISTER|%1|%2|%3|%4")
-                                  .arg(username)
-                                  .arg(password)
-                                  .arg(nickname)
-                                  .arg(avatarPath);
-
-    if (m_tcpSocket->state() == QAbstractSocket::ConnectedState) {
-        m_tcpSocket->write(registerRequest.toUtf8());
-        m_tcpSocket->flush();
-        // 移除这里的弹窗，只在收到服务器响应后弹窗
-    } else {
-        QMessageBox::critical(this, "错误", "无法连接到服务器，请确保服务器已启动！");
+    if (m_registerPending) {
+        return;
+    }
+
+    // 发送注册请求到服务器；头像和注册信息连续发出，服务器按顺序处理
+    m_registerPending = true;
+    const auto handler = [this](const ServerReply& reply) {
+        if (reply.ok()) {
+            handleReply(reply);
+        } else {
+            handleFailure(reply.status);
+        }
+    };
+    if (!avatarData.isEmpty()) {
+        // 头像上传失败只影响头像，注册结果以注册请求为准
+        ChatService::onReply(m_service->uploadAvatar(avatarData), this, [this](const ServerReply& reply) {
+            if (reply.ok()) {
+                handleReply(reply);
+            }
+        });
     }
+    ChatService::onReply(m_service->registerUser(username, password, nickname, avatarPath), this, handler);
+    // 只在收到服务器响应后弹窗
 }
 
 void Register::on_BackpushButton_clicked()
@@ -167,40 +149,43 @@ void Register::on_BackpushButton_clicked()
     this->reject();
 }
 
-void Register::onSocketReadyRead()
+bool Register::handleReply(const ServerReply& reply)
 {
-    while (m_tcpSocket->canReadLine()) {
-        QByteArray data = m_tcpSocket->readLine();
-        QString response = QString::fromUtf8(data).trimmed();
-
-        // 解析服务器响应
-        QStringList parts = response.split("|");
-        if (parts.size() > 0) {
-            QString command = parts[0];
-
-            if (command == "REGISTER_SUCCESS") {
-                // 注册成功 - 只在这里弹窗
-                QMessageBox::information(this, "注册成功", "创建成功，请返回登录界面登录");
-                emit registrationSuccess();
-                this->accept();  // 关闭注册窗口
-
-            } else if (command == "REGISTER_FAIL" && parts.size() > 1) {
-                // 注册失败
-                QString errorMsg = parts[1];
-                QMessageBox::critical(this, "注册失败", errorMsg);
-            }
-        }
+    const QStringList& parts = reply.parts;
+    const QString& command = reply.command;
+
+    if (command == "REGISTER_SUCCESS") {
+        // 注册成功 - 只在这里弹窗
+        m_registerPending = false;
+        QMessageBox::information(this, "注册成功", "创建成功，请返回登录界面登录");
+        emit registrationSuccess();
+        this->accept();  // 关闭注册窗口
+    } else if (command == "REGISTER_FAIL" && parts.size() > 1) {
+        // 注册失败
+        m_registerPending = false;
+        QString errorMsg = parts[1];
+        QMessageBox::critical(this, "注册失败", errorMsg);
+    } else if (command == "AVATAR_UPLOADED" && parts.size() > 1) {
+        qDebug() << "头像已上传：" << parts[1];
+    } else if (command == "AVATAR_UPLOAD_FAIL") {
+        // 服务器无法解码图片时注册仍会继续，使用默认头像
+        qDebug() << "头像上传失败，将使用默认头像：" << parts.value(1);
+    } else {
+        return false;
     }
+    return true;
 }
 
-void Register::onSocketConnected()
+void Register::handleFailure(ServerReply::Status status)
 {
-    m_serverConnected = true;
-}
-
-void Register::onSocketError(QAbstractSocket::SocketError error)
-{
-    Q_UNUSED(error);
-    m_serverConnected = false;
-    QMessageBox::critical(this, "连接错误", "无法连接到服务器，请确保服务器已启动！");
+    // 旧服务器的回复不带请求ID，仍由 replyReceived 交给 handleReply
+    if (status == ServerReply::Status::Unmatched || !m_registerPending) {
+        return;
+    }
+    m_registerPending = false;
+    if (status == ServerReply::Status::TimedOut) {
+        QMessageBox::warning(this, "注册超时", "服务器长时间没有响应，请稍后重试！");
+    } else {
+        QMessageBox::critical(this, "连接错误", "无法连接到服务器，请确保服务器已启动！");
+    }
 }
@@ -2,8 +2,7 @@
 #define REGISTER_H
 
 #include <QDialog>
-#include <QTcpSocket>
-#include <QAbstractSocket>
+#include "chatservice.h"
 
 namespace Ui {
 class Register;
@@ -14,12 +13,10 @@ class Register : public QDialog
     Q_OBJECT
 
 public:
-    explicit Register(QWidget *parent = nullptr);
+    // 使用登录窗口的服务器连接，不另外建立连接
+    explicit Register(ChatService *service, QWidget *parent = nullptr);
     ~Register();
 
-    void setTcpSocket(QTcpSocket* socket);
-    void connectToServer();
-
 signals:
     void registrationSuccess();
 
@@ -27,17 +24,15 @@ private slots:
     void on_PathpushButton_clicked();
     void on_RegisterpushButton_clicked();
     void on_BackpushButton_clicked();
-    void onSocketReadyRead();
-    void onSocketConnected();
-    void onSocketError(QAbstractSocket::SocketError error);
 
 private:
     Ui::Register *ui;
-    QTcpSocket *m_tcpSocket = nullptr;
+    ChatService *m_service;
     bool m_fileDialogOpen = false;
-    bool m_serverConnected = false;
+    bool m_registerPending = false;
 
-    void disconnectFromServer();
+    bool handleReply(const ServerReply& reply);
+    void handleFailure(ServerReply::Status status);
 };
 
 #endif // REGISTER_H
@@ -0,0 +1,313 @@
+#include "reliableudp.h"
+
+#include <QRandomGenerator>
+#include <QDebug>
+
+namespace {
+
+const QByteArray DataPrefix = QByteArrayLiteral("RUDP_DATA|");
+const QByteArray AckPrefix = QByteArrayLiteral("RUDP_ACK|");
+
+// 单个报文的负载上限，避免IP分片
+constexpr qsizetype MaxPayloadSize = 1200;
+// 首次发送时的重传超时和上下限（毫秒）
+constexpr qint64 InitialRtoMs = 200;
+constexpr qint64 MinRtoMs = 50;
+constexpr qint64 MaxRtoMs = 2000;
+// 重传超过该次数仍没有确认时交给TCP
+constexpr int MaxRetransmits = 5;
+// 乱序消息等待缺口的最长时间，超时后跳过缺口。要长于发送方用完全部重传
+// （每次最多 MaxRtoMs）再改走TCP转发的时间，否则转发来的那条总是排在后面
+constexpr qint64 RelayAllowanceMs = 3000;
+constexpr qint64 GapTimeoutMs = (MaxRetransmits + 1) * MaxRtoMs + RelayAllowanceMs;
+// 一个确认报文中最多列出的乱序序号
+constexpr int MaxSackCount = 32;
+// 超出已交付序号太远的报文不接收，限制乱序缓存和跳过记录的大小
+constexpr quint64 MaxReorderWindow = 1024;
+// 有待确认或待补齐的消息时，定时检查的间隔
+constexpr int TimerIntervalMs = 20;
+
+QString peerKey(const QHostAddress& address, quint16 port)
+{
+    return address.toString() + QLatin1Char(':') + QString::number(port);
+}
+
+// 按'|'切出前 count 个字段，最后一个字段是剩余的全部内容
+QList<QByteArray> splitFields(const QByteArray& datagram, int count)
+{
+    QList<QByteArray> fields;
+    qsizetype start = 0;
+    while (fields.size() < count - 1) {
+        const qsizetype end = datagram.indexOf('|', start);
+        if (end < 0) {
+            break;
+        }
+        fields.append(datagram.mid(start, end - start));
+        start = end + 1;
+    }
+    fields.append(datagram.mid(start));
+    return fields;
+}
+
+} // namespace
+
+ReliableUdpChannel::ReliableUdpChannel(QUdpSocket *socket, QObject *parent)
+    : QObject(parent)
+    , m_socket(socket)
+    , m_channelId(QRandomGenerator::global()->generate())
+{
+    m_clock.start();
+    m_timer.setInterval(TimerIntervalMs);
+    connect(&m_timer, &QTimer::timeout, this, &ReliableUdpChannel::onTimer);
+    connect(m_socket, &QUdpSocket::readyRead, this, &ReliableUdpChannel::onReadyRead);
+}
+
+quint64 ReliableUdpChannel::send(const QHostAddress& address, quint16 port, const QByteArray& payload)
+{
+    if (payload.size() > MaxPayloadSize) {
+        return 0;
+    }
+
+    Peer& peer = m_peers[peerKey(address, port)];
+    if (peer.port == 0) {
+        peer.address = address;
+        peer.port = port;
+        peer.rto = InitialRtoMs;
+    }
+
+    const quint64 sequence = peer.nextSequence++;
+    Outgoing& outgoing = peer.unacked[sequence];
+    outgoing.payload = payload;
+    outgoing.datagram = DataPrefix + QByteArray::number(m_channelId) + '|' + QByteArray::number(sequence)
+                        + '|' + payload;
+    transmit(peer, outgoing);
+    scheduleTimer();
+    return sequence;
+}
+
+void ReliableUdpChannel::transmit(Peer& peer, Outgoing& outgoing)
+{
+    const qint64 now = m_clock.elapsed();
+    outgoing.sentAt = now;
+    // 每重传一次超时加倍
+    outgoing.deadline = now + qMin(MaxRtoMs, peer.rto << outgoing.retransmits);
+    m_socket->writeDatagram(outgoing.datagram, peer.address, peer.port);
+}
+
+void ReliableUdpChannel::receiveRelayed(quint32 channelId, quint64 sequence, const QByteArray& payload)
+{
+    if (sequence == 0) {
+        emit messageReceived(payload, channelId, 0);
+        return;
+    }
+    accept(channelId, m_incoming[channelId], sequence, payload);
+    scheduleTimer();
+}
+
+void ReliableUdpChannel::onReadyRead()
+{
+    while (m_socket->hasPendingDatagrams()) {
+        QByteArray datagram;
+        datagram.resize(m_socket->pendingDatagramSize());
+        QHostAddress sender;
+        quint16 senderPort = 0;
+        m_socket->readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
+
+        if (datagram.startsWith(DataPrefix)) {
+            handleData(datagram, sender, senderPort);
+        } else if (datagram.startsWith(AckPrefix)) {
+            handleAck(datagram, sender, senderPort);
+        } else if (!m_senderCheck || m_senderCheck(datagram, sender, senderPort)) {
+            emit datagramReceived(datagram);
+        }
+    }
+}
+
+void ReliableUdpChannel::handleData(const QByteArray& datagram, const QHostAddress& sender, quint16 senderPort)
+{
+    const QList<QByteArray> fields = splitFields(datagram, 4);
+    bool channelOk = false;
+    bool sequenceOk = false;
+    const quint32 channelId = fields.value(1).toUInt(&channelOk);
+    const quint64 sequence = fields.value(2).toULongLong(&sequenceOk);
+    if (fields.size() != 4 || !channelOk || !sequenceOk || sequence == 0) {
+        qDebug() << "无效的UDP消息报文，已丢弃";
+        return;
+    }
+
+    if (m_senderCheck && !m_senderCheck(fields[3], sender, senderPort)) {
+        return;
+    }
+
+    // 重复的报文也要确认，对方可能没收到上一次的确认
+    Incoming& incoming = m_incoming[channelId];
+    accept(channelId, incoming, sequence, fields[3]);
+    sendAck(channelId, incoming, sender, senderPort);
+    scheduleTimer();
+}
+
+bool ReliableUdpChannel::accept(quint32 channelId, Incoming& incoming, quint64 sequence, const QByteArray& payload)
+{
+    if (incoming.skipped.remove(sequence)) {
+        // 被跳过的消息迟到了，此时只能放在后面的消息之后显示
+        emit messageReceived(payload, channelId, sequence);
+        return true;
+    }
+    if (sequence <= incoming.delivered || sequence > incoming.delivered + MaxReorderWindow
+        || incoming.pending.contains(sequence)) {
+        return false;
+    }
+    incoming.pending.insert(sequence, payload);
+    deliverInOrder(channelId, incoming);
+    return true;
+}
+
+void ReliableUdpChannel::deliverInOrder(quint32 channelId, Incoming& incoming)
+{
+    while (!incoming.pending.isEmpty() && incoming.pending.firstKey() == incoming.delivered + 1) {
+        const QByteArray payload = incoming.pending.take(incoming.pending.firstKey());
+        ++incoming.delivered;
+        emit messageReceived(payload, channelId, incoming.delivered);
+    }
+    // 还有乱序消息时从现在开始计算等待缺口的时间
+    incoming.gapSince = incoming.pending.isEmpty() ? 0 : (incoming.gapSince ? incoming.gapSince : m_clock.elapsed());
+}
+
+void ReliableUdpChannel::sendAck(quint32 channelId, const Incoming& incoming, const QHostAddress& address, quint16 port)
+{
+    QByteArray sacks;
+    int count = 0;
+    for (auto it = incoming.pending.cbegin(); it != incoming.pending.cend() && count < MaxSackCount; ++it, ++count) {
+        if (!sacks.isEmpty()) {
+            sacks += ',';
+        }
+        sacks += QByteArray::number(it.key());
+    }
+    m_socket->writeDatagram(AckPrefix + QByteArray::number(channelId) + '|' + QByteArray::number(incoming.delivered)
+                                + '|' + sacks,
+                            address, port);
+}
+
+void ReliableUdpChannel::handleAck(const QByteArray& datagram, const QHostAddress& sender, quint16 senderPort)
+{
+    const QList<QByteArray> fields = splitFields(datagram, 4);
+    if (fields.size() != 4 || fields[1].toUInt() != m_channelId) {
+        return;
+    }
+    auto peerIt = m_peers.find(peerKey(sender, senderPort));
+    if (peerIt == m_peers.end()) {
+        return;
+    }
+    Peer& peer = *peerIt;
+    const qint64 now = m_clock.elapsed();
+
+    // 只用没有重传过（包括快速重传）的消息估算RTT，重传过的无法分辨确认的是哪一次发送
+    qint64 rttSample = -1;
+    auto acknowledge = [&](QMap<quint64, Outgoing>::iterator it) {
+        if (it->retransmits == 0 && !it->fastRetransmitted) {
+            rttSample = now - it->sentAt;
+        }
+        return peer.unacked.erase(it);
+    };
+
+    const quint64 cumulative = fields[2].toULongLong();
+    for (auto it = peer.unacked.begin(); it != peer.unacked.end() && it.key() <= cumulative;) {
+        it = acknowledge(it);
+    }
+
+    quint64 highestSacked = 0;
+    for (const QByteArray& field : fields[3].split(',')) {
+        const quint64 sequence = field.toULongLong();
+        if (sequence == 0) {
+            continue;
+        }
+        highestSacked = qMax(highestSacked, sequence);
+        auto it = peer.unacked.find(sequence);
+        if (it != peer.unacked.end()) {
+            acknowledge(it);
+        }
+    }
+    if (rttSample >= 0) {
+        updateRtt(peer, rttSample);
+    }
+
+    // 对方已经收到更后面的消息，前面缺的那条不等超时立即重发一次
+    for (auto it = peer.unacked.begin(); it != peer.unacked.end() && it.key() < highestSacked; ++it) {
+        if (!it->fastRetransmitted) {
+            it->fastRetransmitted = true;
+            transmit(peer, *it);
+        }
+    }
+}
+
+void ReliableUdpChannel::updateRtt(Peer& peer, qint64 sample)
+{
+    // RFC 6298 的平滑估算
+    if (peer.srtt == 0) {
+        peer.srtt = sample;
+        peer.rttvar = sample / 2.0;
+    } else {
+        peer.rttvar = 0.75 * peer.rttvar + 0.25 * qAbs(peer.srtt - sample);
+        peer.srtt = 0.875 * peer.srtt + 0.125 * sample;
+    }
+    peer.rto = qBound(MinRtoMs, qint64(peer.srtt + 4 * peer.rttvar), MaxRtoMs);
+}
+
+void ReliableUdpChannel::onTimer()
+{
+    const qint64 now = m_clock.elapsed();
+
+    struct Failure { QHostAddress address; quint16 port; quint64 sequence; QByteArray payload; };
+    QList<Failure> failures;
+    for (Peer& peer : m_peers) {
+        for (auto it = peer.unacked.begin(); it != peer.unacked.end();) {
+            if (it->deadline > now) {
+                ++it;
+                continue;
+            }
+            if (it->retransmits >= MaxRetransmits) {
+                failures.append({peer.address, peer.port, it.key(), it->payload});
+                it = peer.unacked.erase(it);
+                continue;
+            }
+            ++it->retransmits;
+            transmit(peer, *it);
+            ++it;
+        }
+    }
+
+    for (auto it = m_incoming.begin(); it != m_incoming.end(); ++it) {
+        Incoming& incoming = it.value();
+        if (!incoming.pending.isEmpty() && now - incoming.gapSince >= GapTimeoutMs) {
+            // 缺的消息迟迟不到（发送方会改走TCP），先交付后面已经到达的
+            qDebug() << "UDP消息缺口等待超时，跳过序号" << incoming.delivered + 1 << "到" << incoming.pending.firstKey() - 1;
+            for (quint64 sequence = incoming.delivered + 1; sequence < incoming.pending.firstKey(); ++sequence) {
+                incoming.skipped.insert(sequence);
+            }
+            incoming.delivered = incoming.pending.firstKey() - 1;
+            incoming.gapSince = 0;
+            deliverInOrder(it.key(), incoming);
+        }
+    }
+
+    scheduleTimer();
+    for (const Failure& failure : failures) {
+        emit deliveryFailed(failure.address, failure.port, failure.sequence, failure.payload);
+    }
+}
+
+void ReliableUdpChannel::scheduleTimer()
+{
+    bool busy = false;
+    for (const Peer& peer : std::as_const(m_peers)) {
+        busy = busy || !peer.unacked.isEmpty();
+    }
+    for (const Incoming& incoming : std::as_const(m_incoming)) {
+        busy = busy || !incoming.pending.isEmpty();
+    }
+    if (busy && !m_timer.isActive()) {
+        m_timer.start();
+    } else if (!busy) {
+        m_timer.stop();
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef RELIABLEUDP_H
+#define RELIABLEUDP_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
+#include <QUdpSocket>
+#include <functional>
+
+// 可靠有序的UDP消息通道，用于好友之间的聊天消息
+// 每条消息带序号，接收方每收到一个报文立即回复累计确认和选择确认（已收到的乱序序号）；
+// 发送方按RTT估算的超时重传，选择确认显示中间缺了一条时立即重发一次。
+// 接收方按序号去重，按发送顺序交付；缺口等待过久时跳过，缺的那条由发送方改走TCP补上。
+// 多次重传仍没有确认的消息通过 deliveryFailed 交给调用方走TCP。
+//
+// 报文格式（负载放在最后，可以含有'|'）：
+//   RUDP_DATA|通道ID|序号|负载
+//   RUDP_ACK|通道ID|累计确认序号|选择确认的序号（逗号分隔）
+// 通道ID由发送方启动时随机生成，对方重启后序号从头开始也不会被当成重复消息
+class ReliableUdpChannel : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ReliableUdpChannel(QUdpSocket *socket, QObject *parent = nullptr);
+
+    quint32 channelId() const { return m_channelId; }
+
+    // 核对UDP报文的来源（负载声称的发送者与来源地址端口是否相符），不通过的报文直接丢弃、不回确认；
+    // 不设置时全部接受。经TCP补发的消息已由服务器核对过，不经过这里
+    using SenderCheck = std::function<bool(const QByteArray& payload, const QHostAddress& address, quint16 port)>;
+    void setSenderCheck(const SenderCheck& check) { m_senderCheck = check; }
+
+    // 发送一条消息，返回序号；负载超过单个报文的安全大小时返回0，由调用方改走TCP
+    quint64 send(const QHostAddress& address, quint16 port, const QByteArray& payload);
+    // 经TCP补发到达的消息，与UDP收到的一样去重和排序；sequence 为0表示没有走过UDP，直接交付
+    void receiveRelayed(quint32 channelId, quint64 sequence, const QByteArray& payload);
+
+signals:
+    // channelId/sequence 是发送方通道ID和序号，可用作这条消息的投递标识；sequence 为0表示没有走过UDP
+    void messageReceived(const QByteArray& payload, quint32 channelId, quint64 sequence);
+    // 不是本通道格式的报文（旧版客户端直接发送的消息）
+    void datagramReceived(const QByteArray& datagram);
+    void deliveryFailed(const QHostAddress& address, quint16 port, quint64 sequence, const QByteArray& payload);
+
+private slots:
+    void onReadyRead();
+    void onTimer();
+
+private:
+    struct Outgoing
+    {
+        QByteArray datagram;
+        QByteArray payload;
+        qint64 sentAt = 0;
+        qint64 deadline = 0;
+        int retransmits = 0;
+        bool fastRetransmitted = false;
+    };
+    struct Peer
+    {
+        QHostAddress address;
+        quint16 port = 0;
+        quint64 nextSequence = 1;
+        QMap<quint64, Outgoing> unacked;
+        double srtt = 0;       // 平滑RTT（毫秒），0表示还没有样本
+        double rttvar = 0;
+        qint64 rto = 0;
+    };
+    struct Incoming
+    {
+        quint64 delivered = 0;             // 已按顺序交付的最大序号
+        QMap<quint64, QByteArray> pending; // 先到的乱序消息
+        QSet<quint64> skipped;             // 等待超时被跳过的序号，经TCP补到时直接交付
+        qint64 gapSince = 0;               // 开始等待缺口的时间
+    };
+
+    void handleData(const QByteArray& datagram, const QHostAddress& sender, quint16 senderPort);
+    void handleAck(const QByteArray& datagram, const QHostAddress& sender, quint16 senderPort);
+    // 记录到达的消息并交付连续的部分，返回false表示重复或超出接收窗口
+    bool accept(quint32 channelId, Incoming& incoming, quint64 sequence, const QByteArray& payload);
+    void deliverInOrder(quint32 channelId, Incoming& incoming);
+    void sendAck(quint32 channelId, const Incoming& incoming, const QHostAddress& address, quint16 port);
+    void updateRtt(Peer& peer, qint64 sample);
+    void transmit(Peer& peer, Outgoing& outgoing);
+    void scheduleTimer();
+
+    QUdpSocket *m_socket;
+    SenderCheck m_senderCheck;
+    quint32 m_channelId;
+    QElapsedTimer m_clock;
+    QTimer m_timer;
+    QHash<QString, Peer> m_peers;          // 地址:端口 -> 发送状态
+    QHash<quint32, Incoming> m_incoming;   // 对方通道ID -> 接收状态
+};
+
+#endif // RELIABLEUDP_H
@@ -0,0 +1,401 @@
+#include "serverconnection.h"
+
+#include <QHostAddress>
+#include <QRandomGenerator>
+#include <QDebug>
+#include "framecompression.h"
+
+namespace {
+
+constexpr quint16 ServerPort = 1967;
+// 不认识HELLO的旧服务器不会回复，超过该时间按旧版文本协议继续
+constexpr int HandshakeTimeoutMs = 1000;
+// 检查请求超时的间隔
+constexpr int TimeoutCheckIntervalMs = 200;
+// 取消或超时的请求，这么久之内到达的回复都丢弃；之后服务器不会再为它发送回复
+constexpr qint64 CancelledRetentionMs = 60 * 1000;
+// 重连的退避时间：从 InitialReconnectDelayMs 开始每次加倍，最多 MaxReconnectDelayMs
+constexpr int InitialReconnectDelayMs = 500;
+constexpr int MaxReconnectDelayMs = 30 * 1000;
+
+// 带ID的回复以 #ID 开头
+bool takeRequestId(QStringList& parts, quint32& requestId)
+{
+    if (parts.isEmpty() || !parts[0].startsWith(QLatin1Char('#'))) {
+        return false;
+    }
+    requestId = parts.takeFirst().mid(1).toUInt();
+    return true;
+}
+
+} // namespace
+
+ServerConnection::ServerConnection(QObject *parent)
+    : QObject(parent)
+    , m_socket(new QTcpSocket(this))
+{
+    m_handshakeTimer.setSingleShot(true);
+    m_handshakeTimer.setInterval(HandshakeTimeoutMs);
+    connect(&m_handshakeTimer, &QTimer::timeout, this, &ServerConnection::onHandshakeTimeout);
+    m_clock.start();
+    m_timeoutTimer.setInterval(TimeoutCheckIntervalMs);
+    connect(&m_timeoutTimer, &QTimer::timeout, this, &ServerConnection::onTimeoutCheck);
+    m_reconnectTimer.setSingleShot(true);
+    connect(&m_reconnectTimer, &QTimer::timeout, this, &ServerConnection::onReconnectTimeout);
+
+    connect(m_socket, &QTcpSocket::connected, this, &ServerConnection::onConnected);
+    connect(m_socket, &QTcpSocket::readyRead, this, &ServerConnection::onReadyRead);
+    connect(m_socket, &QTcpSocket::disconnected, this, &ServerConnection::onDisconnected);
+    connect(m_socket, &QAbstractSocket::errorOccurred, this, &ServerConnection::onError);
+}
+
+void ServerConnection::connectToServer()
+{
+    if (m_socket->state() == QAbstractSocket::UnconnectedState) {
+        m_socket->connectToHost(QHostAddress::LocalHost, ServerPort);
+    }
+}
+
+void ServerConnection::disconnectFromServer()
+{
+    setAutoReconnect(false);
+    if (m_socket->state() != QAbstractSocket::UnconnectedState) {
+        m_socket->disconnectFromHost();
+    }
+}
+
+void ServerConnection::setAutoReconnect(bool enabled)
+{
+    m_autoReconnect = enabled;
+    if (!enabled) {
+        m_reconnectTimer.stop();
+        m_reconnectAttempt = 0;
+    }
+}
+
+void ServerConnection::scheduleReconnect()
+{
+    if (!m_autoReconnect || m_reconnectTimer.isActive()
+        || m_socket->state() != QAbstractSocket::UnconnectedState) {
+        return;
+    }
+    // 指数退避，实际等待时间在后一半区间内随机，服务器重启后大量客户端不会同时重连
+    const int shift = qMin(m_reconnectAttempt, 16);
+    const int backoff = int(qMin<qint64>(MaxReconnectDelayMs, qint64(InitialReconnectDelayMs) << shift));
+    const int delay = backoff / 2 + int(QRandomGenerator::global()->bounded(backoff / 2 + 1));
+    ++m_reconnectAttempt;
+    qDebug() << "将在" << delay << "毫秒后第" << m_reconnectAttempt << "次重连";
+    m_reconnectTimer.start(delay);
+    emit reconnecting(m_reconnectAttempt, delay);
+}
+
+void ServerConnection::onReconnectTimeout()
+{
+    connectToServer();
+}
+
+quint32 ServerConnection::send(const QString& request, const ReplyHandler& handler, int timeoutMs)
+{
+    return enqueue(request.toUtf8(), QByteArray(), handler, timeoutMs);
+}
+
+quint32 ServerConnection::sendBinary(const QString& command, const QByteArray& payload, const ReplyHandler& handler,
+                                     int timeoutMs)
+{
+    return enqueue(QString("BIN|%1|%2").arg(command).arg(payload.size()).toUtf8(), payload, handler, timeoutMs);
+}
+
+quint32 ServerConnection::enqueue(const QByteArray& header, const QByteArray& payload, const ReplyHandler& handler,
+                                  int timeoutMs)
+{
+    PendingRequest request;
+    request.id = m_nextRequestId++;
+    request.header = header;
+    request.payload = payload;
+    if (handler) {
+        Waiting waiting;
+        waiting.handler = handler;
+        waiting.timeoutMs = timeoutMs;
+        waiting.deadline = m_clock.elapsed() + timeoutMs;
+        m_waiting.insert(request.id, waiting);
+        scheduleTimeoutCheck();
+    }
+
+    if (m_ready) {
+        // 不立即flush，同一轮事件中连续发出的请求由Qt合并写出
+        write(request);
+        if (handler && !m_protocol.requestIds()) {
+            // 回复无法对应到请求，处理函数在返回之后收到 Unmatched
+            QTimer::singleShot(0, this, [this, id = request.id]() {
+                finishWaiting(id, ServerReply::Status::Unmatched);
+            });
+        }
+    } else {
+        m_queue.append(request);
+        // 正在等待重连时不提前连接，按退避时间重连后发出
+        if (!m_reconnectTimer.isActive()) {
+            connectToServer();
+        }
+    }
+    return request.id;
+}
+
+void ServerConnection::cancel(quint32 requestId)
+{
+    if (m_waiting.remove(requestId) > 0) {
+        m_cancelled.insert(requestId, m_clock.elapsed());
+        scheduleTimeoutCheck();
+    }
+}
+
+void ServerConnection::finishWaiting(quint32 requestId, ServerReply::Status status)
+{
+    auto it = m_waiting.find(requestId);
+    if (it == m_waiting.end()) {
+        return;
+    }
+    const ReplyHandler handler = it->handler;
+    m_waiting.erase(it);
+    if (status == ServerReply::Status::TimedOut) {
+        // 超时后才到的回复不再交给别处
+        m_cancelled.insert(requestId, m_clock.elapsed());
+    }
+
+    ServerReply reply;
+    reply.status = status;
+    reply.requestId = requestId;
+    handler(reply);
+}
+
+void ServerConnection::scheduleTimeoutCheck()
+{
+    bool needed = !m_cancelled.isEmpty();
+    for (auto it = m_waiting.cbegin(); !needed && it != m_waiting.cend(); ++it) {
+        needed = it->timeoutMs > 0;
+    }
+    if (needed && !m_timeoutTimer.isActive()) {
+        m_timeoutTimer.start();
+    } else if (!needed) {
+        m_timeoutTimer.stop();
+    }
+}
+
+void ServerConnection::onTimeoutCheck()
+{
+    const qint64 now = m_clock.elapsed();
+    QList<quint32> expired;
+    for (auto it = m_waiting.cbegin(); it != m_waiting.cend(); ++it) {
+        if (it->timeoutMs > 0 && it->deadline <= now) {
+            expired.append(it.key());
+        }
+    }
+    for (auto it = m_cancelled.begin(); it != m_cancelled.end();) {
+        it = now - *it >= CancelledRetentionMs ? m_cancelled.erase(it) : std::next(it);
+    }
+
+    for (quint32 requestId : expired) {
+        qDebug() << "请求超时，请求ID：" << requestId;
+        finishWaiting(requestId, ServerReply::Status::TimedOut);
+    }
+    scheduleTimeoutCheck();
+}
+
+void ServerConnection::write(const PendingRequest& request)
+{
+    if (m_protocol.requestIds()) {
+        m_socket->write('#' + QByteArray::number(request.id) + '|');
+    }
+    m_socket->write(request.header + '\n');
+    if (!request.payload.isEmpty()) {
+        m_socket->write(request.payload);
+    }
+}
+
+void ServerConnection::onConnected()
+{
+    qDebug() << "已连接到服务器";
+    m_lineReader.clear();
+    m_pendingBinarySize = -1;
+    m_protocol = Protocol::Settings();
+    m_ready = false;
+    emit connected();
+
+    // 握手完成前不发送其他请求，之后的请求才知道能否带ID
+    m_socket->write((Protocol::buildHello(Protocol::localCapabilities()) + "\n").toUtf8());
+    m_socket->flush();
+    m_handshakeTimer.start();
+}
+
+void ServerConnection::onHandshakeTimeout()
+{
+    qDebug() << "服务器没有回复握手，使用旧版文本协议";
+    finishHandshake();
+}
+
+void ServerConnection::finishHandshake()
+{
+    m_handshakeTimer.stop();
+    if (m_ready) {
+        return;
+    }
+    m_ready = true;
+    m_reconnectAttempt = 0;
+
+    // 先通知 ready：重连后恢复会话的请求在 ready 中发出，排在积压的请求之前
+    const QList<PendingRequest> queue = m_queue;
+    m_queue.clear();
+    emit ready();
+
+    // 排队的请求一次写出，不等待各自的回复
+    for (const PendingRequest& request : queue) {
+        write(request);
+    }
+    m_socket->flush();
+    if (!m_protocol.requestIds()) {
+        // 回复无法对应到请求，等待中的请求都以 Unmatched 结束
+        for (const PendingRequest& request : queue) {
+            finishWaiting(request.id, ServerReply::Status::Unmatched);
+        }
+    }
+}
+
+void ServerConnection::onReadyRead()
+{
+    // 整块读入后一次扫描出所有行和字段，避免 canReadLine/fromUtf8/trimmed/split 反复遍历大响应
+    m_lineReader.append(m_socket->readAll());
+
+    QStringList parts;
+    bool utf8Valid = true;
+    while (m_socket->state() == QAbstractSocket::ConnectedState) {
+        // BIN帧：头部行之后紧跟指定字节数的二进制负载
+        if (m_pendingBinarySize >= 0) {
+            if (m_lineReader.pendingBytes() < m_pendingBinarySize) {
+                break;
+            }
+            ServerReply reply = m_pendingBinary;
+            reply.payload = m_lineReader.readBytes(m_pendingBinarySize);
+            m_pendingBinarySize = -1;
+            if (m_pendingBinaryCompression != Protocol::Compression::None) {
+                QByteArray decompressed;
+                if (!FrameCompression::decompress(reply.payload, m_pendingBinaryCompression, m_pendingBinaryRawSize,
+                                                  decompressed, m_protocol.dictionaryId)) {
+                    qDebug() << "BIN帧解压失败：" << reply.command;
+                    continue;
+                }
+                reply.payload = decompressed;
+            }
+            dispatch(reply);
+            continue;
+        }
+
+        if (!m_lineReader.readLine(parts, &utf8Valid)) {
+            break;
+        }
+        if (!utf8Valid) {
+            qDebug() << "收到非法UTF-8数据，已丢弃";
+            continue;
+        }
+
+        ServerReply reply;
+        takeRequestId(parts, reply.requestId);
+        if (parts.isEmpty()) {
+            continue;
+        }
+        reply.command = parts[0];
+        qDebug() << "收到服务器响应：" << reply.command << "请求ID：" << reply.requestId << "字段数：" << parts.size();
+
+        if (reply.command == "BIN" && parts.size() >= 3) {
+            const qint64 size = parts[2].toLongLong();
+            if (size < 0 || size > m_protocol.maxFrameSize) {
+                qDebug() << "BIN帧长度超出协商上限，断开连接：" << size;
+                m_socket->abort();
+                return;
+            }
+            // 压缩帧带有压缩方式和原始长度，原始长度同样受协商上限约束
+            Protocol::Compression compression = Protocol::Compression::None;
+            qint64 rawSize = size;
+            if (parts.size() >= 5) {
+                compression = Protocol::compressionFromName(parts[3]);
+                rawSize = parts[4].toLongLong();
+                if (rawSize < 0 || rawSize > m_protocol.maxFrameSize) {
+                    qDebug() << "BIN帧原始长度超出协商上限，断开连接：" << rawSize;
+                    m_socket->abort();
+                    return;
+                }
+            }
+            m_pendingBinary = ServerReply();
+            m_pendingBinary.requestId = reply.requestId;
+            m_pendingBinary.command = parts[1];
+            m_pendingBinary.binary = true;
+            m_pendingBinarySize = size;
+            m_pendingBinaryCompression = compression;
+            m_pendingBinaryRawSize = rawSize;
+        } else if (reply.command == "HELLO_OK" && !m_ready) {
+            Protocol::parseHelloReply(parts, m_protocol);
+            qDebug() << "协议协商完成：版本" << m_protocol.version
+                     << "分帧" << Protocol::framingName(m_protocol.framing)
+                     << "编码" << Protocol::encodingName(m_protocol.encoding)
+                     << "压缩" << Protocol::compressionName(m_protocol.compression)
+                     << "功能位" << QString::number(m_protocol.features, 16);
+            finishHandshake();
+        } else if (reply.command == "HELLO_FAIL" && !m_ready) {
+            qDebug() << "协议协商失败，继续使用文本协议：" << parts.value(1);
+            finishHandshake();
+        } else {
+            reply.parts = parts;
+            dispatch(reply);
+        }
+    }
+}
+
+void ServerConnection::dispatch(ServerReply& reply)
+{
+    if (m_cancelled.contains(reply.requestId)) {
+        return;
+    }
+    auto it = m_waiting.find(reply.requestId);
+    if (reply.requestId == 0 || it == m_waiting.end()) {
+        emit replyReceived(reply);
+        return;
+    }
+    // 处理函数中可能发出新请求，先复制一份再调用
+    it->deadline = m_clock.elapsed() + it->timeoutMs;
+    const ReplyHandler handler = it->handler;
+    if (handler(reply)) {
+        m_waiting.remove(reply.requestId);
+    }
+}
+
+void ServerConnection::onDisconnected()
+{
+    qDebug() << "与服务器的连接已断开";
+    failPending("与服务器的连接已断开");
+    emit disconnected();
+}
+
+void ServerConnection::onError(QAbstractSocket::SocketError error)
+{
+    Q_UNUSED(error);
+    qDebug() << "服务器连接错误：" << m_socket->errorString();
+    if (m_socket->state() != QAbstractSocket::ConnectedState) {
+        failPending(m_socket->errorString());
+    }
+}
+
+void ServerConnection::failPending(const QString& reason)
+{
+    m_handshakeTimer.stop();
+    m_ready = false;
+    m_queue.clear();
+    m_cancelled.clear();
+    // 连接断开后旧ID的回复不会再来，还在等待的调用方都要知道
+    const QList<quint32> waiting = m_waiting.keys();
+    if (!waiting.isEmpty()) {
+        qDebug() << waiting.size() << "个请求因连接断开而失败：" << reason;
+    }
+    for (quint32 requestId : waiting) {
+        finishWaiting(requestId, ServerReply::Status::ConnectionLost);
+    }
+    scheduleTimeoutCheck();
+    scheduleReconnect();
+}
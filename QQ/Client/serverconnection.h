@@ -0,0 +1,136 @@
+#ifndef SERVERCONNECTION_H
+#define SERVERCONNECTION_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QTcpSocket>
+#include <QTimer>
+#include <functional>
+#include "framescanner.h"
+#include "protocol.h"
+
+// 服务器的一条回复：文本行或BIN帧
+// 请求没有正常得到回复时，处理函数会收到一条 status 不是 Ok 的空回复
+struct ServerReply
+{
+    enum class Status {
+        Ok,
+        TimedOut,         // 超过请求的超时时间没有收到回复
+        ConnectionLost,   // 连接断开或连不上服务器
+        Unmatched         // 服务器不支持请求ID，回复只能经 replyReceived 按命令名处理
+    };
+
+    Status status = Status::Ok;
+    quint32 requestId = 0;     // 对应请求的ID；0表示服务器主动推送，或旧服务器不带ID的回复
+    QString command;
+    QStringList parts;         // 文本行的全部字段，parts[0] 即命令；BIN帧为空
+    QByteArray payload;        // BIN帧解压后的负载
+    bool binary = false;
+
+    bool ok() const { return status == Status::Ok; }
+};
+
+// 客户端与服务器之间唯一的长连接，登录、注册和聊天窗口共用
+// 连接建立后先握手；服务器支持请求ID时每个请求前加 #ID，回复带回同一个ID，
+// 多个请求可以连续发出不必等待，回复按ID交给各自的处理函数，先后顺序无关。
+// 握手完成前发出的请求先排队；服务器不支持请求ID时按原样发送，回复只能按命令名区分。
+// 文件传输的数据仍走单独的连接，不占用这条连接。
+class ServerConnection : public QObject
+{
+    Q_OBJECT
+public:
+    // 收到带该请求ID的回复时调用，返回true表示请求已经完成，之后同一ID的回复交给 replyReceived
+    // 超时、断线或服务器不支持请求ID时以对应的 status 调用最后一次
+    using ReplyHandler = std::function<bool(const ServerReply& reply)>;
+
+    explicit ServerConnection(QObject *parent = nullptr);
+
+    // 异步连接，不阻塞界面；已连接或正在连接时什么也不做
+    void connectToServer();
+    // 主动断开，之后不再自动重连
+    void disconnectFromServer();
+    // 连接意外断开或连不上时按指数退避加随机抖动反复重连，重连后照常发出 ready
+    void setAutoReconnect(bool enabled);
+
+    bool isConnected() const { return m_socket->state() == QAbstractSocket::ConnectedState; }
+    bool isReady() const { return m_ready; }
+    const Protocol::Settings& protocol() const { return m_protocol; }
+    QHostAddress peerAddress() const { return m_socket->peerAddress(); }
+    quint16 peerPort() const { return m_socket->peerPort(); }
+
+    // 发送一条请求（不含换行符），返回请求ID；没有连接时先连接，握手完成后发出
+    // timeoutMs 大于0时，超过这么久没有收到该请求的任何回复就以 TimedOut 结束，每收到一条回复重新计时
+    quint32 send(const QString& request, const ReplyHandler& handler = ReplyHandler(), int timeoutMs = 0);
+    // 发送 BIN 请求：BIN|命令|字节数 后跟负载
+    quint32 sendBinary(const QString& command, const QByteArray& payload,
+                       const ReplyHandler& handler = ReplyHandler(), int timeoutMs = 0);
+    // 不再等待某个请求的回复，之后到达的回复直接丢弃，处理函数不再被调用
+    void cancel(quint32 requestId);
+
+signals:
+    void connected();
+    // 握手完成（或服务器不支持握手），可以按 protocol() 发送请求
+    void ready();
+    void disconnected();
+    // 第 attempt 次重连将在 delayMs 毫秒后开始
+    void reconnecting(int attempt, int delayMs);
+    // 没有处理函数的回复：服务器推送、旧服务器的回复
+    void replyReceived(const ServerReply& reply);
+
+private slots:
+    void onConnected();
+    void onReadyRead();
+    void onDisconnected();
+    void onError(QAbstractSocket::SocketError error);
+    void onHandshakeTimeout();
+    void onTimeoutCheck();
+    void onReconnectTimeout();
+
+private:
+    struct PendingRequest
+    {
+        quint32 id = 0;
+        QByteArray header;     // 请求行，不含ID和换行符
+        QByteArray payload;    // BIN请求的负载
+    };
+    struct Waiting
+    {
+        ReplyHandler handler;
+        int timeoutMs = 0;     // 0表示不超时
+        qint64 deadline = 0;   // m_clock 上的截止时间
+    };
+
+    quint32 enqueue(const QByteArray& header, const QByteArray& payload, const ReplyHandler& handler, int timeoutMs);
+    void write(const PendingRequest& request);
+    void finishHandshake();
+    void dispatch(ServerReply& reply);
+    void finishWaiting(quint32 requestId, ServerReply::Status status);
+    void failPending(const QString& reason);
+    void scheduleTimeoutCheck();
+    void scheduleReconnect();
+
+    QTcpSocket *m_socket;
+    QTimer m_handshakeTimer;
+    LineReader m_lineReader;
+    Protocol::Settings m_protocol;
+    bool m_ready = false;
+    quint32 m_nextRequestId = 1;
+    QList<PendingRequest> m_queue;             // 握手完成前的请求
+    QHash<quint32, Waiting> m_waiting;         // 等待回复的请求
+    QHash<quint32, qint64> m_cancelled;        // 已取消的请求 -> 取消时间，一段时间内到达的回复直接丢弃
+    QElapsedTimer m_clock;
+    QTimer m_timeoutTimer;
+    bool m_autoReconnect = false;
+    int m_reconnectAttempt = 0;     // 握手成功后清零
+    QTimer m_reconnectTimer;
+
+    // 正在等待负载的BIN帧
+    ServerReply m_pendingBinary;
+    qint64 m_pendingBinarySize = -1;
+    Protocol::Compression m_pendingBinaryCompression = Protocol::Compression::None;
+    qint64 m_pendingBinaryRawSize = 0;
+};
+
+#endif // SERVERCONNECTION_H
@@ -0,0 +1,35 @@
+# 客户端与服务器共用的协议代码
+# 用到 QPromise、QStringEncoder、QAbstractSocket::errorOccurred 等 Qt 6 接口
+lessThan(QT_MAJOR_VERSION, 6): error("需要 Qt 6 或更高版本")
+
+# 接收文件时在工作线程核对内容哈希
+QT += concurrent
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+    $$PWD/binarycodec.cpp \
+    $$PWD/chunkhash.cpp \
+    $$PWD/filetransfer.cpp \
+    $$PWD/framecompression.cpp \
+    $$PWD/framescanner.cpp \
+    $$PWD/protocol.cpp \
+    $$PWD/tokenbucket.cpp
+
+HEADERS += \
+    $$PWD/binarycodec.h \
+    $$PWD/chunkhash.h \
+    $$PWD/filetransfer.h \
+    $$PWD/framecompression.h \
+    $$PWD/framescanner.h \
+    $$PWD/protocol.h \
+    $$PWD/tokenbucket.h \
+    $$PWD/userinfo.h
+
+# 能通过 pkg-config 找到 libzstd 时启用 zstd，否则只使用 qCompress 的 zlib
+packagesExist(libzstd) {
+    DEFINES += QQ_HAVE_ZSTD
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libzstd
+}
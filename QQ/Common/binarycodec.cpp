@@ -0,0 +1,426 @@
+#include "binarycodec.h"
+
+#include <QStringEncoder>
+
+namespace {
+
+constexpr int MaxVarIntBytes = 10;
+
+int varUIntSize(quint64 value)
+{
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+quint64 zigZagEncode(qint64 value)
+{
+    return (quint64(value) << 1) ^ quint64(value >> 63);
+}
+
+qint64 zigZagDecode(quint64 value)
+{
+    return qint64(value >> 1) ^ -qint64(value & 1);
+}
+
+// 公历日期与1970-01-01起天数互转（Howard Hinnant 的 days_from_civil 算法）
+qint64 daysFromCivil(int year, int month, int day)
+{
+    year -= month <= 2;
+    const qint64 era = (year >= 0 ? year : year - 399) / 400;
+    const qint64 yoe = year - era * 400;
+    const qint64 doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const qint64 doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+void civilFromDays(qint64 days, int& year, int& month, int& day)
+{
+    days += 719468;
+    const qint64 era = (days >= 0 ? days : days - 146096) / 146097;
+    const qint64 doe = days - era * 146097;
+    const qint64 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const qint64 doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const qint64 mp = (5 * doy + 2) / 153;
+    day = int(doy - (153 * mp + 2) / 5 + 1);
+    month = int(mp < 10 ? mp + 3 : mp - 9);
+    year = int(yoe + era * 400 + (month <= 2));
+}
+
+int daysInMonth(int year, int month)
+{
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (month == 2 && ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0)) {
+        return 29;
+    }
+    return days[month - 1];
+}
+
+bool readDigits(const QChar* text, int count, int& value)
+{
+    value = 0;
+    for (int i = 0; i < count; ++i) {
+        const char16_t c = text[i].unicode();
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+void writeDigits(char* out, int count, int value)
+{
+    for (int i = count - 1; i >= 0; --i) {
+        out[i] = char('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// 消息头：低位表示发送时间是否按秒数编码，其余位是内容类型
+constexpr quint64 TimeIsSeconds = 1;
+
+void writeMessages(BinaryWriter& writer, const QList<MessageInfo>& messages)
+{
+    writer.writeVarUInt(quint64(messages.size()));
+
+    qint64 prevMessageId = 0;
+    qint64 prevSenderId = 0;
+    qint64 prevReceiverId = 0;
+    qint64 prevTime = 0;
+    for (const MessageInfo& message : messages) {
+        qint64 seconds;
+        const bool timeIsSeconds = BinaryCodec::parseTimestamp(message.sendTime, seconds);
+
+        writer.writeVarInt(message.messageId - prevMessageId);
+        writer.writeVarInt(message.senderId - prevSenderId);
+        writer.writeVarInt(message.receiverId - prevReceiverId);
+        writer.writeVarUInt((quint64(message.contentType) << 1) | (timeIsSeconds ? TimeIsSeconds : 0));
+        writer.writeString(message.content);
+        writer.writeString(message.fileName);
+        writer.writeVarInt(message.fileSize);
+        if (timeIsSeconds) {
+            writer.writeVarInt(seconds - prevTime);
+            prevTime = seconds;
+        } else {
+            writer.writeString(message.sendTime);
+        }
+
+        prevMessageId = message.messageId;
+        prevSenderId = message.senderId;
+        prevReceiverId = message.receiverId;
+    }
+}
+
+bool readMessages(BinaryReader& reader, qsizetype dataSize, QList<MessageInfo>& messages)
+{
+    quint64 count;
+    if (!reader.readVarUInt(count) || count > quint64(dataSize)) {
+        return false;
+    }
+
+    messages.clear();
+    messages.reserve(qsizetype(count));
+
+    qint64 messageId = 0;
+    qint64 senderId = 0;
+    qint64 receiverId = 0;
+    qint64 time = 0;
+    for (quint64 i = 0; i < count; ++i) {
+        MessageInfo message;
+        qint64 messageDelta, senderDelta, receiverDelta, fileSize;
+        quint64 header;
+        if (!reader.readVarInt(messageDelta)
+            || !reader.readVarInt(senderDelta)
+            || !reader.readVarInt(receiverDelta)
+            || !reader.readVarUInt(header)
+            || !reader.readString(message.content)
+            || !reader.readString(message.fileName)
+            || !reader.readVarInt(fileSize)) {
+            return false;
+        }
+
+        if (header & TimeIsSeconds) {
+            qint64 timeDelta;
+            if (!reader.readVarInt(timeDelta)) {
+                return false;
+            }
+            time += timeDelta;
+            message.sendTime = BinaryCodec::formatTimestamp(time);
+        } else if (!reader.readString(message.sendTime)) {
+            return false;
+        }
+
+        messageId += messageDelta;
+        senderId += senderDelta;
+        receiverId += receiverDelta;
+        message.messageId = int(messageId);
+        message.senderId = int(senderId);
+        message.receiverId = int(receiverId);
+        message.contentType = int(header >> 1);
+        message.fileSize = fileSize;
+        messages.append(message);
+    }
+
+    return true;
+}
+
+} // namespace
+
+// BinaryWriter 实现
+BinaryWriter::BinaryWriter(qsizetype reserveSize)
+{
+    m_data.reserve(reserveSize);
+}
+
+void BinaryWriter::writeVarUInt(quint64 value)
+{
+    char buffer[MaxVarIntBytes];
+    int size = 0;
+    while (value >= 0x80) {
+        buffer[size++] = char((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer[size++] = char(value);
+    m_data.append(buffer, size);
+}
+
+void BinaryWriter::writeVarInt(qint64 value)
+{
+    writeVarUInt(zigZagEncode(value));
+}
+
+void BinaryWriter::writeString(const QString& value)
+{
+    // 直接编码进输出缓冲区，不为每个字符串生成临时QByteArray
+    // 长度前缀按最大可能长度预留宽度，实际长度较短时用补位的变长整数写入
+    const qsizetype maxBytes = value.size() * 3;
+    const int prefixSize = varUIntSize(quint64(maxBytes));
+    const qsizetype start = m_data.size();
+    const qsizetype required = start + prefixSize + maxBytes;
+    if (m_data.capacity() < required) {
+        m_data.reserve(qMax(required, m_data.capacity() * 2));
+    }
+    m_data.resize(required);
+
+    QStringEncoder encoder(QStringConverter::Utf8, QStringConverter::Flag::Stateless);
+    char* payload = m_data.data() + start + prefixSize;
+    char* payloadEnd = encoder.appendToBuffer(payload, value);
+    quint64 length = quint64(payloadEnd - payload);
+
+    char* prefix = m_data.data() + start;
+    for (int i = 0; i < prefixSize; ++i) {
+        prefix[i] = char((length & 0x7F) | (i + 1 < prefixSize ? 0x80 : 0));
+        length >>= 7;
+    }
+    m_data.resize(payloadEnd - m_data.constData());
+}
+
+void BinaryWriter::writeBytes(const QByteArray& value)
+{
+    writeVarUInt(quint64(value.size()));
+    m_data.append(value);
+}
+
+// BinaryReader 实现
+BinaryReader::BinaryReader(const QByteArray& data)
+    : m_pos(reinterpret_cast<const uchar*>(data.constData()))
+    , m_end(reinterpret_cast<const uchar*>(data.constData()) + data.size())
+{
+}
+
+bool BinaryReader::readVarUInt(quint64& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 7 * MaxVarIntBytes; shift += 7) {
+        if (m_pos == m_end) {
+            m_error = true;
+            return false;
+        }
+        const uchar byte = *m_pos++;
+        value |= quint64(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    m_error = true;
+    return false;
+}
+
+bool BinaryReader::readVarInt(qint64& value)
+{
+    quint64 raw;
+    if (!readVarUInt(raw)) {
+        return false;
+    }
+    value = zigZagDecode(raw);
+    return true;
+}
+
+bool BinaryReader::readString(QString& value)
+{
+    quint64 length;
+    if (!readVarUInt(length)) {
+        return false;
+    }
+    if (length > quint64(m_end - m_pos)) {
+        m_error = true;
+        return false;
+    }
+    value = QString::fromUtf8(reinterpret_cast<const char*>(m_pos), qsizetype(length));
+    m_pos += length;
+    return true;
+}
+
+bool BinaryReader::readBytes(QByteArray& value)
+{
+    quint64 length;
+    if (!readVarUInt(length)) {
+        return false;
+    }
+    if (length > quint64(m_end - m_pos)) {
+        m_error = true;
+        return false;
+    }
+    value = QByteArray(reinterpret_cast<const char*>(m_pos), qsizetype(length));
+    m_pos += length;
+    return true;
+}
+
+// BinaryCodec 实现
+QByteArray BinaryCodec::encodeUserList(const QList<UserInfo>& users)
+{
+    BinaryWriter writer(16 + users.size() * 48);
+    writer.writeVarUInt(quint64(users.size()));
+
+    qint64 prevUserId = 0;
+    for (const UserInfo& user : users) {
+        writer.writeVarInt(user.userId - prevUserId);
+        writer.writeString(user.username);
+        writer.writeString(user.nickname);
+        writer.writeString(user.avatarPath);
+        writer.writeVarInt(user.status);
+        prevUserId = user.userId;
+    }
+
+    return writer.takeData();
+}
+
+bool BinaryCodec::decodeUserList(const QByteArray& data, QList<UserInfo>& users)
+{
+    BinaryReader reader(data);
+    quint64 count;
+    if (!reader.readVarUInt(count) || count > quint64(data.size())) {
+        return false;
+    }
+
+    users.clear();
+    users.reserve(qsizetype(count));
+
+    qint64 userId = 0;
+    for (quint64 i = 0; i < count; ++i) {
+        UserInfo user;
+        qint64 delta, status;
+        if (!reader.readVarInt(delta)
+            || !reader.readString(user.username)
+            || !reader.readString(user.nickname)
+            || !reader.readString(user.avatarPath)
+            || !reader.readVarInt(status)) {
+            return false;
+        }
+        userId += delta;
+        user.userId = int(userId);
+        user.status = int(status);
+        users.append(user);
+    }
+
+    return reader.atEnd();
+}
+
+QByteArray BinaryCodec::encodeMessageList(const QList<MessageInfo>& messages)
+{
+    BinaryWriter writer(16 + messages.size() * 64);
+    writeMessages(writer, messages);
+    return writer.takeData();
+}
+
+bool BinaryCodec::decodeMessageList(const QByteArray& data, QList<MessageInfo>& messages)
+{
+    BinaryReader reader(data);
+    return readMessages(reader, data.size(), messages) && reader.atEnd();
+}
+
+QByteArray BinaryCodec::encodeMessageChunk(int peerId, const QList<MessageInfo>& messages)
+{
+    BinaryWriter writer(24 + messages.size() * 64);
+    writer.writeVarInt(peerId);
+    writeMessages(writer, messages);
+    return writer.takeData();
+}
+
+bool BinaryCodec::decodeMessageChunk(const QByteArray& data, int& peerId, QList<MessageInfo>& messages)
+{
+    BinaryReader reader(data);
+    qint64 id;
+    if (!reader.readVarInt(id)) {
+        return false;
+    }
+    peerId = int(id);
+    return readMessages(reader, data.size(), messages) && reader.atEnd();
+}
+
+bool BinaryCodec::parseTimestamp(const QString& text, qint64& seconds)
+{
+    // 格式固定为 yyyy-MM-dd HH:mm:ss
+    if (text.size() != 19) {
+        return false;
+    }
+
+    const QChar* p = text.constData();
+    if (p[4] != u'-' || p[7] != u'-' || p[10] != u' ' || p[13] != u':' || p[16] != u':') {
+        return false;
+    }
+
+    int year, month, day, hour, minute, second;
+    if (!readDigits(p, 4, year) || !readDigits(p + 5, 2, month) || !readDigits(p + 8, 2, day)
+        || !readDigits(p + 11, 2, hour) || !readDigits(p + 14, 2, minute) || !readDigits(p + 17, 2, second)) {
+        return false;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > daysInMonth(year, month)
+        || hour > 23 || minute > 59 || second > 59) {
+        return false;
+    }
+
+    seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    return true;
+}
+
+QString BinaryCodec::formatTimestamp(qint64 seconds)
+{
+    qint64 days = seconds / 86400;
+    qint64 rest = seconds % 86400;
+    if (rest < 0) {
+        rest += 86400;
+        --days;
+    }
+
+    int year, month, day;
+    civilFromDays(days, year, month, day);
+
+    char buffer[19];
+    writeDigits(buffer, 4, year);
+    buffer[4] = '-';
+    writeDigits(buffer + 5, 2, month);
+    buffer[7] = '-';
+    writeDigits(buffer + 8, 2, day);
+    buffer[10] = ' ';
+    writeDigits(buffer + 11, 2, int(rest / 3600));
+    buffer[13] = ':';
+    writeDigits(buffer + 14, 2, int(rest / 60 % 60));
+    buffer[16] = ':';
+    writeDigits(buffer + 17, 2, int(rest % 60));
+    return QString::fromLatin1(buffer, 19);
+}
@@ -0,0 +1,67 @@
+#ifndef BINARYCODEC_H
+#define BINARYCODEC_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+#include "userinfo.h"
+
+// 紧凑二进制编码：无符号/ZigZag变长整数 + 长度前缀的UTF-8字符串
+class BinaryWriter
+{
+public:
+    explicit BinaryWriter(qsizetype reserveSize = 0);
+
+    void writeVarUInt(quint64 value);
+    void writeVarInt(qint64 value);  // ZigZag，适合写差值
+    void writeString(const QString& value);
+    void writeBytes(const QByteArray& value);   // 长度前缀 + 原始字节
+
+    const QByteArray& data() const { return m_data; }
+    QByteArray takeData() { return std::move(m_data); }
+
+private:
+    QByteArray m_data;
+};
+
+class BinaryReader
+{
+public:
+    explicit BinaryReader(const QByteArray& data);
+
+    bool readVarUInt(quint64& value);
+    bool readVarInt(qint64& value);
+    bool readString(QString& value);
+    bool readBytes(QByteArray& value);
+
+    bool atEnd() const { return m_pos == m_end; }
+    bool hasError() const { return m_error; }
+
+private:
+    const uchar* m_pos;
+    const uchar* m_end;
+    bool m_error = false;
+};
+
+// UserInfo / MessageInfo 列表的二进制编解码
+// 列表内的ID与发送时间按与前一项的差值编码；客户端和服务器共用同一份格式
+namespace BinaryCodec {
+
+QByteArray encodeUserList(const QList<UserInfo>& users);
+bool decodeUserList(const QByteArray& data, QList<UserInfo>& users);
+
+QByteArray encodeMessageList(const QList<MessageInfo>& messages);
+bool decodeMessageList(const QByteArray& data, QList<MessageInfo>& messages);
+
+// 分块发送的聊天记录：会话对方ID + 一段消息列表
+QByteArray encodeMessageChunk(int peerId, const QList<MessageInfo>& messages);
+bool decodeMessageChunk(const QByteArray& data, int& peerId, QList<MessageInfo>& messages);
+
+// "yyyy-MM-dd HH:mm:ss" 与秒数互转（不涉及时区，只做格式转换）
+bool parseTimestamp(const QString& text, qint64& seconds);
+QString formatTimestamp(qint64 seconds);
+
+}
+
+#endif // BINARYCODEC_H
@@ -0,0 +1,129 @@
+#include "chunkhash.h"
+
+#include <QtEndian>
+#include <cstring>
+
+namespace {
+
+// XXH64 常量与轮函数（Yann Collet 的 xxHash 规范）
+constexpr quint64 Prime1 = 0x9E3779B185EBCA87ULL;
+constexpr quint64 Prime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr quint64 Prime3 = 0x165667B19E3779F9ULL;
+constexpr quint64 Prime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr quint64 Prime5 = 0x27D4EB2F165667C5ULL;
+
+inline quint64 rotl(quint64 value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline quint64 read64(const uchar* p)
+{
+    quint64 value;
+    std::memcpy(&value, p, sizeof(value));
+    return qFromLittleEndian(value);
+}
+
+inline quint32 read32(const uchar* p)
+{
+    quint32 value;
+    std::memcpy(&value, p, sizeof(value));
+    return qFromLittleEndian(value);
+}
+
+inline quint64 accumulate(quint64 acc, quint64 input)
+{
+    acc += input * Prime2;
+    acc = rotl(acc, 31);
+    return acc * Prime1;
+}
+
+inline quint64 mergeRound(quint64 acc, quint64 value)
+{
+    acc ^= accumulate(0, value);
+    return acc * Prime1 + Prime4;
+}
+
+} // namespace
+
+quint64 ChunkHash::xxh64(const char* data, qsizetype size, quint64 seed)
+{
+    const uchar* p = reinterpret_cast<const uchar*>(data);
+    const uchar* const end = p + size;
+    quint64 hash;
+
+    if (size >= 32) {
+        // 四个累加器互不依赖，CPU可以同时执行
+        quint64 v1 = seed + Prime1 + Prime2;
+        quint64 v2 = seed + Prime2;
+        quint64 v3 = seed;
+        quint64 v4 = seed - Prime1;
+        const uchar* const limit = end - 32;
+        do {
+            v1 = accumulate(v1, read64(p));
+            v2 = accumulate(v2, read64(p + 8));
+            v3 = accumulate(v3, read64(p + 16));
+            v4 = accumulate(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = mergeRound(hash, v1);
+        hash = mergeRound(hash, v2);
+        hash = mergeRound(hash, v3);
+        hash = mergeRound(hash, v4);
+    } else {
+        hash = seed + Prime5;
+    }
+
+    hash += quint64(size);
+
+    while (end - p >= 8) {
+        hash ^= accumulate(0, read64(p));
+        hash = rotl(hash, 27) * Prime1 + Prime4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        hash ^= quint64(read32(p)) * Prime1;
+        hash = rotl(hash, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+    while (p < end) {
+        hash ^= (*p) * Prime5;
+        hash = rotl(hash, 11) * Prime1;
+        ++p;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+quint64 ChunkHash::digest(const QList<quint64>& chunkHashes)
+{
+    QByteArray bytes(chunkHashes.size() * qsizetype(sizeof(quint64)), Qt::Uninitialized);
+    uchar* out = reinterpret_cast<uchar*>(bytes.data());
+    for (quint64 hash : chunkHashes) {
+        qToLittleEndian(hash, out);
+        out += sizeof(quint64);
+    }
+    return xxh64(bytes);
+}
+
+QString ChunkHash::toHex(quint64 hash)
+{
+    return QString("%1").arg(hash, 16, 16, QLatin1Char('0'));
+}
+
+bool ChunkHash::fromHex(const QString& text, quint64& hash)
+{
+    if (text.size() != 16) {
+        return false;
+    }
+    bool ok = false;
+    hash = text.toULongLong(&ok, 16);
+    return ok;
+}
@@ -0,0 +1,25 @@
+#ifndef CHUNKHASH_H
+#define CHUNKHASH_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// 文件分块校验：每块计算 XXH64，整个文件的校验值是各块校验值依次拼接后的 XXH64
+// XXH64 四路并行累加，单核可达到内存带宽级别的速度，校验几乎不增加传输时间；
+// 整体校验只用到已经算好的分块值，结束时不必重新读取文件
+namespace ChunkHash {
+
+quint64 xxh64(const char* data, qsizetype size, quint64 seed = 0);
+inline quint64 xxh64(const QByteArray& data) { return xxh64(data.constData(), data.size()); }
+
+// 由分块校验值计算整个文件的校验值
+quint64 digest(const QList<quint64>& chunkHashes);
+
+// 协议中用16位十六进制表示
+QString toHex(quint64 hash);
+bool fromHex(const QString& text, quint64& hash);
+
+}
+
+#endif // CHUNKHASH_H
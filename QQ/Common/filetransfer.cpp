@@ -0,0 +1,994 @@
+#include "filetransfer.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QStandardPaths>
+#include <QTimer>
+#include <QDebug>
+#include <QtEndian>
+#include <QtConcurrent>
+#include "chunkhash.h"
+#include "protocol.h"
+
+namespace {
+
+// 发送缓冲区中未写出的数据超过该值时暂停读文件
+constexpr qint64 SendWatermark = 1024 * 1024;
+// 限速接收时套接字读缓冲区的大小，超过后内核缓冲区写满，发送方随之放慢
+constexpr qint64 ShapedReadBufferSize = 256 * 1024;
+// 断线后的重连次数和间隔
+constexpr int MaxRetries = 5;
+constexpr int RetryDelayMs = 2000;
+
+// 目标文件已存在时在文件名后加序号
+QString uniqueFilePath(const QString& directory, const QString& fileName)
+{
+    QFileInfo info(fileName);
+    QString path = directory + QLatin1Char('/') + fileName;
+    for (int index = 1; QFileInfo::exists(path); ++index) {
+        const QString suffix = info.completeSuffix();
+        path = directory + QStringLiteral("/%1(%2)").arg(info.baseName()).arg(index)
+               + (suffix.isEmpty() ? QString() : QLatin1Char('.') + suffix);
+    }
+    return path;
+}
+
+} // namespace
+
+// 接收中的文件：.part 预先分配到完整大小，各条连接收到的块按偏移写入；
+// .sum 中每块占8字节校验值，全零表示该块还没有收到。同一传输的各条连接共用一个对象
+class FileAssembly
+{
+public:
+    // 打开（或续用已打开的）接收文件，已有的 .part/.sum 作为续传状态
+    static QSharedPointer<FileAssembly> open(const QString& directory, const QString& transferId,
+                                             qint64 fileSize, QString* errorMessage);
+    // 并行的其他连接加入时查找已打开的接收文件
+    static QSharedPointer<FileAssembly> find(const QString& directory, const QString& transferId);
+
+    ~FileAssembly() { close(); }
+
+    qint64 fileSize() const { return m_fileSize; }
+    qint64 receivedBytes() const { return m_received; }
+    bool isComplete() const { return m_received == m_fileSize; }
+    // [begin, end) 中第一个没有收到的块的偏移，都已收到时返回 end
+    qint64 firstMissing(qint64 begin, qint64 end) const;
+    const QList<quint64>& chunkHashes() const { return m_chunkHashes; }
+    QString partPath() const { return m_file.fileName(); }
+    QString errorString() const { return m_file.errorString(); }
+
+    bool write(qint64 offset, const QByteArray& data, quint64 hash);
+    // 不再接受数据，之后打开同一传输会重新读取磁盘上的状态
+    void close();
+    void discard();
+
+private:
+    static QHash<QString, QWeakPointer<FileAssembly>>& registry();
+    bool load();
+
+    QString m_key;
+    QFile m_file;
+    QFile m_sumFile;
+    qint64 m_fileSize = 0;
+    qint64 m_received = 0;
+    QList<quint64> m_chunkHashes;
+};
+
+QHash<QString, QWeakPointer<FileAssembly>>& FileAssembly::registry()
+{
+    static QHash<QString, QWeakPointer<FileAssembly>> assemblies;
+    return assemblies;
+}
+
+QSharedPointer<FileAssembly> FileAssembly::find(const QString& directory, const QString& transferId)
+{
+    return registry().value(directory + QLatin1Char('/') + transferId).toStrongRef();
+}
+
+QSharedPointer<FileAssembly> FileAssembly::open(const QString& directory, const QString& transferId,
+                                                qint64 fileSize, QString* errorMessage)
+{
+    QSharedPointer<FileAssembly> assembly = find(directory, transferId);
+    if (assembly && assembly->m_fileSize == fileSize) {
+        return assembly;
+    }
+
+    QDir().mkpath(directory);
+    assembly.reset(new FileAssembly);
+    assembly->m_key = directory + QLatin1Char('/') + transferId;
+    assembly->m_fileSize = fileSize;
+    assembly->m_file.setFileName(assembly->m_key + QStringLiteral(".part"));
+    assembly->m_sumFile.setFileName(assembly->m_key + QStringLiteral(".sum"));
+    if (!assembly->m_file.open(QIODevice::ReadWrite) || !assembly->m_sumFile.open(QIODevice::ReadWrite)) {
+        if (errorMessage) *errorMessage = "无法创建文件";
+        return QSharedPointer<FileAssembly>();
+    }
+    if (!assembly->load()) {
+        if (errorMessage) *errorMessage = "无法读取续传信息";
+        return QSharedPointer<FileAssembly>();
+    }
+    registry().insert(assembly->m_key, assembly);
+    return assembly;
+}
+
+bool FileAssembly::load()
+{
+    const qint64 chunkCount = (m_fileSize + FileTransfer::ChunkSize - 1) / FileTransfer::ChunkSize;
+    QByteArray sums = m_sumFile.readAll();
+    if (m_file.size() > m_fileSize || sums.size() > chunkCount * qint64(sizeof(quint64))) {
+        // 不是这个文件留下的数据
+        sums.clear();
+        m_file.resize(0);
+    }
+    // 旧的 .part 只有已接收的前缀，补齐后缺少的块校验值为零
+    sums.append(QByteArray(chunkCount * qint64(sizeof(quint64)) - sums.size(), '\0'));
+
+    m_chunkHashes.clear();
+    m_received = 0;
+    const uchar* p = reinterpret_cast<const uchar*>(sums.constData());
+    for (qint64 i = 0; i < chunkCount; ++i) {
+        const quint64 hash = qFromLittleEndian<quint64>(p + i * sizeof(quint64));
+        m_chunkHashes.append(hash);
+        if (hash != 0) {
+            m_received += qMin(FileTransfer::ChunkSize, m_fileSize - i * FileTransfer::ChunkSize);
+        }
+    }
+
+    // 预先分配完整大小，之后各块直接写到自己的位置
+    return m_file.resize(m_fileSize) && m_sumFile.resize(sums.size())
+           && m_sumFile.seek(0) && m_sumFile.write(sums) == sums.size() && m_sumFile.flush();
+}
+
+qint64 FileAssembly::firstMissing(qint64 begin, qint64 end) const
+{
+    for (qint64 offset = begin; offset < end; offset += FileTransfer::ChunkSize) {
+        if (m_chunkHashes.value(qsizetype(offset / FileTransfer::ChunkSize)) == 0) {
+            return offset;
+        }
+    }
+    return end;
+}
+
+bool FileAssembly::write(qint64 offset, const QByteArray& data, quint64 hash)
+{
+    const qsizetype index = qsizetype(offset / FileTransfer::ChunkSize);
+    if (!m_file.isOpen() || index >= m_chunkHashes.size()) {
+        return false;
+    }
+
+    uchar hashBytes[sizeof(quint64)];
+    qToLittleEndian(hash, hashBytes);
+    // 先写数据再写校验值：中途退出时，没有校验值的块在续传时会重新接收
+    if (!m_file.seek(offset) || m_file.write(data) != data.size() || !m_file.flush()
+        || !m_sumFile.seek(index * qint64(sizeof(quint64)))
+        || m_sumFile.write(reinterpret_cast<const char*>(hashBytes), sizeof(hashBytes)) != qint64(sizeof(hashBytes))
+        || !m_sumFile.flush()) {
+        return false;
+    }
+
+    if (m_chunkHashes[index] == 0) {
+        m_received += data.size();
+    }
+    m_chunkHashes[index] = hash;
+    return true;
+}
+
+void FileAssembly::close()
+{
+    m_file.close();
+    m_sumFile.close();
+    auto it = registry().find(m_key);
+    if (it != registry().end() && (it->isNull() || it->toStrongRef().data() == this)) {
+        registry().erase(it);
+    }
+}
+
+void FileAssembly::discard()
+{
+    close();
+    m_file.remove();
+    m_sumFile.remove();
+}
+
+QString FileTransfer::transferId(const QFileInfo& fileInfo, int senderId, int receiverId)
+{
+    QString key = QString("%1|%2|%3|%4")
+                      .arg(senderId)
+                      .arg(fileInfo.absoluteFilePath())
+                      .arg(fileInfo.size())
+                      .arg(fileInfo.lastModified().toMSecsSinceEpoch());
+    if (receiverId > 0) {
+        // 点对点传输不带接收者，保持旧的ID，已有的 .part 仍能续传
+        key += QString("|%1").arg(receiverId);
+    }
+    return QString::fromLatin1(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex().left(24));
+}
+
+bool FileTransfer::isValidTransferId(const QString& transferId)
+{
+    if (transferId.isEmpty() || transferId.size() > 64) {
+        return false;
+    }
+    for (const QChar c : transferId) {
+        if (c.unicode() >= 0x80 || !c.isLetterOrNumber()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+QByteArray FileTransfer::sha256(const QString& filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    // addData(QIODevice*) 按块读取，大文件也不会整体读入内存
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (!hash.addData(&file)) {
+        return QByteArray();
+    }
+    return hash.result();
+}
+
+QByteArray FileTransfer::contentProof(const QString& filePath, qint64 offset, qint64 length, const QByteArray& nonce)
+{
+    QFile file(filePath);
+    if (offset < 0 || length < 0 || length > MaxProofLength || !file.open(QIODevice::ReadOnly)
+        || offset + length > file.size() || !file.seek(offset)) {
+        return QByteArray();
+    }
+    const QByteArray data = file.read(length);
+    if (data.size() != length) {
+        return QByteArray();
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(nonce);
+    hash.addData(data);
+    return hash.result();
+}
+
+QString FileTransfer::downloadDirectory()
+{
+    QString base = QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
+    if (base.isEmpty()) {
+        base = QDir::homePath();
+    }
+    return base + QStringLiteral("/QQ");
+}
+
+// FileSender 实现
+FileSender::FileSender(const QString& filePath, int senderId, const QHostAddress& host, quint16 port,
+                       QObject *parent)
+    : QObject(parent)
+    , m_fileInfo(filePath)
+    , m_senderId(senderId)
+    , m_host(host)
+    , m_port(port)
+    , m_transferId(FileTransfer::transferId(m_fileInfo, senderId))
+    , m_file(filePath)
+{
+}
+
+void FileSender::start()
+{
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        fail(QString("无法打开文件: %1").arg(m_file.errorString()));
+        return;
+    }
+    const qsizetype chunkCount = qsizetype((m_fileInfo.size() + FileTransfer::ChunkSize - 1) / FileTransfer::ChunkSize);
+    m_chunkHashes.fill(0, chunkCount);
+    m_hashKnown.fill(false, chunkCount);
+    connectToReceiver();
+}
+
+void FileSender::connectToReceiver()
+{
+    if (m_socket) {
+        m_socket->disconnect(this);
+        m_socket->deleteLater();
+    }
+    stopRanges();
+    m_reader.clear();
+    m_offset = -1;
+    m_peerStreams = 1;
+    m_endSent = false;
+
+    m_socket = new QTcpSocket(this);
+    connect(m_socket, &QTcpSocket::connected, this, &FileSender::onConnected);
+    connect(m_socket, &QTcpSocket::readyRead, this, &FileSender::onReadyRead);
+    connect(m_socket, &QTcpSocket::bytesWritten, this, &FileSender::onBytesWritten);
+    connect(m_socket, &QTcpSocket::disconnected, this, &FileSender::onDisconnected);
+    connect(m_socket, &QAbstractSocket::errorOccurred, this, [this](QAbstractSocket::SocketError) {
+        qDebug() << "文件发送连接错误：" << m_socket->errorString();
+        if (m_socket->state() == QAbstractSocket::UnconnectedState) {
+            onDisconnected();
+        }
+    });
+    m_socket->connectToHost(m_host, m_port);
+}
+
+void FileSender::onConnected()
+{
+    QString offer = QString("FILE_OFFER|%1|%2|%3|%4")
+                        .arg(m_transferId)
+                        .arg(m_senderId)
+                        .arg(m_fileInfo.fileName())
+                        .arg(m_fileInfo.size());
+    if (!m_transferToken.isEmpty()) {
+        offer += QString("|%1|%2|%3").arg(m_relayReceiverId).arg(m_contentHash, m_transferToken);
+    } else if (m_relayReceiverId > 0) {
+        offer += QString("|%1").arg(m_relayReceiverId);
+        if (!m_contentHash.isEmpty()) {
+            offer += QString("|%1").arg(m_contentHash);
+        }
+    }
+    m_socket->write((offer + "\n").toUtf8());
+}
+
+void FileSender::onReadyRead()
+{
+    m_reader.append(m_socket->readAll());
+
+    QStringList parts;
+    while (m_reader.readLine(parts)) {
+        const QString command = parts.value(0);
+        if (command == "FILE_PARALLEL" && parts.size() == 3 && parts[1] == m_transferId) {
+            m_peerStreams = qBound(1, parts[2].toInt(), FileTransfer::MaxParallelStreams);
+        } else if (command == "FILE_RESUME" && parts.size() == 3 && parts[1] == m_transferId) {
+            const qint64 offset = parts[2].toLongLong();
+            if (offset < 0 || offset > m_fileInfo.size()) {
+                fail("接收方返回了无效的续传位置");
+                return;
+            }
+            m_confirmed = offset;
+            if (m_offset < 0) {
+                // 连接后的第一次回复：剩余部分足够大时分段并行发送
+                if (offset > 0) {
+                    qDebug() << "文件从" << offset << "字节处续传：" << m_fileInfo.fileName();
+                }
+                startRanges(offset);
+            } else if (offset >= m_end) {
+                // FILE_END 时接收方还缺其他段的数据（对应的连接中断了），由这条连接补发到文件末尾
+                m_end = m_fileInfo.size();
+            }
+            seekTo(offset);
+            pump();
+        } else if (command == "FILE_ACK" && parts.size() == 2) {
+            m_confirmed = parts[1].toLongLong();
+            m_retries = 0;
+            reportProgress();
+        } else if (command == "FILE_CHALLENGE" && parts.size() == 5 && parts[1] == m_transferId) {
+            // 服务器已有相同内容，证明本地确实有这个文件
+            const QByteArray proof = FileTransfer::contentProof(m_fileInfo.absoluteFilePath(), parts[2].toLongLong(),
+                                                                parts[3].toLongLong(), parts[4].toLatin1());
+            m_socket->write(QString("FILE_PROOF|%1|%2\n")
+                                .arg(m_transferId, QString::fromLatin1(proof.toHex()))
+                                .toUtf8());
+        } else if (command == "FILE_DONE") {
+            m_done = true;
+            stopRanges();
+            emit progress(m_fileInfo.size(), m_fileInfo.size());
+            emit finished();
+            m_socket->disconnectFromHost();
+            return;
+        } else if (command == "FILE_FAIL") {
+            fail(parts.value(2, "接收方拒绝了文件"));
+            return;
+        }
+    }
+}
+
+void FileSender::seekTo(qint64 offset)
+{
+    m_offset = offset;
+    m_endSent = false;
+    m_file.seek(offset);
+}
+
+void FileSender::startRanges(qint64 offset)
+{
+    const qint64 total = m_fileInfo.size();
+    m_end = total;
+
+    const int streams = qMin(m_maxStreams, m_peerStreams);
+    const qint64 chunks = (total - offset + FileTransfer::ChunkSize - 1) / FileTransfer::ChunkSize;
+    const qint64 count = qMin(qint64(streams), chunks / FileTransfer::MinChunksPerStream);
+    if (count <= 1 || offset % FileTransfer::ChunkSize != 0) {
+        return;
+    }
+
+    // 按块对齐平分，第一段由这条连接发送
+    const qint64 rangeSize = (chunks + count - 1) / count * FileTransfer::ChunkSize;
+    m_end = offset + rangeSize;
+    for (qint64 begin = m_end; begin < total; begin += rangeSize) {
+        FileRangeSender *range = new FileRangeSender(m_fileInfo.absoluteFilePath(), m_transferId, m_host, m_port,
+                                                     begin, qMin(begin + rangeSize, total), this);
+        connect(range, &FileRangeSender::chunkHashed, this, &FileSender::recordHash);
+        connect(range, &FileRangeSender::progress, this, [this](qint64 bytes) {
+            m_rangeConfirmed += bytes;
+            reportProgress();
+        });
+        auto rangeDone = [this, range]() {
+            m_ranges.removeOne(range);
+            range->deleteLater();
+            pump();   // 其他段都结束后发送 FILE_END
+        };
+        connect(range, &FileRangeSender::finished, this, rangeDone);
+        connect(range, &FileRangeSender::failed, this, [this, rangeDone](const QString& reason) {
+            qDebug() << "并行连接中断，结束时补发：" << reason;
+            rangeDone();
+        });
+        m_ranges.append(range);
+        range->setTransferToken(m_transferToken);
+        range->start();
+    }
+    qDebug() << "分" << m_ranges.size() + 1 << "条连接并行发送：" << m_fileInfo.fileName();
+}
+
+void FileSender::stopRanges()
+{
+    for (FileRangeSender *range : std::as_const(m_ranges)) {
+        range->disconnect(this);
+        range->deleteLater();
+    }
+    m_ranges.clear();
+    m_rangeConfirmed = 0;
+}
+
+void FileSender::recordHash(qint64 offset, quint64 hash)
+{
+    const qsizetype index = qsizetype(offset / FileTransfer::ChunkSize);
+    if (index < m_chunkHashes.size()) {
+        m_chunkHashes[index] = hash;
+        m_hashKnown[index] = true;
+    }
+}
+
+bool FileSender::hashMissingChunks()
+{
+    // 续传时接收方已有的块，本进程没有读过，读一遍补齐校验值
+    QByteArray chunk;
+    for (qsizetype index = 0; index < m_chunkHashes.size(); ++index) {
+        if (m_hashKnown[index]) {
+            continue;
+        }
+        const qint64 offset = qint64(index) * FileTransfer::ChunkSize;
+        chunk.resize(qMin(FileTransfer::ChunkSize, m_fileInfo.size() - offset));
+        if (!m_file.seek(offset) || m_file.read(chunk.data(), chunk.size()) != chunk.size()) {
+            fail(QString("读取文件失败: %1").arg(m_file.errorString()));
+            return false;
+        }
+        recordHash(offset, ChunkHash::xxh64(chunk));
+    }
+    return true;
+}
+
+void FileSender::reportProgress()
+{
+    emit progress(qMin(m_confirmed + m_rangeConfirmed, m_fileInfo.size()), m_fileInfo.size());
+}
+
+void FileSender::onBytesWritten()
+{
+    pump();
+}
+
+void FileSender::pump()
+{
+    if (!m_socket || m_offset < 0 || m_endSent || m_done) {
+        return;
+    }
+
+    QByteArray chunk;
+    while (m_offset < m_end && m_socket->bytesToWrite() < SendWatermark) {
+        chunk.resize(qMin(FileTransfer::ChunkSize, m_end - m_offset));
+        const qint64 length = m_file.read(chunk.data(), chunk.size());
+        if (length <= 0) {
+            fail(QString("读取文件失败: %1").arg(m_file.errorString()));
+            return;
+        }
+        chunk.resize(length);
+
+        const quint64 hash = ChunkHash::xxh64(chunk);
+        recordHash(m_offset, hash);
+        m_socket->write(QString("FILE_CHUNK|%1|%2|%3\n")
+                            .arg(m_offset)
+                            .arg(length)
+                            .arg(ChunkHash::toHex(hash))
+                            .toUtf8());
+        m_socket->write(chunk);
+        m_offset += length;
+    }
+
+    // 其他段都确认（或中断）后才结束，接收方据此检查是否还缺数据
+    if (m_offset >= m_end && m_ranges.isEmpty()) {
+        if (!hashMissingChunks()) {
+            return;
+        }
+        m_socket->write(QString("FILE_END|%1|%2\n")
+                            .arg(m_transferId, ChunkHash::toHex(ChunkHash::digest(m_chunkHashes)))
+                            .toUtf8());
+        m_endSent = true;
+    }
+}
+
+void FileSender::onDisconnected()
+{
+    if (m_done || !m_socket || m_reconnectScheduled) {
+        return;
+    }
+
+    // 未完成时重连，接收方会告知已经收到的位置；并行的其他段一并停止，重连后重新分段
+    stopRanges();
+    if (++m_retries > MaxRetries) {
+        fail("连接中断，重试次数已用完");
+        return;
+    }
+    qDebug() << "文件传输连接中断，" << RetryDelayMs * m_retries << "毫秒后重连：" << m_fileInfo.fileName();
+    m_offset = -1;
+    m_reconnectScheduled = true;
+    QTimer::singleShot(RetryDelayMs * m_retries, this, [this]() {
+        m_reconnectScheduled = false;
+        if (!m_done) {
+            connectToReceiver();
+        }
+    });
+}
+
+void FileSender::fail(const QString& reason)
+{
+    if (m_done) {
+        return;
+    }
+    m_done = true;
+    stopRanges();
+    if (m_socket) {
+        m_socket->abort();
+    }
+    emit failed(reason);
+}
+
+// FileRangeSender 实现
+FileRangeSender::FileRangeSender(const QString& filePath, const QString& transferId, const QHostAddress& host,
+                                 quint16 port, qint64 begin, qint64 end, QObject *parent)
+    : QObject(parent)
+    , m_file(filePath)
+    , m_transferId(transferId)
+    , m_host(host)
+    , m_port(port)
+    , m_begin(begin)
+    , m_end(end)
+    , m_socket(new QTcpSocket(this))
+{
+    connect(m_socket, &QTcpSocket::connected, this, [this]() {
+        QString join = QString("FILE_JOIN|%1|%2|%3").arg(m_transferId).arg(m_begin).arg(m_end);
+        if (!m_transferToken.isEmpty()) {
+            join += QString("|%1").arg(m_transferToken);
+        }
+        m_socket->write((join + "\n").toUtf8());
+    });
+    connect(m_socket, &QTcpSocket::readyRead, this, &FileRangeSender::onReadyRead);
+    connect(m_socket, &QTcpSocket::bytesWritten, this, &FileRangeSender::pump);
+    connect(m_socket, &QTcpSocket::disconnected, this, &FileRangeSender::onDisconnected);
+    connect(m_socket, &QAbstractSocket::errorOccurred, this, [this](QAbstractSocket::SocketError) {
+        if (m_socket->state() == QAbstractSocket::UnconnectedState) {
+            onDisconnected();
+        }
+    });
+}
+
+void FileRangeSender::start()
+{
+    // 每段用自己的文件句柄，各自的读取位置互不影响
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        finish(false, m_file.errorString());
+        return;
+    }
+    m_socket->connectToHost(m_host, m_port);
+}
+
+void FileRangeSender::onReadyRead()
+{
+    m_reader.append(m_socket->readAll());
+
+    QStringList parts;
+    while (m_reader.readLine(parts)) {
+        const QString command = parts.value(0);
+        if (command == "FILE_RESUME" && parts.size() == 3 && parts[1] == m_transferId) {
+            const qint64 offset = parts[2].toLongLong();
+            if (offset < m_begin || offset > m_end) {
+                finish(false, "接收方返回了无效的续传位置");
+                return;
+            }
+            if (m_offset < 0) {
+                // 这一段中接收方已有的部分
+                emit progress(offset - m_begin);
+                m_confirmed = offset;
+            }
+            m_offset = offset;
+            m_file.seek(offset);
+            if (m_confirmed >= m_end) {
+                finish(true);
+                return;
+            }
+            pump();
+        } else if (command == "FILE_ACK" && parts.size() == 2) {
+            const qint64 confirmed = parts[1].toLongLong();
+            if (confirmed > m_confirmed) {
+                emit progress(confirmed - m_confirmed);
+                m_confirmed = confirmed;
+            }
+            if (m_confirmed >= m_end) {
+                finish(true);
+                return;
+            }
+        } else if (command == "FILE_FAIL") {
+            finish(false, parts.value(2, "接收方拒绝了文件"));
+            return;
+        }
+    }
+}
+
+void FileRangeSender::pump()
+{
+    if (m_done || m_offset < 0) {
+        return;
+    }
+
+    QByteArray chunk;
+    while (m_offset < m_end && m_socket->bytesToWrite() < SendWatermark) {
+        chunk.resize(qMin(FileTransfer::ChunkSize, m_end - m_offset));
+        if (m_file.read(chunk.data(), chunk.size()) != chunk.size()) {
+            finish(false, QString("读取文件失败: %1").arg(m_file.errorString()));
+            return;
+        }
+
+        const quint64 hash = ChunkHash::xxh64(chunk);
+        emit chunkHashed(m_offset, hash);
+        m_socket->write(QString("FILE_CHUNK|%1|%2|%3\n")
+                            .arg(m_offset)
+                            .arg(chunk.size())
+                            .arg(ChunkHash::toHex(hash))
+                            .toUtf8());
+        m_socket->write(chunk);
+        m_offset += chunk.size();
+    }
+}
+
+void FileRangeSender::onDisconnected()
+{
+    finish(m_confirmed >= m_end, "连接中断");
+}
+
+void FileRangeSender::finish(bool success, const QString& reason)
+{
+    if (m_done) {
+        return;
+    }
+    m_done = true;
+    m_socket->disconnectFromHost();
+    if (success) {
+        emit finished();
+    } else {
+        emit failed(reason);
+    }
+}
+
+// FileReceiver 实现
+FileReceiver::FileReceiver(QTcpSocket *socket, const QString& directory, QObject *parent)
+    : QObject(parent)
+    , m_socket(socket)
+    , m_directory(directory)
+{
+    m_socket->setParent(this);
+    connect(m_socket, &QTcpSocket::readyRead, this, &FileReceiver::onReadyRead);
+    connect(m_socket, &QTcpSocket::disconnected, this, &FileReceiver::onDisconnected);
+}
+
+FileReceiver::~FileReceiver() = default;
+
+void FileReceiver::accept(const QStringList& firstLine, const QByteArray& buffered)
+{
+    if (firstLine.value(0) == "FILE_JOIN") {
+        handleJoin(firstLine);
+    } else {
+        handleOffer(firstLine);
+    }
+    m_reader.append(buffered);
+    processBuffered();
+}
+
+void FileReceiver::setBandwidthLimit(const QList<QSharedPointer<TokenBucket>>& buckets)
+{
+    m_buckets = buckets;
+    m_socket->setReadBufferSize(buckets.isEmpty() ? 0 : ShapedReadBufferSize);
+}
+
+void FileReceiver::onReadyRead()
+{
+    if (m_readScheduled) {
+        return;
+    }
+    const int delay = TokenBucket::delayMs(m_buckets);
+    if (delay > 0) {
+        m_readScheduled = true;
+        QTimer::singleShot(delay, this, [this]() {
+            m_readScheduled = false;
+            onReadyRead();
+        });
+        return;
+    }
+
+    const QByteArray data = m_socket->readAll();
+    TokenBucket::consume(m_buckets, data.size());
+    m_reader.append(data);
+    processBuffered();
+}
+
+void FileReceiver::processBuffered()
+{
+    QStringList parts;
+    while (true) {
+        // 数据块：头部行之后紧跟指定字节数的文件内容
+        if (m_pendingChunkSize >= 0) {
+            if (m_reader.pendingBytes() < m_pendingChunkSize) {
+                break;
+            }
+            const QByteArray data = m_reader.readBytes(m_pendingChunkSize);
+            m_pendingChunkSize = -1;
+            handleChunk(m_pendingChunkOffset, data);
+            continue;
+        }
+
+        if (!m_reader.readLine(parts)) {
+            break;
+        }
+        const QString command = parts.value(0);
+        if ((command == "FILE_OFFER" || command == "FILE_JOIN") && !m_transferId.isEmpty()) {
+            // 一条连接只传一个文件，之后的 FILE_OFFER 不能换掉已经核对过的传输
+            qDebug() << "传输连接上重复的" << command << "，断开连接";
+            m_socket->abort();
+            return;
+        }
+        if ((command == "FILE_OFFER" || command == "FILE_JOIN") && m_offerCheck && !m_offerCheck(parts)) {
+            qDebug() << "未经确认的文件传输，拒绝：" << parts.value(1);
+            sendLine(QString("FILE_FAIL|%1|未经确认的文件传输").arg(parts.value(1)));
+            m_socket->disconnectFromHost();
+            return;
+        }
+        if (command == "FILE_OFFER" && parts.size() >= 5 && parts.size() <= 8) {
+            handleOffer(parts);
+        } else if (command == "FILE_JOIN" && (parts.size() == 4 || parts.size() == 5)) {
+            handleJoin(parts);
+        } else if (command == "FILE_CHUNK" && parts.size() == 4) {
+            // 块必须按 ChunkSize 对齐且长度正好是该块的长度，否则按块记录的校验值和计数都会错位
+            const qint64 offset = parts[1].toLongLong();
+            const qint64 length = parts[2].toLongLong();
+            if (!m_assembly || offset < 0 || offset >= m_assembly->fileSize() || offset % FileTransfer::ChunkSize != 0
+                || length != qMin(FileTransfer::ChunkSize, m_assembly->fileSize() - offset)
+                || !ChunkHash::fromHex(parts[3], m_pendingChunkHash)) {
+                qDebug() << "无效的文件数据块，断开连接";
+                m_socket->abort();
+                return;
+            }
+            m_pendingChunkOffset = offset;
+            m_pendingChunkSize = length;
+        } else if (command == "FILE_END") {
+            handleEnd(parts);
+        }
+    }
+}
+
+void FileReceiver::handleOffer(const QStringList& parts)
+{
+    m_transferId = parts[1];
+    // 只取文件名部分，防止对方通过路径写到下载目录之外
+    m_fileName = QFileInfo(parts[3]).fileName();
+    m_senderId = parts[2].toInt();
+    m_fileSize = parts[4].toLongLong();
+    m_relayReceiverId = parts.value(5).toInt();
+    m_contentHash = parts.value(6);
+
+    if (!FileTransfer::isValidTransferId(m_transferId) || m_fileName.isEmpty() || m_fileSize < 0) {
+        sendLine(QString("FILE_FAIL|%1|无效的文件信息").arg(m_transferId));
+        m_socket->disconnectFromHost();
+        return;
+    }
+    if (m_fileSize > m_maxFileSize) {
+        sendLine(QString("FILE_FAIL|%1|文件过大").arg(m_transferId));
+        emit failed(m_fileName, "文件过大");
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    // 已有的 .part/.sum 就是上次确认写入的部分，从第一个缺少的块续传
+    QString error;
+    m_assembly = FileAssembly::open(m_directory, m_transferId, m_fileSize, &error);
+    if (!m_assembly) {
+        sendLine(QString("FILE_FAIL|%1|%2").arg(m_transferId, error));
+        emit failed(m_fileName, error);
+        m_socket->disconnectFromHost();
+        return;
+    }
+    m_primary = true;
+    m_end = m_fileSize;
+    m_next = m_assembly->firstMissing(0, m_fileSize);
+    m_rewindRequested = false;
+    sendLine(QString("FILE_PARALLEL|%1|%2").arg(m_transferId).arg(FileTransfer::MaxParallelStreams));
+    sendLine(QString("FILE_RESUME|%1|%2").arg(m_transferId).arg(m_next));
+    qDebug() << "开始接收文件：" << m_fileName << "已有" << m_assembly->receivedBytes() << "/" << m_fileSize << "字节";
+}
+
+void FileReceiver::handleJoin(const QStringList& parts)
+{
+    // 并行传输的其他段，加入第一条连接已经打开的接收文件
+    m_transferId = parts[1];
+    const qint64 begin = parts[2].toLongLong();
+    const qint64 end = parts[3].toLongLong();
+    if (FileTransfer::isValidTransferId(m_transferId)) {
+        m_assembly = FileAssembly::find(m_directory, m_transferId);
+    }
+    if (!m_assembly || begin < 0 || begin >= end || end > m_assembly->fileSize()
+        || begin % FileTransfer::ChunkSize != 0) {
+        m_assembly.reset();
+        sendLine(QString("FILE_FAIL|%1|没有对应的文件传输").arg(m_transferId));
+        m_socket->disconnectFromHost();
+        return;
+    }
+    m_primary = false;
+    m_fileSize = m_assembly->fileSize();
+    m_end = end;
+    m_next = m_assembly->firstMissing(begin, end);
+    sendLine(QString("FILE_RESUME|%1|%2").arg(m_transferId).arg(m_next));
+}
+
+void FileReceiver::requestRewind(qint64 offset)
+{
+    // 回退请求只发一次，发送方回退前已在路上的数据块直接丢弃
+    if (!m_rewindRequested) {
+        m_rewindRequested = true;
+        m_next = offset;
+        sendLine(QString("FILE_RESUME|%1|%2").arg(m_transferId).arg(offset));
+    }
+}
+
+void FileReceiver::handleChunk(qint64 offset, const QByteArray& data)
+{
+    if (offset != m_next) {
+        // 顺序被打乱（通常是续传前残留的数据），让发送方从期望的位置重发
+        requestRewind(m_next);
+        return;
+    }
+    m_rewindRequested = false;
+    if (offset + data.size() > m_end) {
+        abortTransfer("数据超出文件大小", "数据超出文件大小");
+        return;
+    }
+
+    // 校验失败的块不写入，要求从这一块重发
+    const quint64 hash = ChunkHash::xxh64(data);
+    if (hash != m_pendingChunkHash) {
+        qDebug() << "文件数据块校验失败，偏移" << offset << "：" << m_transferId;
+        if (++m_chunkRetries > FileTransfer::MaxChunkRetries) {
+            abortTransfer("数据块多次校验失败", "数据块多次校验失败");
+            return;
+        }
+        requestRewind(offset);
+        return;
+    }
+    m_chunkRetries = 0;
+
+    // 按偏移写入预先分配的文件，各条连接互不干扰
+    if (!m_assembly->write(offset, data, hash)) {
+        abortTransfer("写入文件失败", m_assembly->errorString());
+        return;
+    }
+
+    m_next += data.size();
+    sendLine(QString("FILE_ACK|%1").arg(m_next));
+    if (m_primary) {
+        emit progress(m_fileName, m_assembly->receivedBytes(), m_fileSize);
+    }
+}
+
+void FileReceiver::handleEnd(const QStringList& parts)
+{
+    if (!m_primary || parts.value(1) != m_transferId || !m_assembly) {
+        return;
+    }
+    if (!m_assembly->isComplete()) {
+        // 有的块被丢弃过或其他连接中断了，等待发送方按 FILE_RESUME 补发
+        requestRewind(m_assembly->firstMissing(0, m_fileSize));
+        return;
+    }
+
+    // 整体校验只用收到时算好的分块校验值
+    quint64 expected = 0;
+    if (!ChunkHash::fromHex(parts.value(2), expected) || ChunkHash::digest(m_assembly->chunkHashes()) != expected) {
+        qDebug() << "文件整体校验失败，丢弃已接收的数据：" << m_fileName;
+        m_assembly->discard();
+        abortTransfer("文件校验失败", "文件校验失败");
+        return;
+    }
+
+    const QString partPath = m_assembly->partPath();
+    m_assembly->close();
+    m_assembly.reset();
+    QString savedPath;
+    if (m_storeByTransferId) {
+        // 中转文件按传输ID保存，保留分块校验值供转发时使用
+        savedPath = m_directory + QLatin1Char('/') + m_transferId;
+        QFile::remove(savedPath);
+    } else {
+        QFile::remove(m_directory + QLatin1Char('/') + m_transferId + QStringLiteral(".sum"));
+        savedPath = uniqueFilePath(m_directory, m_fileName);
+    }
+    if (!QFile::rename(partPath, savedPath)) {
+        abortTransfer("无法保存文件", "无法保存文件");
+        return;
+    }
+
+    QString contentHash;
+    if (!m_verifyContentHash || !Protocol::parseContentReference(m_contentHash, contentHash)) {
+        completeReceive(savedPath);
+        return;
+    }
+    // 分块校验值只能说明传输没有出错，内容是否就是声称的文件要读完整个文件才知道
+    m_verifying = true;
+    QFutureWatcher<QByteArray> *watcher = new QFutureWatcher<QByteArray>(this);
+    connect(watcher, &QFutureWatcher<QByteArray>::finished, this, [this, watcher, savedPath, contentHash]() {
+        watcher->deleteLater();
+        m_verifying = false;
+        if (QString::fromLatin1(watcher->result().toHex()) == contentHash) {
+            completeReceive(savedPath);
+        } else {
+            qDebug() << "文件内容与声称的哈希不符，丢弃：" << m_fileName;
+            QFile::remove(savedPath);
+            QFile::remove(savedPath + QStringLiteral(".sum"));
+            abortTransfer("文件内容与哈希不符", "文件内容与哈希不符");
+        }
+        if (m_socket->state() == QAbstractSocket::UnconnectedState) {
+            deleteLater();
+        }
+    });
+    watcher->setFuture(QtConcurrent::run(&FileTransfer::sha256, savedPath));
+}
+
+void FileReceiver::completeReceive(const QString& savedPath)
+{
+    m_finished = true;
+    sendLine(QString("FILE_DONE|%1").arg(m_transferId));
+    emit finished(m_fileName, savedPath);
+    m_socket->disconnectFromHost();
+}
+
+void FileReceiver::abortTransfer(const QString& reason, const QString& detail)
+{
+    sendLine(QString("FILE_FAIL|%1|%2").arg(m_transferId, reason));
+    // 其他段失败时由第一条连接在结束时补发，不单独报告
+    if (m_primary) {
+        emit failed(m_fileName, detail);
+    }
+    m_socket->disconnectFromHost();
+}
+
+void FileReceiver::sendLine(const QString& line)
+{
+    m_socket->write((line + "\n").toUtf8());
+}
+
+void FileReceiver::onDisconnected()
+{
+    // 未完成的 .part 保留在下载目录，发送方重连后继续；最后一条连接断开时关闭文件
+    m_assembly.reset();
+    if (m_primary && !m_finished && !m_fileName.isEmpty()) {
+        qDebug() << "文件接收中断，已保存" << m_fileName;
+    }
+    if (!m_verifying) {
+        deleteLater();
+    }
+}
@@ -0,0 +1,277 @@
+#ifndef FILETRANSFER_H
+#define FILETRANSFER_H
+
+#include <QObject>
+#include <QFile>
+#include <QSharedPointer>
+#include <QFileInfo>
+#include <QHostAddress>
+#include <QTcpSocket>
+#include <functional>
+#include "framescanner.h"
+#include "tokenbucket.h"
+
+// 文件传输（点对点或经服务器中转）
+// 发送方连接接收方的文件端口，按固定大小分块读取并发送，文件从不整体读入内存；
+// 接收方把 <下载目录>/<传输ID>.part 预先分配到完整大小，收到的块按偏移写入，每写完一块回复确认的偏移。
+// 断线后发送方重新连接并再次发起，接收方告知第一个缺少的块作为续传位置。
+// 每块附带 XXH64 校验值，校验失败的块让发送方从该块重发；各块校验值按块序号记入 .sum（全零表示未收到），
+// 结束时比较由全部分块校验值得到的整体校验值，续传的部分也不必重新读取。
+//
+// 大文件可以分成几段，由多条连接并行发送：接收方在 FILE_RESUME 之前回复 FILE_PARALLEL 表示支持，
+// 发送方在第一条连接上发送第一段，其余各段各开一条连接以 FILE_JOIN 加入同一个传输。
+// 第一条连接等其他各段都确认后才发送 FILE_END；中途断开的段由接收方在 FILE_END 时要求回退补发。
+//
+// 传输协议（每行以'\n'结尾）：
+//   发送方 FILE_OFFER|传输ID|发送者ID|文件名|文件大小[|接收者ID[|内容哈希[|传输令牌]]]
+//          带接收者ID表示交给服务器中转；带内容哈希（sha256:...）时服务器已有相同文件，
+//          先要求发送方证明持有该文件，通过后直接回复 FILE_DONE；
+//          传输令牌由服务器签发，带令牌时前面的字段都要写出（可以为空）。一条连接只传一个文件
+//   服务器 FILE_CHALLENGE|传输ID|偏移|长度|随机数
+//   发送方 FILE_PROOF|传输ID|SHA-256(随机数 + 文件中该段内容) 的十六进制
+//   接收方 FILE_PARALLEL|传输ID|最多连接数          可选，旧版发送方会忽略
+//   接收方 FILE_RESUME|传输ID|偏移                 从该偏移开始发送（也用于要求发送方回退）
+//   发送方 FILE_CHUNK|偏移|长度|XXH64  后面紧跟 长度 字节数据
+//   接收方 FILE_ACK|已确认偏移
+//   发送方 FILE_END|传输ID|整体校验值
+//   接收方 FILE_DONE|传输ID  或  FILE_FAIL|传输ID|原因
+//   并行的其他连接：发送方 FILE_JOIN|传输ID|起始偏移|结束偏移[|传输令牌]，之后的 FILE_RESUME/FILE_CHUNK/FILE_ACK 同上，
+//   该段全部确认后发送方直接断开
+//
+// 中转：发送方把文件上传到服务器（连接聊天端口，FILE_OFFER 带接收者ID），服务器保存后通知接收方
+//   FILE_AVAILABLE|传输ID|发送者ID|文件名|文件大小|下载令牌
+// 接收方另开一条连接发送 FILE_FETCH|传输ID|下载令牌，服务器核对令牌后作为发送方走上面同样的流程
+namespace FileTransfer {
+
+// 旧版客户端固定监听的文件端口；现在客户端监听系统分配的端口并登记到服务器，
+// 只有服务器不支持端点登记时才按这个端口直连
+constexpr quint16 DefaultPort = 54321;
+constexpr qint64 ChunkSize = 256 * 1024;
+// 接收方接受的文件大小上限，超过的 FILE_OFFER 直接拒绝，不预先分配空间
+constexpr qint64 MaxFileSize = 4LL * 1024 * 1024 * 1024;
+
+// 同一块的校验连续失败超过该次数时放弃传输
+constexpr int MaxChunkRetries = 5;
+
+// 并行传输：接收方最多接受的连接数、发送方默认使用的连接数（客户端设置 transfer/parallelStreams）
+constexpr int MaxParallelStreams = 8;
+constexpr int DefaultParallelStreams = 4;
+// 每段至少这么多块，小文件只用一条连接
+constexpr qint64 MinChunksPerStream = 8;
+
+// 同一发送者的同一文件（路径、大小、修改时间都相同）得到相同的ID，重新发送时可以续传；
+// 经服务器中转时把接收者也算进去，同一文件发给不同好友各自占一份中转记录
+QString transferId(const QFileInfo& fileInfo, int senderId, int receiverId = 0);
+// 接收的文件保存位置
+QString downloadDirectory();
+// 传输ID会用作文件名，只接受字母和数字
+bool isValidTransferId(const QString& transferId);
+// 顺序读取计算文件的SHA-256，读取失败时返回空；用于文件库去重，可在工作线程中调用
+QByteArray sha256(const QString& filePath);
+
+// 文件库去重时持有证明的内容范围上限
+constexpr qint64 MaxProofLength = 64 * 1024;
+// SHA-256(nonce + 文件 [offset, offset+length) 的内容)，范围超出文件或读取失败时返回空
+QByteArray contentProof(const QString& filePath, qint64 offset, qint64 length, const QByteArray& nonce);
+
+}
+
+class FileRangeSender;
+class FileAssembly;
+
+class FileSender : public QObject
+{
+    Q_OBJECT
+public:
+    FileSender(const QString& filePath, int senderId, const QHostAddress& host, quint16 port,
+               QObject *parent = nullptr);
+
+    // 经服务器中转时设置接收者，host/port 为服务器地址；contentHash 用于服务器去重
+    void setRelayReceiver(int receiverId, const QString& contentHash = QString())
+    {
+        m_relayReceiverId = receiverId;
+        m_contentHash = contentHash;
+        m_transferId = FileTransfer::transferId(m_fileInfo, m_senderId, receiverId);
+    }
+
+    // 服务器签发的传输令牌，随 FILE_OFFER 和各条并行连接的 FILE_JOIN 发出
+    void setTransferToken(const QString& token) { m_transferToken = token; }
+
+    // 最多使用的并行连接数，接收方不支持时只用一条
+    void setMaxStreams(int streams) { m_maxStreams = qBound(1, streams, FileTransfer::MaxParallelStreams); }
+
+    void start();
+    QString fileName() const { return m_fileInfo.fileName(); }
+    QString transferId() const { return m_transferId; }
+
+signals:
+    void progress(qint64 confirmed, qint64 total);
+    void finished();
+    void failed(const QString& reason);
+
+private slots:
+    void onConnected();
+    void onReadyRead();
+    void onBytesWritten();
+    void onDisconnected();
+
+private:
+    void connectToReceiver();
+    void seekTo(qint64 offset);
+    void startRanges(qint64 offset);    // 把剩余部分分段，第一段自己发送，其余各段另开连接
+    void stopRanges();
+    void recordHash(qint64 offset, quint64 hash);
+    bool hashMissingChunks();            // 发送 FILE_END 前补齐本次没有发送过的块的校验值
+    void reportProgress();
+    void pump();     // 发送缓冲区低于水位时继续读文件发送下一块
+    void fail(const QString& reason);
+
+    QFileInfo m_fileInfo;
+    int m_senderId;
+    int m_relayReceiverId = 0;
+    QString m_contentHash;
+    QString m_transferToken;
+    QHostAddress m_host;
+    quint16 m_port;
+    QString m_transferId;
+
+    QFile m_file;
+    QTcpSocket *m_socket = nullptr;
+    LineReader m_reader;
+    qint64 m_offset = -1;       // 下一块的起始偏移，-1表示还在等待 FILE_RESUME
+    qint64 m_end = 0;           // 这条连接负责发送到的偏移
+    qint64 m_confirmed = 0;     // 接收方在这条连接上确认的偏移
+    QList<quint64> m_chunkHashes;  // 各块的校验值，按块序号排列
+    QList<bool> m_hashKnown;
+    int m_maxStreams = 1;
+    int m_peerStreams = 1;      // 接收方在 FILE_PARALLEL 中允许的连接数
+    QList<FileRangeSender*> m_ranges;
+    qint64 m_rangeConfirmed = 0;   // 其他连接已确认的字节数
+    int m_retries = 0;
+    bool m_endSent = false;
+    bool m_reconnectScheduled = false;
+    bool m_done = false;
+};
+
+// 并行传输中除第一段以外的一段，由 FileSender 创建和管理
+class FileRangeSender : public QObject
+{
+    Q_OBJECT
+public:
+    FileRangeSender(const QString& filePath, const QString& transferId, const QHostAddress& host, quint16 port,
+                    qint64 begin, qint64 end, QObject *parent = nullptr);
+
+    void setTransferToken(const QString& token) { m_transferToken = token; }
+    void start();
+
+signals:
+    void chunkHashed(qint64 offset, quint64 hash);
+    void progress(qint64 bytes);     // 新确认的字节数
+    void finished();
+    void failed(const QString& reason);
+
+private slots:
+    void onReadyRead();
+    void pump();
+    void onDisconnected();
+
+private:
+    void finish(bool success, const QString& reason = QString());
+
+    QFile m_file;
+    QString m_transferId;
+    QString m_transferToken;
+    QHostAddress m_host;
+    quint16 m_port;
+    qint64 m_begin;
+    qint64 m_end;
+    QTcpSocket *m_socket;
+    LineReader m_reader;
+    qint64 m_offset = -1;
+    qint64 m_confirmed = 0;
+    bool m_done = false;
+};
+
+class FileReceiver : public QObject
+{
+    Q_OBJECT
+public:
+    // 接管传输连接，文件保存到 directory；传输结束后连接和对象一起释放
+    FileReceiver(QTcpSocket *socket, const QString& directory, QObject *parent = nullptr);
+    ~FileReceiver();
+
+    // 完成的文件以传输ID命名并保留 .sum（服务器中转用），默认按原文件名另存
+    void setStoreByTransferId(bool enabled) { m_storeByTransferId = enabled; }
+    // FILE_OFFER 带了内容引用（sha256:<哈希>）时，收完后先在工作线程核对整个文件，
+    // 相符才回复 FILE_DONE，否则删除文件并回复 FILE_FAIL
+    void setVerifyContentHash(bool enabled) { m_verifyContentHash = enabled; }
+    // 接受的文件大小上限，默认 FileTransfer::MaxFileSize
+    void setMaxFileSize(qint64 size) { m_maxFileSize = qBound<qint64>(0, size, FileTransfer::MaxFileSize); }
+
+    // 收到 FILE_OFFER 或 FILE_JOIN 时先交给 check 核对（发送者、令牌等），不通过的回复 FILE_FAIL 并断开；
+    // 不设置时全部接受，经 accept 传入的第一行由调用方自己核对
+    using OfferCheck = std::function<bool(const QStringList& parts)>;
+    void setOfferCheck(const OfferCheck& check) { m_offerCheck = check; }
+
+    // 连接已由别处读出 FILE_OFFER 或 FILE_JOIN 时调用，buffered 为随后已经收到的数据
+    void accept(const QStringList& firstLine, const QByteArray& buffered);
+
+    // 限制接收速率：令牌不足时暂停读取，读缓冲区满后由TCP流控让发送方放慢
+    void setBandwidthLimit(const QList<QSharedPointer<TokenBucket>>& buckets);
+
+    QString transferId() const { return m_transferId; }
+    int senderId() const { return m_senderId; }
+    int relayReceiverId() const { return m_relayReceiverId; }
+    QString contentHash() const { return m_contentHash; }
+    QString fileName() const { return m_fileName; }
+    qint64 fileSize() const { return m_fileSize; }
+
+signals:
+    void progress(const QString& fileName, qint64 received, qint64 total);
+    void finished(const QString& fileName, const QString& savedPath);
+    void failed(const QString& fileName, const QString& reason);
+
+private slots:
+    void onReadyRead();
+    void onDisconnected();
+
+private:
+    void processBuffered();
+    void handleOffer(const QStringList& parts);
+    void handleJoin(const QStringList& parts);
+    void handleChunk(qint64 offset, const QByteArray& data);
+    void handleEnd(const QStringList& parts);
+    void completeReceive(const QString& savedPath);
+    void requestRewind(qint64 offset);
+    void abortTransfer(const QString& reason, const QString& detail);
+    void sendLine(const QString& line);
+
+    QTcpSocket *m_socket;
+    QString m_directory;
+    bool m_storeByTransferId = false;
+    bool m_verifyContentHash = false;
+    bool m_verifying = false;         // 正在核对内容哈希，连接断开后等核对完再释放
+    qint64 m_maxFileSize = FileTransfer::MaxFileSize;
+    OfferCheck m_offerCheck;
+    LineReader m_reader;
+    QSharedPointer<FileAssembly> m_assembly;   // 同一传输的各条连接共用
+    QList<QSharedPointer<TokenBucket>> m_buckets;
+    bool m_readScheduled = false;     // 限速等待中，定时器到期后再读取
+    bool m_primary = false;           // 由 FILE_OFFER 发起的第一条连接，负责结束时的校验和保存
+    QString m_transferId;
+    QString m_fileName;
+    int m_senderId = 0;
+    int m_relayReceiverId = 0;
+    QString m_contentHash;
+    qint64 m_fileSize = 0;
+    qint64 m_next = 0;                // 这条连接上期望的下一块偏移
+    qint64 m_end = 0;                 // 这条连接负责的范围终点
+    qint64 m_pendingChunkOffset = 0;
+    qint64 m_pendingChunkSize = -1;   // -1表示没有等待中的数据块
+    quint64 m_pendingChunkHash = 0;
+    int m_chunkRetries = 0;           // 当前块连续校验失败的次数
+    bool m_rewindRequested = false;   // 已要求发送方回退，等待对应偏移的数据块
+    bool m_finished = false;
+};
+
+#endif // FILETRANSFER_H
@@ -0,0 +1,205 @@
+#include "framecompression.h"
+
+#include <QFile>
+#include <QDebug>
+#include <QtEndian>
+
+#ifdef QQ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+constexpr int ZlibLevel = 6;
+
+#ifdef QQ_HAVE_ZSTD
+constexpr int ZstdLevel = 3;
+
+// 共享字典，进程启动时加载一次
+struct ZstdDictionary
+{
+    ZSTD_CDict* compressDict = nullptr;
+    ZSTD_DDict* decompressDict = nullptr;
+    quint32 id = 0;
+
+    ~ZstdDictionary()
+    {
+        ZSTD_freeCDict(compressDict);
+        ZSTD_freeDDict(decompressDict);
+    }
+};
+
+ZstdDictionary& zstdDictionary()
+{
+    static ZstdDictionary dictionary;
+    return dictionary;
+}
+
+// 每个线程复用一组压缩/解压上下文，避免每帧重新分配
+struct ZstdContexts
+{
+    ZSTD_CCtx* compress = ZSTD_createCCtx();
+    ZSTD_DCtx* decompress = ZSTD_createDCtx();
+
+    ~ZstdContexts()
+    {
+        ZSTD_freeCCtx(compress);
+        ZSTD_freeDCtx(decompress);
+    }
+};
+
+ZstdContexts& zstdContexts()
+{
+    thread_local ZstdContexts contexts;
+    return contexts;
+}
+
+QByteArray zstdCompress(const QByteArray& data, quint32 dictionaryId)
+{
+    QByteArray output(qsizetype(ZSTD_compressBound(size_t(data.size()))), Qt::Uninitialized);
+    const ZstdDictionary& dictionary = zstdDictionary();
+
+    size_t result;
+    if (dictionaryId != 0 && dictionaryId == dictionary.id) {
+        result = ZSTD_compress_usingCDict(zstdContexts().compress, output.data(), size_t(output.size()),
+                                          data.constData(), size_t(data.size()), dictionary.compressDict);
+    } else {
+        result = ZSTD_compressCCtx(zstdContexts().compress, output.data(), size_t(output.size()),
+                                   data.constData(), size_t(data.size()), ZstdLevel);
+    }
+
+    if (ZSTD_isError(result)) {
+        qDebug() << "zstd压缩失败：" << ZSTD_getErrorName(result);
+        return QByteArray();
+    }
+    output.truncate(qsizetype(result));
+    return output;
+}
+
+bool zstdDecompress(const QByteArray& data, qint64 rawSize, QByteArray& output, quint32 dictionaryId)
+{
+    output.resize(qsizetype(rawSize));
+    const ZstdDictionary& dictionary = zstdDictionary();
+
+    size_t result;
+    if (dictionaryId != 0) {
+        if (dictionaryId != dictionary.id) {
+            qDebug() << "缺少zstd共享字典：" << dictionaryId;
+            return false;
+        }
+        result = ZSTD_decompress_usingDDict(zstdContexts().decompress, output.data(), size_t(output.size()),
+                                            data.constData(), size_t(data.size()), dictionary.decompressDict);
+    } else {
+        result = ZSTD_decompressDCtx(zstdContexts().decompress, output.data(), size_t(output.size()),
+                                     data.constData(), size_t(data.size()));
+    }
+
+    return !ZSTD_isError(result) && qint64(result) == rawSize;
+}
+#endif
+
+} // namespace
+
+QStringList FrameCompression::supportedNames()
+{
+#ifdef QQ_HAVE_ZSTD
+    return QStringList{ "zstd", "zlib", "none" };
+#else
+    return QStringList{ "zlib", "none" };
+#endif
+}
+
+bool FrameCompression::loadDictionary(const QString& path)
+{
+#ifdef QQ_HAVE_ZSTD
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    const QByteArray content = file.readAll();
+    const quint32 id = ZSTD_getDictID_fromDict(content.constData(), size_t(content.size()));
+    if (id == 0) {
+        qDebug() << "不是zstd训练生成的字典：" << path;
+        return false;
+    }
+
+    ZstdDictionary& dictionary = zstdDictionary();
+    ZSTD_freeCDict(dictionary.compressDict);
+    ZSTD_freeDDict(dictionary.decompressDict);
+    dictionary.compressDict = ZSTD_createCDict(content.constData(), size_t(content.size()), ZstdLevel);
+    dictionary.decompressDict = ZSTD_createDDict(content.constData(), size_t(content.size()));
+    dictionary.id = (dictionary.compressDict && dictionary.decompressDict) ? id : 0;
+
+    qDebug() << "已加载zstd共享字典：" << path << "ID:" << dictionary.id;
+    return dictionary.id != 0;
+#else
+    Q_UNUSED(path);
+    return false;
+#endif
+}
+
+quint32 FrameCompression::dictionaryId()
+{
+#ifdef QQ_HAVE_ZSTD
+    return zstdDictionary().id;
+#else
+    return 0;
+#endif
+}
+
+QByteArray FrameCompression::compress(const QByteArray& data, Protocol::Compression method, quint32 dictionaryId)
+{
+    if (data.size() < Threshold) {
+        return QByteArray();
+    }
+
+    QByteArray output;
+    switch (method) {
+    case Protocol::Compression::Zlib:
+        output = qCompress(data, ZlibLevel);
+        break;
+    case Protocol::Compression::Zstd:
+#ifdef QQ_HAVE_ZSTD
+        output = zstdCompress(data, dictionaryId);
+#endif
+        break;
+    case Protocol::Compression::None:
+        break;
+    }
+    Q_UNUSED(dictionaryId);
+
+    if (output.size() >= data.size()) {
+        return QByteArray();
+    }
+    return output;
+}
+
+bool FrameCompression::decompress(const QByteArray& data, Protocol::Compression method, qint64 rawSize,
+                                  QByteArray& output, quint32 dictionaryId)
+{
+    Q_UNUSED(dictionaryId);
+    if (rawSize < 0) {
+        return false;
+    }
+
+    switch (method) {
+    case Protocol::Compression::Zlib:
+        // qUncompress 按负载开头4字节记录的长度分配缓冲区，先核对它与帧头声明的原始长度一致
+        if (data.size() < 4 || qFromBigEndian<quint32>(data.constData()) != quint64(rawSize)) {
+            return false;
+        }
+        output = qUncompress(data);
+        return output.size() == rawSize;
+    case Protocol::Compression::Zstd:
+#ifdef QQ_HAVE_ZSTD
+        return zstdDecompress(data, rawSize, output, dictionaryId);
+#else
+        return false;
+#endif
+    case Protocol::Compression::None:
+        output = data;
+        return output.size() == rawSize;
+    }
+    return false;
+}
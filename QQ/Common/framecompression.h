@@ -0,0 +1,33 @@
+#ifndef FRAMECOMPRESSION_H
+#define FRAMECOMPRESSION_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+#include "protocol.h"
+
+// BIN帧负载压缩：zlib（qCompress）始终可用，构建时检测到 libzstd 则额外支持 zstd
+// zstd 可选使用由聊天流量训练出的共享字典（zstd --train 生成），双方字典ID一致时才启用
+namespace FrameCompression {
+
+// 小于该长度的负载不压缩
+constexpr qsizetype Threshold = 1024;
+
+// 本程序支持的压缩方式，按优先级排列（用于HELLO）
+QStringList supportedNames();
+
+// 加载共享字典，成功后 dictionaryId() 返回非0
+bool loadDictionary(const QString& path);
+quint32 dictionaryId();
+
+// 压缩失败或压缩后没有变小时返回空QByteArray，调用方按原样发送
+QByteArray compress(const QByteArray& data, Protocol::Compression method, quint32 dictionaryId = 0);
+
+// 解压并校验长度必须等于 rawSize；调用方先按协商的最大帧长度检查 rawSize，解压时最多分配 rawSize 字节
+bool decompress(const QByteArray& data, Protocol::Compression method, qint64 rawSize,
+                QByteArray& output, quint32 dictionaryId = 0);
+
+}
+
+#endif // FRAMECOMPRESSION_H
@@ -0,0 +1,511 @@
+#include "framescanner.h"
+
+#include <QtAlgorithms>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FRAMESCANNER_HAVE_SSE2 1
+#endif
+
+// GCC/Clang(MinGW)可以为单个函数打开AVX2并在运行时检测CPU；MSVC只在编译时开启/arch:AVX2时使用
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAMESCANNER_HAVE_AVX2 1
+#define FRAMESCANNER_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#define FRAMESCANNER_HAVE_AVX2 1
+#define FRAMESCANNER_TARGET_AVX2
+#endif
+
+using FrameScanner::ScanResult;
+
+namespace {
+
+using ScanFunction = ScanResult (*)(const uchar*, qsizetype, qsizetype, QList<qsizetype>&);
+
+inline bool isDelimiter(uchar c)
+{
+    return c == '\n' || c == '|';
+}
+
+// 只识别ASCII空白，UTF-8续字节（如0x85、0xA0）不能当作空白
+inline bool isAsciiSpace(uchar c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline void appendMask(QList<qsizetype>& delimiters, qsizetype base, quint32 mask)
+{
+    while (mask) {
+        delimiters.append(base + qCountTrailingZeroBits(mask));
+        mask &= mask - 1;
+    }
+}
+
+// 校验从 p[i] 开始的一个多字节序列（p[i] >= 0x80）
+// 返回消耗的字节数；序列被缓冲区末尾截断时返回0
+inline int checkSequence(const uchar* p, qsizetype i, qsizetype end, bool& valid)
+{
+    const uchar lead = p[i];
+    int length;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+    } else {
+        valid = false;  // 孤立的续字节、过长编码的首字节或超出范围
+        return 1;
+    }
+
+    const qsizetype available = qMin<qsizetype>(length, end - i);
+    for (qsizetype k = 1; k < available; ++k) {
+        if ((p[i + k] & 0xC0) != 0x80) {
+            valid = false;
+            return 1;
+        }
+    }
+    if (available < length) {
+        return 0;
+    }
+
+    const uchar second = p[i + 1];
+    if ((lead == 0xE0 && second < 0xA0)        // 三字节过长编码
+        || (lead == 0xED && second > 0x9F)     // UTF-16代理区
+        || (lead == 0xF0 && second < 0x90)     // 四字节过长编码
+        || (lead == 0xF4 && second > 0x8F)) {  // 大于U+10FFFF
+        valid = false;
+        return 1;
+    }
+    return length;
+}
+
+ScanResult scanScalar(const uchar* p, qsizetype begin, qsizetype end, QList<qsizetype>& delimiters)
+{
+    ScanResult result;
+    qsizetype i = begin;
+    while (i < end) {
+        const uchar c = p[i];
+        if (c < 0x80) {
+            if (isDelimiter(c)) {
+                delimiters.append(i);
+            }
+            ++i;
+            continue;
+        }
+        const int length = checkSequence(p, i, end, result.utf8Valid);
+        if (length == 0) {
+            result.resumePos = i;
+            return result;
+        }
+        i += length;
+    }
+    result.resumePos = end;
+    return result;
+}
+
+#ifdef FRAMESCANNER_HAVE_SSE2
+// 16字节一组：纯ASCII块只做两次比较；遇到非ASCII字节时交给标量校验整段多字节序列
+ScanResult scanSse2(const uchar* p, qsizetype begin, qsizetype end, QList<qsizetype>& delimiters)
+{
+    ScanResult result;
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i separator = _mm_set1_epi8('|');
+
+    qsizetype i = begin;
+    while (i + 16 <= end) {
+        const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const quint32 nonAscii = quint32(_mm_movemask_epi8(input));
+        const quint32 delimMask = quint32(_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(input, newline), _mm_cmpeq_epi8(input, separator))));
+
+        if (nonAscii == 0) {
+            appendMask(delimiters, i, delimMask);
+            i += 16;
+            continue;
+        }
+
+        const uint prefix = qCountTrailingZeroBits(nonAscii);
+        appendMask(delimiters, i, delimMask & ((1u << prefix) - 1));
+        i += prefix;
+
+        // 中文等连续的多字节字符整段按标量处理，遇到ASCII再回到向量路径
+        do {
+            const int length = checkSequence(p, i, end, result.utf8Valid);
+            if (length == 0) {
+                result.resumePos = i;
+                return result;
+            }
+            i += length;
+        } while (i < end && p[i] >= 0x80);
+    }
+
+    ScanResult tail = scanScalar(p, i, end, delimiters);
+    tail.utf8Valid = tail.utf8Valid && result.utf8Valid;
+    return tail;
+}
+#endif
+
+#ifdef FRAMESCANNER_HAVE_AVX2
+// 32字节一组的向量化UTF-8校验（查表法，参考 Keiser & Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte"），同时用比较掩码收集分隔符位置
+namespace Utf8Error {
+constexpr char TooShort = 1 << 0;
+constexpr char TooLong = 1 << 1;
+constexpr char Overlong3 = 1 << 2;
+constexpr char TooLarge = 1 << 3;
+constexpr char Surrogate = 1 << 4;
+constexpr char Overlong2 = 1 << 5;
+constexpr char TooLarge1000 = 1 << 6;
+constexpr char Overlong4 = 1 << 6;
+constexpr char TwoConts = char(1 << 7);
+constexpr char Carry = TooShort | TooLong | TwoConts;
+}
+
+FRAMESCANNER_TARGET_AVX2 inline __m256i table16(char t0, char t1, char t2, char t3,
+                                                char t4, char t5, char t6, char t7,
+                                                char t8, char t9, char t10, char t11,
+                                                char t12, char t13, char t14, char t15)
+{
+    return _mm256_setr_epi8(t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15,
+                            t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15);
+}
+
+FRAMESCANNER_TARGET_AVX2 inline __m256i highNibble(__m256i v)
+{
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+// 取 input 之前第 N 个字节组成的向量（跨越上一块）
+template<int N>
+FRAMESCANNER_TARGET_AVX2 inline __m256i previous(__m256i input, __m256i prevInput)
+{
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prevInput, input, 0x21), 16 - N);
+}
+
+FRAMESCANNER_TARGET_AVX2 __m256i checkUtf8Block(__m256i input, __m256i prevInput)
+{
+    using namespace Utf8Error;
+
+    const __m256i prev1 = previous<1>(input, prevInput);
+    const __m256i byte1High = _mm256_shuffle_epi8(table16(
+        TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+        TwoConts, TwoConts, TwoConts, TwoConts,
+        TooShort | Overlong2,
+        TooShort,
+        TooShort | Overlong3 | Surrogate,
+        TooShort | TooLarge | TooLarge1000 | Overlong4), highNibble(prev1));
+    const __m256i byte1Low = _mm256_shuffle_epi8(table16(
+        Carry | Overlong3 | Overlong2 | Overlong4,
+        Carry | Overlong2,
+        Carry,
+        Carry,
+        Carry | TooLarge,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000 | Surrogate,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000), _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+    const __m256i byte2High = _mm256_shuffle_epi8(table16(
+        TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooShort, TooShort, TooShort, TooShort), highNibble(input));
+    const __m256i specialCases = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    // 三、四字节序列的第三、四个字节必须是续字节
+    const __m256i prev2 = previous<2>(input, prevInput);
+    const __m256i prev3 = previous<3>(input, prevInput);
+    const __m256i isThirdByte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80)));
+    const __m256i isFourthByte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80)));
+    const __m256i mustBeContinuation = _mm256_and_si256(_mm256_or_si256(isThirdByte, isFourthByte),
+                                                        _mm256_set1_epi8(char(0x80)));
+    return _mm256_xor_si256(mustBeContinuation, specialCases);
+}
+
+// 块末尾是否停在未完成的多字节序列中间
+FRAMESCANNER_TARGET_AVX2 inline __m256i incompleteTail(__m256i input)
+{
+    const __m256i maxValue = _mm256_setr_epi8(
+        char(255), char(255), char(255), char(255), char(255), char(255), char(255), char(255),
+        char(255), char(255), char(255), char(255), char(255), char(255), char(255), char(255),
+        char(255), char(255), char(255), char(255), char(255), char(255), char(255), char(255),
+        char(255), char(255), char(255), char(255), char(255),
+        char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+    return _mm256_subs_epu8(input, maxValue);
+}
+
+FRAMESCANNER_TARGET_AVX2 ScanResult scanAvx2(const uchar* p, qsizetype begin, qsizetype end,
+                                             QList<qsizetype>& delimiters)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i separator = _mm256_set1_epi8('|');
+    __m256i prevInput = _mm256_setzero_si256();
+    __m256i prevIncomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+
+    qsizetype i = begin;
+    while (i + 32 <= end) {
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        const quint32 delimMask = quint32(_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(input, newline), _mm256_cmpeq_epi8(input, separator))));
+        appendMask(delimiters, i, delimMask);
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prevIncomplete);
+            prevIncomplete = _mm256_setzero_si256();
+        } else {
+            error = _mm256_or_si256(error, checkUtf8Block(input, prevInput));
+            prevIncomplete = incompleteTail(input);
+        }
+        prevInput = input;
+        i += 32;
+    }
+
+    // 退回到最后一个可能未完成序列的首字节，剩余部分交给标量处理；
+    // 退回的都是非ASCII字节，不会重复记录分隔符
+    qsizetype tailBegin = i;
+    for (int back = 0; back < 3 && tailBegin > begin && (p[tailBegin - 1] & 0xC0) == 0x80; ++back) {
+        --tailBegin;
+    }
+    if (tailBegin > begin && p[tailBegin - 1] >= 0xC0) {
+        --tailBegin;
+    }
+
+    ScanResult tail = scanScalar(p, tailBegin, end, delimiters);
+    tail.utf8Valid = tail.utf8Valid && _mm256_testz_si256(error, error);
+    return tail;
+}
+#endif
+
+struct Implementation {
+    ScanFunction scan;
+    const char* name;
+};
+
+// 本机可用的实现，按优先级排列，最后一个总是标量实现
+QList<Implementation> availableList()
+{
+    QList<Implementation> list;
+#if defined(FRAMESCANNER_HAVE_AVX2) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        list.append({ scanAvx2, "avx2" });
+    }
+#elif defined(FRAMESCANNER_HAVE_AVX2)
+    list.append({ scanAvx2, "avx2" });
+#endif
+#ifdef FRAMESCANNER_HAVE_SSE2
+    list.append({ scanSse2, "sse2" });
+#endif
+    list.append({ scanScalar, "scalar" });
+    return list;
+}
+
+const QList<Implementation>& implementations()
+{
+    static const QList<Implementation> list = availableList();
+    return list;
+}
+
+const Implementation& implementation()
+{
+    return implementations().first();
+}
+
+} // namespace
+
+ScanResult FrameScanner::scan(const char* data, qsizetype begin, qsizetype end, QList<qsizetype>& delimiters)
+{
+    if (begin >= end) {
+        ScanResult result;
+        result.resumePos = end;
+        return result;
+    }
+    return implementation().scan(reinterpret_cast<const uchar*>(data), begin, end, delimiters);
+}
+
+const char* FrameScanner::implementationName()
+{
+    return implementation().name;
+}
+
+QList<const char*> FrameScanner::availableImplementations()
+{
+    QList<const char*> names;
+    for (const Implementation& impl : implementations()) {
+        names.append(impl.name);
+    }
+    return names;
+}
+
+bool FrameScanner::scanWith(const char* name, const char* data, qsizetype begin, qsizetype end,
+                            QList<qsizetype>& delimiters, ScanResult& result)
+{
+    for (const Implementation& impl : implementations()) {
+        if (qstrcmp(impl.name, name) != 0) {
+            continue;
+        }
+        if (begin >= end) {
+            result = ScanResult();
+            result.resumePos = end;
+        } else {
+            result = impl.scan(reinterpret_cast<const uchar*>(data), begin, end, delimiters);
+        }
+        return true;
+    }
+    return false;
+}
+
+// LineReader 实现
+void LineReader::append(const QByteArray& data)
+{
+    if (data.isEmpty()) {
+        return;
+    }
+
+    m_buffer.append(data);
+    scanPending();
+}
+
+void LineReader::scanPending()
+{
+    const FrameScanner::ScanResult result =
+        FrameScanner::scan(m_buffer.constData(), m_scanPos, m_buffer.size(), m_delimiters);
+    if (!result.utf8Valid) {
+        m_invalidUpTo = result.resumePos;
+    }
+    m_scanPos = result.resumePos;
+}
+
+void LineReader::clear()
+{
+    m_buffer.clear();
+    m_delimiters.clear();
+    m_delimIndex = 0;
+    m_readPos = 0;
+    m_scanPos = 0;
+    m_invalidUpTo = 0;
+}
+
+bool LineReader::readLine(QStringList& fields, bool* utf8Valid)
+{
+    // 跳过本行内的'|'，找到行尾
+    qsizetype lineDelim = m_delimIndex;
+    while (lineDelim < m_delimiters.size() && m_buffer.at(m_delimiters.at(lineDelim)) != '\n') {
+        ++lineDelim;
+    }
+    if (lineDelim == m_delimiters.size()) {
+        compact();
+        return false;
+    }
+
+    const qsizetype lineBegin = m_readPos;
+    const qsizetype lineEnd = m_delimiters.at(lineDelim);
+
+    if (utf8Valid) {
+        *utf8Valid = lineBegin >= m_invalidUpTo || isValidRange(lineBegin, lineEnd);
+    }
+    splitFields(lineBegin, lineEnd, m_delimIndex, lineDelim, fields);
+
+    m_readPos = lineEnd + 1;
+    m_delimIndex = lineDelim + 1;
+    return true;
+}
+
+bool LineReader::takeUnterminated(QStringList& fields, bool* utf8Valid)
+{
+    if (!hasPendingData()) {
+        return false;
+    }
+
+    // 缓冲区里已经没有'\n'，剩下的分隔符都是'|'
+    if (utf8Valid) {
+        *utf8Valid = m_scanPos == m_buffer.size()
+                     && (m_readPos >= m_invalidUpTo || isValidRange(m_readPos, m_buffer.size()));
+    }
+    splitFields(m_readPos, m_buffer.size(), m_delimIndex, m_delimiters.size(), fields);
+    clear();
+    return true;
+}
+
+QByteArray LineReader::readBytes(qsizetype size)
+{
+    size = qMin(size, pendingBytes());
+    const QByteArray bytes = m_buffer.mid(m_readPos, size);
+    m_readPos += size;
+
+    // 二进制负载里扫描到的分隔符作废
+    while (m_delimIndex < m_delimiters.size() && m_delimiters.at(m_delimIndex) < m_readPos) {
+        ++m_delimIndex;
+    }
+    // 扫描停在负载内部（末尾像是未完成的多字节序列）时，从负载之后重新开始
+    if (m_scanPos < m_readPos) {
+        m_scanPos = m_readPos;
+        scanPending();
+    }
+    return bytes;
+}
+
+void LineReader::compact()
+{
+    if (m_readPos == 0) {
+        return;
+    }
+
+    m_buffer.remove(0, m_readPos);
+    m_delimiters.remove(0, m_delimIndex);
+    for (qsizetype& pos : m_delimiters) {
+        pos -= m_readPos;
+    }
+    m_scanPos -= m_readPos;
+    m_invalidUpTo = qMax<qsizetype>(0, m_invalidUpTo - m_readPos);
+    m_delimIndex = 0;
+    m_readPos = 0;
+}
+
+void LineReader::splitFields(qsizetype lineBegin, qsizetype lineEnd,
+                             qsizetype firstDelim, qsizetype lastDelim, QStringList& fields) const
+{
+    const char* data = m_buffer.constData();
+
+    // 与 QString::trimmed() 一致，去掉行首尾的空白（包括'\r'）
+    while (lineBegin < lineEnd && isAsciiSpace(uchar(data[lineBegin]))) {
+        ++lineBegin;
+    }
+    while (lineEnd > lineBegin && isAsciiSpace(uchar(data[lineEnd - 1]))) {
+        --lineEnd;
+    }
+
+    fields.clear();
+    fields.reserve(lastDelim - firstDelim + 1);
+
+    qsizetype fieldBegin = lineBegin;
+    for (qsizetype i = firstDelim; i < lastDelim; ++i) {
+        const qsizetype pos = m_delimiters.at(i);
+        if (pos < lineBegin || pos >= lineEnd) {
+            continue;
+        }
+        fields.append(QString::fromUtf8(data + fieldBegin, pos - fieldBegin));
+        fieldBegin = pos + 1;
+    }
+    fields.append(QString::fromUtf8(data + fieldBegin, lineEnd - fieldBegin));
+}
+
+bool LineReader::isValidRange(qsizetype begin, qsizetype end) const
+{
+    QList<qsizetype> delimiters;
+    const FrameScanner::ScanResult result = FrameScanner::scan(m_buffer.constData(), begin, end, delimiters);
+    return result.utf8Valid && result.resumePos == end;
+}
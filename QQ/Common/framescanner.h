@@ -0,0 +1,73 @@
+#ifndef FRAMESCANNER_H
+#define FRAMESCANNER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+// 分隔符扫描内核：一次遍历同时找出换行符、字段分隔符'|'并校验UTF-8
+// x86 上按 AVX2 / SSE2 / 标量 依次选择可用的实现
+namespace FrameScanner {
+
+// 扫描结果
+struct ScanResult {
+    bool utf8Valid = true;      // [begin, resumePos) 内是否为合法UTF-8
+    qsizetype resumePos = 0;    // 末尾不完整多字节序列的起点，下次从这里继续扫描
+};
+
+// 扫描 data[begin, end)，'\n' 与 '|' 的偏移按出现顺序追加到 delimiters
+// begin 必须位于字符边界上
+ScanResult scan(const char* data, qsizetype begin, qsizetype end, QList<qsizetype>& delimiters);
+
+// 当前进程实际使用的实现名称（"avx2" / "sse2" / "scalar"），用于日志
+const char* implementationName();
+
+// 本机可用的全部实现名称，按优先级排列；供基准测试逐一比较
+QList<const char*> availableImplementations();
+// 用指定的实现扫描，参数与 scan() 相同；该实现在本机不可用时返回false
+bool scanWith(const char* name, const char* data, qsizetype begin, qsizetype end,
+              QList<qsizetype>& delimiters, ScanResult& result);
+
+}
+
+// 按行切分协议数据：每行以'\n'结尾，字段之间以'|'分隔
+// 新到达的数据只扫描一次，缓冲区中的多行可以连续取出
+class LineReader
+{
+public:
+    void append(const QByteArray& data);
+    void clear();
+
+    // 取出下一整行并切分为字段；没有完整行时返回false
+    // utf8Valid 为false表示该行含非法UTF-8，字段中的非法字节已被替换
+    bool readLine(QStringList& fields, bool* utf8Valid = nullptr);
+
+    // 取出尚未以'\n'结尾的剩余数据（兼容不带换行符的旧客户端请求）
+    bool takeUnterminated(QStringList& fields, bool* utf8Valid = nullptr);
+
+    // 取出紧跟在当前位置之后的size字节原始数据（BIN帧的负载），调用前需确认 pendingBytes() >= size
+    QByteArray readBytes(qsizetype size);
+
+    // 查看待处理数据开头的若干字节（不消费）
+    QByteArray peek(qsizetype maxSize) const { return m_buffer.mid(m_readPos, maxSize); }
+
+    bool hasPendingData() const { return m_readPos < m_buffer.size(); }
+    qsizetype pendingBytes() const { return m_buffer.size() - m_readPos; }
+
+private:
+    void scanPending();
+    void compact();
+    void splitFields(qsizetype lineBegin, qsizetype lineEnd,
+                     qsizetype firstDelim, qsizetype lastDelim, QStringList& fields) const;
+    bool isValidRange(qsizetype begin, qsizetype end) const;
+
+    QByteArray m_buffer;
+    QList<qsizetype> m_delimiters;  // m_buffer 中 '\n' 与 '|' 的偏移
+    qsizetype m_delimIndex = 0;     // 下一个未消费的分隔符
+    qsizetype m_readPos = 0;        // 下一行的起点
+    qsizetype m_scanPos = 0;        // 已扫描到的位置
+    qsizetype m_invalidUpTo = 0;    // 此位置之前存在非法UTF-8，需要逐行复核
+};
+
+#endif // FRAMESCANNER_H
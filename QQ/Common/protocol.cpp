@@ -0,0 +1,267 @@
+#include "protocol.h"
+#include "framecompression.h"
+
+#include <QHash>
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+
+namespace {
+
+// 解析 key=value 形式的字段（跳过第一个命令字段）
+QHash<QString, QString> parseOptions(const QStringList& parts)
+{
+    QHash<QString, QString> options;
+    for (int i = 1; i < parts.size(); ++i) {
+        const QString& part = parts[i];
+        const int pos = part.indexOf('=');
+        if (pos > 0) {
+            options.insert(part.left(pos), part.mid(pos + 1));
+        }
+    }
+    return options;
+}
+
+QStringList parseList(const QString& value)
+{
+    return value.split(',', Qt::SkipEmptyParts);
+}
+
+// 取对端列表中第一个本端也支持的选项
+QString pick(const QStringList& remote, const QStringList& local, const QString& fallback)
+{
+    for (const QString& option : remote) {
+        if (local.contains(option)) {
+            return option;
+        }
+    }
+    return fallback;
+}
+
+Protocol::Framing framingFromName(const QString& name)
+{
+    return name == "frame" ? Protocol::Framing::Frame : Protocol::Framing::Line;
+}
+
+Protocol::Encoding encodingFromName(const QString& name)
+{
+    return name == "binary" ? Protocol::Encoding::Binary : Protocol::Encoding::Text;
+}
+
+// 没有 features 字段的旧版本按版本号推出功能位
+quint32 parseFeatures(const QHash<QString, QString>& options, int version)
+{
+    bool ok = false;
+    const quint32 features = options.value("features").toUInt(&ok, 16);
+    return ok ? features : Protocol::featuresForVersion(version);
+}
+
+} // namespace
+
+quint32 Protocol::featuresForVersion(int version)
+{
+    quint32 features = 0;
+    if (version >= StreamingVersion) {
+        features |= StreamedHistory;
+    }
+    if (version >= FileRelayVersion) {
+        features |= FileRelay;
+    }
+    if (version >= PeerDiscoveryVersion) {
+        features |= PeerDiscovery;
+    }
+    if (version >= MessageRelayVersion) {
+        features |= MessageRelay;
+    }
+    if (version >= RequestIdVersion) {
+        features |= RequestIds;
+    }
+    if (version >= SessionResumeVersion) {
+        features |= SessionResume;
+    }
+    if (version >= HistorySyncVersion) {
+        features |= HistorySync;
+    }
+    if (version >= UploadTokenVersion) {
+        features |= UploadTokens;
+    }
+    if (version >= PeerFileOfferVersion) {
+        features |= PeerFileOffers;
+    }
+    return features;
+}
+
+Protocol::Capabilities Protocol::localCapabilities()
+{
+    Capabilities capabilities;
+    capabilities.version = CurrentVersion;
+    capabilities.framing = QStringList{ "frame", "line" };
+    capabilities.encoding = QStringList{ "binary", "text" };
+    capabilities.compression = FrameCompression::supportedNames();
+    capabilities.maxFrameSize = DefaultMaxFrameSize;
+    capabilities.dictionaryId = FrameCompression::dictionaryId();
+    capabilities.features = featuresForVersion(CurrentVersion);
+    return capabilities;
+}
+
+QString Protocol::buildHello(const Capabilities& capabilities)
+{
+    return QString("HELLO|version=%1|framing=%2|encoding=%3|compression=%4|maxframe=%5|dict=%6|features=%7")
+        .arg(capabilities.version)
+        .arg(capabilities.framing.join(','))
+        .arg(capabilities.encoding.join(','))
+        .arg(capabilities.compression.join(','))
+        .arg(capabilities.maxFrameSize)
+        .arg(capabilities.dictionaryId)
+        .arg(capabilities.features, 0, 16);
+}
+
+bool Protocol::parseHello(const QStringList& parts, Capabilities& capabilities)
+{
+    if (parts.isEmpty() || parts[0] != "HELLO") {
+        return false;
+    }
+
+    const QHash<QString, QString> options = parseOptions(parts);
+    capabilities.version = options.value("version").toInt();
+    capabilities.framing = parseList(options.value("framing"));
+    capabilities.encoding = parseList(options.value("encoding"));
+    capabilities.compression = parseList(options.value("compression"));
+    capabilities.maxFrameSize = options.value("maxframe").toLongLong();
+    capabilities.dictionaryId = options.value("dict").toUInt();
+    capabilities.features = parseFeatures(options, capabilities.version);
+    return capabilities.version > 0;
+}
+
+Protocol::Settings Protocol::negotiate(const Capabilities& local, const Capabilities& remote)
+{
+    Settings settings;
+    settings.version = qMin(local.version, remote.version);
+    settings.features = local.features & remote.features;
+    settings.framing = framingFromName(pick(remote.framing, local.framing, "line"));
+
+    // 二进制编码和压缩都依赖BIN帧
+    if (settings.framing == Framing::Frame) {
+        settings.encoding = encodingFromName(pick(remote.encoding, local.encoding, "text"));
+        settings.compression = compressionFromName(pick(remote.compression, local.compression, "none"));
+        if (settings.compression == Compression::Zstd && local.dictionaryId == remote.dictionaryId) {
+            settings.dictionaryId = local.dictionaryId;
+        }
+    }
+
+    settings.maxFrameSize = remote.maxFrameSize > 0
+                                ? qMin(local.maxFrameSize, remote.maxFrameSize)
+                                : local.maxFrameSize;
+    return settings;
+}
+
+QString Protocol::buildHelloReply(const Settings& settings)
+{
+    return QString("HELLO_OK|version=%1|framing=%2|encoding=%3|compression=%4|maxframe=%5|dict=%6|features=%7")
+        .arg(settings.version)
+        .arg(framingName(settings.framing))
+        .arg(encodingName(settings.encoding))
+        .arg(compressionName(settings.compression))
+        .arg(settings.maxFrameSize)
+        .arg(settings.dictionaryId)
+        .arg(settings.features, 0, 16);
+}
+
+bool Protocol::parseHelloReply(const QStringList& parts, Settings& settings)
+{
+    if (parts.isEmpty() || parts[0] != "HELLO_OK") {
+        return false;
+    }
+
+    const QHash<QString, QString> options = parseOptions(parts);
+    settings.version = options.value("version").toInt();
+    settings.framing = framingFromName(options.value("framing"));
+    settings.encoding = encodingFromName(options.value("encoding"));
+    settings.compression = compressionFromName(options.value("compression"));
+    settings.maxFrameSize = options.value("maxframe").toLongLong();
+    settings.dictionaryId = options.value("dict").toUInt();
+    settings.features = parseFeatures(options, settings.version);
+    if (settings.maxFrameSize <= 0) {
+        settings.maxFrameSize = DefaultMaxFrameSize;
+    }
+    return settings.version > 0;
+}
+
+QString Protocol::contentReference(const QByteArray& data)
+{
+    return contentReferenceFromDigest(QCryptographicHash::hash(data, QCryptographicHash::Sha256));
+}
+
+QString Protocol::contentReferenceFromDigest(const QByteArray& sha256Digest)
+{
+    return "sha256:" + QString::fromLatin1(sha256Digest.toHex());
+}
+
+bool Protocol::parseContentReference(const QString& reference, QString& hash)
+{
+    if (!reference.startsWith("sha256:") || reference.size() != 7 + 64) {
+        return false;
+    }
+
+    // 哈希会用作服务器和客户端的文件名，只接受小写十六进制
+    const QString candidate = reference.mid(7);
+    for (const QChar c : candidate) {
+        if (!((c >= u'0' && c <= u'9') || (c >= u'a' && c <= u'f'))) {
+            return false;
+        }
+    }
+    hash = candidate;
+    return true;
+}
+
+QString Protocol::randomToken()
+{
+    quint32 words[4];
+    QRandomGenerator::system()->fillRange(words);
+    return QString::fromLatin1(QByteArray(reinterpret_cast<const char*>(words), sizeof(words)).toHex());
+}
+
+bool Protocol::tokenEquals(const QString& expected, const QString& actual)
+{
+    if (expected.isEmpty() || expected.size() != actual.size()) {
+        return false;
+    }
+    ushort diff = 0;
+    for (qsizetype i = 0; i < expected.size(); ++i) {
+        diff |= expected[i].unicode() ^ actual[i].unicode();
+    }
+    return diff == 0;
+}
+
+QString Protocol::framingName(Framing framing)
+{
+    return framing == Framing::Frame ? "frame" : "line";
+}
+
+QString Protocol::encodingName(Encoding encoding)
+{
+    return encoding == Encoding::Binary ? "binary" : "text";
+}
+
+QString Protocol::compressionName(Compression compression)
+{
+    switch (compression) {
+    case Compression::Zlib:
+        return "zlib";
+    case Compression::Zstd:
+        return "zstd";
+    case Compression::None:
+        break;
+    }
+    return "none";
+}
+
+Protocol::Compression Protocol::compressionFromName(const QString& name)
+{
+    if (name == "zlib") {
+        return Compression::Zlib;
+    }
+    if (name == "zstd") {
+        return Compression::Zstd;
+    }
+    return Compression::None;
+}
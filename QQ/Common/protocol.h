@@ -0,0 +1,124 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <QString>
+#include <QStringList>
+
+// 协议能力协商
+// 客户端连接后发送：HELLO|version=11|framing=frame,line|encoding=binary,text|compression=zstd,zlib,none|maxframe=16777216|dict=0|features=ff
+// 服务器回复选定的结果：HELLO_OK|version=11|framing=frame|encoding=binary|compression=zlib|maxframe=16777216|dict=0|features=ff
+// 列表按优先级排列；不发送HELLO的旧客户端保持纯文本行协议
+// dict 是 zstd 共享字典的ID，0 表示没有字典；双方ID一致且选中 zstd 时才使用字典
+// features 是十六进制的功能位（见 Feature），协商结果取双方的交集；
+// 一端可以只实现其中一部分功能，不必实现版本号之前的全部功能。没有 features 字段的旧版本按版本号推出功能位
+namespace Protocol {
+
+constexpr int LegacyVersion = 1;
+constexpr int HandshakeVersion = 2;   // HELLO协商、BIN帧
+constexpr int StreamingVersion = 3;   // 聊天记录分块发送：MESSAGES_CHUNK ... MESSAGES_END
+constexpr int FileRelayVersion = 4;   // 服务器中转文件：FILE_OFFER 上传、FILE_AVAILABLE 通知、FILE_FETCH 下载
+constexpr int PeerDiscoveryVersion = 5;   // 端点登记：REGISTER_ENDPOINT|用户ID|UDP端口|文件端口，PEER_LOOKUP -> PEER_ENDPOINT/PEER_OFFLINE
+constexpr int MessageRelayVersion = 6;    // 可靠UDP消息的TCP兜底：RELAY_MESSAGE -> MESSAGE_RELAYED，PEER_ENDPOINT 带上对方的协议版本
+constexpr int RequestIdVersion = 7;        // 请求行前加 #请求ID|，回复带回同一个ID；服务器推送不带ID
+constexpr int SessionResumeVersion = 8;    // LOGIN_SUCCESS 末尾带续连令牌；断线重连后 RESUME|令牌|UDP端口|文件端口|已收到的投递标识 恢复会话，
+                                           // 文本消息 SAVE_MESSAGE|发送者|接收者|1|投递标识|内容，投递标识为UDP通道ID.序号，可以为空
+constexpr int HistorySyncVersion = 9;      // SYNC_MESSAGES|用户ID|好友ID|消息ID 只取该ID之后的消息：MESSAGES_SINCE，差得太多时按 GET_MESSAGES desc 分块重发
+constexpr int UploadTokenVersion = 10;     // 中转上传先在聊天连接上领取令牌：RELAY_UPLOAD|传输ID|接收者ID|文件大小 ->
+                                           // RELAY_UPLOAD_OK|传输ID|令牌 或 RELAY_UPLOAD_FAIL|传输ID|原因，上传连接的 FILE_OFFER、FILE_JOIN 末尾带上令牌
+constexpr int PeerFileOfferVersion = 11;   // 直连发文件先经服务器征得对方同意：PEER_FILE|接收者ID|传输ID|文件名|文件大小 -> PEER_FILE_SENT|传输ID 或 PEER_FILE_FAIL|传输ID|原因，
+                                           // 对方收到 PEER_FILE_OFFER|发送者ID|传输ID|文件名|文件大小，回 PEER_FILE_ANSWER|发送者ID|传输ID|令牌（拒绝时令牌为空），
+                                           // 服务器转给发送方 PEER_FILE_ANSWER|接收者ID|传输ID|令牌，直连的 FILE_OFFER、FILE_JOIN 末尾带上这个令牌
+constexpr int CurrentVersion = PeerFileOfferVersion;
+constexpr qint64 DefaultMaxFrameSize = 16 * 1024 * 1024;
+
+// 可以单独协商的功能，每个对应上面引入它的版本
+enum Feature : quint32 {
+    StreamedHistory = 1u << 0,
+    FileRelay = 1u << 1,
+    PeerDiscovery = 1u << 2,
+    MessageRelay = 1u << 3,
+    RequestIds = 1u << 4,
+    SessionResume = 1u << 5,
+    HistorySync = 1u << 6,
+    UploadTokens = 1u << 7,
+    PeerFileOffers = 1u << 8,
+};
+// 达到某个版本的旧实现具备的功能位
+quint32 featuresForVersion(int version);
+
+// 分帧方式：Line 只有文本行；Frame 允许在行之间插入 BIN|命令|字节数 的二进制帧
+enum class Framing { Line, Frame };
+// 列表类响应的编码
+enum class Encoding { Text, Binary };
+// 二进制帧负载的压缩方式
+enum class Compression { None, Zlib, Zstd };
+
+// 一端支持的能力
+struct Capabilities
+{
+    int version = CurrentVersion;
+    QStringList framing;
+    QStringList encoding;
+    QStringList compression;
+    qint64 maxFrameSize = DefaultMaxFrameSize;
+    quint32 dictionaryId = 0;
+    quint32 features = 0;
+};
+
+// 协商结果，每个连接保存一份；默认值即旧版协议
+struct Settings
+{
+    int version = LegacyVersion;
+    Framing framing = Framing::Line;
+    Encoding encoding = Encoding::Text;
+    Compression compression = Compression::None;
+    qint64 maxFrameSize = DefaultMaxFrameSize;
+    quint32 dictionaryId = 0;
+    quint32 features = 0;       // 双方都支持的功能位
+
+    bool binaryLists() const { return framing == Framing::Frame && encoding == Encoding::Binary; }
+    bool hasFeature(Feature feature) const { return (features & feature) != 0; }
+    bool streamedHistory() const { return hasFeature(StreamedHistory); }
+    bool fileRelay() const { return hasFeature(FileRelay); }
+    bool peerDiscovery() const { return hasFeature(PeerDiscovery); }
+    bool messageRelay() const { return hasFeature(MessageRelay); }
+    bool requestIds() const { return hasFeature(RequestIds); }
+    bool sessionResume() const { return hasFeature(SessionResume); }
+    bool historySync() const { return hasFeature(HistorySync); }
+    bool uploadTokens() const { return hasFeature(UploadTokens); }
+    bool peerFileOffers() const { return hasFeature(PeerFileOffers); }
+};
+
+// 本程序支持的全部能力
+Capabilities localCapabilities();
+
+QString buildHello(const Capabilities& capabilities);
+bool parseHello(const QStringList& parts, Capabilities& capabilities);
+
+// 按对端的优先级选出双方都支持的选项
+Settings negotiate(const Capabilities& local, const Capabilities& remote);
+
+QString buildHelloReply(const Settings& settings);
+bool parseHelloReply(const QStringList& parts, Settings& settings);
+
+// 服务器头像库和文件库都按内容的SHA-256保存，引用记为 "sha256:<64位十六进制>"
+// 头像引用保存在 avatarPath 中，文件引用保存在消息的 file_hash 中
+constexpr qint64 MaxAvatarUploadSize = 8 * 1024 * 1024;
+QString contentReference(const QByteArray& data);
+QString contentReferenceFromDigest(const QByteArray& sha256Digest);
+// 是内容引用时取出其中的哈希；本地路径等其他值返回false
+bool parseContentReference(const QString& reference, QString& hash);
+
+// 一次性令牌：128位随机数的十六进制
+QString randomToken();
+// 比较令牌时不在第一个不同的字符处提前返回，避免按耗时逐位猜测；期望值为空时总是不匹配
+bool tokenEquals(const QString& expected, const QString& actual);
+
+QString framingName(Framing framing);
+QString encodingName(Encoding encoding);
+QString compressionName(Compression compression);
+Compression compressionFromName(const QString& name);
+
+}
+
+#endif // PROTOCOL_H
@@ -0,0 +1,58 @@
+#include "tokenbucket.h"
+
+#include <QtMath>
+
+TokenBucket::TokenBucket(qint64 bytesPerSecond, qint64 burstBytes)
+    : m_rate(bytesPerSecond)
+    , m_burst(burstBytes)
+    , m_tokens(double(burstBytes))
+{
+    m_clock.start();
+}
+
+void TokenBucket::refill()
+{
+    // 按上次补充以来经过的纳秒数补充令牌，频繁调用也不丢时间
+    const qint64 now = m_clock.nsecsElapsed();
+    const qint64 elapsed = now - m_refilledNs;
+    m_refilledNs = now;
+    m_tokens = qMin(double(m_burst), m_tokens + double(m_rate) * double(elapsed) / 1e9);
+}
+
+int TokenBucket::delayMs()
+{
+    if (m_rate <= 0) {
+        return 0;
+    }
+    refill();
+    if (m_tokens >= 0) {
+        return 0;
+    }
+    // 至少等1毫秒，避免定时器空转
+    return qMax(1, qCeil(-m_tokens * 1000.0 / double(m_rate)));
+}
+
+void TokenBucket::consume(qint64 bytes)
+{
+    if (m_rate <= 0) {
+        return;
+    }
+    refill();
+    m_tokens -= double(bytes);
+}
+
+int TokenBucket::delayMs(const QList<QSharedPointer<TokenBucket>>& buckets)
+{
+    int delay = 0;
+    for (const QSharedPointer<TokenBucket>& bucket : buckets) {
+        delay = qMax(delay, bucket->delayMs());
+    }
+    return delay;
+}
+
+void TokenBucket::consume(const QList<QSharedPointer<TokenBucket>>& buckets, qint64 bytes)
+{
+    for (const QSharedPointer<TokenBucket>& bucket : buckets) {
+        bucket->consume(bytes);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QSharedPointer>
+
+// 令牌桶限速：每秒补充 rate 字节的令牌，最多积累 burst 字节
+// 允许一次透支一整块，令牌为负时调用方等到补回再继续，平均速率不超过 rate
+// 同一个桶可以被多条连接共享（例如同一用户的所有传输），rate 为0表示不限速
+class TokenBucket
+{
+public:
+    TokenBucket(qint64 bytesPerSecond, qint64 burstBytes);
+
+    qint64 rate() const { return m_rate; }
+
+    // 距离有可用令牌还需等待的毫秒数，0表示可以立即发送
+    int delayMs();
+    void consume(qint64 bytes);
+
+    // 同时受多个桶限制时取最长的等待时间，发送后每个桶都扣除
+    static int delayMs(const QList<QSharedPointer<TokenBucket>>& buckets);
+    static void consume(const QList<QSharedPointer<TokenBucket>>& buckets, qint64 bytes);
+
+private:
+    void refill();
+
+    qint64 m_rate;
+    qint64 m_burst;
+    double m_tokens;
+    QElapsedTimer m_clock;      // 创建时启动后一直计时，不重新开始
+    qint64 m_refilledNs = 0;    // 上次补充令牌时 m_clock 的纳秒读数
+};
+
+#endif // TOKENBUCKET_H
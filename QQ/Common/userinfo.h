@@ -15,7 +15,7 @@ struct UserInfo {
 
 // 消息信息结构体定义
 struct MessageInfo {
-    int messageId;
+    int messageId = 0;   // 0 表示没有服务器分配的ID（本地发出或经UDP直接收到的消息）
     int senderId;
     int receiverId;
     QString content;
@@ -2,4 +2,5 @@ TEMPLATE = subdirs
 
 SUBDIRS += \
     Client \
-    Server
+    Server \
+    Benchmark
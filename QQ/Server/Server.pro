@@ -1,9 +1,11 @@
-QT       += core gui network sql
+QT       += core gui network sql concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++17
 
+include(../Common/Common.pri)
+
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
@@ -11,12 +13,17 @@ CONFIG += c++17
 SOURCES += \
     main.cpp \
     mainwindow.cpp \
-    database.cpp
+    database.cpp \
+    avatarstore.cpp \
+    filerelay.cpp \
+    filestore.cpp
 
 HEADERS += \
     mainwindow.h \
     database.h \
-    userinfo.h
+    avatarstore.h \
+    filerelay.h \
+    filestore.h
 
 FORMS += \
     mainwindow.ui
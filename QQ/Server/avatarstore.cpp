@@ -0,0 +1,145 @@
+#include "avatarstore.h"
+
+#include <QBuffer>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QImageReader>
+#include <QSaveFile>
+#include "protocol.h"
+
+namespace {
+
+bool writeFileAtomically(const QString& path, const QByteArray& data)
+{
+    // 先写临时文件再改名，读取方不会看到写了一半的头像
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(data);
+    return file.commit();
+}
+
+} // namespace
+
+AvatarStore::AvatarStore(const QString& rootPath)
+    : m_rootPath(rootPath)
+{
+    QDir().mkpath(m_rootPath);
+}
+
+const QList<int>& AvatarStore::thumbnailSizes()
+{
+    static const QList<int> sizes{40};
+    return sizes;
+}
+
+QString AvatarStore::directoryFor(const QString& hash) const
+{
+    return m_rootPath + QLatin1Char('/') + hash.left(2);
+}
+
+QString AvatarStore::originalPath(const QString& hash) const
+{
+    return directoryFor(hash) + QLatin1Char('/') + hash + QStringLiteral(".orig");
+}
+
+QString AvatarStore::thumbnailPath(const QString& hash, int size) const
+{
+    return directoryFor(hash) + QStringLiteral("/%1_%2.png").arg(hash).arg(size);
+}
+
+QString AvatarStore::store(const QByteArray& imageData, QString* errorMessage)
+{
+    const QString reference = Protocol::contentReference(imageData);
+    QString hash;
+    Protocol::parseContentReference(reference, hash);
+
+    // 同一张图片已经存过，直接复用
+    if (contains(hash)) {
+        return reference;
+    }
+
+    if (!QDir().mkpath(directoryFor(hash))) {
+        if (errorMessage) *errorMessage = "无法创建头像目录";
+        return QString();
+    }
+    if (!writeThumbnails(hash, imageData, errorMessage)) {
+        return QString();
+    }
+    // 原图最后写入，作为“已完整保存”的标记
+    if (!writeFileAtomically(originalPath(hash), imageData)) {
+        if (errorMessage) *errorMessage = "无法保存头像文件";
+        return QString();
+    }
+    return reference;
+}
+
+bool AvatarStore::writeThumbnails(const QString& hash, const QByteArray& imageData, QString* errorMessage) const
+{
+    QBuffer buffer;
+    buffer.setData(imageData);
+    QImageReader reader(&buffer);
+    reader.setAutoTransform(true);
+
+    // 只解码居中的正方形区域，并让解码器先缩到最大缩略图的尺寸
+    const int largest = thumbnailSizes().last();
+    const QSize fullSize = reader.size();
+    if (fullSize.isValid()) {
+        const int side = qMin(fullSize.width(), fullSize.height());
+        reader.setClipRect(QRect((fullSize.width() - side) / 2, (fullSize.height() - side) / 2, side, side));
+        if (side > largest * 2) {
+            reader.setScaledSize(QSize(largest * 2, largest * 2));
+        }
+    }
+
+    QImage source = reader.read();
+    if (source.isNull()) {
+        if (errorMessage) *errorMessage = QString("无法解码头像图片: %1").arg(reader.errorString());
+        return false;
+    }
+    if (source.width() != source.height()) {
+        const int side = qMin(source.width(), source.height());
+        source = source.copy((source.width() - side) / 2, (source.height() - side) / 2, side, side);
+    }
+
+    for (int size : thumbnailSizes()) {
+        const QImage scaled = source.scaled(size, size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        QByteArray png;
+        QBuffer output(&png);
+        output.open(QIODevice::WriteOnly);
+        if (!scaled.save(&output, "PNG") || !writeFileAtomically(thumbnailPath(hash, size), png)) {
+            if (errorMessage) *errorMessage = QString("无法生成%1px缩略图").arg(size);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AvatarStore::contains(const QString& hash) const
+{
+    return QFileInfo::exists(originalPath(hash));
+}
+
+QByteArray AvatarStore::thumbnail(const QString& hash, int size) const
+{
+    if (!contains(hash)) {
+        return QByteArray();
+    }
+
+    int chosen = thumbnailSizes().last();
+    for (int candidate : thumbnailSizes()) {
+        if (candidate >= size) {
+            chosen = candidate;
+            break;
+        }
+    }
+
+    QFile file(thumbnailPath(hash, chosen));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    return file.readAll();
+}
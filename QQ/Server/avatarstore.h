@@ -0,0 +1,35 @@
+#ifndef AVATARSTORE_H
+#define AVATARSTORE_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// 服务器头像库：按内容的SHA-256保存上传的头像，相同图片只存一份
+// 保存时同时生成客户端用到的各个尺寸的方形PNG缩略图，请求时直接返回小文件
+// 目录结构：<根目录>/<哈希前两位>/<哈希>.orig 为原图，<哈希>_<尺寸>.png 为缩略图
+class AvatarStore
+{
+public:
+    explicit AvatarStore(const QString& rootPath);
+
+    // 预先生成的缩略图尺寸：客户端只请求40的头像（AvatarCache::DownloadSize），更小的尺寸在本地缩放
+    static const QList<int>& thumbnailSizes();
+
+    // 保存头像并生成缩略图，返回 "sha256:<哈希>" 引用；不是可解码的图片时返回空字符串
+    QString store(const QByteArray& imageData, QString* errorMessage = nullptr);
+
+    bool contains(const QString& hash) const;
+    // 读取指定尺寸的缩略图；尺寸不在 thumbnailSizes() 中时取不小于它的最近尺寸
+    QByteArray thumbnail(const QString& hash, int size) const;
+
+private:
+    QString directoryFor(const QString& hash) const;
+    QString originalPath(const QString& hash) const;
+    QString thumbnailPath(const QString& hash, int size) const;
+    bool writeThumbnails(const QString& hash, const QByteArray& imageData, QString* errorMessage) const;
+
+    QString m_rootPath;
+};
+
+#endif // AVATARSTORE_H
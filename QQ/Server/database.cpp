@@ -31,9 +31,39 @@ bool DatabaseManager::connectToDatabase(const QString& dbPath)
     }
 
     qDebug() << "Database connected successfully!";
+    ensureFileBlobSchema();
     return true;
 }
 
+void DatabaseManager::ensureFileBlobSchema()
+{
+    // 旧数据库没有文件库和投递标识相关的表和列，连接时补上
+    QSqlQuery query;
+    if (!query.exec("CREATE TABLE IF NOT EXISTS file_blobs ("
+                    "hash CHAR(64) PRIMARY KEY, "
+                    "file_size INTEGER NOT NULL, "
+                    "ref_count INTEGER NOT NULL DEFAULT 0, "
+                    "created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP)")) {
+        qDebug() << "Create file_blobs failed:" << query.lastError().text();
+    }
+
+    bool hasFileHash = false;
+    bool hasDeliveryKey = false;
+    if (query.exec("PRAGMA table_info(messages)")) {
+        while (query.next()) {
+            const QString column = query.value(1).toString();
+            hasFileHash = hasFileHash || column == "file_hash";
+            hasDeliveryKey = hasDeliveryKey || column == "delivery_key";
+        }
+    }
+    if (!hasFileHash && !query.exec("ALTER TABLE messages ADD COLUMN file_hash CHAR(64)")) {
+        qDebug() << "Add messages.file_hash failed:" << query.lastError().text();
+    }
+    if (!hasDeliveryKey && !query.exec("ALTER TABLE messages ADD COLUMN delivery_key VARCHAR(40)")) {
+        qDebug() << "Add messages.delivery_key failed:" << query.lastError().text();
+    }
+}
+
 void DatabaseManager::closeDatabase()
 {
     if (m_database.isOpen()) {
@@ -187,29 +217,125 @@ QList<MessageInfo> DatabaseManager::getMessageList(int user1Id, int user2Id)
 {
     QList<MessageInfo> messageList;
 
+    QSharedPointer<MessageCursor> cursor = openMessageCursor(user1Id, user2Id);
+    if (!cursor) {
+        return messageList;
+    }
+
+    qDebug() << "Found messages between user" << user1Id << "and user" << user2Id << ":";
+    MessageInfo message;
+    while (cursor->next(message)) {
+        messageList.append(message);
+
+        qDebug() << "Message:" << message.content << "From:" << message.senderId << "To:" << message.receiverId;
+    }
+
+    return messageList;
+}
+
+QSharedPointer<MessageCursor> DatabaseManager::openMessageCursor(int user1Id, int user2Id, bool newestFirst)
+{
     if (!m_database.isOpen()) {
         qDebug() << "Database is not open";
+        return QSharedPointer<MessageCursor>();
+    }
+
+    QSharedPointer<MessageCursor> cursor(new MessageCursor(m_database, user1Id, user2Id, newestFirst));
+    if (!cursor->isValid()) {
+        return QSharedPointer<MessageCursor>();
+    }
+    return cursor;
+}
+
+int DatabaseManager::latestMessageId()
+{
+    if (!m_database.isOpen()) {
+        return 0;
+    }
+    if (m_latestMessageId >= 0) {
+        return m_latestMessageId;
+    }
+
+    QSqlQuery query("SELECT COALESCE(MAX(message_id), 0) FROM messages");
+    if (!query.next()) {
+        qDebug() << "Query latest message id failed:" << query.lastError().text();
+        return 0;
+    }
+    m_latestMessageId = query.value(0).toInt();
+    return m_latestMessageId;
+}
+
+QList<MessageInfo> DatabaseManager::getMessagesSince(int userId, int afterMessageId, int limit,
+                                                     const QSet<QString>& excludedKeys)
+{
+    QList<MessageInfo> messageList;
+    if (!m_database.isOpen()) {
         return messageList;
     }
 
     QSqlQuery query;
+    query.prepare(
+        "SELECT message_id, sender_id, receiver_id, content_type, content, file_name, file_size, "
+        "strftime('%Y-%m-%d %H:%M:%S', send_time) as send_time, delivery_key "
+        "FROM messages "
+        "WHERE message_id > :afterId AND (sender_id = :userId OR receiver_id = :userId) "
+        "ORDER BY message_id DESC LIMIT :limit");
+    query.bindValue(":afterId", afterMessageId);
+    query.bindValue(":userId", userId);
+    // 被排除的消息不占名额
+    query.bindValue(":limit", limit + excludedKeys.size());
+    if (!query.exec()) {
+        qDebug() << "Query messages since" << afterMessageId << "failed:" << query.lastError().text();
+        return messageList;
+    }
+
+    while (query.next()) {
+        MessageInfo message;
+        message.messageId = query.value(0).toInt();
+        message.senderId = query.value(1).toInt();
+        message.receiverId = query.value(2).toInt();
+        message.contentType = query.value(3).toInt();
+        message.content = query.value(4).toString();
+        message.fileName = query.value(5).toString();
+        message.fileSize = query.value(6).toLongLong();
+        message.sendTime = query.value(7).toString();
+        const QString deliveryKey = query.value(8).toString();
+        if (!deliveryKey.isEmpty() && excludedKeys.contains(deliveryKey)) {
+            continue;
+        }
+        messageList.prepend(message);
+        if (messageList.size() >= limit) {
+            break;
+        }
+    }
+    return messageList;
+}
+
+QList<MessageInfo> DatabaseManager::getConversationSince(int user1Id, int user2Id, int afterMessageId, int limit)
+{
+    QList<MessageInfo> messageList;
+    if (!m_database.isOpen()) {
+        return messageList;
+    }
+
+    QSqlQuery query;
+    query.setForwardOnly(true);
     query.prepare(
         "SELECT message_id, sender_id, receiver_id, content_type, content, file_name, file_size, "
         "strftime('%Y-%m-%d %H:%M:%S', send_time) as send_time "
         "FROM messages "
-        "WHERE (sender_id = :user1Id AND receiver_id = :user2Id) "
-        "OR (sender_id = :user2Id AND receiver_id = :user1Id) "
-        "ORDER BY send_time ASC"
-        );
+        "WHERE message_id > :afterId "
+        "AND ((sender_id = :user1Id AND receiver_id = :user2Id) OR (sender_id = :user2Id AND receiver_id = :user1Id)) "
+        "ORDER BY message_id ASC LIMIT :limit");
+    query.bindValue(":afterId", afterMessageId);
     query.bindValue(":user1Id", user1Id);
     query.bindValue(":user2Id", user2Id);
-
+    query.bindValue(":limit", limit);
     if (!query.exec()) {
-        qDebug() << "Get message list failed:" << query.lastError().text();
+        qDebug() << "Query conversation since" << afterMessageId << "failed:" << query.lastError().text();
         return messageList;
     }
 
-    qDebug() << "Found messages between user" << user1Id << "and user" << user2Id << ":";
     while (query.next()) {
         MessageInfo message;
         message.messageId = query.value(0).toInt();
@@ -221,25 +347,65 @@ QList<MessageInfo> DatabaseManager::getMessageList(int user1Id, int user2Id)
         message.fileSize = query.value(6).toLongLong();
         message.sendTime = query.value(7).toString();
         messageList.append(message);
+    }
+    return messageList;
+}
 
-        qDebug() << "Message:" << message.content << "From:" << message.senderId << "To:" << message.receiverId;
+// MessageCursor 实现
+MessageCursor::MessageCursor(const QSqlDatabase& database, int user1Id, int user2Id, bool newestFirst)
+    : m_query(database)
+{
+    // 只向前遍历，SQLite驱动不必缓存已读过的行
+    m_query.setForwardOnly(true);
+    m_query.prepare(QString(
+        "SELECT message_id, sender_id, receiver_id, content_type, content, file_name, file_size, "
+        "strftime('%Y-%m-%d %H:%M:%S', send_time) as send_time "
+        "FROM messages "
+        "WHERE (sender_id = :user1Id AND receiver_id = :user2Id) "
+        "OR (sender_id = :user2Id AND receiver_id = :user1Id) "
+        "ORDER BY send_time %1, message_id %1"
+        ).arg(newestFirst ? "DESC" : "ASC"));
+    m_query.bindValue(":user1Id", user1Id);
+    m_query.bindValue(":user2Id", user2Id);
+
+    m_valid = m_query.exec();
+    if (!m_valid) {
+        qDebug() << "Get message list failed:" << m_query.lastError().text();
     }
+}
 
-    return messageList;
+bool MessageCursor::next(MessageInfo& message)
+{
+    if (!m_valid || !m_query.next()) {
+        return false;
+    }
+
+    message.messageId = m_query.value(0).toInt();
+    message.senderId = m_query.value(1).toInt();
+    message.receiverId = m_query.value(2).toInt();
+    message.contentType = m_query.value(3).toInt();
+    message.content = m_query.value(4).toString();
+    message.fileName = m_query.value(5).toString();
+    message.fileSize = m_query.value(6).toLongLong();
+    message.sendTime = m_query.value(7).toString();
+    return true;
 }
 
 bool DatabaseManager::saveMessage(int senderId, int receiverId, int contentType,
                                   const QString& content, const QString& fileName,
-                                  qint64 fileSize)
+                                  qint64 fileSize, const QString& fileHash, const QString& deliveryKey)
 {
     if (!m_database.isOpen()) {
         return false;
     }
 
+    // file_hash 只记下消息对应的内容，引用计数由中转文件入库和送达时维护
     QSqlQuery query;
     query.prepare(
-        "INSERT INTO messages (sender_id, receiver_id, content_type, content, file_name, file_size, send_time) "
-        "VALUES (:senderId, :receiverId, :contentType, :content, :fileName, :fileSize, datetime('now'))"
+        "INSERT INTO messages (sender_id, receiver_id, content_type, content, file_name, file_size, file_hash, "
+        "delivery_key, send_time) "
+        "VALUES (:senderId, :receiverId, :contentType, :content, :fileName, :fileSize, :fileHash, "
+        ":deliveryKey, datetime('now'))"
         );
     query.bindValue(":senderId", senderId);
     query.bindValue(":receiverId", receiverId);
@@ -247,12 +413,81 @@ bool DatabaseManager::saveMessage(int senderId, int receiverId, int contentType,
     query.bindValue(":content", content);
     query.bindValue(":fileName", fileName);
     query.bindValue(":fileSize", fileSize);
+    query.bindValue(":fileHash", fileHash.isEmpty() ? QVariant() : QVariant(fileHash));
+    query.bindValue(":deliveryKey", deliveryKey.isEmpty() ? QVariant() : QVariant(deliveryKey));
 
     if (!query.exec()) {
         qDebug() << "Save message failed:" << query.lastError().text();
         return false;
     }
+    const int messageId = query.lastInsertId().toInt();
+
+    if (m_latestMessageId >= 0) {
+        m_latestMessageId = qMax(m_latestMessageId, messageId);
+    }
+    return true;
+}
+
+bool DatabaseManager::addFileReference(const QString& hash, qint64 fileSize)
+{
+    QSqlQuery query;
+    query.prepare(
+        "INSERT INTO file_blobs (hash, file_size, ref_count) VALUES (:hash, :fileSize, 1) "
+        "ON CONFLICT(hash) DO UPDATE SET ref_count = ref_count + 1"
+        );
+    query.bindValue(":hash", hash);
+    query.bindValue(":fileSize", fileSize);
+    if (!query.exec()) {
+        qDebug() << "Add file reference failed:" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
 
+bool DatabaseManager::releaseFileReference(const QString& hash)
+{
+    QSqlQuery query;
+    query.prepare("UPDATE file_blobs SET ref_count = ref_count - 1 WHERE hash = :hash AND ref_count > 0");
+    query.bindValue(":hash", hash);
+    if (!query.exec()) {
+        qDebug() << "Release file reference failed:" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+int DatabaseManager::fileReferenceCount(const QString& hash)
+{
+    QSqlQuery query;
+    query.prepare("SELECT ref_count FROM file_blobs WHERE hash = :hash");
+    query.bindValue(":hash", hash);
+    if (!query.exec()) {
+        // 查询失败时当作仍被引用，不能据此删除文件
+        qDebug() << "Query file reference failed:" << query.lastError().text();
+        return -1;
+    }
+    return query.next() ? query.value(0).toInt() : 0;
+}
+
+bool DatabaseManager::removeFileBlob(const QString& hash)
+{
+    QSqlQuery query;
+    query.prepare("DELETE FROM file_blobs WHERE hash = :hash AND ref_count <= 0");
+    query.bindValue(":hash", hash);
+    if (!query.exec()) {
+        qDebug() << "Remove file blob failed:" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool DatabaseManager::clearFileReferences()
+{
+    QSqlQuery query;
+    if (!query.exec("UPDATE file_blobs SET ref_count = 0")) {
+        qDebug() << "Clear file references failed:" << query.lastError().text();
+        return false;
+    }
     return true;
 }
 
@@ -8,9 +8,26 @@
 #include <QDebug>
 #include <QString>
 #include <QList>
+#include <QSet>
+#include <QSharedPointer>
 
 #include "userinfo.h"
 
+// 聊天记录游标：只向前逐条读取查询结果，不把整个会话一次读入内存
+class MessageCursor
+{
+public:
+    MessageCursor(const QSqlDatabase& database, int user1Id, int user2Id, bool newestFirst = false);
+
+    bool isValid() const { return m_valid; }
+    // 读取下一条消息，没有更多时返回false
+    bool next(MessageInfo& message);
+
+private:
+    QSqlQuery m_query;
+    bool m_valid = false;
+};
+
 class DatabaseManager : public QObject
 {
     Q_OBJECT
@@ -37,10 +54,32 @@ public:
     // 获取聊天记录
     QList<MessageInfo> getMessageList(int user1Id, int user2Id);
 
-    // 保存消息
+    // 打开聊天记录游标，供分块流式发送；newestFirst 为true时从最新一条往前读；失败时返回空指针
+    QSharedPointer<MessageCursor> openMessageCursor(int user1Id, int user2Id, bool newestFirst = false);
+
+    // 当前最大的消息ID，没有消息时为0；第一次查询数据库，之后随 saveMessage 更新，可以频繁调用
+    int latestMessageId();
+    // 与该用户有关、ID大于 afterMessageId 的消息，最多取最新的 limit 条，按ID升序返回；
+    // 投递标识在 excludedKeys 中的消息（客户端已经经UDP收到）不返回
+    QList<MessageInfo> getMessagesSince(int userId, int afterMessageId, int limit,
+                                        const QSet<QString>& excludedKeys = QSet<QString>());
+    // 两人之间ID大于 afterMessageId 的消息，按ID升序最多取 limit 条
+    QList<MessageInfo> getConversationSince(int user1Id, int user2Id, int afterMessageId, int limit);
+
+    // 保存消息；fileHash 是经服务器中转的文件内容的SHA-256，只作记录，不计入文件库的引用
+    // deliveryKey 是发送方UDP通道的投递标识，续连时据此排除对方已经直接收到的消息
     bool saveMessage(int senderId, int receiverId, int contentType,
                      const QString& content, const QString& fileName = "",
-                     qint64 fileSize = 0);
+                     qint64 fileSize = 0, const QString& fileHash = QString(),
+                     const QString& deliveryKey = QString());
+
+    // 文件库的引用计数：每个引用该内容的中转文件（<传输ID>.info）计一次，
+    // 内容核对过、已在文件库中时才增加，送达或过期删除时减少，为0的由定期清理删除
+    bool addFileReference(const QString& hash, qint64 fileSize);
+    bool releaseFileReference(const QString& hash);
+    int fileReferenceCount(const QString& hash);   // 没有记录时为0，查询失败时为-1
+    bool removeFileBlob(const QString& hash);      // 只删除计数已经为0的记录
+    bool clearFileReferences();                    // 启动时按中转目录重新计数前清零
 
     // 搜索用户
     QList<UserInfo> searchUsers(int userId, const QString& keyword, bool excludeFriends = true);
@@ -58,7 +97,10 @@ private:
     DatabaseManager(const DatabaseManager&) = delete;
     DatabaseManager& operator=(const DatabaseManager&) = delete;
 
+    void ensureFileBlobSchema();
+
     QSqlDatabase m_database;
+    int m_latestMessageId = -1;   // -1 表示还没有从数据库读取
 };
 
 #endif // DATABASE_H
@@ -0,0 +1,392 @@
+#include "filerelay.h"
+
+#include <QRandomGenerator>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QtEndian>
+#include <QDebug>
+#include "chunkhash.h"
+#include "filetransfer.h"
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#endif
+
+namespace {
+
+// 等待持有证明的时间
+constexpr int ProofTimeoutMs = 30 * 1000;
+
+#ifndef Q_OS_LINUX
+// 没有 sendfile 时经用户空间转发，发送缓冲区超过该值时暂停读文件
+constexpr qint64 SendWatermark = 1024 * 1024;
+#endif
+
+} // namespace
+
+bool RelayFileInfo::save(const QString& path) const
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+    // 文件名可以含有'|'，下载令牌单独放在第二行，旧格式的文件照样能读
+    file.write(QString("%1|%2|%3|%4|%5|%6\n%7\n")
+                   .arg(transferId)
+                   .arg(senderId)
+                   .arg(receiverId)
+                   .arg(fileSize)
+                   .arg(contentHash, fileName, fetchToken)
+                   .toUtf8());
+    return true;
+}
+
+bool RelayFileInfo::load(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    // 文件名放在最后，其中可以含有'|'
+    const QStringList parts = QString::fromUtf8(file.readLine()).trimmed().split('|');
+    if (parts.size() < 6) {
+        return false;
+    }
+    transferId = parts[0];
+    senderId = parts[1].toInt();
+    receiverId = parts[2].toInt();
+    fileSize = parts[3].toLongLong();
+    contentHash = parts[4];
+    fileName = parts.mid(5).join('|');
+    fetchToken = QString::fromLatin1(file.readLine()).trimmed();
+    return true;
+}
+
+RelayForwarder::RelayForwarder(QTcpSocket *socket, QObject *parent)
+    : QObject(parent)
+    , m_socket(socket)
+{
+    m_socket->setParent(this);
+    connect(m_socket, &QTcpSocket::readyRead, this, &RelayForwarder::onReadyRead);
+    connect(m_socket, &QTcpSocket::bytesWritten, this, &RelayForwarder::pump);
+    connect(m_socket, &QTcpSocket::disconnected, this, &RelayForwarder::onDisconnected);
+}
+
+bool RelayForwarder::start(const RelayFileInfo& info, const QString& dataPath, const QByteArray& buffered)
+{
+    m_info = info;
+    m_file.setFileName(dataPath);
+    if (!m_file.open(QIODevice::ReadOnly) || m_file.size() != m_info.fileSize) {
+        return false;
+    }
+
+    QFile sums(dataPath + ".sum");
+    if (!sums.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const QByteArray data = sums.readAll();
+    const qint64 expectedChunks = (m_info.fileSize + FileTransfer::ChunkSize - 1) / FileTransfer::ChunkSize;
+    if (data.size() != expectedChunks * qint64(sizeof(quint64))) {
+        return false;
+    }
+    const uchar* p = reinterpret_cast<const uchar*>(data.constData());
+    for (qint64 i = 0; i < expectedChunks; ++i) {
+        m_chunkHashes.append(qFromLittleEndian<quint64>(p + i * sizeof(quint64)));
+    }
+
+    // 接收方看到的就是一次普通的文件传输
+    m_socket->write(QString("FILE_OFFER|%1|%2|%3|%4\n")
+                        .arg(m_info.transferId)
+                        .arg(m_info.senderId)
+                        .arg(m_info.fileName)
+                        .arg(m_info.fileSize)
+                        .toUtf8());
+    m_socket->flush();
+
+    m_reader.append(buffered);
+    processBuffered();
+    return true;
+}
+
+void RelayForwarder::onReadyRead()
+{
+    m_reader.append(m_socket->readAll());
+    processBuffered();
+}
+
+void RelayForwarder::processBuffered()
+{
+    QStringList parts;
+    while (m_reader.readLine(parts)) {
+        const QString command = parts.value(0);
+        if (command == "FILE_RESUME" && parts.size() == 3 && parts[1] == m_info.transferId) {
+            // 接收方只在块边界上续传或回退
+            const qint64 offset = parts[2].toLongLong();
+            if (offset < 0 || offset > m_info.fileSize || offset % FileTransfer::ChunkSize != 0) {
+                fail("无效的续传位置");
+                return;
+            }
+            m_endQueued = false;
+            if (m_chunkRemaining > 0) {
+                // 正在写的块必须写完，接收方会丢弃它
+                m_rewindTo = offset;
+            } else {
+                m_offset = offset;
+            }
+            pump();
+        } else if (command == "FILE_DONE") {
+            m_done = true;
+            emit finished(m_info.transferId, m_info.receiverId);
+            m_socket->disconnectFromHost();
+            return;
+        } else if (command == "FILE_FAIL") {
+            fail(parts.value(2, "接收方拒绝了文件"));
+            return;
+        }
+    }
+}
+
+void RelayForwarder::pump()
+{
+    if (m_done || m_offset < 0) {
+        return;
+    }
+#ifdef Q_OS_LINUX
+    // 直接写套接字前，Qt 缓冲区中的 FILE_OFFER 必须先写完，bytesWritten 会再次触发
+    if (m_socket->bytesToWrite() > 0) {
+        return;
+    }
+#endif
+
+    while (true) {
+        if (!m_pending.isEmpty() && !writePending()) {
+            return;
+        }
+        if (m_chunkRemaining > 0 && !writeChunkData()) {
+            return;
+        }
+        if (m_done) {
+            return;
+        }
+
+        if (m_rewindTo >= 0) {
+            m_offset = m_rewindTo;
+            m_rewindTo = -1;
+        }
+        if (m_offset >= m_info.fileSize) {
+            if (m_endQueued) {
+                return;
+            }
+            m_endQueued = true;
+            m_pending = QString("FILE_END|%1|%2\n")
+                            .arg(m_info.transferId, ChunkHash::toHex(ChunkHash::digest(m_chunkHashes)))
+                            .toUtf8();
+            continue;
+        }
+
+        // 令牌不足时整块推迟，已经开始写的块不受影响
+        const qint64 length = qMin(FileTransfer::ChunkSize, m_info.fileSize - m_offset);
+        const int delay = TokenBucket::delayMs(m_buckets);
+        if (delay > 0) {
+            if (!m_throttled) {
+                m_throttled = true;
+                QTimer::singleShot(delay, this, [this]() {
+                    m_throttled = false;
+                    pump();
+                });
+            }
+            return;
+        }
+        TokenBucket::consume(m_buckets, length);
+        const quint64 hash = m_chunkHashes.value(qsizetype(m_offset / FileTransfer::ChunkSize));
+        m_pending = QString("FILE_CHUNK|%1|%2|%3\n")
+                        .arg(m_offset)
+                        .arg(length)
+                        .arg(ChunkHash::toHex(hash))
+                        .toUtf8();
+        m_chunkOffset = m_offset;
+        m_chunkRemaining = length;
+        m_offset += length;
+    }
+}
+
+bool RelayForwarder::writePending()
+{
+#ifdef Q_OS_LINUX
+    while (!m_pending.isEmpty()) {
+        const ssize_t written = ::send(int(m_socket->socketDescriptor()), m_pending.constData(),
+                                       size_t(m_pending.size()), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                waitWritable();
+            } else {
+                fail(QString("发送失败: %1").arg(qt_error_string(errno)));
+            }
+            return false;
+        }
+        m_pending.remove(0, written);
+    }
+#else
+    m_socket->write(m_pending);
+    m_pending.clear();
+#endif
+    return true;
+}
+
+bool RelayForwarder::writeChunkData()
+{
+#ifdef Q_OS_LINUX
+    while (m_chunkRemaining > 0) {
+        // 由内核从页缓存直接拷贝到套接字，不经过用户空间缓冲区
+        off_t position = off_t(m_chunkOffset);
+        const ssize_t sent = ::sendfile(int(m_socket->socketDescriptor()), m_file.handle(),
+                                        &position, size_t(m_chunkRemaining));
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                waitWritable();
+            } else {
+                fail(QString("转发文件失败: %1").arg(qt_error_string(errno)));
+            }
+            return false;
+        }
+        if (sent == 0) {
+            fail("中转文件被截断");
+            return false;
+        }
+        m_chunkOffset += sent;
+        m_chunkRemaining -= sent;
+    }
+#else
+    QByteArray buffer;
+    while (m_chunkRemaining > 0) {
+        if (m_socket->bytesToWrite() >= SendWatermark) {
+            return false;   // bytesWritten 时继续
+        }
+        buffer.resize(m_chunkRemaining);
+        if (!m_file.seek(m_chunkOffset) || m_file.read(buffer.data(), buffer.size()) != buffer.size()) {
+            fail("读取中转文件失败");
+            return false;
+        }
+        m_socket->write(buffer);
+        m_chunkOffset += buffer.size();
+        m_chunkRemaining = 0;
+    }
+#endif
+    return true;
+}
+
+void RelayForwarder::waitWritable()
+{
+    // 套接字发送缓冲区满了，可写时继续；此时 Qt 自己的写通知是关闭的
+    if (!m_writeNotifier) {
+        m_writeNotifier = new QSocketNotifier(m_socket->socketDescriptor(), QSocketNotifier::Write, this);
+        connect(m_writeNotifier, &QSocketNotifier::activated, this, [this]() {
+            m_writeNotifier->setEnabled(false);
+            pump();
+        });
+    }
+    m_writeNotifier->setEnabled(true);
+}
+
+void RelayForwarder::fail(const QString& reason)
+{
+    if (m_done) {
+        return;
+    }
+    m_done = true;
+    emit failed(m_info.transferId, reason);
+    m_socket->abort();
+}
+
+void RelayForwarder::onDisconnected()
+{
+    if (m_writeNotifier) {
+        m_writeNotifier->setEnabled(false);
+    }
+    deleteLater();
+}
+
+ContentProof::ContentProof(QTcpSocket *socket, const QString& transferId, const QString& blobPath, qint64 fileSize,
+                           QObject *parent)
+    : QObject(parent)
+    , m_socket(socket)
+    , m_transferId(transferId)
+    , m_blobPath(blobPath)
+    , m_fileSize(fileSize)
+{
+    m_socket->setParent(this);
+    connect(m_socket, &QTcpSocket::readyRead, this, &ContentProof::onReadyRead);
+    connect(m_socket, &QTcpSocket::disconnected, this, &QObject::deleteLater);
+    m_timeout.setSingleShot(true);
+    m_timeout.setInterval(ProofTimeoutMs);
+    connect(&m_timeout, &QTimer::timeout, this, [this]() {
+        finish(false, "等待持有证明超时");
+    });
+}
+
+void ContentProof::start(const QByteArray& buffered)
+{
+    const qint64 length = qMin(m_fileSize, FileTransfer::MaxProofLength);
+    const qint64 offset = m_fileSize > length ? QRandomGenerator::system()->bounded(m_fileSize - length + 1) : 0;
+    quint32 words[4];
+    QRandomGenerator::system()->fillRange(words);
+    const QByteArray nonce = QByteArray(reinterpret_cast<const char*>(words), sizeof(words)).toHex();
+
+    m_expected = FileTransfer::contentProof(m_blobPath, offset, length, nonce);
+    if (m_expected.isEmpty()) {
+        finish(false, "文件库中的内容无法读取");
+        return;
+    }
+    m_socket->write(QString("FILE_CHALLENGE|%1|%2|%3|%4\n")
+                        .arg(m_transferId)
+                        .arg(offset)
+                        .arg(length)
+                        .arg(QString::fromLatin1(nonce))
+                        .toUtf8());
+    m_timeout.start();
+
+    m_reader.append(buffered);
+    processBuffered();
+}
+
+void ContentProof::onReadyRead()
+{
+    m_reader.append(m_socket->readAll());
+    processBuffered();
+}
+
+void ContentProof::processBuffered()
+{
+    QStringList parts;
+    while (!m_done && m_reader.readLine(parts)) {
+        if (parts.value(0) == "FILE_PROOF" && parts.size() == 3 && parts[1] == m_transferId) {
+            const bool ok = QByteArray::fromHex(parts[2].toLatin1()) == m_expected;
+            finish(ok, ok ? QString() : "持有证明不符");
+        }
+    }
+}
+
+void ContentProof::finish(bool ok, const QString& reason)
+{
+    if (m_done) {
+        return;
+    }
+    m_done = true;
+    m_timeout.stop();
+    if (ok) {
+        m_socket->write(QString("FILE_DONE|%1\n").arg(m_transferId).toUtf8());
+        emit verified();
+    } else {
+        m_socket->write(QString("FILE_FAIL|%1|%2\n").arg(m_transferId, reason).toUtf8());
+        emit failed(reason);
+    }
+    m_socket->disconnectFromHost();
+}
@@ -0,0 +1,114 @@
+#ifndef FILERELAY_H
+#define FILERELAY_H
+
+#include <QObject>
+#include <QFile>
+#include <QList>
+#include <QTcpSocket>
+#include <QTimer>
+#include "framescanner.h"
+#include "tokenbucket.h"
+
+class QSocketNotifier;
+
+// 中转文件的元数据，上传完成后保存在 <传输ID>.info
+// contentHash 不为空时文件内容在服务器文件库中，否则是中转目录下的 <传输ID>
+// fetchToken 随 FILE_AVAILABLE 发给接收方，FILE_FETCH 必须带上它
+struct RelayFileInfo
+{
+    QString transferId;
+    int senderId = 0;
+    int receiverId = 0;
+    QString fileName;
+    qint64 fileSize = 0;
+    QString contentHash;
+    QString fetchToken;
+
+    bool save(const QString& path) const;
+    bool load(const QString& path);
+};
+
+// 把服务器上保存的中转文件发给接收方，协议与点对点传输中的发送方相同
+// Linux 上文件内容用 sendfile() 直接从页缓存写入套接字，数据不经过用户空间；
+// 分块头部和校验值来自上传时保存的 .sum，转发时不再读取和计算文件内容
+class RelayForwarder : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RelayForwarder(QTcpSocket *socket, QObject *parent = nullptr);
+
+    // 发送 FILE_OFFER，等待接收方回复续传位置；dataPath 为文件内容，旁边是同名的 .sum
+    // 文件不存在或与元数据不符时返回false
+    bool start(const RelayFileInfo& info, const QString& dataPath, const QByteArray& buffered);
+
+    // 每块发送前按令牌桶等待，限制该连接和该用户的转发速率
+    void setBandwidthLimit(const QList<QSharedPointer<TokenBucket>>& buckets) { m_buckets = buckets; }
+
+signals:
+    void finished(const QString& transferId, int receiverId);
+    void failed(const QString& transferId, const QString& reason);
+
+private slots:
+    void onReadyRead();
+    void onDisconnected();
+
+private:
+    void processBuffered();
+    void pump();
+    bool writePending();       // 写出 m_pending 中的头部行，写不完时返回false
+    bool writeChunkData();     // 写出当前块剩余的数据，写不完时返回false
+    void waitWritable();
+    void fail(const QString& reason);
+
+    QTcpSocket *m_socket;
+    RelayFileInfo m_info;
+    QFile m_file;
+    QList<quint64> m_chunkHashes;
+    LineReader m_reader;
+    QSocketNotifier *m_writeNotifier = nullptr;
+    QList<QSharedPointer<TokenBucket>> m_buckets;
+    bool m_throttled = false;      // 限速等待中，定时器到期后继续
+
+    QByteArray m_pending;          // 待写出的头部行
+    qint64 m_offset = -1;          // 下一块的起始偏移，-1表示还在等待 FILE_RESUME
+    qint64 m_chunkOffset = 0;      // 当前块在文件中的偏移
+    qint64 m_chunkRemaining = 0;   // 当前块还没写出的字节数
+    qint64 m_rewindTo = -1;        // 当前块写完后回退到的偏移
+    bool m_endQueued = false;
+    bool m_done = false;
+};
+
+// 上传的文件在文件库中已有相同内容时，确认上传方确实持有该文件再跳过上传：
+// 随机选文件库中的一段内容和一个随机数，要求对方回复二者的SHA-256，只凭哈希值拿不到别人的文件
+class ContentProof : public QObject
+{
+    Q_OBJECT
+public:
+    ContentProof(QTcpSocket *socket, const QString& transferId, const QString& blobPath, qint64 fileSize,
+                 QObject *parent = nullptr);
+
+    // 发送 FILE_CHALLENGE；通过后回复 FILE_DONE，否则回复 FILE_FAIL，连接断开后自行释放
+    void start(const QByteArray& buffered);
+
+signals:
+    void verified();
+    void failed(const QString& reason);
+
+private slots:
+    void onReadyRead();
+
+private:
+    void processBuffered();
+    void finish(bool ok, const QString& reason = QString());
+
+    QTcpSocket *m_socket;
+    QString m_transferId;
+    QString m_blobPath;
+    qint64 m_fileSize;
+    QByteArray m_expected;
+    LineReader m_reader;
+    QTimer m_timeout;
+    bool m_done = false;
+};
+
+#endif // FILERELAY_H
@@ -0,0 +1,78 @@
+#include "filestore.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+
+FileStore::FileStore(const QString& rootPath)
+    : m_rootPath(rootPath)
+{
+    QDir().mkpath(m_rootPath);
+}
+
+QString FileStore::directoryFor(const QString& hash) const
+{
+    return m_rootPath + QLatin1Char('/') + hash.left(2);
+}
+
+QString FileStore::blobPath(const QString& hash) const
+{
+    return directoryFor(hash) + QLatin1Char('/') + hash;
+}
+
+bool FileStore::contains(const QString& hash) const
+{
+    // .sum 最后移入，作为“已完整保存”的标记
+    const QString path = blobPath(hash);
+    return QFile::exists(path) && QFile::exists(path + ".sum");
+}
+
+qint64 FileStore::size(const QString& hash) const
+{
+    return QFileInfo(blobPath(hash)).size();
+}
+
+bool FileStore::adopt(const QString& filePath, const QString& hash)
+{
+    if (contains(hash)) {
+        // 同时上传的相同文件，保留先入库的一份
+        QFile::remove(filePath);
+        QFile::remove(filePath + ".sum");
+        return true;
+    }
+
+    if (!QDir().mkpath(directoryFor(hash))) {
+        return false;
+    }
+    // 同一文件系统内改名，不复制文件内容
+    const QString target = blobPath(hash);
+    QFile::remove(target);
+    QFile::remove(target + ".sum");
+    return QFile::rename(filePath, target) && QFile::rename(filePath + ".sum", target + ".sum");
+}
+
+bool FileStore::remove(const QString& hash)
+{
+    // 先删 .sum，中途失败时 contains() 也不再认为内容完整
+    const QString path = blobPath(hash);
+    const bool sumRemoved = !QFile::exists(path + ".sum") || QFile::remove(path + ".sum");
+    const bool blobRemoved = !QFile::exists(path) || QFile::remove(path);
+    return sumRemoved && blobRemoved;
+}
+
+QStringList FileStore::hashes() const
+{
+    QSet<QString> result;
+    const QStringList prefixes = QDir(m_rootPath).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const QString& prefix : prefixes) {
+        const QStringList names = QDir(m_rootPath + QLatin1Char('/') + prefix).entryList(QDir::Files);
+        for (const QString& name : names) {
+            const QString hash = name.endsWith(".sum") ? name.chopped(4) : name;
+            if (hash.size() == 64 && hash.startsWith(prefix)) {
+                result.insert(hash);
+            }
+        }
+    }
+    return QStringList(result.cbegin(), result.cend());
+}
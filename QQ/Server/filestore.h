@@ -0,0 +1,33 @@
+#ifndef FILESTORE_H
+#define FILESTORE_H
+
+#include <QString>
+#include <QStringList>
+
+// 服务器文件库：中转的文件按内容的SHA-256保存，相同内容只存一份
+// 每个文件旁边保留上传时的分块校验值 <哈希>.sum，转发时直接使用
+// 目录结构：<根目录>/<哈希前两位>/<哈希>；引用计数记录在数据库 file_blobs 表中，由服务器维护
+class FileStore
+{
+public:
+    explicit FileStore(const QString& rootPath);
+
+    // 文件和分块校验值都已保存
+    bool contains(const QString& hash) const;
+    qint64 size(const QString& hash) const;
+    QString blobPath(const QString& hash) const;
+
+    // 把上传完成、已经校验过的文件及其 .sum 移入文件库；已有相同内容时删除传入的文件
+    bool adopt(const QString& filePath, const QString& hash);
+    // 删除文件及其 .sum，供清理不再被引用的内容
+    bool remove(const QString& hash);
+    // 文件库中的全部哈希（包括只剩一半的），供清理时逐个核对引用计数
+    QStringList hashes() const;
+
+private:
+    QString directoryFor(const QString& hash) const;
+
+    QString m_rootPath;
+};
+
+#endif // FILESTORE_H
@@ -1,9 +1,12 @@
 #include "mainwindow.h"
+#include "framecompression.h"
 #include <QApplication>
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+    // 程序目录下有共享字典时用于zstd压缩，客户端和服务器需使用同一份字典
+    FrameCompression::loadDictionary(QCoreApplication::applicationDirPath() + "/qq.dict");
     MainWindow w;
     w.show();
     return a.exec();
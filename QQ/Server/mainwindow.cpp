@@ -3,11 +3,73 @@
 #include <QMessageBox>
 #include <QDateTime>
 #include <QHostAddress>
+#include <QCoreApplication>
+#include <QDir>
+#include <QTimer>
+#include "filetransfer.h"
+
+namespace {
+
+// 每个聊天记录分块的消息条数
+constexpr int HistoryChunkSize = 100;
+// 发送缓冲区低于该字节数时才继续读取下一块；聊天消息直接写入，
+// 最多排在这么多聊天记录数据之后，传输聊天记录时新消息的延迟保持不变
+constexpr qint64 HistoryWriteWatermark = 64 * 1024;
+
+// 文件中转的默认限速，一个用户的大文件不会占满服务器带宽
+constexpr qint64 DefaultUserBandwidth = 8 * 1024 * 1024;
+constexpr qint64 DefaultConnectionBandwidth = 4 * 1024 * 1024;
+// 令牌桶最多积累的字节数，空闲后允许的突发量
+constexpr qint64 BandwidthBurst = 1024 * 1024;
+
+// 断线后续连令牌的有效期
+constexpr qint64 ResumeTokenLifetimeMs = 10 * 60 * 1000;
+// 续连时最多补发的消息条数，更早的由客户端打开会话时从聊天记录中取
+constexpr int MaxResumeMessages = 500;
+// 增量同步一次最多返回的消息条数，超过时按完整聊天记录分块重发
+constexpr int MaxSyncMessages = 1000;
+// 投递标识是 UDP通道ID.序号，超过该长度的视为无效
+constexpr int MaxDeliveryKeyLength = 40;
+// 中转文件的大小上限，超过的不签发上传令牌，接收时也不预先分配
+constexpr qint64 MaxRelayFileSize = 1024LL * 1024 * 1024;
+// 上传令牌最后一次使用后的有效期，足够发送方断线后重连续传
+constexpr qint64 UploadGrantLifetimeMs = 10 * 60 * 1000;
+// 接收方一直没有取走的中转文件保留的时长
+constexpr qint64 RelayRetentionMs = 30LL * 24 * 60 * 60 * 1000;
+// 这么久没有写入的未完成上传（.part）和没有登记的中转文件视为废弃
+constexpr qint64 StaleUploadMs = 24LL * 60 * 60 * 1000;
+// 清理中转目录和文件库的间隔
+constexpr int RelayCleanupIntervalMs = 60 * 60 * 1000;
+
+void appendMessageFields(QString& response, const MessageInfo& message)
+{
+    response += QString("|%1|%2|%3|%4|%5|%6|%7|%8")
+    .arg(message.messageId)
+        .arg(message.senderId)
+        .arg(message.receiverId)
+        .arg(message.contentType)
+        .arg(message.content)
+        .arg(message.fileName)
+        .arg(message.fileSize)
+        .arg(message.sendTime);
+}
+
+} // namespace
 
 ChatServer::ChatServer(QObject *parent)
     : QTcpServer(parent)
     , m_dbManager(nullptr)
+    , m_capabilities(Protocol::localCapabilities())
+    , m_avatarStore(QCoreApplication::applicationDirPath() + "/avatars")
+    , m_relayDirectory(QCoreApplication::applicationDirPath() + "/relay")
+    , m_fileStore(m_relayDirectory + "/blobs")
+    , m_userBandwidth(DefaultUserBandwidth)
+    , m_connectionBandwidth(DefaultConnectionBandwidth)
 {
+    QDir().mkpath(m_relayDirectory);
+    m_relayCleanupTimer = new QTimer(this);
+    m_relayCleanupTimer->setInterval(RelayCleanupIntervalMs);
+    connect(m_relayCleanupTimer, &QTimer::timeout, this, [this]() { cleanupRelayFiles(false); });
 }
 
 ChatServer::~ChatServer()
@@ -20,6 +82,31 @@ void ChatServer::setDatabaseManager(DatabaseManager* dbManager)
     m_dbManager = dbManager;
 }
 
+void ChatServer::setProtocolCapabilities(const Protocol::Capabilities& capabilities)
+{
+    m_capabilities = capabilities;
+}
+
+void ChatServer::setBandwidthLimits(qint64 userBytesPerSecond, qint64 connectionBytesPerSecond)
+{
+    // 只影响之后开始的传输
+    m_userBandwidth = userBytesPerSecond;
+    m_connectionBandwidth = connectionBytesPerSecond;
+    m_userBuckets.clear();
+}
+
+QList<QSharedPointer<TokenBucket>> ChatServer::transferBuckets(int userId)
+{
+    QSharedPointer<TokenBucket> userBucket = m_userBuckets.value(userId).toStrongRef();
+    if (!userBucket) {
+        userBucket.reset(new TokenBucket(m_userBandwidth, BandwidthBurst));
+        m_userBuckets.insert(userId, userBucket);
+    }
+    return QList<QSharedPointer<TokenBucket>>()
+           << userBucket
+           << QSharedPointer<TokenBucket>(new TokenBucket(m_connectionBandwidth, BandwidthBurst));
+}
+
 void ChatServer::stopServer()
 {
     // 关闭所有客户端连接
@@ -31,6 +118,7 @@ void ChatServer::stopServer()
         client->deleteLater();
     }
     clients.clear();
+    m_sessions.clear();
 
     // 停止监听
     if (isListening()) {
@@ -44,6 +132,11 @@ bool ChatServer::startServer(quint16 port)
         return true;
     }
 
+    // 第一次启动时按中转目录重新计算文件库的引用，之后定期清理
+    if (!m_relayCleanupTimer->isActive()) {
+        cleanupRelayFiles(true);
+        m_relayCleanupTimer->start();
+    }
     return listen(QHostAddress::Any, port);
 }
 
@@ -55,6 +148,7 @@ void ChatServer::incomingConnection(qintptr socketDescriptor)
 
     connect(client, &QTcpSocket::readyRead, this, &ChatServer::onReadyRead);
     connect(client, &QTcpSocket::disconnected, this, &ChatServer::onClientDisconnected);
+    connect(client, &QTcpSocket::bytesWritten, this, &ChatServer::onClientBytesWritten);
 
     QString message = QString("客户端已连接: %1:%2")
                           .arg(client->peerAddress().toString())
@@ -70,8 +164,26 @@ void ChatServer::onClientDisconnected()
                               .arg(client->peerAddress().toString())
                               .arg(client->peerPort());
         emit logMessage(message);
+
+        // 令牌保留一段时间，客户端重连后凭它恢复会话
+        const int userId = m_sessions.value(client).userId;
+        releaseResumeToken(client, true);
         clients.removeOne(client);
+        m_sessions.remove(client);
         client->deleteLater();
+
+        // 用户没有其他连接时标记为离线，续连时恢复
+        if (userId > 0 && m_dbManager && !findUserConnection(userId)) {
+            m_dbManager->updateUserStatus(userId, 0);
+        }
+    }
+}
+
+void ChatServer::onClientBytesWritten()
+{
+    QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
+    if (client) {
+        pumpHistoryStream(client);
     }
 }
 
@@ -80,17 +192,102 @@ void ChatServer::onReadyRead()
     QTcpSocket *client = qobject_cast<QTcpSocket*>(sender());
     if (!client) return;
 
-    QByteArray data = client->readAll();
-    QString message = QString::fromUtf8(data).trimmed();
+    // 每个连接一个行缓冲：新数据只扫描一次，同一次读到的多条请求依次处理
+    m_sessions[client].reader.append(client->readAll());
+    // 客户端此刻还连着，记下续连时补发消息的起点
+    m_sessions[client].contactMessageId = m_dbManager ? m_dbManager->latestMessageId() : 0;
+
+    QStringList parts;
+    bool utf8Valid = true;
+    while (true) {
+        // 处理请求可能导致连接断开，每次都重新查找会话
+        auto it = m_sessions.find(client);
+        if (it == m_sessions.end()) {
+            return;
+        }
+
+        // BIN帧：头部行之后紧跟指定字节数的二进制负载
+        if (it->pendingBinarySize >= 0) {
+            if (it->reader.pendingBytes() < it->pendingBinarySize) {
+                break;
+            }
+            const QString command = it->pendingBinaryCommand;
+            const QString tag = it->pendingBinaryTag;
+            const QByteArray payload = it->reader.readBytes(it->pendingBinarySize);
+            it->pendingBinarySize = -1;
+            setRequestTag(client, tag);
+            processBinaryRequest(client, command, payload);
+            setRequestTag(client, QString());
+            continue;
+        }
+
+        if (!it->reader.readLine(parts, &utf8Valid)) {
+            break;
+        }
+        it->sentTerminatedLine = true;
+        // 新客户端在请求前加 #ID，回复时原样带回，客户端据此匹配乱序到达的回复
+        QString tag;
+        if (utf8Valid && !parts.isEmpty() && parts[0].startsWith('#')) {
+            tag = parts.takeFirst();
+        }
+        if (utf8Valid && parts.size() == 3 && parts[0] == "BIN") {
+            // 客户端上传目前只有头像，负载上限按头像大小限制
+            const qint64 size = parts[2].toLongLong();
+            if (size < 0 || size > Protocol::MaxAvatarUploadSize) {
+                emit logMessage(QString("BIN请求长度超出上限，断开连接: %1字节").arg(size));
+                client->abort();
+                return;
+            }
+            it->pendingBinaryCommand = parts[1];
+            it->pendingBinaryTag = tag;
+            it->pendingBinarySize = size;
+            continue;
+        }
+        setRequestTag(client, tag);
+        processRequest(client, parts, utf8Valid);
+        setRequestTag(client, QString());
+    }
 
-    emit logMessage(QString("收到客户端消息: %1").arg(message));
+    ClientSession& session = m_sessions[client];
+    LineReader& reader = session.reader;
+
+    // 旧版客户端的登录、注册请求不带换行符，数据读完后把剩余部分当作一条完整请求；
+    // 发过带换行符请求的连接一定是新客户端，它的半行只是还没收全
+    if (!session.sentTerminatedLine && session.pendingBinarySize < 0 && client->bytesAvailable() == 0
+        && isUnterminatedLegacyRequest(reader)
+        && reader.takeUnterminated(parts, &utf8Valid)) {
+        processRequest(client, parts, utf8Valid);
+    }
+}
+
+bool ChatServer::isUnterminatedLegacyRequest(const LineReader& reader) const
+{
+    const QByteArray pending = reader.peek(9);
+    return pending.startsWith("LOGIN|") || pending.startsWith("REGISTER|");
+}
+
+Protocol::Settings ChatServer::protocolSettings(QTcpSocket* client) const
+{
+    auto it = m_sessions.constFind(client);
+    return it != m_sessions.cend() ? it->protocol : Protocol::Settings();
+}
+
+void ChatServer::processRequest(QTcpSocket* client, const QStringList& parts, bool utf8Valid)
+{
+    if (!utf8Valid) {
+        emit logMessage("收到非法UTF-8数据，已丢弃");
+        return;
+    }
+
+    emit logMessage(QString("收到客户端消息: %1").arg(parts.join('|')));
 
     // 解析消息格式：命令|参数1|参数2|...
-    QStringList parts = message.split("|");
     if (parts.size() > 0) {
         QString command = parts[0];
 
-        if (command == "LOGIN" && parts.size() == 3) {
+        if (command == "HELLO") {
+            handleHelloRequest(client, parts);
+        } else if (command == "LOGIN" && parts.size() == 3) {
             QString username = parts[1];
             QString password = parts[2];
 
@@ -113,31 +310,59 @@ void ChatServer::onReadyRead()
         } else if (command == "LOGOUT" && parts.size() == 2) {
             int userId = parts[1].toInt();
             handleLogoutRequest(client, userId);
-        } else if (command == "GET_MESSAGES" && parts.size() == 3) {
+        } else if (command == "RESUME" && (parts.size() == 4 || parts.size() == 5)) {
+            // 第五个字段是逗号分隔的投递标识，只看最近的若干条
+            QStringList keys = parts.value(4).split(',', Qt::SkipEmptyParts);
+            if (keys.size() > MaxResumeMessages) {
+                keys = keys.mid(keys.size() - MaxResumeMessages);
+            }
+            handleResumeRequest(client, parts[1], quint16(parts[2].toUInt()), quint16(parts[3].toUInt()),
+                                QSet<QString>(keys.cbegin(), keys.cend()));
+        } else if (command == "GET_MESSAGES" && (parts.size() == 3 || parts.size() == 4)) {
             int user1Id = parts[1].toInt();
             int user2Id = parts[2].toInt();
+            // 可选的第四个字段 desc：从最新的消息开始发送，客户端先显示最近一屏
+            bool newestFirst = parts.size() == 4 && parts[3] == "desc";
             emit logMessage(QString("收到聊天记录请求: 用户1=%1, 用户2=%2").arg(user1Id).arg(user2Id));
-            handleMessageListRequest(client, user1Id, user2Id);
+            handleMessageListRequest(client, user1Id, user2Id, newestFirst);
+        } else if (command == "SYNC_MESSAGES" && parts.size() == 4) {
+            int user1Id = parts[1].toInt();
+            int user2Id = parts[2].toInt();
+            int afterMessageId = parts[3].toInt();
+            emit logMessage(QString("收到聊天记录同步请求: 用户1=%1, 用户2=%2, 起始消息ID=%3")
+                                .arg(user1Id).arg(user2Id).arg(afterMessageId));
+            handleSyncMessagesRequest(client, user1Id, user2Id, afterMessageId);
         } else if (command == "SAVE_MESSAGE" && parts.size() >= 4) {
             int senderId = parts[1].toInt();
             int receiverId = parts[2].toInt();
             int contentType = parts[3].toInt();
 
-            if (contentType == 1 && parts.size() >= 5) {
+            // 支持续连的客户端在文本内容前带投递标识（可以为空）
+            const bool keyed = protocolSettings(client).sessionResume();
+            if (contentType == 1 && parts.size() >= (keyed ? 6 : 5)) {
                 // 文本消息
-                QString content = parts[4];
+                QString deliveryKey = keyed ? parts[4] : QString();
+                QString content = parts[keyed ? 5 : 4];
+                if (deliveryKey.size() > MaxDeliveryKeyLength) {
+                    deliveryKey.clear();
+                }
                 emit logMessage(QString("收到保存消息请求: 发送者=%1, 接收者=%2, 内容=%3")
                                     .arg(senderId).arg(receiverId).arg(content));
-                handleSaveMessageRequest(client, senderId, receiverId, contentType, content);
+                handleSaveMessageRequest(client, senderId, receiverId, contentType, content,
+                                         QString(), 0, QString(), deliveryKey);
             } else if (contentType == 2 && parts.size() >= 7) {
                 // 文件消息
                 QString fileName = parts[4];
                 qint64 fileSize = parts[5].toLongLong();
-                QString filePath = parts[6];
+                // 经服务器中转的文件第七个字段是内容引用 "sha256:<哈希>"，消息记录引用文件库中的内容
+                QString fileHash;
+                if (!Protocol::parseContentReference(parts[6], fileHash)) {
+                    fileHash.clear();
+                }
                 QString content = QString("文件: %1").arg(fileName);
                 emit logMessage(QString("收到保存文件消息请求: 发送者=%1, 接收者=%2, 文件名=%3")
                                     .arg(senderId).arg(receiverId).arg(fileName));
-                handleSaveMessageRequest(client, senderId, receiverId, contentType, content, fileName, fileSize);
+                handleSaveMessageRequest(client, senderId, receiverId, contentType, content, fileName, fileSize, fileHash);
             }
         } else if (command == "SEARCH_USERS" && parts.size() == 3) {
             // 处理搜索用户请求
@@ -145,6 +370,30 @@ void ChatServer::onReadyRead()
             QString keyword = parts[2];
             emit logMessage(QString("收到搜索用户请求: 用户ID=%1, 关键词=%2").arg(userId).arg(keyword));
             handleSearchUsersRequest(client, userId, keyword);
+        } else if (command == "RELAY_UPLOAD" && parts.size() == 4) {
+            handleRelayUploadRequest(client, parts[1], parts[2].toInt(), parts[3].toLongLong());
+        } else if (command == "FILE_OFFER" && parts.size() >= 6 && parts.size() <= 8) {
+            // 只有带接收者ID的上传才由服务器中转，第七个字段是内容哈希，第八个字段是上传令牌
+            startRelayUpload(client, parts);
+        } else if (command == "REGISTER_ENDPOINT" && parts.size() == 4) {
+            handleRegisterEndpoint(client, parts[1].toInt(), quint16(parts[2].toUInt()), quint16(parts[3].toUInt()));
+        } else if (command == "PEER_LOOKUP" && parts.size() == 2) {
+            handlePeerLookup(client, parts[1].toInt());
+        } else if (command == "PEER_FILE" && parts.size() == 5) {
+            handlePeerFileOffer(client, parts[1].toInt(), parts[2], parts[3], parts[4].toLongLong());
+        } else if (command == "PEER_FILE_ANSWER" && parts.size() == 4) {
+            handlePeerFileAnswer(client, parts[1].toInt(), parts[2], parts[3]);
+        } else if (command == "RELAY_MESSAGE" && parts.size() >= 5) {
+            // 负载是 发送者|接收者|消息，消息中可以含有'|'
+            handleRelayMessage(client, parts[1].toInt(), parts[2], parts[3], parts.mid(4).join('|'));
+        } else if (command == "FILE_JOIN" && (parts.size() == 4 || parts.size() == 5)) {
+            // 并行上传的其他段，第五个字段是上传令牌
+            startRelayJoin(client, parts);
+        } else if (command == "FILE_FETCH" && (parts.size() == 2 || parts.size() == 3)) {
+            // 第三个字段是 FILE_AVAILABLE 中下发的下载令牌，旧客户端不带令牌，下载会被拒绝
+            startRelayDownload(client, parts[1], parts.value(2));
+        } else if (command == "GET_AVATAR" && parts.size() == 3) {
+            handleAvatarRequest(client, parts[1], parts[2].toInt());
         } else if (command == "ADD_FRIEND" && parts.size() == 3) {
             // 新增：处理添加好友请求
             int userId = parts[1].toInt();
@@ -155,6 +404,41 @@ void ChatServer::onReadyRead()
     }
 }
 
+void ChatServer::processBinaryRequest(QTcpSocket* client, const QString& command, const QByteArray& payload)
+{
+    emit logMessage(QString("收到二进制请求: %1，%2字节").arg(command).arg(payload.size()));
+
+    if (command == "AVATAR_UPLOAD") {
+        handleAvatarUpload(client, payload);
+    } else {
+        emit logMessage(QString("未知的二进制请求: %1").arg(command));
+    }
+}
+
+void ChatServer::handleHelloRequest(QTcpSocket* client, const QStringList& parts)
+{
+    Protocol::Capabilities remote;
+    if (!Protocol::parseHello(parts, remote)) {
+        sendResponse(client, "HELLO_FAIL|无法解析的握手请求");
+        return;
+    }
+
+    // 协商结果只影响之后的响应，请求按顺序处理，客户端总是先收到HELLO_OK
+    Protocol::Settings settings = Protocol::negotiate(m_capabilities, remote);
+    m_sessions[client].protocol = settings;
+    sendResponse(client, Protocol::buildHelloReply(settings));
+
+    emit logMessage(QString("协议协商完成: %1:%2 版本=%3, 分帧=%4, 编码=%5, 压缩=%6, 最大帧=%7, 功能位=%8")
+                        .arg(client->peerAddress().toString())
+                        .arg(client->peerPort())
+                        .arg(settings.version)
+                        .arg(Protocol::framingName(settings.framing))
+                        .arg(Protocol::encodingName(settings.encoding))
+                        .arg(Protocol::compressionName(settings.compression))
+                        .arg(settings.maxFrameSize)
+                        .arg(settings.features, 0, 16));
+}
+
 void ChatServer::handleLoginRequest(QTcpSocket* client, const QString& username, const QString& password)
 {
     if (!m_dbManager) {
@@ -172,9 +456,17 @@ void ChatServer::handleLoginRequest(QTcpSocket* client, const QString& username,
                                .arg(userInfo.nickname)
                                .arg(userInfo.avatarPath)
                                .arg(userInfo.status);
+        // 支持续连的客户端断线后凭令牌恢复会话，不必重新登录
+        if (protocolSettings(client).sessionResume()) {
+            response += QString("|%1").arg(issueResumeToken(client, userInfo.userId));
+        }
         sendResponse(client, response);
+        m_sessions[client].userId = userInfo.userId;
 
         emit logMessage(QString("用户 '%1'(ID:%2) 登录成功").arg(userInfo.nickname).arg(userInfo.userId));
+
+        // 离线期间中转过来的文件
+        notifyPendingRelayFiles(client, userInfo.userId);
         emit userLoginSuccess(userInfo.nickname);
 
         // 等待客户端请求好友列表（由客户端主动请求）
@@ -195,8 +487,16 @@ void ChatServer::handleRegisterRequest(QTcpSocket* client, const QString& userna
         return;
     }
 
+    // 头像库引用必须指向已上传的头像，否则退回默认头像
+    QString storedAvatarPath = avatarPath;
+    QString avatarHash;
+    if (Protocol::parseContentReference(avatarPath, avatarHash) && !m_avatarStore.contains(avatarHash)) {
+        emit logMessage(QString("注册请求引用了不存在的头像: %1").arg(avatarPath));
+        storedAvatarPath = "default_avatar.png";
+    }
+
     // 调用DatabaseManager的registerUser函数
-    if (m_dbManager->registerUser(username, password, nickname, avatarPath)) {
+    if (m_dbManager->registerUser(username, password, nickname, storedAvatarPath)) {
         // 注册成功
         sendResponse(client, "REGISTER_SUCCESS");
 
@@ -213,6 +513,546 @@ void ChatServer::handleRegisterRequest(QTcpSocket* client, const QString& userna
     }
 }
 
+QByteArray ChatServer::detachClient(QTcpSocket* client)
+{
+    // 把已经读入缓冲、还没处理的数据一并交给新的处理对象
+    QByteArray buffered;
+    auto it = m_sessions.find(client);
+    if (it != m_sessions.end()) {
+        buffered = it->reader.readBytes(it->reader.pendingBytes());
+        m_sessions.erase(it);
+    }
+    clients.removeOne(client);
+    client->disconnect(this);
+    return buffered;
+}
+
+QTcpSocket* ChatServer::findUserConnection(int userId) const
+{
+    // 优先选择登记过端点的聊天连接，其次是登录连接
+    QTcpSocket *found = nullptr;
+    for (auto it = m_sessions.cbegin(); it != m_sessions.cend(); ++it) {
+        if (it->userId == userId) {
+            if (it->udpPort != 0) {
+                return it.key();
+            }
+            found = it.key();
+        }
+    }
+    return found;
+}
+
+void ChatServer::handleRegisterEndpoint(QTcpSocket* client, int userId, quint16 udpPort, quint16 filePort)
+{
+    // 只能为本连接已登录的用户登记，用户ID由 LOGIN 或 RESUME 设置，不信任请求中的ID
+    auto it = m_sessions.find(client);
+    if (it == m_sessions.end() || it->userId <= 0 || it->userId != userId) {
+        emit logMessage(QString("拒绝端点登记: 连接未以用户ID=%1登录").arg(userId));
+        return;
+    }
+    // 登录和续连时已经通知过待收的中转文件，这里只记录端口
+    it->udpPort = udpPort;
+    it->filePort = filePort;
+    emit logMessage(QString("用户ID=%1登记端点: %2 UDP=%3 文件=%4")
+                        .arg(userId)
+                        .arg(client->peerAddress().toString())
+                        .arg(udpPort)
+                        .arg(filePort));
+}
+
+void ChatServer::handlePeerLookup(QTcpSocket* client, int peerId)
+{
+    // 只把端点告诉好友
+    const int userId = m_sessions.value(client).userId;
+    if (userId <= 0 || !m_dbManager || !m_dbManager->isFriend(userId, peerId)) {
+        sendResponse(client, QString("PEER_OFFLINE|%1").arg(peerId));
+        return;
+    }
+
+    QTcpSocket *peer = findUserConnection(peerId);
+    const ClientSession peerSession = peer ? m_sessions.value(peer) : ClientSession();
+    if (!peer || peerSession.udpPort == 0) {
+        sendResponse(client, QString("PEER_OFFLINE|%1").arg(peerId));
+        return;
+    }
+    QString response = QString("PEER_ENDPOINT|%1|%2|%3|%4")
+                           .arg(peerId)
+                           .arg(peer->peerAddress().toString())
+                           .arg(peerSession.udpPort)
+                           .arg(peerSession.filePort);
+    // 新客户端据对方的版本决定用可靠UDP通道还是旧的单个报文
+    if (protocolSettings(client).messageRelay()) {
+        response += QString("|%1").arg(peerSession.protocol.version);
+    }
+    sendResponse(client, response);
+}
+
+void ChatServer::handlePeerFileOffer(QTcpSocket* client, int receiverId, const QString& transferId,
+                                     const QString& fileName, qint64 fileSize)
+{
+    // 服务器只在好友之间转达，令牌由接收方生成，经 PEER_FILE_ANSWER 交给发送方
+    const int senderId = m_sessions.value(client).userId;
+    QTcpSocket *target = findUserConnection(receiverId);
+    QString error;
+    if (senderId <= 0) {
+        error = "请先登录";
+    } else if (!FileTransfer::isValidTransferId(transferId) || fileName.isEmpty() || fileSize < 0) {
+        error = "无效的文件信息";
+    } else if (!m_dbManager || !m_dbManager->isFriend(senderId, receiverId)) {
+        error = "对方不是好友";
+    } else if (!target || m_sessions.value(target).filePort == 0 || !protocolSettings(target).peerFileOffers()) {
+        error = "对方不在线或不支持直连发送";
+    }
+    if (!error.isEmpty()) {
+        sendResponse(client, QString("PEER_FILE_FAIL|%1|%2").arg(transferId, error));
+        return;
+    }
+    sendNotification(target, QString("PEER_FILE_OFFER|%1|%2|%3|%4")
+                                 .arg(senderId)
+                                 .arg(transferId, QFileInfo(fileName).fileName())
+                                 .arg(fileSize));
+    sendResponse(client, QString("PEER_FILE_SENT|%1").arg(transferId));
+}
+
+void ChatServer::handlePeerFileAnswer(QTcpSocket* client, int senderId, const QString& transferId,
+                                      const QString& token)
+{
+    const int receiverId = m_sessions.value(client).userId;
+    if (receiverId <= 0 || !FileTransfer::isValidTransferId(transferId)
+        || !m_dbManager || !m_dbManager->isFriend(receiverId, senderId)) {
+        return;
+    }
+    QTcpSocket *target = findUserConnection(senderId);
+    if (!target || !protocolSettings(target).peerFileOffers()) {
+        emit logMessage(QString("直连文件的答复无法送达: 用户ID=%1不在线").arg(senderId));
+        return;
+    }
+    sendNotification(target, QString("PEER_FILE_ANSWER|%1|%2|%3").arg(receiverId).arg(transferId, token));
+}
+
+void ChatServer::handleRelayMessage(QTcpSocket* client, int receiverId, const QString& channelId,
+                                    const QString& sequence, const QString& payload)
+{
+    // UDP走不通时的兜底，服务器只转发，不保存消息内容（消息已由 SAVE_MESSAGE 保存）
+    const int userId = m_sessions.value(client).userId;
+    if (userId <= 0 || !m_dbManager || !m_dbManager->isFriend(userId, receiverId)) {
+        return;
+    }
+    QTcpSocket *target = findUserConnection(receiverId);
+    if (!target || !protocolSettings(target).messageRelay()) {
+        emit logMessage(QString("中转消息失败: 用户ID=%1不在线或不支持").arg(receiverId));
+        return;
+    }
+    // 接收方按负载里的发送者显示消息，发送者和接收者按会话和核对过的好友重新填写，消息正文原样转发
+    const QStringList fields = payload.split('|');
+    if (fields.size() < 3 || fields[0].toInt() != userId || fields[1].toInt() != receiverId) {
+        emit logMessage(QString("中转消息的发送者或接收者与会话不符，已丢弃: 用户ID=%1").arg(userId));
+        return;
+    }
+    const QString text = fields.mid(2).join('|');
+    sendNotification(target, QString("MESSAGE_RELAYED|%1|%2|%3|%4|")
+                                 .arg(channelId, sequence, QString::number(userId), QString::number(receiverId))
+                             + text);
+}
+
+void ChatServer::handleRelayUploadRequest(QTcpSocket* client, const QString& transferId, int receiverId,
+                                          qint64 fileSize)
+{
+    const int senderId = m_sessions.value(client).userId;
+    QString error;
+    if (senderId <= 0) {
+        error = "请先登录";
+    } else if (!FileTransfer::isValidTransferId(transferId) || fileSize < 0) {
+        error = "无效的文件信息";
+    } else if (fileSize > MaxRelayFileSize) {
+        error = "文件过大";
+    } else if (!m_dbManager || !m_dbManager->isFriend(senderId, receiverId)) {
+        error = "对方不是好友";
+    } else if (relayTransferTaken(transferId, senderId, receiverId)) {
+        error = "传输ID冲突";
+    }
+    if (!error.isEmpty()) {
+        emit logMessage(QString("拒绝签发中转上传令牌: 用户ID=%1, %2").arg(senderId).arg(error));
+        sendResponse(client, QString("RELAY_UPLOAD_FAIL|%1|%2").arg(transferId, error));
+        return;
+    }
+
+    // 顺便清理过期的令牌
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (auto it = m_uploadGrants.begin(); it != m_uploadGrants.end();) {
+        it = it->expiresAt < now ? m_uploadGrants.erase(it) : std::next(it);
+    }
+
+    // 同一上传重新申请时换发新令牌，旧令牌作废
+    RelayUploadGrant grant;
+    grant.token = Protocol::randomToken();
+    grant.senderId = senderId;
+    grant.receiverId = receiverId;
+    grant.fileSize = fileSize;
+    grant.expiresAt = now + UploadGrantLifetimeMs;
+    m_uploadGrants.insert(transferId, grant);
+    sendResponse(client, QString("RELAY_UPLOAD_OK|%1|%2").arg(transferId, grant.token));
+}
+
+bool ChatServer::useUploadGrant(const QString& transferId, const QString& token, RelayUploadGrant& grant)
+{
+    auto it = m_uploadGrants.find(transferId);
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (it == m_uploadGrants.end() || it->expiresAt < now || !Protocol::tokenEquals(it->token, token)) {
+        return false;
+    }
+    it->expiresAt = now + UploadGrantLifetimeMs;
+    grant = *it;
+    return true;
+}
+
+void ChatServer::rejectTransferConnection(QTcpSocket* client, const QString& transferId, const QString& reason)
+{
+    connect(client, &QTcpSocket::disconnected, client, &QObject::deleteLater);
+    client->write(QString("FILE_FAIL|%1|%2\n").arg(transferId, reason).toUtf8());
+    client->disconnectFromHost();
+}
+
+void ChatServer::startRelayUpload(QTcpSocket* client, const QStringList& parts)
+{
+    emit logMessage(QString("收到中转文件上传: 发送者=%1, 接收者=%2, 文件名=%3, 大小=%4")
+                        .arg(parts[2], parts[5], parts[3], parts[4]));
+
+    const QString transferId = parts[1];
+    const QByteArray buffered = detachClient(client);
+
+    // 上传连接没有登录，发送者、接收者和大小都以聊天连接上签发令牌时核对过的为准
+    RelayUploadGrant grant;
+    if (!useUploadGrant(transferId, parts.value(7), grant) || grant.senderId != parts[2].toInt()
+        || grant.receiverId != parts[5].toInt() || grant.fileSize != parts[4].toLongLong()) {
+        emit logMessage(QString("中转文件上传令牌无效，拒绝上传: %1").arg(transferId));
+        rejectTransferConnection(client, transferId, "上传令牌无效");
+        return;
+    }
+    if (!m_dbManager || !m_dbManager->isFriend(grant.senderId, grant.receiverId)) {
+        emit logMessage(QString("中转文件的接收者不是好友，拒绝上传: %1").arg(transferId));
+        rejectTransferConnection(client, transferId, "对方不是好友");
+        return;
+    }
+    if (relayTransferTaken(transferId, grant.senderId, grant.receiverId)) {
+        emit logMessage(QString("中转文件ID已被占用，拒绝上传: %1").arg(transferId));
+        rejectTransferConnection(client, transferId, "传输ID冲突");
+        return;
+    }
+
+    QString contentHash;
+    if (!Protocol::parseContentReference(parts.value(6), contentHash)) {
+        contentHash.clear();
+    }
+    if (!contentHash.isEmpty() && m_fileStore.contains(contentHash)
+        && m_fileStore.size(contentHash) == grant.fileSize) {
+        // 文件库中已有相同内容：发送方证明确实持有文件后不必上传，直接把引用交给接收方
+        RelayFileInfo info;
+        info.transferId = transferId;
+        info.senderId = grant.senderId;
+        info.receiverId = grant.receiverId;
+        info.fileName = parts[3];
+        info.fileSize = grant.fileSize;
+        info.contentHash = contentHash;
+
+        // 核对期间先占一个引用，清理时不会删掉正在使用的内容；通过后这个引用归新的中转文件
+        if (!m_dbManager->addFileReference(contentHash, info.fileSize)) {
+            rejectTransferConnection(client, transferId, "服务器内部错误");
+            return;
+        }
+        ContentProof *proof = new ContentProof(client, info.transferId, m_fileStore.blobPath(contentHash),
+                                               info.fileSize, this);
+        connect(proof, &ContentProof::verified, this, [this, info]() {
+            emit logMessage(QString("文件库已有相同文件，跳过上传: %1").arg(info.fileName));
+            m_uploadGrants.remove(info.transferId);
+            registerRelayFile(info);
+        });
+        connect(proof, &ContentProof::failed, this, [this, info](const QString& reason) {
+            emit logMessage(QString("文件去重被拒绝: %1, %2").arg(info.fileName, reason));
+            if (m_dbManager) {
+                m_dbManager->releaseFileReference(info.contentHash);
+            }
+        });
+        proof->start(buffered);
+        return;
+    }
+
+    FileReceiver *receiver = new FileReceiver(client, m_relayDirectory, this);
+    receiver->setStoreByTransferId(true);
+    receiver->setMaxFileSize(MaxRelayFileSize);
+    // 声称的内容哈希核对无误后才回复 FILE_DONE，不符时上传方收到 FILE_FAIL
+    receiver->setVerifyContentHash(true);
+    receiver->setBandwidthLimit(transferBuckets(grant.senderId));
+    connect(receiver, &FileReceiver::finished, this,
+            [this, receiver, grant](const QString& fileName, const QString& savedPath) {
+        m_uploadGrants.remove(receiver->transferId());
+        RelayFileInfo info;
+        info.transferId = receiver->transferId();
+        info.senderId = grant.senderId;
+        info.receiverId = grant.receiverId;
+        info.fileName = fileName;
+        info.fileSize = receiver->fileSize();
+        // 带内容哈希的上传在回复 FILE_DONE 前已由 FileReceiver 核对过；没有哈希的旧客户端，文件留在中转目录
+        QString contentHash;
+        // 先占引用再入库，清理时不会删掉刚入库的内容
+        if (Protocol::parseContentReference(receiver->contentHash(), contentHash) && m_dbManager
+            && m_dbManager->addFileReference(contentHash, info.fileSize)) {
+            if (m_fileStore.adopt(savedPath, contentHash)) {
+                info.contentHash = contentHash;
+            } else {
+                m_dbManager->releaseFileReference(contentHash);
+                emit logMessage(QString("中转文件移入文件库失败: %1").arg(info.fileName));
+            }
+        }
+        registerRelayFile(info);
+    });
+    connect(receiver, &FileReceiver::failed, this, [this](const QString& fileName, const QString& reason) {
+        // 令牌保留到过期，发送方重连后继续上传
+        emit logMessage(QString("中转文件上传失败: %1, %2").arg(fileName, reason));
+    });
+    receiver->accept(parts, buffered);
+}
+
+bool ChatServer::relayTransferTaken(const QString& transferId, int senderId, int receiverId) const
+{
+    if (!FileTransfer::isValidTransferId(transferId)) {
+        return false;
+    }
+    auto grant = m_uploadGrants.constFind(transferId);
+    if (grant != m_uploadGrants.constEnd() && grant->expiresAt >= QDateTime::currentMSecsSinceEpoch()
+        && (grant->senderId != senderId || grant->receiverId != receiverId)) {
+        return true;
+    }
+    RelayFileInfo info;
+    if (!info.load(m_relayDirectory + QLatin1Char('/') + transferId + ".info")) {
+        return false;
+    }
+    return info.senderId != senderId || info.receiverId != receiverId;
+}
+
+void ChatServer::startRelayJoin(QTcpSocket* client, const QStringList& parts)
+{
+    const QByteArray buffered = detachClient(client);
+    // 只能加入凭令牌开始的上传，并行的各条连接计入同一个发送者的限额
+    RelayUploadGrant grant;
+    if (!useUploadGrant(parts[1], parts.value(4), grant)) {
+        emit logMessage(QString("并行上传连接的令牌无效: %1").arg(parts[1]));
+        rejectTransferConnection(client, parts[1], "上传令牌无效");
+        return;
+    }
+    FileReceiver *receiver = new FileReceiver(client, m_relayDirectory, this);
+    receiver->setStoreByTransferId(true);
+    receiver->setBandwidthLimit(transferBuckets(grant.senderId));
+    receiver->accept(parts, buffered);
+}
+
+void ChatServer::registerRelayFile(const RelayFileInfo& uploaded)
+{
+    // 每次投递生成新的下载令牌，只通知给接收方，凭令牌才能取文件
+    RelayFileInfo info = uploaded;
+    info.fetchToken = Protocol::randomToken();
+    const QString basePath = m_relayDirectory + QLatin1Char('/') + info.transferId;
+    if (!info.save(basePath + ".info")) {
+        emit logMessage(QString("中转文件信息保存失败: %1").arg(basePath));
+        if (!info.contentHash.isEmpty() && m_dbManager) {
+            m_dbManager->releaseFileReference(info.contentHash);
+        }
+        return;
+    }
+    // 未送达标记，接收方下载完成后删除
+    QFile marker(basePath + ".pending");
+    marker.open(QIODevice::WriteOnly);
+    emit logMessage(QString("中转文件上传完成: %1 (%2字节)").arg(info.fileName).arg(info.fileSize));
+
+    if (QTcpSocket *target = findUserConnection(info.receiverId)) {
+        notifyRelayFile(target, info);
+    }
+}
+
+void ChatServer::startRelayDownload(QTcpSocket* client, const QString& transferId, const QString& fetchToken)
+{
+    const QByteArray buffered = detachClient(client);
+    RelayForwarder *forwarder = new RelayForwarder(client, this);
+    connect(forwarder, &RelayForwarder::finished, this, [this](const QString& transferId, int receiverId) {
+        // 已经送达的文件不再保留，文件库中的内容没有其他引用时由定期清理删除
+        emit logMessage(QString("中转文件已送达: %1, 接收者=%2").arg(transferId).arg(receiverId));
+        retireRelayFile(transferId);
+    });
+    connect(forwarder, &RelayForwarder::failed, this, [this](const QString& transferId, const QString& reason) {
+        emit logMessage(QString("中转文件转发失败: %1, %2").arg(transferId, reason));
+    });
+
+    RelayFileInfo info;
+    const QString basePath = m_relayDirectory + QLatin1Char('/') + transferId;
+    const bool found = FileTransfer::isValidTransferId(transferId) && info.load(basePath + ".info")
+                       && Protocol::tokenEquals(info.fetchToken, fetchToken);
+    const QString dataPath = info.contentHash.isEmpty() ? basePath : m_fileStore.blobPath(info.contentHash);
+    forwarder->setBandwidthLimit(transferBuckets(info.receiverId));
+    if (!found || !forwarder->start(info, dataPath, buffered)) {
+        emit logMessage(QString("请求的中转文件不存在或下载令牌不符: %1").arg(transferId));
+        client->write(QString("FILE_FAIL|%1|文件不存在\n").arg(transferId).toUtf8());
+        client->disconnectFromHost();
+    }
+}
+
+void ChatServer::retireRelayFile(const QString& transferId)
+{
+    const QString basePath = m_relayDirectory + QLatin1Char('/') + transferId;
+    RelayFileInfo info;
+    const bool loaded = info.load(basePath + ".info");
+    QFile::remove(basePath + ".info");
+    QFile::remove(basePath + ".pending");
+    if (loaded && !info.contentHash.isEmpty()) {
+        if (m_dbManager) {
+            m_dbManager->releaseFileReference(info.contentHash);
+        }
+    } else {
+        // 没有内容哈希的中转文件保存在中转目录下
+        QFile::remove(basePath);
+        QFile::remove(basePath + ".sum");
+    }
+}
+
+void ChatServer::cleanupRelayFiles(bool rebuildReferences)
+{
+    if (!m_dbManager) {
+        return;
+    }
+    const QDateTime now = QDateTime::currentDateTime();
+    QDir directory(m_relayDirectory);
+
+    // 送达后留下的（旧版本不删除）和过期没取走的中转文件
+    if (rebuildReferences) {
+        m_dbManager->clearFileReferences();
+    }
+    QSet<QString> registered;
+    const QStringList infoFiles = directory.entryList(QStringList() << "*.info", QDir::Files);
+    for (const QString& name : infoFiles) {
+        const QString transferId = name.chopped(5);
+        const QString basePath = m_relayDirectory + QLatin1Char('/') + transferId;
+        const bool expired = QFileInfo(basePath + ".info").lastModified().msecsTo(now) > RelayRetentionMs;
+        if (!QFile::exists(basePath + ".pending") || expired) {
+            if (rebuildReferences) {
+                // 计数已经清零，不再减少
+                QFile::remove(basePath + ".info");
+                QFile::remove(basePath + ".pending");
+                QFile::remove(basePath);
+                QFile::remove(basePath + ".sum");
+            } else {
+                retireRelayFile(transferId);
+            }
+            emit logMessage(QString("清理中转文件: %1").arg(transferId));
+            continue;
+        }
+        registered.insert(transferId);
+        RelayFileInfo info;
+        if (rebuildReferences && info.load(basePath + ".info") && !info.contentHash.isEmpty()) {
+            m_dbManager->addFileReference(info.contentHash, info.fileSize);
+        }
+    }
+
+    // 没有登记的中转文件（入库失败或登记前服务器退出）和长时间没有继续的未完成上传
+    const QStringList files = directory.entryList(QDir::Files);
+    for (const QString& name : files) {
+        const QString transferId = name.section('.', 0, 0);
+        if (!FileTransfer::isValidTransferId(transferId) || registered.contains(transferId)
+            || m_uploadGrants.contains(transferId)) {
+            continue;
+        }
+        const QString path = m_relayDirectory + QLatin1Char('/') + name;
+        if (QFileInfo(path).lastModified().msecsTo(now) > StaleUploadMs) {
+            QFile::remove(path);
+        }
+    }
+
+    // 文件库中没有引用的内容；核对去重期间和入库后都先占了引用，不会删掉正在使用的
+    const QStringList hashes = m_fileStore.hashes();
+    int removed = 0;
+    for (const QString& hash : hashes) {
+        if (m_dbManager->fileReferenceCount(hash) == 0 && m_fileStore.remove(hash)) {
+            m_dbManager->removeFileBlob(hash);
+            ++removed;
+        }
+    }
+    if (removed > 0) {
+        emit logMessage(QString("清理文件库中不再引用的文件: %1个").arg(removed));
+    }
+}
+
+void ChatServer::notifyRelayFile(QTcpSocket* client, const RelayFileInfo& info)
+{
+    sendNotification(client, QString("FILE_AVAILABLE|%1|%2|%3|%4|%5")
+                             .arg(info.transferId)
+                             .arg(info.senderId)
+                             .arg(info.fileName)
+                             .arg(info.fileSize)
+                             .arg(info.fetchToken));
+}
+
+void ChatServer::notifyPendingRelayFiles(QTcpSocket* client, int userId)
+{
+    const QStringList pending = QDir(m_relayDirectory).entryList(QStringList() << "*.pending", QDir::Files);
+    for (const QString& name : pending) {
+        RelayFileInfo info;
+        const QString infoPath = m_relayDirectory + QLatin1Char('/') + name.chopped(8) + ".info";
+        if (!info.load(infoPath) || info.receiverId != userId) {
+            continue;
+        }
+        if (info.fetchToken.isEmpty()) {
+            // 升级前保存的中转文件没有下载令牌，补上后再通知
+            info.fetchToken = Protocol::randomToken();
+            if (!info.save(infoPath)) {
+                continue;
+            }
+        }
+        notifyRelayFile(client, info);
+    }
+}
+
+void ChatServer::handleAvatarUpload(QTcpSocket* client, const QByteArray& imageData)
+{
+    QString errorMessage;
+    const QString reference = m_avatarStore.store(imageData, &errorMessage);
+    if (reference.isEmpty()) {
+        sendResponse(client, QString("AVATAR_UPLOAD_FAIL|%1").arg(errorMessage));
+        emit logMessage(QString("头像保存失败: %1").arg(errorMessage));
+        return;
+    }
+
+    sendResponse(client, QString("AVATAR_UPLOADED|%1").arg(reference));
+    emit logMessage(QString("头像已保存: %1，%2字节").arg(reference).arg(imageData.size()));
+}
+
+void ChatServer::handleAvatarRequest(QTcpSocket* client, const QString& reference, int size)
+{
+    QString hash;
+    if (!Protocol::parseContentReference(reference, hash)) {
+        sendResponse(client, QString("AVATAR_FAIL|%1|无效的头像引用").arg(reference));
+        return;
+    }
+
+    // 缩略图是PNG，只能以BIN帧发送
+    if (protocolSettings(client).framing != Protocol::Framing::Frame) {
+        sendResponse(client, QString("AVATAR_FAIL|%1|需要二进制帧").arg(reference));
+        return;
+    }
+
+    const QByteArray image = m_avatarStore.thumbnail(hash, size);
+    if (image.isEmpty()) {
+        sendResponse(client, QString("AVATAR_FAIL|%1|头像不存在").arg(reference));
+        return;
+    }
+
+    // 负载：头像引用、请求的尺寸、PNG数据
+    BinaryWriter writer(image.size() + 80);
+    writer.writeString(reference);
+    writer.writeVarUInt(quint64(qMax(0, size)));
+    writer.writeBytes(image);
+    if (!sendBinaryResponse(client, "AVATAR", writer.data())) {
+        sendResponse(client, QString("AVATAR_FAIL|%1|头像过大").arg(reference));
+    }
+}
+
 void ChatServer::handleFriendListRequest(QTcpSocket* client, int userId)
 {
     if (!m_dbManager) {
@@ -232,16 +1072,132 @@ void ChatServer::handleLogoutRequest(QTcpSocket* client, int userId)
         m_dbManager->updateUserStatus(userId, 0);
         emit logMessage(QString("用户ID=%1已退出").arg(userId));
     }
+    // 客户端登出后保留连接供下次登录，这条连接不再代表该用户
+    releaseResumeToken(client, false);
+    auto it = m_sessions.find(client);
+    if (it != m_sessions.end()) {
+        it->userId = 0;
+        it->udpPort = 0;
+        it->filePort = 0;
+        it->history = HistoryStream();
+    }
     sendResponse(client, "LOGOUT_SUCCESS");
 }
 
-void ChatServer::handleMessageListRequest(QTcpSocket* client, int user1Id, int user2Id)
+QString ChatServer::issueResumeToken(QTcpSocket* client, int userId)
+{
+    releaseResumeToken(client, false);
+
+    // 顺便清理过期的令牌
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (auto it = m_resumeTickets.begin(); it != m_resumeTickets.end();) {
+        it = it->expiresAt > 0 && it->expiresAt <= now ? m_resumeTickets.erase(it) : std::next(it);
+    }
+
+    const QString token = Protocol::randomToken();
+
+    ResumeTicket ticket;
+    ticket.userId = userId;
+    m_resumeTickets.insert(token, ticket);
+    m_sessions[client].resumeToken = token;
+    return token;
+}
+
+void ChatServer::releaseResumeToken(QTcpSocket* client, bool keepForResume)
+{
+    auto it = m_sessions.find(client);
+    if (it == m_sessions.end() || it->resumeToken.isEmpty()) {
+        return;
+    }
+    const QString token = it->resumeToken;
+    it->resumeToken.clear();
+
+    auto ticket = m_resumeTickets.find(token);
+    if (ticket == m_resumeTickets.end()) {
+        return;
+    }
+    if (!keepForResume) {
+        m_resumeTickets.erase(ticket);
+        return;
+    }
+    // 服务器发现断线往往比真正断线晚，从最后一次收到客户端数据时算起补发
+    ticket->lastMessageId = it->contactMessageId;
+    ticket->expiresAt = QDateTime::currentMSecsSinceEpoch() + ResumeTokenLifetimeMs;
+}
+
+void ChatServer::handleResumeRequest(QTcpSocket* client, const QString& token, quint16 udpPort, quint16 filePort,
+                                     const QSet<QString>& deliveredKeys)
+{
+    if (!m_dbManager) {
+        sendResponse(client, "RESUME_FAIL|数据库未连接");
+        return;
+    }
+
+    auto ticketIt = m_resumeTickets.find(token);
+    if (ticketIt == m_resumeTickets.end()
+        || (ticketIt->expiresAt > 0 && ticketIt->expiresAt <= QDateTime::currentMSecsSinceEpoch())) {
+        if (ticketIt != m_resumeTickets.end()) {
+            m_resumeTickets.erase(ticketIt);
+        }
+        sendResponse(client, "RESUME_FAIL|会话已过期，请重新登录");
+        emit logMessage("续连失败: 令牌无效或已过期");
+        return;
+    }
+    ResumeTicket ticket = ticketIt.value();
+    m_resumeTickets.erase(ticketIt);
+
+    // 服务器可能还没发现旧连接已经断开：旧连接交出令牌后关闭，从最后一次收到它的数据时算起补发
+    QTcpSocket *staleClient = nullptr;
+    for (auto it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+        if (it.key() != client && it->resumeToken == token) {
+            it->resumeToken.clear();
+            staleClient = it.key();
+            if (ticket.lastMessageId < 0) {
+                ticket.lastMessageId = it->contactMessageId;
+            }
+            break;
+        }
+    }
+    if (ticket.lastMessageId < 0) {
+        ticket.lastMessageId = m_dbManager->latestMessageId();
+    }
+
+    // 恢复登录状态和端点，相当于 LOGIN 加 REGISTER_ENDPOINT
+    ClientSession& session = m_sessions[client];
+    session.userId = ticket.userId;
+    session.udpPort = udpPort;
+    session.filePort = filePort;
+    const QString newToken = issueResumeToken(client, ticket.userId);
+    if (staleClient) {
+        staleClient->abort();
+    }
+    m_dbManager->updateUserStatus(ticket.userId, 1);
+
+    // 一次请求的全部回复：新令牌、好友列表（含在线状态）、断线期间的消息
+    sendResponse(client, QString("RESUME_OK|%1|%2").arg(ticket.userId).arg(newToken));
+    sendFriendList(client, ticket.userId, m_dbManager->getFriendList(ticket.userId));
+    // 断线期间好友经UDP直接送到的消息客户端已经显示，按投递标识排除
+    const QList<MessageInfo> missed = m_dbManager->getMessagesSince(ticket.userId, ticket.lastMessageId,
+                                                                     MaxResumeMessages, deliveredKeys);
+    sendMissedMessages(client, ticket.userId, missed);
+    notifyPendingRelayFiles(client, ticket.userId);
+
+    emit logMessage(QString("用户ID=%1续连成功").arg(ticket.userId));
+}
+
+void ChatServer::handleMessageListRequest(QTcpSocket* client, int user1Id, int user2Id, bool newestFirst)
 {
     if (!m_dbManager) {
         sendResponse(client, "MESSAGES_LIST|0|数据库未连接");
         return;
     }
 
+    if (protocolSettings(client).streamedHistory()) {
+        startHistoryStream(client, user1Id, user2Id, newestFirst);
+        return;
+    }
+
+    // 旧版客户端只认识一次性返回的 MESSAGES_LIST
     QList<MessageInfo> messageList = m_dbManager->getMessageList(user1Id, user2Id);
     emit logMessage(QString("为用户ID=%1和%2查询聊天记录，找到%3条消息")
                         .arg(user1Id).arg(user2Id).arg(messageList.size()));
@@ -249,16 +1205,123 @@ void ChatServer::handleMessageListRequest(QTcpSocket* client, int user1Id, int u
     sendMessageList(client, user1Id, user2Id, messageList);
 }
 
+void ChatServer::handleSyncMessagesRequest(QTcpSocket* client, int user1Id, int user2Id, int afterMessageId)
+{
+    if (!m_dbManager) {
+        sendResponse(client, QString("MESSAGES_SINCE|%1|0").arg(user2Id));
+        return;
+    }
+
+    // 多取一条，判断客户端的缓存是否落后太多
+    const QList<MessageInfo> messageList =
+        m_dbManager->getConversationSince(user1Id, user2Id, afterMessageId, MaxSyncMessages + 1);
+    if (messageList.size() > MaxSyncMessages) {
+        emit logMessage(QString("用户ID=%1的本地缓存落后太多，改为发送完整聊天记录").arg(user1Id));
+        startHistoryStream(client, user1Id, user2Id, true);
+        return;
+    }
+
+    sendMessagesSince(client, user2Id, messageList);
+    emit logMessage(QString("已向用户ID=%1同步与%2的新消息，共%3条").arg(user1Id).arg(user2Id).arg(messageList.size()));
+}
+
+void ChatServer::startHistoryStream(QTcpSocket* client, int user1Id, int user2Id, bool newestFirst)
+{
+    auto it = m_sessions.find(client);
+    if (it == m_sessions.end()) {
+        return;
+    }
+
+    // 新请求直接替换未发完的旧请求，客户端按 MESSAGES_BEGIN 重新开始
+    HistoryStream stream;
+    stream.cursor = m_dbManager->openMessageCursor(user1Id, user2Id, newestFirst);
+    stream.peerId = user2Id;
+    stream.requestTag = it->requestTag;
+    it->history = stream;
+
+    sendResponse(client, QString("MESSAGES_BEGIN|%1").arg(user2Id));
+    if (!stream.cursor) {
+        sendResponse(client, QString("MESSAGES_END|%1|0").arg(user2Id));
+        return;
+    }
+
+    emit logMessage(QString("开始分块发送用户ID=%1和%2的聊天记录").arg(user1Id).arg(user2Id));
+    pumpHistoryStream(client);
+}
+
+void ChatServer::pumpHistoryStream(QTcpSocket* client)
+{
+    auto it = m_sessions.find(client);
+    if (it == m_sessions.end() || !it->history.cursor || it->history.pumping) {
+        return;
+    }
+
+    // 分块大多在之后的 bytesWritten 中发送，这时要带上发起请求时的ID
+    const QString previousTag = it->requestTag;
+    it->requestTag = it->history.requestTag;
+    writeHistoryChunks(client);
+    setRequestTag(client, previousTag);
+}
+
+void ChatServer::writeHistoryChunks(QTcpSocket* client)
+{
+    auto it = m_sessions.find(client);
+    it->history.pumping = true;
+
+    // 内存中只保留当前这一块；对端读得慢时等 bytesWritten 再继续
+    // 发送时flush可能同步触发信号修改会话，所以每块都重新查找会话
+    QList<MessageInfo> chunk;
+    chunk.reserve(HistoryChunkSize);
+    while (true) {
+        it = m_sessions.find(client);
+        if (it == m_sessions.end() || !it->history.cursor) {
+            return;
+        }
+
+        HistoryStream& stream = it->history;
+        if (client->state() != QAbstractSocket::ConnectedState
+            || client->bytesToWrite() >= HistoryWriteWatermark) {
+            stream.pumping = false;
+            return;
+        }
+
+        chunk.clear();
+        MessageInfo message;
+        while (chunk.size() < HistoryChunkSize && stream.cursor->next(message)) {
+            chunk.append(message);
+        }
+
+        const int peerId = stream.peerId;
+        stream.sentCount += chunk.size();
+        const int sentCount = stream.sentCount;
+        const bool finished = chunk.size() < HistoryChunkSize;
+        if (finished) {
+            stream = HistoryStream();
+        }
+
+        if (!chunk.isEmpty()) {
+            sendMessageChunk(client, peerId, chunk);
+        }
+        if (finished) {
+            sendResponse(client, QString("MESSAGES_END|%1|%2").arg(peerId).arg(sentCount));
+            emit logMessage(QString("聊天记录发送完成，共%1条消息").arg(sentCount));
+            return;
+        }
+    }
+}
+
 void ChatServer::handleSaveMessageRequest(QTcpSocket* client, int senderId, int receiverId,
                                           int contentType, const QString& content,
-                                          const QString& fileName, qint64 fileSize)
+                                          const QString& fileName, qint64 fileSize, const QString& fileHash,
+                                          const QString& deliveryKey)
 {
     if (!m_dbManager) {
         sendResponse(client, "MESSAGE_SAVED|FAIL|数据库未连接");
         return;
     }
 
-    if (m_dbManager->saveMessage(senderId, receiverId, contentType, content, fileName, fileSize)) {
+    if (m_dbManager->saveMessage(senderId, receiverId, contentType, content, fileName, fileSize, fileHash,
+                                 deliveryKey)) {
         sendResponse(client, "MESSAGE_SAVED|SUCCESS");
         emit logMessage(QString("消息保存成功: 发送者=%1, 接收者=%2").arg(senderId).arg(receiverId));
     } else {
@@ -307,6 +1370,12 @@ void ChatServer::handleAddFriendRequest(QTcpSocket* client, int userId, int frie
 
 void ChatServer::sendFriendList(QTcpSocket* client, int userId, const QList<UserInfo>& friendList)
 {
+    if (protocolSettings(client).binaryLists()
+        && sendBinaryResponse(client, "FRIEND_LIST", BinaryCodec::encodeUserList(friendList))) {
+        emit logMessage(QString("已向用户ID=%1发送好友列表，共%2个好友").arg(userId).arg(friendList.size()));
+        return;
+    }
+
     QString response = QString("FRIEND_LIST|%1").arg(friendList.size());
 
     for (const UserInfo& friendInfo : friendList) {
@@ -324,26 +1393,75 @@ void ChatServer::sendFriendList(QTcpSocket* client, int userId, const QList<User
 
 void ChatServer::sendMessageList(QTcpSocket* client, int user1Id, int user2Id, const QList<MessageInfo>& messageList)
 {
+    if (protocolSettings(client).binaryLists()
+        && sendBinaryResponse(client, "MESSAGES_LIST", BinaryCodec::encodeMessageList(messageList))) {
+        emit logMessage(QString("已向用户ID=%1发送聊天记录，共%2条消息").arg(user1Id).arg(messageList.size()));
+        return;
+    }
+
     QString response = QString("MESSAGES_LIST|%1").arg(messageList.size());
 
     for (const MessageInfo& message : messageList) {
-        response += QString("|%1|%2|%3|%4|%5|%6|%7|%8")
-        .arg(message.messageId)
-            .arg(message.senderId)
-            .arg(message.receiverId)
-            .arg(message.contentType)
-            .arg(message.content)
-            .arg(message.fileName)
-            .arg(message.fileSize)
-            .arg(message.sendTime);
+        appendMessageFields(response, message);
     }
 
     sendResponse(client, response);
     emit logMessage(QString("已向用户ID=%1发送聊天记录，共%2条消息").arg(user1Id).arg(messageList.size()));
 }
 
+void ChatServer::sendMessagesSince(QTcpSocket* client, int peerId, const QList<MessageInfo>& messageList)
+{
+    // 格式与聊天记录分块相同：会话对方ID + 按ID升序的消息
+    if (protocolSettings(client).binaryLists()
+        && sendBinaryResponse(client, "MESSAGES_SINCE", BinaryCodec::encodeMessageChunk(peerId, messageList))) {
+        return;
+    }
+
+    QString response = QString("MESSAGES_SINCE|%1|%2").arg(peerId).arg(messageList.size());
+    for (const MessageInfo& message : messageList) {
+        appendMessageFields(response, message);
+    }
+    sendResponse(client, response);
+}
+
+void ChatServer::sendMissedMessages(QTcpSocket* client, int userId, const QList<MessageInfo>& messageList)
+{
+    if (protocolSettings(client).binaryLists()
+        && sendBinaryResponse(client, "MISSED_MESSAGES", BinaryCodec::encodeMessageList(messageList))) {
+        emit logMessage(QString("已向用户ID=%1补发断线期间的消息，共%2条").arg(userId).arg(messageList.size()));
+        return;
+    }
+
+    QString response = QString("MISSED_MESSAGES|%1").arg(messageList.size());
+    for (const MessageInfo& message : messageList) {
+        appendMessageFields(response, message);
+    }
+    sendResponse(client, response);
+    emit logMessage(QString("已向用户ID=%1补发断线期间的消息，共%2条").arg(userId).arg(messageList.size()));
+}
+
+void ChatServer::sendMessageChunk(QTcpSocket* client, int peerId, const QList<MessageInfo>& messageList)
+{
+    if (protocolSettings(client).binaryLists()
+        && sendBinaryResponse(client, "MESSAGES_CHUNK", BinaryCodec::encodeMessageChunk(peerId, messageList))) {
+        return;
+    }
+
+    QString response = QString("MESSAGES_CHUNK|%1|%2").arg(peerId).arg(messageList.size());
+    for (const MessageInfo& message : messageList) {
+        appendMessageFields(response, message);
+    }
+    sendResponse(client, response);
+}
+
 void ChatServer::sendSearchResults(QTcpSocket* client, int userId, const QList<UserInfo>& userList)
 {
+    if (protocolSettings(client).binaryLists()
+        && sendBinaryResponse(client, "SEARCH_RESULTS", BinaryCodec::encodeUserList(userList))) {
+        emit logMessage(QString("已向用户ID=%1发送搜索结果，共%2个用户").arg(userId).arg(userList.size()));
+        return;
+    }
+
     QString response = QString("SEARCH_RESULTS|%1").arg(userList.size());
 
     for (const UserInfo& userInfo : userList) {
@@ -369,16 +1487,73 @@ void ChatServer::sendAddFriendResult(QTcpSocket* client, int userId, int friendI
     sendResponse(client, response);
 }
 
+void ChatServer::setRequestTag(QTcpSocket* client, const QString& tag)
+{
+    auto it = m_sessions.find(client);
+    if (it != m_sessions.end()) {
+        it->requestTag = tag;
+    }
+}
+
+void ChatServer::sendNotification(QTcpSocket* client, const QString& notification)
+{
+    // 推送可能发生在处理该连接自己的请求期间，不能带上那个请求的ID
+    const QString tag = m_sessions.value(client).requestTag;
+    setRequestTag(client, QString());
+    sendResponse(client, notification);
+    setRequestTag(client, tag);
+}
+
 void ChatServer::sendResponse(QTcpSocket* client, const QString& response)
 {
     if (client && client->state() == QAbstractSocket::ConnectedState) {
-        QByteArray data = (response + "\n").toUtf8();
+        const QString tag = m_sessions.value(client).requestTag;
+        QByteArray data = ((tag.isEmpty() ? response : tag + '|' + response) + "\n").toUtf8();
         client->write(data);
         client->flush();
         emit logMessage(QString("发送响应: %1").arg(response));
     }
 }
 
+bool ChatServer::sendBinaryResponse(QTcpSocket* client, const QString& command, const QByteArray& payload)
+{
+    const Protocol::Settings settings = protocolSettings(client);
+    if (payload.size() > settings.maxFrameSize) {
+        // 超出对端能接收的帧长，由调用方改用文本格式发送
+        emit logMessage(QString("二进制响应 %1 超过最大帧长: %2字节").arg(command).arg(payload.size()));
+        return false;
+    }
+
+    if (client && client->state() == QAbstractSocket::ConnectedState) {
+        const QString tag = m_sessions.value(client).requestTag;
+        if (!tag.isEmpty()) {
+            client->write((tag + '|').toUtf8());
+        }
+        // 协商了压缩且负载较大时压缩发送：BIN|命令|压缩后字节数|压缩方式|原始字节数
+        const QByteArray compressed = FrameCompression::compress(payload, settings.compression, settings.dictionaryId);
+        if (!compressed.isEmpty()) {
+            client->write(QString("BIN|%1|%2|%3|%4\n")
+                              .arg(command)
+                              .arg(compressed.size())
+                              .arg(Protocol::compressionName(settings.compression))
+                              .arg(payload.size())
+                              .toUtf8());
+            client->write(compressed);
+            emit logMessage(QString("发送二进制响应: %1，%2字节（%3压缩后%4字节）")
+                                .arg(command)
+                                .arg(payload.size())
+                                .arg(Protocol::compressionName(settings.compression))
+                                .arg(compressed.size()));
+        } else {
+            client->write(QString("BIN|%1|%2\n").arg(command).arg(payload.size()).toUtf8());
+            client->write(payload);
+            emit logMessage(QString("发送二进制响应: %1，%2字节").arg(command).arg(payload.size()));
+        }
+        client->flush();
+    }
+    return true;
+}
+
 // MainWindow 实现
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
@@ -5,9 +5,70 @@
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QList>
+#include <QHash>
 #include "database.h"
+#include "framescanner.h"
+#include "protocol.h"
+#include "binarycodec.h"
+#include "framecompression.h"
+#include "avatarstore.h"
+#include "filerelay.h"
+#include "filestore.h"
 #include "userinfo.h"
 
+// 正在分块发送的聊天记录，每个连接同时只有一个
+struct HistoryStream
+{
+    QSharedPointer<MessageCursor> cursor;   // 为空表示没有进行中的发送
+    int peerId = 0;                         // 会话对方ID，客户端据此丢弃过期的分块
+    int sentCount = 0;
+    bool pumping = false;                   // 防止flush触发bytesWritten时重入
+    QString requestTag;                     // 发起请求的ID，之后的分块都带上
+};
+
+// 每个客户端连接的状态
+struct ClientSession
+{
+    LineReader reader;              // 未处理完的请求数据
+    Protocol::Settings protocol;    // HELLO协商结果，未协商时为旧版文本协议
+    HistoryStream history;
+    int userId = 0;                 // 登录成功后的用户ID，用于给该用户推送通知
+    // 客户端登记的UDP消息端口和文件接收端口，地址取聊天连接的对端地址；0表示未登记
+    quint16 udpPort = 0;
+    quint16 filePort = 0;
+    // 客户端发来的BIN帧：收到头部行后等待的负载
+    QString pendingBinaryCommand;
+    QString pendingBinaryTag;
+    qint64 pendingBinarySize = -1;
+    // 正在处理的请求带的 #ID，期间发给该连接的回复都带回这个ID；为空时不带
+    QString requestTag;
+    QString resumeToken;            // 登录时发给客户端的续连令牌，断线后凭它恢复会话
+    // 最后一次收到该连接的数据时数据库中最大的消息ID：此时客户端确实还连着，
+    // 之后保存的消息可能在真正断线到服务器发现断线之间丢失，续连时从这里开始补发
+    int contactMessageId = 0;
+    // 收到过以换行符结尾的请求（包括HELLO）：说明不是旧版客户端，不再把未结束的数据当作完整请求
+    bool sentTerminatedLine = false;
+};
+
+// 续连令牌对应的会话；连接还在时不过期，断开后保留一段时间
+struct ResumeTicket
+{
+    int userId = 0;
+    int lastMessageId = -1;         // 最后一次收到客户端数据时数据库中最大的消息ID，之后的消息在续连时补发；-1表示连接还在
+    qint64 expiresAt = 0;           // 断线后的过期时间（毫秒时间戳），0表示连接还在
+};
+
+// 中转上传令牌：在已登录的聊天连接上签发，上传连接凭它确定发送者和接收者；
+// 只用于这一次上传（断线续传和并行连接可以继续使用），上传完成后作废
+struct RelayUploadGrant
+{
+    QString token;
+    int senderId = 0;
+    int receiverId = 0;
+    qint64 fileSize = 0;
+    qint64 expiresAt = 0;           // 过期时间（毫秒时间戳），每次使用后顺延
+};
+
 QT_BEGIN_NAMESPACE
 namespace Ui {
 class MainWindow;
@@ -26,6 +87,12 @@ public:
 
     void setDatabaseManager(DatabaseManager* dbManager);
 
+    // 服务器愿意协商的能力，用于逐步开启新的传输模式
+    void setProtocolCapabilities(const Protocol::Capabilities& capabilities);
+
+    // 文件中转的限速（字节/秒，0表示不限）：同一用户的所有传输共享一个令牌桶，每条连接另有一个
+    void setBandwidthLimits(qint64 userBytesPerSecond, qint64 connectionBytesPerSecond);
+
 signals:
     void logMessage(const QString &msg);
     void userLoginSuccess(const QString &nickname);
@@ -39,10 +106,28 @@ protected:
 private slots:
     void onClientDisconnected();
     void onReadyRead();
+    void onClientBytesWritten();
 
 private:
     QList<QTcpSocket*> clients;
+    QHash<QTcpSocket*, ClientSession> m_sessions;
     DatabaseManager* m_dbManager;
+    Protocol::Capabilities m_capabilities;
+    AvatarStore m_avatarStore;
+    QString m_relayDirectory;       // 中转文件的保存目录
+    FileStore m_fileStore;          // 按内容哈希去重的文件库，位于中转目录下
+    qint64 m_userBandwidth;
+    qint64 m_connectionBandwidth;
+    QHash<int, QWeakPointer<TokenBucket>> m_userBuckets;   // 用户没有进行中的传输时自动释放
+    QHash<QString, RelayUploadGrant> m_uploadGrants;       // 传输ID -> 已签发的上传令牌
+    QTimer *m_relayCleanupTimer = nullptr;
+    QHash<QString, ResumeTicket> m_resumeTickets;          // 续连令牌 -> 会话
+
+    void processRequest(QTcpSocket* client, const QStringList& parts, bool utf8Valid);
+    void processBinaryRequest(QTcpSocket* client, const QString& command, const QByteArray& payload);
+    bool isUnterminatedLegacyRequest(const LineReader& reader) const;
+    Protocol::Settings protocolSettings(QTcpSocket* client) const;
+    void handleHelloRequest(QTcpSocket* client, const QStringList& parts);
 
     // 原有处理函数...
     void handleLoginRequest(QTcpSocket* client, const QString& username, const QString& password);
@@ -50,23 +135,86 @@ private:
                                const QString& nickname, const QString& avatarPath);
     void handleFriendListRequest(QTcpSocket* client, int userId);
     void handleLogoutRequest(QTcpSocket* client, int userId);
-    void handleMessageListRequest(QTcpSocket* client, int user1Id, int user2Id);
+    // 断线重连：一次请求恢复登录状态、端点和在线状态，回复好友列表和断线期间的消息
+    // deliveredKeys 是客户端断线期间经UDP直接收到的消息的投递标识，这些消息不再补发
+    void handleResumeRequest(QTcpSocket* client, const QString& token, quint16 udpPort, quint16 filePort,
+                             const QSet<QString>& deliveredKeys);
+    // 为该连接签发新的续连令牌，旧令牌作废
+    QString issueResumeToken(QTcpSocket* client, int userId);
+    void releaseResumeToken(QTcpSocket* client, bool keepForResume);
+    void handleMessageListRequest(QTcpSocket* client, int user1Id, int user2Id, bool newestFirst = false);
+    // 增量同步：客户端本地缓存已经有 afterMessageId 及之前的消息
+    void handleSyncMessagesRequest(QTcpSocket* client, int user1Id, int user2Id, int afterMessageId);
+    // 聊天记录分块发送：从数据库游标读一块发一块，发送缓冲区排空后再继续
+    void startHistoryStream(QTcpSocket* client, int user1Id, int user2Id, bool newestFirst);
+    void pumpHistoryStream(QTcpSocket* client);
+    void writeHistoryChunks(QTcpSocket* client);
     void handleSaveMessageRequest(QTcpSocket* client, int senderId, int receiverId,
                                   int contentType, const QString& content,
-                                  const QString& fileName = "", qint64 fileSize = 0);
+                                  const QString& fileName = "", qint64 fileSize = 0,
+                                  const QString& fileHash = QString(),
+                                  const QString& deliveryKey = QString());
     void handleSearchUsersRequest(QTcpSocket* client, int userId, const QString& keyword);
 
     // 新增：处理添加好友请求
     void handleAddFriendRequest(QTcpSocket* client, int userId, int friendId);
 
+    // 文件中转：上传和下载各用一条单独的连接，交给专门的对象处理后不再属于聊天连接
+    QByteArray detachClient(QTcpSocket* client);
+    QTcpSocket* findUserConnection(int userId) const;
+    // 端点登记：客户端监听系统分配的端口，登录后登记，好友之间通过服务器查找对方
+    void handleRegisterEndpoint(QTcpSocket* client, int userId, quint16 udpPort, quint16 filePort);
+    void handlePeerLookup(QTcpSocket* client, int peerId);
+    // 直连发文件前经服务器向对方转达文件信息，对方同意时带回一次性令牌
+    void handlePeerFileOffer(QTcpSocket* client, int receiverId, const QString& transferId,
+                             const QString& fileName, qint64 fileSize);
+    void handlePeerFileAnswer(QTcpSocket* client, int senderId, const QString& transferId, const QString& token);
+    // 可靠UDP消息多次重传失败后经服务器转发给对方，带上通道ID和序号供对方去重排序
+    void handleRelayMessage(QTcpSocket* client, int receiverId, const QString& channelId,
+                            const QString& sequence, const QString& payload);
+
+    // 在聊天连接上为登录用户签发中转上传令牌
+    void handleRelayUploadRequest(QTcpSocket* client, const QString& transferId, int receiverId, qint64 fileSize);
+    // 核对上传连接带来的令牌，有效时顺延有效期并取出对应的上传
+    bool useUploadGrant(const QString& transferId, const QString& token, RelayUploadGrant& grant);
+    // 回复 FILE_FAIL 后关闭已经脱离聊天连接的传输连接
+    void rejectTransferConnection(QTcpSocket* client, const QString& transferId, const QString& reason);
+    void startRelayUpload(QTcpSocket* client, const QStringList& parts);
+    void startRelayJoin(QTcpSocket* client, const QStringList& parts);
+    // 该ID已被另一对发送者/接收者占用时返回 true，防止覆盖别人的中转记录
+    bool relayTransferTaken(const QString& transferId, int senderId, int receiverId) const;
+    QList<QSharedPointer<TokenBucket>> transferBuckets(int userId);
+    // 保存元数据并通知接收方；内容在文件库中时调用方已为它增加了引用
+    void registerRelayFile(const RelayFileInfo& info);
+    // 删除送达或过期的中转文件，释放它对文件库内容的引用
+    void retireRelayFile(const QString& transferId);
+    // 清理过期的中转文件、废弃的上传和不再引用的文件库内容；rebuildReferences 时先按中转目录重新计数
+    void cleanupRelayFiles(bool rebuildReferences);
+    void startRelayDownload(QTcpSocket* client, const QString& transferId, const QString& fetchToken);
+    void notifyRelayFile(QTcpSocket* client, const RelayFileInfo& info);
+    void notifyPendingRelayFiles(QTcpSocket* client, int userId);
+
+    // 头像库：上传后按内容哈希保存，客户端按哈希和尺寸取缩略图
+    void handleAvatarUpload(QTcpSocket* client, const QByteArray& imageData);
+    void handleAvatarRequest(QTcpSocket* client, const QString& reference, int size);
+
     // 发送函数...
     void sendFriendList(QTcpSocket* client, int userId, const QList<UserInfo>& friendList);
     void sendMessageList(QTcpSocket* client, int user1Id, int user2Id, const QList<MessageInfo>& messageList);
+    void sendMessageChunk(QTcpSocket* client, int peerId, const QList<MessageInfo>& messageList);
+    void sendMessagesSince(QTcpSocket* client, int peerId, const QList<MessageInfo>& messageList);
     void sendSearchResults(QTcpSocket* client, int userId, const QList<UserInfo>& userList);
+    void sendMissedMessages(QTcpSocket* client, int userId, const QList<MessageInfo>& messageList);
     // 新增：发送添加好友结果
     void sendAddFriendResult(QTcpSocket* client, int userId, int friendId, bool success, const QString& message);
 
+    // 回复当前请求，带上请求的ID（如果有）
     void sendResponse(QTcpSocket* client, const QString& response);
+    // 服务器主动推送，不属于任何请求，不带ID
+    void sendNotification(QTcpSocket* client, const QString& notification);
+    void setRequestTag(QTcpSocket* client, const QString& tag);
+    // 发送 BIN|命令|字节数 行，随后紧跟二进制负载；超过协商的最大帧长时不发送并返回false
+    bool sendBinaryResponse(QTcpSocket* client, const QString& command, const QByteArray& payload);
 };
 
 class MainWindow : public QMainWindow